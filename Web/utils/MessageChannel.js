@@ -1,8 +1,30 @@
 import { Mutex } from "@utils/Mutex.js"; 
+
+// Record header: low 30 bits = body length, FRAG_MORE = more fragments of this message
+// follow, FRAG_ABORT = writer gave up, drop the partial message. The first fragment of a
+// fragmented message carries the full message size in 4 extra bytes after the header.
+// The buffer starts with an 8-byte control header: a 4-byte generation counter (native
+// bumps it when it resets the rings for a new document) and 4 reserved bytes.
+// The flag byte in front of each region is a doorbell owned by that region's consumer:
+// bit 0 = asleep, bits 1-7 = sleep epoch. Producers ring once per asleep epoch.
+// Must match linkSphereBrowser/MessageChannel.h.
+const DOORBELL_ASLEEP = 1;
+const CONTROL_HEADER_SIZE = 8;
+const FRAG_MORE = 0x80000000;
+const FRAG_ABORT = 0x40000000;
+const FRAG_LEN_MASK = 0x3FFFFFFF;
+
 export class MessageChannel {
     constructor(sharedPtr, totalSize, isLeftMaster) {
         if (!sharedPtr) throw "null";
-        if (totalSize < 18) throw "small";
+        if (totalSize < CONTROL_HEADER_SIZE + 18) throw "small";
+        this.shared = sharedPtr;
+        this.generation = this.load32(0);
+        this.writeSeq = 0;      // messages written in this generation, native counts its reads the same way
+        this.onWrite = null;    // (generation, seq) after each complete write, used for tracing
+
+        totalSize -= CONTROL_HEADER_SIZE;
+        const base = CONTROL_HEADER_SIZE;
         const half = Math.floor(totalSize / 2);
 
         const leftDataRegionSize = half - 9;
@@ -11,18 +33,16 @@ export class MessageChannel {
         if (leftDataRegionSize < 4 || rightDataRegionSize < 4) throw "tiny";
 
         // --- Left pointers ---
-        const leftFlag = 0;
-        const leftRead = 1;
-        const leftWrite = 5;
-        const leftData = 9;
+        const leftFlag = base + 0;
+        const leftRead = base + 1;
+        const leftWrite = base + 5;
+        const leftData = base + 9;
 
         // --- Right pointers ---
-        const rightFlag = half + 0;
-        const rightRead = half + 1;
-        const rightWrite = half + 5;
-        const rightData = half + 9;
-
-        this.shared = sharedPtr;
+        const rightFlag = base + half + 0;
+        const rightRead = base + half + 1;
+        const rightWrite = base + half + 5;
+        const rightData = base + half + 9;
 
         if (isLeftMaster) {
             this.masterFlag = leftFlag;
@@ -54,6 +74,15 @@ export class MessageChannel {
         this.readLock = new Mutex();
         this.writeLock = new Mutex();
 
+        // fragmented message being assembled by the reader
+        this.readMsgSize = 0;
+        this.readMsgDone = 0;
+        this.abortPending = false;
+
+        this.readAborted = false;   // a reset dropped a message the reader was assembling
+
+        this.rungState = 0;     // producer: consumer state we last rang for
+        this.sleepEpoch = 0;    // consumer: bumped on every trySleep
     }
 
     // --- Master writing ---
@@ -77,39 +106,88 @@ export class MessageChannel {
         return this.masterDataRegionSize - 1 - used;
     }
 
-    async writeBuf(src, size) {
+    // Writes a message of any size. Larger than the free space, it is split into
+    // continuation records; waitForSpace (async, returns false to give up) is awaited
+    // whenever the ring is too full to make progress, so pass one that wakes the reader.
+    // Returns size, or 0 if nothing was sent.
+    async writeBuf(src, size, waitForSpace = null) {
         await this.writeLock.lock();
         try {
-            if (!src || size === 0 || this.availableToWriteUnsafe() < size + 4)
-                return 0;
-
-            let w = this.load32(this.masterWrite);
-
-            this.writeRegion(
-                this.masterData,
-                this.masterDataRegionSize,
-                w,
-                this.u32ToBytes(size),
-                4
-            );
-            w = (w + 4) % this.masterDataRegionSize;
-
-            this.writeRegion(
-                this.masterData,
-                this.masterDataRegionSize,
-                w,
-                src,
-                size
-            );
-            w = (w + size) % this.masterDataRegionSize;
-
-            this.store32(this.masterWrite, w);
-            this.shared[this.masterFlag] |= 1;
+            if (!src || size === 0 || size > FRAG_LEN_MASK) return 0;
+            this.syncGeneration();
+
+            const maxFragment = Math.floor(this.masterDataRegionSize / 2);
+            const minFragment = Math.min(maxFragment, 4096);
+            let done = 0;
+
+            while (done < size) {
+                if (this.load32(0) !== this.generation) return 0;   // rings were reset under us
+                if (this.abortPending && !this.writeAbortUnsafe()) {
+                    if (!waitForSpace || !(await waitForSpace())) return 0;
+                    continue;
+                }
+
+                const avail = this.availableToWriteUnsafe();
+                const remaining = size - done;
+
+                if (done === 0 && avail >= remaining + 4) {
+                    this.writeRecordUnsafe(0, 0, src, 0, size);
+                    this.wroteMessage();
+                    return size;
+                }
+
+                const prefix = done === 0 ? 4 : 0;
+                const want = Math.min(remaining, maxFragment);
+
+                if (avail < 4 + prefix + Math.min(want, minFragment)) {
+                    if (!waitForSpace || !(await waitForSpace())) {
+                        if (done) this.writeAbortUnsafe();
+                        return 0;
+                    }
+                    continue;
+                }
+
+                const len = Math.min(avail - 4 - prefix, want);
+                const flags = (done + len < size) ? FRAG_MORE : 0;
+
+                this.writeRecordUnsafe(flags, done === 0 ? size : 0, src, done, len);
+                done += len;
+            }
+            this.wroteMessage();
             return size;
         } finally {
             this.writeLock.unlock();
         }
+    }
 
+    wroteMessage() {
+        this.writeSeq++;
+        if (this.onWrite) this.onWrite(this.generation, this.writeSeq);
+    }
+
+    writeRecordUnsafe(flags, totalSize, src, srcOff, len) {
+        let w = this.load32(this.masterWrite);
+
+        this.writeRegion(this.masterData, this.masterDataRegionSize, w, this.u32ToBytes((flags | len) >>> 0), 4);
+        w = (w + 4) % this.masterDataRegionSize;
+
+        if (totalSize) {
+            this.writeRegion(this.masterData, this.masterDataRegionSize, w, this.u32ToBytes(totalSize), 4);
+            w = (w + 4) % this.masterDataRegionSize;
+        }
+
+        if (len) {
+            this.writeRegion(this.masterData, this.masterDataRegionSize, w, src.subarray(srcOff, srcOff + len), len);
+            w = (w + len) % this.masterDataRegionSize;
+        }
+
+        this.store32(this.masterWrite, w);
+    }
+
+    writeAbortUnsafe() {
+        this.abortPending = this.availableToWriteUnsafe() < 4;
+        if (!this.abortPending) this.writeRecordUnsafe(FRAG_ABORT, 0, null, 0, 0);
+        return !this.abortPending;
     }
 
 
@@ -132,59 +210,170 @@ export class MessageChannel {
             : (this.slaveDataRegionSize - (r - w));
     }
 
+    // Size of the whole next message (also for a fragmented one that is partly read),
+    // 0 if its first record has not fully arrived yet.
     async sizeofNextMessage() {
         await this.readLock.lock();
         try {
-            if (this.availableToReadUnsafe() < 4) return 0;
-
-            const r = this.load32(this.masterRead);
-            return this.read32Wrapped(
-                this.slaveData,
-                this.slaveDataRegionSize,
-                r
-            );
+            this.syncGeneration();
+            if (this.readMsgSize) return this.readMsgSize;
+            return this.peekMessageSizeUnsafe();
         } finally {
             this.readLock.unlock();
         }
     }
 
+    // Reads the next message into dst. A fragmented message is copied in as its
+    // fragments arrive: 0 is returned until the last one is consumed, so keep calling
+    // with the same dst. Returns -1 if the writer aborted the message.
     async readBuf(dst, maxLen) {
         await this.readLock.lock();
         try {
+            this.syncGeneration();
+            if (this.readAborted) {
+                this.readAborted = false;
+                return -1;
+            }
+            const total = this.readMsgSize || this.peekMessageSizeUnsafe();
+            if (total === 0 || total > maxLen) return 0;
+
+            return this.drainFragmentsUnsafe(dst);
+        } finally {
+            this.readLock.unlock();
+        }
+    }
+
+    recordReadyUnsafe() {
+        const avail = this.availableToReadUnsafe();
+        if (avail < 4) return false;
+
+        const hdr = this.read32Wrapped(this.slaveData, this.slaveDataRegionSize, this.load32(this.masterRead));
+        if (hdr & FRAG_ABORT) return true;
+
+        const prefix = (!this.readMsgSize && (hdr & FRAG_MORE)) ? 4 : 0;
+        return avail >= 4 + prefix + (hdr & FRAG_LEN_MASK);
+    }
+
+    peekMessageSizeUnsafe() {
+        for (;;) {
             const avail = this.availableToReadUnsafe();
             if (avail < 4) return 0;
 
-            let r = this.load32(this.masterRead);
-            let sz = this.read32Wrapped(
-                this.slaveData,
-                this.slaveDataRegionSize,
-                r
-            );
+            const r = this.load32(this.masterRead);
+            const hdr = this.read32Wrapped(this.slaveData, this.slaveDataRegionSize, r);
+
+            if (hdr & FRAG_ABORT) {
+                this.store32(this.masterRead, (r + 4) % this.slaveDataRegionSize);
+                continue;
+            }
 
-            if (sz === 0 || sz > maxLen) return 0;
-            if (avail < sz + 4) return 0;
+            const len = hdr & FRAG_LEN_MASK;
+            if (!(hdr & FRAG_MORE))
+                return (len && avail >= len + 4) ? len : 0;
 
+            if (avail < len + 8) return 0;
+            return this.read32Wrapped(this.slaveData, this.slaveDataRegionSize, (r + 4) % this.slaveDataRegionSize);
+        }
+    }
+
+    drainFragmentsUnsafe(dst) {
+        for (;;) {
+            const avail = this.availableToReadUnsafe();
+            if (avail < 4) return 0;
+
+            let r = this.load32(this.masterRead);
+            const hdr = this.read32Wrapped(this.slaveData, this.slaveDataRegionSize, r);
+
+            if (hdr & FRAG_ABORT) {
+                this.store32(this.masterRead, (r + 4) % this.slaveDataRegionSize);
+                const inProgress = this.readMsgSize !== 0;
+                this.readMsgSize = this.readMsgDone = 0;
+                if (inProgress) return -1;
+                continue;
+            }
+
+            const len = hdr & FRAG_LEN_MASK;
+            const first = this.readMsgSize === 0;
+            const prefix = (first && (hdr & FRAG_MORE)) ? 4 : 0;
+
+            if (len === 0 && first) return 0;
+            if (avail < 4 + prefix + len) return 0;
             r = (r + 4) % this.slaveDataRegionSize;
 
-            this.readRegion(
-                this.slaveData,
-                this.slaveDataRegionSize,
-                r,
-                dst,
-                sz
-            );
-            r = (r + sz) % this.slaveDataRegionSize;
+            if (first) {
+                this.readMsgSize = prefix
+                    ? this.read32Wrapped(this.slaveData, this.slaveDataRegionSize, r)
+                    : len;
+                this.readMsgDone = 0;
+                r = (r + prefix) % this.slaveDataRegionSize;
+            }
+
+            const corrupt = this.readMsgDone + len > this.readMsgSize;
+            if (!corrupt)
+                this.readRegion(this.slaveData, this.slaveDataRegionSize, r, dst.subarray(this.readMsgDone), len);
+            r = (r + len) % this.slaveDataRegionSize;
+            this.readMsgDone += len;
 
             this.store32(this.masterRead, r);
-            this.shared[this.slaveFlag] = 1;
 
-            return sz;
-        } finally {
-            this.readLock.unlock();
+            if (corrupt) {
+                this.readMsgSize = this.readMsgDone = 0;
+                return -1;
+            }
+            if (!(hdr & FRAG_MORE)) {
+                const total = this.readMsgDone === this.readMsgSize ? this.readMsgSize : -1;
+                this.readMsgSize = this.readMsgDone = 0;
+                return total;
+            }
         }
     }
 
 
+    // --- Doorbell, producer side ---
+    // Call after writing. True once per native sleep: the caller must post "dataReady".
+    needsDoorbell() {
+        this.syncGeneration();
+        const state = this.shared[this.masterFlag];
+        if (!(state & DOORBELL_ASLEEP) || state === this.rungState) return false;
+
+        this.rungState = state;
+        return true;
+    }
+
+    // --- Doorbell, consumer side ---
+    // Advertise "polling": native stops posting "dataReady" until the next trySleep.
+    setPolling() {
+        this.syncGeneration();
+        this.shared[this.slaveFlag] = (this.sleepEpoch << 1) & 0xFF;
+    }
+
+    // Advertise "asleep" and recheck the ring. Returns false (and stays polling) if data
+    // slipped in meanwhile; otherwise native will post "dataReady" on its next write.
+    trySleep() {
+        this.syncGeneration();
+        this.sleepEpoch = (this.sleepEpoch + 1) & 0x7F;
+        this.shared[this.slaveFlag] = ((this.sleepEpoch << 1) | DOORBELL_ASLEEP) & 0xFF;
+
+        if (!this.recordReadyUnsafe()) return true;   // a half-written fragment is fine, its writer rings when done
+
+        this.setPolling();
+        return false;
+    }
+
+    // syncGeneration: drops local ring state if native reset the rings since we last looked
+    syncGeneration() {
+        const g = this.load32(0);
+        if (g === this.generation) return;
+
+        this.generation = g;
+        this.writeSeq = 0;
+        if (this.readMsgSize) this.readAborted = true;
+        this.readMsgSize = this.readMsgDone = 0;
+        this.abortPending = false;
+        this.rungState = 0;
+        this.sleepEpoch = 0;
+    }
+
     getMasterFlagPtr() {
         return this.masterFlag;
     }
@@ -17,6 +17,7 @@ export default class MessageHandler {
         const arr = new Uint8Array(window.chrome.webview.sharedBuffer);
         this.channel = new MessageChannel(arr, arr.length, false);
         window.chrome.webview.addEventListener("message", this._onHostSignal.bind(this));
+        this._drainChannel();   // picks up anything native wrote before us and advertises "asleep"
         this.setNotificationHandler("close", () => { this.sendNotification("close-current") });
         this.setNotificationHandler("connected", p => {
             console.log("client is connected",p);
@@ -98,29 +99,59 @@ export default class MessageHandler {
         if (!this.channel) return;
 
         /* -------- MESSAGES -------- */
-        let size;
-        while ((size = await this.channel.sizeofNextMessage()) > 0) {
-            const buf = new Uint8Array(size);
-            await this.channel.readBuf(buf, size);
-
-            setTimeout(() => {
-                try {
-                    const block = new MessageBlock(buf);
-                    const handler = this.onMessageReceiveHandler.get(block.getType());
-                    if (!handler) return;
-                    setTimeout(() => handler(
-                        block.getSrcIP(),
-                        block.getSrcPort(),
-                        block.getDstIP(),
-                        block.getDstPort(),
-                        block.getType(),
-                        block.getPayload()
-                    ), 0); // each handler isolated
-                } catch (e) {
-                    console.error("[MessageHandler] Invalid message", e);
+        await this._drainChannel();
+    }
+
+    // _drainChannel: Reads every complete message from the ring, then advertises "asleep"
+    // so native posts the next "dataReady" only when it writes again. While draining, native
+    // writes are picked up without any notification at all.
+    // A fragmented message can span several wakeups, its buffer is kept until complete.
+    // recheck: called by the safety net below rather than by a notification.
+    async _drainChannel(recheck = false) {
+        if (this._draining) return;
+        this._draining = true;
+        clearTimeout(this._sleepCheck);
+        let got = 0;
+        try {
+            do {
+                this.channel.setPolling();
+                let size;
+                while ((size = await this.channel.sizeofNextMessage()) > 0) {
+                    if (!this._pendingBuf || this._pendingBuf.length !== size)
+                        this._pendingBuf = new Uint8Array(size);
+                    const read = await this.channel.readBuf(this._pendingBuf, size);
+                    if (read === 0) break;      // rest of the message is still in flight
+                    got++;
+                    const buf = this._pendingBuf;
+                    this._pendingBuf = null;
+                    if (read < 0) continue;     // writer aborted it
+
+                    setTimeout(() => {
+                        try {
+                            const block = new MessageBlock(buf);
+                            const handler = this.onMessageReceiveHandler.get(block.getType());
+                            if (!handler) return;
+                            setTimeout(() => handler(
+                                block.getSrcIP(),
+                                block.getSrcPort(),
+                                block.getDstIP(),
+                                block.getDstPort(),
+                                block.getType(),
+                                block.getPayload()
+                            ), 0); // each handler isolated
+                        } catch (e) {
+                            console.error("[MessageHandler] Invalid message", e);
+                        }
+                    }, 0);
                 }
-            }, 0);
+            } while (!this.channel.trySleep());
+        } finally {
+            this._draining = false;
         }
+        // safety net: the page writes the flag without memory fences, recheck once after going
+        // idle; a recheck that found nothing leaves the page asleep until the next dataReady
+        if (!recheck || got)
+            this._sleepCheck = setTimeout(() => this._drainChannel(true), 100);
     }
 
 
@@ -140,16 +171,30 @@ export default class MessageHandler {
         msg.setDst(dst, dstPort);
         msg.setPayload(payloadBytes);
 
-        const written = await this.channel.writeBuf(msg.getRawData(), totalSize);
+        // larger than the free ring space: fragments go out while native drains the ring
+        const deadline = Date.now() + 2000;
+        const waitForSpace = async () => {
+            this._ringDoorbell();
+            await new Promise(r => setTimeout(r, 1));
+            return Date.now() < deadline;
+        };
+        const written = await this.channel.writeBuf(msg.getRawData(), totalSize, waitForSpace);
         if (written <= 0) {
             console.error("[MessageHandler] Buffer full");
             return false;
         }
 
-        window.chrome.webview.postMessage("dataReady");
+        this._ringDoorbell();
         return true;
     }
 
+    // _ringDoorbell: Posts "dataReady" only if native's receiver said it is asleep and
+    // nobody rang since; while it is polling the ring it needs no notification
+    _ringDoorbell() {
+        if (this.channel.needsDoorbell())
+            window.chrome.webview.postMessage("dataReady");
+    }
+
     // sendNotification: Sends simple string notification to native
     // Input: data (string, default: "dataReady"), Output: none
     // Example: sendNotification("close-current")
@@ -355,6 +400,224 @@ export default class MessageHandler {
     }
 
 
+    // Native metrics (counters, latency histograms, per-connection lines), resolves the text dump
+    getMetrics() {
+        return new Promise(resolve => {
+            const handler = text => {
+                this.removeNotificationHandler("metrics", handler);
+                resolve(text);
+            };
+            this.setNotificationHandler("metrics", handler);
+            this.sendNotification("getMetrics-all");
+        });
+    }
+
+    // Sampled tracing (see linkSphereBrowser/Tracing.h): one message in every n is traced
+    // through native and over the wire, 0 turns it off. The page records the js_write point,
+    // native derives the same trace id from the message's position in the channel.
+    setTraceSampling(n) {
+        this._traceEvents = [];
+        this.channel.onWrite = n ? (generation, seq) => {
+            if (seq % n) return;
+            if (this._traceEvents.length >= 4096) this._traceEvents.shift();
+            const id = ((generation & 0x7FFFFFFF) >>> 0).toString(16).padStart(8, "0") + (seq >>> 0).toString(16).padStart(8, "0");
+            this._traceEvents.push({ id, ts: (performance.timeOrigin + performance.now()) * 1000 });
+        } : null;
+        this.sendNotification(`traceSample-${n}`);
+    }
+
+    // Chrome Trace Event object with the native and page trace points, for chrome://tracing
+    getTrace() {
+        return new Promise(resolve => {
+            const handler = text => {
+                this.removeNotificationHandler("trace", handler);
+                const trace = JSON.parse(text);
+                // js_write lasts until the first native point of the same message
+                const first = new Map();
+                for (const e of trace.traceEvents) {
+                    const t = first.get(e.args.trace);
+                    if (t === undefined || e.ts < t) first.set(e.args.trace, e.ts);
+                }
+                for (const e of this._traceEvents ?? []) {
+                    const next = first.get(e.id);
+                    trace.traceEvents.push({
+                        name: "js_write", cat: "msg", ph: "X", ts: e.ts,
+                        dur: next !== undefined ? Math.max(0, next - e.ts) : 0,
+                        pid: 0, tid: 0, args: { trace: e.id }
+                    });
+                }
+                resolve(trace);
+            };
+            this.setNotificationHandler("trace", handler);
+            this.sendNotification("getTrace-all");
+        });
+    }
+
+    // Native PING/PONG (linkSphereBrowser/PeerClock.h): RTT and clock offset measured between
+    // the network threads, without the page in the loop. TCP connections are pinged every
+    // 2 s by default; ping() sends one now, e.g. over a UDP port.
+    ping(type, sp, dip, dp) { this.sendNotification(`ping-${type}-${sp}-${dip}-${dp}`); }
+    setPingInterval(ms) { this.sendNotification(`pingInterval-${ms}`); }
+
+    // Native per-connection timers (ms, 0 = off). A TCP connection's handler (attachConnHandler)
+    // gets "peer-dead" when a peer that answered PINGs goes silent for deadAfterMs, "peer-alive"
+    // when it is heard from again, and "idle-timeout" after idleMs without messages.
+    setLiveness({ heartbeatMs = 2000, deadAfterMs = 6000, idleMs = 0, connectMs = 5000 } = {}) {
+        this.sendNotification(`liveness-${heartbeatMs}-${deadAfterMs}-${idleMs}-${connectMs}`);
+    }
+
+    // Native room election (linkSphereBrowser/RoomElection.h). The master holds a lease it
+    // renews every leaseMs / 3; when it runs out the members agree on a new master without a
+    // vote. leaseMs 0 leaves the room.
+    setRoom(roomId, ip, port, leaseMs = 150) {
+        let hash = 0x811c9dc5;      // FNV-1a, so peers in other rooms ignore our leases
+        for (const c of new TextEncoder().encode(String(roomId))) hash = Math.imul(hash ^ c, 0x01000193) >>> 0;
+        this.sendNotification(`room-${hash}-${ip}-${port}-${leaseMs}`);
+    }
+
+    // [{ ip, port }] with port the member's TCP server port
+    setRoomMembers(peers) {
+        this.sendNotification(`roomMembers-${peers.map(p => `${p.ip}:${p.port}`).join(",")}`);
+    }
+
+    electRoomMaster() { this.sendNotification("roomElect-now"); }
+
+    // cb({ ip, port, term }) whenever the master changes (or on electRoomMaster); a higher term
+    // always wins, so anything from an older term's master can be ignored
+    onRoomMaster(cb) {
+        if (this._roomMaster) this.removeNotificationHandler("roomMaster", this._roomMaster);
+        this._roomMaster = cb ? text => {
+            const m = /^(\d+):(\d+)-(\d+)$/.exec(text);
+            if (m) cb({ ip: +m[1], port: +m[2], term: +m[3] });
+        } : null;
+        if (cb) this.setNotificationHandler("roomMaster", this._roomMaster);
+    }
+
+    // Native relay tree (linkSphereBrowser/RelayTree.h), planned by the room master. children
+    // is how many members this one can mix for; cb({ parent, children }) gets this member's
+    // place whenever it changes, parent { ip, port } or null at the root.
+    setRelayCapacity(children) { this.sendNotification(`relayCapacity-${children}`); }
+
+    onRelayPlan(cb) {
+        if (this._relayPlan) this.removeNotificationHandler("relayPlan", this._relayPlan);
+        this._relayPlan = cb ? text => {
+            const m = /^(\d+):(\d+)-(.*)$/.exec(text);
+            if (!m) return;
+            const children = m[3] ? m[3].split(",").map(c => {
+                const [ip, port] = c.split(":");
+                return { ip: +ip, port: +port };
+            }) : [];
+            cb({ parent: +m[1] ? { ip: +m[1], port: +m[2] } : null, children });
+        } : null;
+        if (cb) this.setNotificationHandler("relayPlan", this._relayPlan);
+    }
+
+    // Room broadcasts (linkSphereBrowser/Multicast.h): broadcast() reaches every member of the
+    // room (setRoomMembers) once, as a single LAN multicast datagram on this UDP port where it
+    // gets through and over TCP where it does not. Port 0, the default, sends TCP copies only.
+    setMulticast(port) {
+        this.multicastPort = port;
+        this.sendNotification(`multicast-${port}`);
+    }
+
+    broadcast(type, payload) {
+        return this.sendMessage(0, 0xFFFFFFFF, 0, type, payload);
+    }
+
+    // TCP connections to another LinkSphere on this machine move to shared memory
+    // (linkSphereBrowser/LocalLink.h), on by default; applies to connections made afterwards.
+    setLocalLink(enabled) { this.sendNotification(`localLink-${enabled ? 1 : 0}`); }
+
+    // Native office presence (linkSphereBrowser/Presence.h) on the discovery UDP socket: who is
+    // online and their userInfo, kept up by probing and gossip between the members themselves.
+    // cb({ full, up, gone }) on every change; up lists { privateIP, tcpPort, discoveryPort,
+    // userInfo } added or changed, gone the ips that left. full: up is everyone (snapshot).
+    startPresence(ip, tcpPort, discoveryPort, userInfo) {
+        this.sendNotification(`presenceStart-${ip}-${tcpPort}-${discoveryPort}-${JSON.stringify(userInfo ?? {})}`);
+    }
+
+    setPresenceInfo(userInfo) { this.sendNotification(`presenceInfo-${JSON.stringify(userInfo ?? {})}`); }
+
+    // [{ ip, port }] with port the member's discovery port, e.g. from the directory
+    seedPresence(peers) {
+        this.sendNotification(`presenceSeed-${peers.map(p => `${p.ip}:${p.port}`).join(",")}`);
+    }
+
+    stopPresence() { this.sendNotification("presenceStop-now"); }
+
+    // Native traffic capture (linkSphereBrowser/Capture.h): every message this app sends and
+    // receives, with timestamps, goes to segment files of segmentMB in dir on this machine,
+    // for linkSphereReplay (replay, pcapng export). The "capture" notification answers with
+    // "started-<dir>" and "stopped-<records>-<dropped>"; failures come as "error".
+    startCapture(dir, segmentMB = 64) { this.sendNotification(`captureStart-${segmentMB}-${dir}`); }
+
+    stopCapture() { this.sendNotification("captureStop-now"); }
+
+    // Native connection restore (linkSphereBrowser/ConnectionTable.h): the server, room and
+    // connections of the last run are set up again natively at startup, parallel connects at
+    // a time; this starts another pass. The "restore" notification answers with
+    // "done-<up>-<failed>-<ms>".
+    restoreConnections(parallel = 16) { this.sendNotification(`restore-${parallel}`); }
+
+    // Native admission control (linkSphereBrowser/Admission.h), per peer address, 0 = unlimited:
+    // connections over maxConnsPerIP are reset, messages over a rate are dropped before they
+    // reach the page. A type's limit comes on top of the overall one.
+    setAdmission(maxConnsPerIP, msgsPerSec, bytesPerSec) {
+        this.sendNotification(`admission-${maxConnsPerIP}-${msgsPerSec}-${bytesPerSec}`);
+    }
+
+    setAdmissionForType(type, msgsPerSec, bytesPerSec) {
+        this.sendNotification(`admissionType-${type}-${msgsPerSec}-${bytesPerSec}`);
+    }
+
+    // resolves [{ ip, conns, droppedMsgs, droppedBytes }] for the peers holding connections or
+    // having had messages dropped, most dropped first
+    getAdmission() {
+        return new Promise(resolve => {
+            const handler = text => {
+                this.removeNotificationHandler("admission", handler);
+                resolve(text ? text.split(",").map(s => {
+                    const [ip, conns, droppedMsgs, droppedBytes] = s.split(":").map(Number);
+                    return { ip, conns, droppedMsgs, droppedBytes };
+                }) : []);
+            };
+            this.setNotificationHandler("admission", handler);
+            this.sendNotification("getAdmission-now");
+        });
+    }
+
+    // Native log (linkSphereBrowser/Log.h): records below level (0 debug, 1 info, 2 warn,
+    // 3 error) are dropped at the call site; sampling keeps one record in every n of a level.
+    setLogLevel(level) { this.sendNotification(`logLevel-${level}`); }
+
+    setLogSampling(level, n) { this.sendNotification(`logSampling-${level}-${n}`); }
+
+    requestPresenceSnapshot() { this.sendNotification("presenceSnapshot-now"); }
+
+    onPresence(cb) {
+        if (this._presence) this.removeNotificationHandler("presence", this._presence);
+        this._presence = cb ? text => {
+            let msg;
+            try { msg = JSON.parse(text); } catch { return; }
+            const up = msg.up.map(u => {
+                let userInfo = {};
+                try { userInfo = JSON.parse(u.info); } catch { }
+                return { privateIP: u.ip, tcpPort: u.tcpPort, discoveryPort: u.discoveryPort, userInfo };
+            });
+            cb({ full: !!msg.full, up, gone: msg.gone });
+        } : null;
+        if (cb) this.setNotificationHandler("presence", this._presence);
+    }
+
+    // cb({ ip, port, srttUs, jitterUs, offsetUs }) on every PONG; offset is peer clock minus ours
+    onPeerClock(cb) {
+        if (this._peerClock) this.removeNotificationHandler("peerClock", this._peerClock);
+        this._peerClock = cb ? text => {
+            const m = /^(\d+):(\d+)-(-?\d+)-(-?\d+)-(-?\d+)$/.exec(text);
+            if (m) cb({ ip: +m[1], port: +m[2], srttUs: +m[3], jitterUs: +m[4], offsetUs: +m[5] });
+        } : null;
+        if (cb) this.setNotificationHandler("peerClock", this._peerClock);
+    }
 
 
     /* ---------------- HANDLER REGISTRATION ---------------- */
@@ -17,6 +17,12 @@ export const MsgType = Object.freeze({
   PONG:         0x31,
   ACK:          0x32,
   ERROR:        0x33,
+  MCAST_DATA:   0x34,     // handled natively, see linkSphereBrowser/Multicast.h
+  PRESENCE_PROBE:     0x35,   // handled natively, see linkSphereBrowser/Presence.h
+  PRESENCE_ACK:       0x36,
+  PRESENCE_PROBE_REQ: 0x37,
+  PRESENCE_DIGEST:    0x38,
+  PRESENCE_DELTA:     0x39,
 
   // -------------------
   // Discovery / Meta
@@ -66,4 +72,11 @@ export const MsgType = Object.freeze({
   PEER_CONNECTED:0x8D,
   PEER_REMOVED:0x8E,
   GET_ALL_PEERS:0x8F,
+  ROOM_LEASE:0x90,     // handled natively, see linkSphereBrowser/RoomElection.h
+  RELAY_PLAN:0x91,     // handled natively, see linkSphereBrowser/RelayTree.h
+  RELAY_REPORT:0x92,
+  MCAST_UNICAST:0x93,  // handled natively, see linkSphereBrowser/Multicast.h
+  MCAST_ACK:0x94,
+  SHM_OFFER:0x95,      // handled natively, see linkSphereBrowser/LocalLink.h
+  SHM_SWITCH:0x96,
 });
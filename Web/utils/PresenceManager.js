@@ -1,7 +1,6 @@
 import axios from "axios";
 import { MsgType } from "@utils/MessageTypes";
 import { AuthManager } from "./AuthManager.js";
-import pako from "pako";
 
 
 export class PresenceManager {
@@ -18,10 +17,7 @@ export class PresenceManager {
     this.organisationName =  null;
     this.privateIP = this.messageHandler.getDefaultIP();
     this.localUsers= new Map();
-    this.accUpdates=new Map();// it will be json nothing else
-    this.messageHandler.setOnMessageReceive(MsgType.DISCOVERY,this.onDiscoveryMessage.bind(this));
-    this.periodUpdateTimer=null;
-    this.updateTimerInterval=1;
+    this.liveUsers=new Set();// ips native presence reports online
     this.onUserUpdate=null;
     this.activated=false;
     this.removeInactiveTimer = null;
@@ -33,25 +29,44 @@ export class PresenceManager {
         return;
     this.activated=true;
     await this.pushMyPresence();
-    await this.fetchAllUsers();
-    this.periodUpdateTimer= setInterval(this.sendPeriodicUpdate.bind(this), this.updateTimerInterval*1000);
-    this.removeInactiveTimer = setInterval(this.removeInactive.bind(this), 60 * 1000); // run every 1 minute
+    const users = await this.fetchAllUsers();
+
+    // the directory only bootstraps; who is online comes from native presence (Presence.h)
+    this.messageHandler.onPresence(this.onPresence.bind(this));
+    const me = this.getMyPresence();
+    this.messageHandler.startPresence(this.privateIP, me.tcpPort, this.discoveryPort, me.userInfo);
+    this.messageHandler.seedPresence(users
+      .filter(u => u.privateIP !== this.privateIP && u.discoveryPort > 0)
+      .map(u => ({ ip: u.privateIP, port: u.discoveryPort })));
+    this.removeInactiveTimer = setInterval(this.removeInactive.bind(this), 30 * 1000);
   }
   
+  // live users stay "Online"; directory entries nobody saw live go after a minute
   removeInactive(){
     const now = Date.now();
-    let removed = false;
 
     for (const [ip, user] of this.localUsers) {
-        if (now - user.lastSeen > 60 * 1000) { // 1 minute inactivity
-            this.localUsers.delete(ip);
-            removed = true;
-        }
+        if (ip === this.privateIP || this.liveUsers.has(ip)) user.lastSeen = now;
+        else if (now - user.lastSeen > 60 * 1000) this.localUsers.delete(ip);
     }
 
-    if (removed && this.onUserUpdate) {
+    if (this.onUserUpdate)
         this.onUserUpdate([...this.localUsers.values()]);
+  }
+
+  onPresence({ up, gone }){
+    const now = Date.now();
+    for (const u of up) {
+      if (u.privateIP === this.privateIP) continue;
+      this.liveUsers.add(u.privateIP);
+      this.localUsers.set(u.privateIP, { ...u, lastSeen: now });
+    }
+    for (const ip of gone) {
+      this.liveUsers.delete(ip);
+      this.localUsers.delete(ip);
     }
+    if (this.onUserUpdate)
+      this.onUserUpdate([...this.localUsers.values()]);
   }
   
   setOrganisation(name) { this.organisationName = name; }
@@ -105,6 +120,8 @@ export class PresenceManager {
     data = {...this.getDefaultPresence(),userInfo:{...data?.userInfo,...myInfoUpdate} };
     localStorage.setItem("myPresence", JSON.stringify(data));
     this.localUsers.set(data.privateIP,data);
+    if(this.activated)
+      this.messageHandler.setPresenceInfo(data.userInfo);
     if(this.onUserUpdate)
       this.onUserUpdate([...this.localUsers.values()]);
   }
@@ -191,84 +208,4 @@ export class PresenceManager {
     return [...this.localUsers.values()];
 
   }
-
-
-  /* ---------------- NETWORK / GOSSIP ---------------- */
-  async sendPeriodicUpdate() {
-  
-    const now = Date.now();
-    const myUpdate = await this.getMyPresence();
-    if(!myUpdate)return;
-    myUpdate.lastSeen=now;
-
-    this.localUsers.set(this.privateIP, myUpdate);
-    this.accUpdates.set(this.privateIP, myUpdate);
-
-    const peers = [...this.localUsers.keys()];//.filter(ip => ip !== this.privateIP); //remove this comment 
-    const targets = this.pickRandom(peers, 3);
-    const jsonStr = JSON.stringify([...this.accUpdates.values()]);
-    const payload = pako.deflate(jsonStr); 
-
-    targets.forEach(t => {
-      this.messageHandler.sendMessage(
-        this.discoveryPort,
-        t,
-        this.localUsers.get(t).discoveryPort,
-        MsgType.DISCOVERY,
-        payload,
-      );
-    });
-    this.accUpdates.clear();
-  }
-
-
-  onDiscoveryMessage(srcIP,srcPort,dstIP,dstPort,type, payload) {
-    const decompressedStr = pako.inflate(payload, { to: "string" });
-    const updates = JSON.parse(decompressedStr);
-
-    // console.log("update received",updates,this.getMyPresence());
-
-    updates.forEach(u => {
-      const existing = this.localUsers.get(u.privateIP);
-      if(u.privateIP===this.privateIP )return;
-      if (!existing || u.lastSeen > existing.lastSeen) {
-        this.localUsers.set(u.privateIP, {...existing,...u});
-        this.accUpdates.set(u.privateIP, {...existing,...u});
-      }
-      
-    });
-
-    const now = Date.now();
-    const ONE_MIN = 60 * 1000;
-
-    let activeUserCount = 0;
-    this.localUsers.forEach(user => {
-      if (now - user.lastSeen <= ONE_MIN) {
-        activeUserCount++;
-      }
-    });
-
-    const a=Math.min(10,Math.max(activeUserCount,this.updateTimerInterval));
-    if(a!=this.updateTimerInterval){
-      clearInterval(this.periodUpdateTimer);
-      this.updateTimerInterval=a;
-      this.periodUpdateTimer= setInterval(this.sendPeriodicUpdate.bind(this), this.updateTimerInterval*1000);
-    }
-    
-    if(this.onUserUpdate)
-      this.onUserUpdate([...this.localUsers.values()]);
-  }
-
-  /* ---------------- HELPERS ---------------- */
-  pickRandom(arr, n) {
-    const out = [], len = arr.length;
-    for (let i = 0; i < n && i < len; i++) {
-      const r = Math.floor(Math.random() * (len - i)) + i;
-      const val = arr[r];
-      arr[r] = arr[i];
-      arr[i] = val;
-      out.push(arr[i]);
-    }
-    return out;
-  }
 }
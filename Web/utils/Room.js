@@ -24,7 +24,9 @@ export class Room {
     this.currentMasterPort=null;
 
     this.peers=new Map();
-    this.vote=new Set();
+    this.masterTerm=0;
+    this.relayCapacity=null;
+    this.relayInterval=null;
 
     this.client=new RoomClient(); // RoomClient
     this.server=new RoomServer(); // RoomServer
@@ -46,14 +48,18 @@ export class Room {
     this.client.init(messageHandler,stream);
     this.client.setOnServerDisconnect(this.startElection.bind(this));
     this.server.init(messageHandler,this.broadcastPeerUpdate.bind(this));
+    this.messageHandler.setOnMessageReceive(MsgType.AUDIO_MIX,this._onMixAudio.bind(this));
 
     this.messageHandler.setOnMessageReceive(MsgType.CONNECT_REQUEST,this._onConnect.bind(this));
     this.messageHandler.setOnMessageReceive(MsgType.CONNECT_REPLY,this._onConnect.bind(this));
-    this.messageHandler.setOnMessageReceive(MsgType.CAST_VOTE,this.onVote.bind(this));
     this.messageHandler.setOnMessageReceive(MsgType.PEER_CONNECTED,this.onPeerUpdate.bind(this));
     this.messageHandler.setOnMessageReceive(MsgType.PEER_REMOVED,this.onPeerUpdate.bind(this));
     this.messageHandler.setOnMessageReceive(MsgType.ALL_PEERS,this.onAllPeersReceive.bind(this));
     this.messageHandler.setOnMessageReceive(MsgType.GET_ALL_PEERS,this.onAllPeersRequest.bind(this));
+    this.messageHandler.onRoomMaster(this._onMasterElected.bind(this));
+    this.messageHandler.setRoom(this.roomId,this.selfIP,this.selfPort);
+    this.messageHandler.onRelayPlan(this._onRelayPlan.bind(this));
+    this.relayInterval=setInterval(this._reportCapacity.bind(this),2000);
 
     this.running=true;
   }
@@ -141,6 +147,7 @@ export class Room {
     }
 
     this.peers.set(ip, updatedPeer);
+    this._syncMembers();
 
     const payload = new TextEncoder().encode(JSON.stringify(this.getSelfInfo()));
 
@@ -174,6 +181,7 @@ export class Room {
     }
 
     this.peers.set(srcIP, peer);
+    this._syncMembers();
 
     
     if(data.master.ip&&data.master.ip!==this.currentMasterIP){
@@ -210,6 +218,8 @@ export class Room {
   async broadcastPeerUpdate(update,type){
     if(!this.running||this.currentMasterIP!==this.selfIP)return;
     const payload=new TextEncoder().encode(JSON.stringify(update));
+    if(this.messageHandler.multicastPort)  //one datagram for the whole room, see MessageHandler.setMulticast
+      return this.messageHandler.broadcast(type,payload);
     for (const [_, peer] of this.peers) {
       if (peer.status === PeerStatus.CONNECTED) {
         await this.messageHandler.sendMessage(0,peer.ip,peer.port,type,payload);
@@ -225,6 +235,7 @@ export class Room {
     this.messageHandler.removeConn(MsgType.TCP,this.selfIP,this.selfPort,peer.ip,peer.randomPort);
 
     this.peers.delete(peerIP);
+    this._syncMembers();
 
     if(peer.senderConn){
       this.messageHandler.detachConnHandler(MsgType.TCP,0,peer.ip,peer.port,peer.senderConn);
@@ -234,79 +245,76 @@ export class Room {
       this.messageHandler.detachConnHandler(MsgType.TCP,this.selfPort,peer.ip,peer.randomPort,peer.receiverConn);
       peer.receiverConn=null;
     }
-    this.vote.delete(peerIP);
     this.server.removeClientFromMixer(peerIP);
   }
 
-  async startElection() {
+  // the election itself runs natively (RoomElection.h), the outcome arrives in _onMasterElected
+  startElection() {
     if(!this.running)return;
     if(this.currentMasterIP===this.selfIP)
       this.server.stopServer();
     this.currentMasterIP = null;
     this.currentMasterPort = null;
+    this.connect({ip: this.selfIP,port: this.selfPort,name: this.name ?? "",photo: this.photo ?? ""});
+    this.messageHandler.electRoomMaster();
+  }
 
-    while (this.running&&this.currentMasterIP === null) {
-      this.vote.clear();
-      this.connect({ip: this.selfIP,port: this.selfPort,name: this.name ?? "",photo: this.photo ?? ""});
-
-      for (const [ip, peer] of this.peers)
+  _onMasterElected({ ip, port, term }) {
+    if(!this.running)return;
+    this.masterTerm=term;
+    if(ip===this.currentMasterIP&&port===this.currentMasterPort)return;
+    if(this.currentMasterIP===this.selfIP)
+      this.server.stopServer();
+    this.server.setRelay(null,null);  //the new master sends everyone a fresh relay plan
+    this.currentMasterIP=ip;
+    this.currentMasterPort=port;
+    if(ip===this.selfIP)
+      this.server.startMixer();
+    this.client.onServerConnect(this.currentMasterIP,this.currentMasterPort);
+    if(ip===this.selfIP){
+      for(const [_, peer] of this.peers)  //their CONNECT_REPLY adds them to the mixer
         this.connect(peer);
-
-      await new Promise((resolve) => setTimeout(resolve, 200));
-      if(!(this.running&&this.currentMasterIP === null))break;
-
-      let ip = 0;
-
-      for (const [_, peer] of this.peers) {
-        if (peer.status === PeerStatus.CONNECTED) {
-          ip = ip > peer.ip ? ip : peer.ip;
-        } else {
-          // console.log(`⚠️ Peer not connected: ${peer.ip}`);
-        }
-      }
-
-      const candidate = this.peers.get(ip);
-      if(!candidate)
-        continue;
-
-      const payload = new TextEncoder().encode(JSON.stringify({}));
-
-      this.messageHandler.sendMessage(0, candidate.ip, candidate.port, MsgType.CAST_VOTE, payload);
-
-      await new Promise((resolve) => setTimeout(resolve, 200));
     }
-
-    console.log("✅ Election complete! Master elected:", this.currentMasterIP, this.currentMasterPort);
+    console.log("✅ Master elected:", this.currentMasterIP, this.currentMasterPort, "term", term);
   }
 
-  
-  onVote(srcIP, srcPort, dstIP, dstPort, type, payload){
+  // our place in the relay tree (RelayTree.h): a node with children, or the root, mixes for
+  // them and itself and sends its parent the mix of its subtree; a leaf talks to its parent
+  _onRelayPlan({ parent, children }) {
     if(!this.running)return;
-    if(this.currentMasterIP!=null){
-        let peer=this.peers.get(srcIP);
-        this.connect(peer);
-        return;
-    }
-    this.vote.add(srcIP);
-    let currentActive=0;
-    for(const [ip,peer] of this.peers){
-        if(peer.status===PeerStatus.CONNECTED)
-          currentActive++;
+    const mixes=!parent||children.length>0;
+    if(mixes){
+      const clients=new Map(children.map(c=>[c.ip,c.port]));
+      clients.set(this.selfIP,this.selfPort);
+      this.server.setRelay(clients,parent);
+    }else{
+      this.server.setRelay(new Map(),null);
     }
+    const target=mixes?{ip:this.selfIP,port:this.selfPort}:parent;
+    if(target.ip!==this.client.currentMasterIP||target.port!==this.client.currentMasterPort)
+      this.client.onServerConnect(target.ip,target.port);
+  }
 
-    let totalVote=this.vote.size;
-
-    if((currentActive/2)<totalVote ){
-        this.currentMasterIP=this.selfIP;
-        this.currentMasterPort=this.selfPort;
-        this.server.startMixer();
-        this.client.onServerConnect(this.currentMasterIP,this.currentMasterPort);//this is client side function try to remove from here
-        for(const ip of this.vote){
-          const peer=this.peers.get(ip);
-          this.connect(peer);
-        }
-    }
+  // the parent's AUDIO_MIX feeds our mixer, every other one is what we listen to
+  _onMixAudio(srcIP, ...rest) {
+    if(!this.running)return;
+    if(this.server.isUpstream(srcIP))
+      this.server.onUpstreamAudio(srcIP,rest[rest.length-1]);
+    else
+      this.client.onMixAudioReceive(srcIP,...rest);
+  }
+
+  _reportCapacity(){
+    if(!this.running)return;
+    const capacity=this.server.capacity();
+    if(capacity===null||capacity===this.relayCapacity)return;
+    this.relayCapacity=capacity;
+    this.messageHandler.setRelayCapacity(capacity);
+  }
 
+  _syncMembers(){
+    if(!this.running||this.leaving)return;
+    this.messageHandler.setRoomMembers([...this.peers.values()].map(p=>({ip:p.ip,port:p.port})));
   }
   
   stop() {
@@ -316,14 +324,19 @@ export class Room {
     }
     this.currentMasterIP=null;  //so that we no longer perform server function
     this.currentMasterPort=null;//so that we no longer perform server function
+    clearInterval(this.relayInterval);
+    this.relayInterval=null;
     
     this.client.stop();
     this.server.stop();
 
     if (this.messageHandler) {
+      this.leaving=true;  //peers removed below must not be reconnected as standby
+      this.messageHandler.setRoom(this.roomId,this.selfIP,this.selfPort,0);
+      this.messageHandler.onRoomMaster(null);
+      this.messageHandler.onRelayPlan(null);
       this.messageHandler.removeMessageHandler(MsgType.CONNECT_REQUEST);
       this.messageHandler.removeMessageHandler(MsgType.CONNECT_REPLY);
-      this.messageHandler.removeMessageHandler(MsgType.CAST_VOTE);
       this.messageHandler.removeMessageHandler(MsgType.PEER_CONNECTED);
       this.messageHandler.removeMessageHandler(MsgType.PEER_REMOVED);
       this.messageHandler.removeMessageHandler(MsgType.ALL_PEERS);
@@ -336,10 +349,6 @@ export class Room {
     if (this.peers)
       this.peers.clear();
 
-    if(this.vote)
-      this.vote.clear();
-
-    this.vote=null;
     this.messageHandler = null;
     this.peers = null;
     this.running=false;
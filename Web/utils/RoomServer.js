@@ -2,6 +2,8 @@ import { MsgType } from "@utils/MessageTypes";
 import { RingBuffer } from "./RingBuffer.js";
 import { OpusDecoder, OpusEncoder } from "@utils/audio";
 
+const MIX_BUDGET_MS = 5;    // share of each 20 ms tick the mixer may use, for capacity()
+
 export class RoomServer {
   constructor() {
     this.messageHandler = null;
@@ -10,6 +12,12 @@ export class RoomServer {
     this.mixerBuffer = new Map();
     this.mixerInterval = null;
     this.mix = null;
+    this.mixCostMs = 0;     // smoothed mixer time per stream
+
+    // relay tree (MessageHandler.onRelayPlan): who this node mixes for, ip -> port, null for
+    // everyone that connects; upstream is the parent this node's subtree is mixed with
+    this.relayClients = null;
+    this.upstream = null;
 
     this.running = null;
   }
@@ -28,6 +36,14 @@ export class RoomServer {
   addClientToMixer({ ip, port, name, photo }) {
     if (!this.running || this.mixerBuffer.has(ip)) return;
 
+    if (!this.relayClients || this.relayClients.has(ip))
+      this._createMixInfo(ip, port);
+
+    this.broadcast({ ip, port, name, photo },MsgType.PEER_CONNECTED);
+  }
+
+  // the upstream gets our subtree's mix as CLIENT_AUDIO and sends back the rest of the room
+  _createMixInfo(ip, port, upstream = false) {
     const mixInfo = {};
 
     mixInfo.encoder = new OpusEncoder();
@@ -35,7 +51,8 @@ export class RoomServer {
     mixInfo.audioBuf = new RingBuffer(960 * 10);
     mixInfo.out = new Float32Array(960);
 
-    mixInfo.clientTimeout = setTimeout(() => {
+    mixInfo.upstream = upstream;
+    mixInfo.clientTimeout = upstream ? null : setTimeout(() => {
       this.removeClientFromMixer(ip);
     }, 500);
 
@@ -44,19 +61,64 @@ export class RoomServer {
     });
 
     mixInfo.encoder.onData((mixedAudio) => {
-      this.messageHandler.sendMessage(0,ip,port,MsgType.AUDIO_MIX,mixedAudio);
+      this.messageHandler.sendMessage(0,ip,port,upstream ? MsgType.CLIENT_AUDIO : MsgType.AUDIO_MIX,mixedAudio);
     });
 
     this.mixerBuffer.set(ip, mixInfo);
+    return mixInfo;
+  }
 
-    this.broadcast({ ip, port, name, photo },MsgType.PEER_CONNECTED);
+  // clients: Map ip -> port of the children plus ourselves, upstream: { ip, port } or null at
+  // the root; (null, null) goes back to mixing everyone. Members that moved elsewhere are
+  // dropped without a PEER_REMOVED, they are still in the room.
+  setRelay(clients, upstream) {
+    if (!this.running) return;
+
+    for (const [ip, mixInfo] of this.mixerBuffer) {
+      const keep = mixInfo.upstream
+        ? upstream?.ip === ip
+        : clients && clients.has(ip);
+      if (!keep) this._dropMixInfo(ip);
+    }
+
+    this.relayClients = clients;
+    this.upstream = upstream;
+
+    if (!clients || !clients.size) {
+      clearInterval(this.mixerInterval);
+      this.mixerInterval = null;
+      return;
+    }
+    for (const [ip, port] of clients)
+      if (!this.mixerBuffer.has(ip)) this._createMixInfo(ip, port);
+    if (upstream && !this.mixerBuffer.has(upstream.ip))
+      this._createMixInfo(upstream.ip, upstream.port, true);
+    if (!this.mixerInterval) this.startMixer();
+  }
+
+  isUpstream(ip) {
+    return this.upstream?.ip === ip;
+  }
+
+  // AUDIO_MIX from the parent: everything outside our subtree
+  onUpstreamAudio(srcIP, payload) {
+    if (!this.running) return;
+    this.mixerBuffer.get(srcIP)?.decoder.writePacket(payload);
+  }
+
+  // children this node could mix for within MIX_BUDGET_MS, null until it has mixed
+  capacity() {
+    if (!this.mixCostMs) return null;
+    return Math.max(1, Math.min(64, Math.floor(MIX_BUDGET_MS / this.mixCostMs) - 2));
   }
 
   onClientAudioReceived(srcIP, srcPort, dstIP, dstPort, type, payload) {
     if (!this.running) return;
 
-    const mixInfo = this.mixerBuffer.get(srcIP);
-    if (!mixInfo) return;
+    let mixInfo = this.mixerBuffer.get(srcIP);
+    if (!mixInfo && this.relayClients?.has(srcIP))     // a child that timed out and came back
+      mixInfo = this._createMixInfo(srcIP, this.relayClients.get(srcIP));
+    if (!mixInfo || mixInfo.upstream) return;
 
     mixInfo.decoder.writePacket(payload);
 
@@ -75,6 +137,7 @@ export class RoomServer {
 
     this.mixerInterval = setInterval(() => {
       if (!this.running) return;
+      const start = performance.now();
 
       for (const [, mixInfo] of this.mixerBuffer) {
         mixInfo.out.fill(0);
@@ -94,6 +157,11 @@ export class RoomServer {
         }
         mixInfo.encoder.writeSamples(mixInfo.out);
       }
+
+      if (this.mixerBuffer.size) {
+        const cost = (performance.now() - start) / this.mixerBuffer.size;
+        this.mixCostMs = this.mixCostMs ? 0.9 * this.mixCostMs + 0.1 * cost : cost;
+      }
     }, 20);
   }
 
@@ -101,6 +169,7 @@ export class RoomServer {
     if (!this.running) return;
 
     clearInterval(this.mixerInterval);
+    this.mixerInterval = null;
     for (const [ip] of this.mixerBuffer) {
       this.removeClientFromMixer(ip);
     }
@@ -108,6 +177,15 @@ export class RoomServer {
 
   removeClientFromMixer(peerIP){
     if(!this.running) return;
+    const mixInfo=this.mixerBuffer.get(peerIP);
+    if(mixInfo){
+      this._dropMixInfo(peerIP);
+      if(!mixInfo.upstream)
+        this.broadcast({peerIP},MsgType.PEER_REMOVED);
+    }
+  }
+
+  _dropMixInfo(peerIP){
     const mixInfo=this.mixerBuffer.get(peerIP);
     if(mixInfo){
       clearTimeout(mixInfo.clientTimeout);
@@ -119,7 +197,6 @@ export class RoomServer {
       mixInfo.out=null;
       mixInfo.clientTimeout=null;
       this.mixerBuffer.delete(peerIP);
-      this.broadcast({peerIP},MsgType.PEER_REMOVED);
     }
   }
 
@@ -136,6 +213,8 @@ export class RoomServer {
     this.messageHandler = null;
     this.broadcast = null;
     this.mix = null;
+    this.relayClients = null;
+    this.upstream = null;
 
     this.running = false;
   }
@@ -0,0 +1,202 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Admission control for what peers send us, decided before anything is allocated for it:
+// how many accepted TCP connections one source address may hold, and token buckets on the
+// messages and bytes a source sends, over all types and per message type. A peer that floods
+// runs out of tokens and loses its own messages; the dispatcher queue, the receive callback
+// and the page never see them, so the other peers' messages do not wait behind them.
+//
+// Limits of 0 are off, and all are off by default. A source is an IPv4 address: TCP the
+// connection's peer, UDP the datagram's sender.
+namespace admission {
+
+constexpr uint32_t MAX_SOURCES = 4096;          // tracked at once; idle ones are forgotten first
+constexpr uint32_t REPORT_EVERY_MS = 5000;      // a source still dropping is reported again after
+
+struct Rate {
+    uint32_t perSec = 0;                        // 0: unlimited
+    uint32_t burst = 0;                         // bucket size, 0: one second's worth
+};
+
+struct Limits {
+    uint32_t maxConnsPerIP = 0;                 // accepted TCP connections held at once
+    Rate msgs;                                  // per source, every type together
+    Rate bytes;
+    Rate typeMsgs[256];                         // per source and type
+    Rate typeBytes[256];
+
+    bool limitsTraffic() const {
+        if (msgs.perSec || bytes.perSec) return true;
+        for (int t = 0; t < 256; ++t)
+            if (typeMsgs[t].perSec || typeBytes[t].perSec) return true;
+        return false;
+    }
+};
+
+// Refilled at the rate's perSec on use. A message bigger than the burst still passes once the
+// bucket is full, leaving it in debt, so a limit below the largest message slows that sender
+// down instead of cutting it off.
+class Bucket {
+public:
+    bool allows(const Rate& rate, uint64_t cost, uint64_t nowNs) {
+        if (!rate.perSec) return true;
+        double cap = rate.burst ? rate.burst : rate.perSec;
+        if (!lastNs) tokens = cap;
+        else if (nowNs > lastNs) tokens = std::min(cap, tokens + (nowNs - lastNs) * 1e-9 * rate.perSec);
+        lastNs = nowNs;
+        return tokens >= std::min<double>((double)cost, cap);
+    }
+
+    void take(const Rate& rate, uint64_t cost) {
+        if (rate.perSec) tokens -= (double)cost;
+    }
+
+private:
+    double tokens = 0;
+    uint64_t lastNs = 0;
+};
+
+struct SourceStats {
+    uint32_t ip;
+    uint32_t conns;
+    uint64_t droppedMsgs;
+    uint64_t droppedBytes;
+};
+
+// Thread safe; sources are spread over a few locks by address so receiver threads of
+// different peers rarely wait for each other.
+class Gate {
+public:
+    Gate() { setLimits(Limits{}); }
+
+    void setLimits(const Limits& l) {
+        auto shared = std::make_shared<const Limits>(l);
+        for (Stripe& s : stripes) {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            s.limits = shared;
+            for (auto& [ip, src] : s.sources) src.types.clear();
+        }
+        traffic.store(l.limitsTraffic(), std::memory_order_relaxed);
+    }
+
+    Limits limits() {
+        std::lock_guard<std::mutex> lock(stripes[0].mtx);
+        return *stripes[0].limits;
+    }
+
+    // whether admit() can drop anything; receivers skip it (and reading ahead for it) if not
+    bool limitsTraffic() const { return traffic.load(std::memory_order_relaxed); }
+
+    // a connection accepted from ip, counted until releaseConnection; false over maxConnsPerIP
+    bool admitConnection(uint32_t ip) {
+        Stripe& s = stripeOf(ip);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        Source& src = sourceOf(s, ip, 0);
+        if (s.limits->maxConnsPerIP && src.conns >= s.limits->maxConnsPerIP) return false;
+        ++src.conns;
+        return true;
+    }
+
+    void releaseConnection(uint32_t ip) {
+        Stripe& s = stripeOf(ip);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        auto it = s.sources.find(ip);
+        if (it != s.sources.end() && it->second.conns) --it->second.conns;
+    }
+
+    // a message of bytes from ip; false: drop it. report is set on the first drop from ip and
+    // on the first one every REPORT_EVERY_MS after
+    bool admit(uint32_t ip, uint8_t type, uint32_t bytes, uint64_t nowNs, bool& report) {
+        Stripe& s = stripeOf(ip);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        const Limits& l = *s.limits;
+        Source& src = sourceOf(s, ip, nowNs);
+        src.lastSeenNs = nowNs;
+        Bucket* typeMsgs = nullptr;
+        Bucket* typeBytes = nullptr;
+        if (l.typeMsgs[type].perSec || l.typeBytes[type].perSec) {
+            auto& b = src.types[type];
+            typeMsgs = &b.first;
+            typeBytes = &b.second;
+        }
+        bool ok = src.msgs.allows(l.msgs, 1, nowNs) && src.bytes.allows(l.bytes, bytes, nowNs) &&
+            (!typeMsgs || (typeMsgs->allows(l.typeMsgs[type], 1, nowNs) && typeBytes->allows(l.typeBytes[type], bytes, nowNs)));
+        if (ok) {
+            src.msgs.take(l.msgs, 1);
+            src.bytes.take(l.bytes, bytes);
+            if (typeMsgs) {
+                typeMsgs->take(l.typeMsgs[type], 1);
+                typeBytes->take(l.typeBytes[type], bytes);
+            }
+            return true;
+        }
+        src.droppedMsgs++;
+        src.droppedBytes += bytes;
+        report = !src.reportedNs || nowNs - src.reportedNs >= uint64_t(REPORT_EVERY_MS) * 1000000;
+        if (report) src.reportedNs = nowNs;
+        return false;
+    }
+
+    // sources holding connections or that had messages dropped, most dropped first
+    std::vector<SourceStats> sources() {
+        std::vector<SourceStats> out;
+        for (Stripe& s : stripes) {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            for (auto& [ip, src] : s.sources)
+                if (src.conns || src.droppedMsgs) out.push_back({ ip, src.conns, src.droppedMsgs, src.droppedBytes });
+        }
+        std::sort(out.begin(), out.end(), [](const SourceStats& a, const SourceStats& b) { return a.droppedMsgs > b.droppedMsgs; });
+        return out;
+    }
+
+private:
+    static constexpr uint32_t STRIPES = 16;
+
+    struct Source {
+        Bucket msgs, bytes;
+        std::unordered_map<uint8_t, std::pair<Bucket, Bucket>> types;      // only limited types
+        uint32_t conns = 0;
+        uint64_t droppedMsgs = 0;
+        uint64_t droppedBytes = 0;
+        uint64_t lastSeenNs = 0;
+        uint64_t reportedNs = 0;
+    };
+
+    struct Stripe {
+        std::mutex mtx;
+        std::shared_ptr<const Limits> limits;
+        std::unordered_map<uint32_t, Source> sources;
+    };
+
+    Stripe stripes[STRIPES];
+    std::atomic<bool> traffic{ false };
+
+    Stripe& stripeOf(uint32_t ip) {
+        return stripes[(ip * 2654435761u) >> 28];
+    }
+
+    // a full stripe forgets the source seen longest ago that holds no connection; sources
+    // spoofed by the thousand then cost a bounded table, not memory
+    Source& sourceOf(Stripe& s, uint32_t ip, uint64_t nowNs) {
+        auto it = s.sources.find(ip);
+        if (it != s.sources.end()) return it->second;
+        if (s.sources.size() >= MAX_SOURCES / STRIPES) {
+            auto oldest = s.sources.end();
+            for (auto o = s.sources.begin(); o != s.sources.end(); ++o)
+                if (!o->second.conns && (oldest == s.sources.end() || o->second.lastSeenNs < oldest->second.lastSeenNs)) oldest = o;
+            if (oldest != s.sources.end()) s.sources.erase(oldest);
+        }
+        Source& src = s.sources[ip];
+        src.lastSeenNs = nowNs;
+        return src;
+    }
+};
+
+} // namespace admission
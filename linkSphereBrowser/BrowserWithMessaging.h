@@ -2,9 +2,13 @@
 #include <chrono>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 #include "BrowserWindow.h"
 #include "MessageChannel.h"
+#include "MessageBlock.h"
 #include "ThreadPool.h"
+#include "Metrics.h"
+#include "Tracing.h"
 
 #define WM_SEND_TO_WEBVIEW (WM_APP + 123)
 #define WM_CUSTOM_CLOSE (WM_APP + 124)
@@ -13,6 +17,7 @@
 class BrowserWithMessaging : public BrowserWindow {
 public:
     using BinaryMessageCallback = void(*)(const BYTE* data, uint32_t size);
+    using BlockMessageCallback = void(*)(MessageBlock* msg);     // callee owns msg
     using OfflinePageCallback = std::function<std::wstring(int)>;
 
     BrowserWithMessaging(
@@ -33,16 +38,47 @@ public:
 
     int sendMessage(const BYTE* data, uint32_t size) {
         if (!channel) return 0;
-        int a= channel->writeBuf(data, size);
-        notify();
+        uint64_t start = metrics::now();
+        // messages larger than the free ring space go out in fragments while the page drains it
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        int a = channel->writeStream(data, size, [this, deadline]() {
+            ringDoorbell();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return std::chrono::steady_clock::now() < deadline;
+            });
+        ringDoorbell();
+
+        metrics::recordSince(metrics::CHANNEL_WRITE_NS, start);
+        if (a) {
+            tracing::point(tracing::RING_WRITE, tracing::current());
+            metrics::add(metrics::CHANNEL_MSGS_OUT);
+            metrics::add(metrics::CHANNEL_BYTES_OUT, size);
+        }
+        else metrics::add(metrics::CHANNEL_WRITE_FAILURES);
+        metrics::setGauge(metrics::RING_OUT_FREE, (int64_t)channel->availableToWrite());
         return a;
     }
 
+    // Wakes the page only if it said it is asleep and nobody rang since; while it is
+    // draining the ring it picks up new data without a "dataReady".
+    void ringDoorbell() {
+        if (channel && channel->needsDoorbell())
+            notify();
+    }
+
     void setOnReceiveCallback(BinaryMessageCallback cb) {
         onReceive = cb;
         stopReceiverThread();
         // Start polling thread
-        if (cb)
+        if (cb || onReceiveBlock)
+            startReceiverThread();
+    }
+
+    // messages from the page are streamed straight into a MessageBlock, no intermediate buffer
+    void setOnReceiveCallback(BlockMessageCallback cb) {
+        onReceiveBlock = cb;
+        stopReceiverThread();
+        if (cb || onReceive)
             startReceiverThread();
     }
     void setOnNotificationCallback(void (*cb)(const std::wstring&)) {
@@ -50,6 +86,13 @@ public:
 
     }
 
+    // Size of the shared buffer backing the page channel (both directions). Takes effect on
+    // the next document load; the current buffer is reused as long as the size is unchanged.
+    void setChannelSize(uint32_t bytes) {
+        if (bytes >= MessageChannel::CONTROL_HEADER_SIZE + 18)
+            channelSize = bytes;
+    }
+
     bool isOpen() const {
         return windowAlive;
     }
@@ -72,15 +115,19 @@ private:
 
     wil::com_ptr<ICoreWebView2SharedBuffer> sharedBuffer;
     BYTE* sharedPtr = nullptr;
+    UINT32 sharedBufferSize = 0;
+    std::atomic<UINT32> channelSize{ 10 * 1024 * 1024 };
 
     std::unique_ptr<MessageChannel> channel;
     BinaryMessageCallback onReceive = nullptr;
+    BlockMessageCallback onReceiveBlock = nullptr;
     OfflinePageCallback offlinePageCallback;
     void (*onNotification)(const std::wstring&) = nullptr;
     std::mutex g_mutex;
     std::condition_variable g_cv;
     std::thread receiverThread;
     bool g_running=1;
+    bool doorbellRung = false;
     bool windowAlive=true;
     ThreadPool* threadPool;
     bool m_isNavigating = false;
@@ -124,6 +171,7 @@ private:
                     if (*message == L"dataReady") {
                         // Notify the receiver thread that new data is available
                         std::lock_guard<std::mutex> lock(g_mutex);
+                        doorbellRung = true;
                         g_cv.notify_one();
                         delete message; // free immediately, no need to pass to threadPool
                     }
@@ -201,33 +249,117 @@ private:
     }
 
 
+    // How long the receiver keeps polling an idle ring before it advertises "asleep" and
+    // blocks. Bursts from the page then cost no "dataReady" round trips at all; the wait
+    // timeout is only a safety net, the page writes the ring without memory fences.
+    static constexpr auto receiverSpin = std::chrono::microseconds(50);
+    static constexpr auto receiverSleepCap = std::chrono::milliseconds(100);
+
     void startReceiverThread() {
         g_running = 1;
         receiverThread = std::thread([this] {
-            std::unique_lock<std::mutex> lock(g_mutex);
             while (g_running) {
-                g_cv.wait(lock, [this] {
-                    return !g_running || (channel && channel->availableToRead() > 0);
-                    });
-                if (!g_running) break;
-                uint32_t msgSize = channel->sizeofNextMessage();
-                if (!msgSize) continue;
-                BYTE* buffer = new BYTE[msgSize];
-                int readBytes = channel->readBuf(buffer, msgSize);
-                if (readBytes > 0) {
-                    threadPool->enqueue([this, buffer, readBytes]() {
-                        onReceive(buffer, readBytes);
-                        delete[] buffer;
-                        });
+                if (!channel) {
+                    std::unique_lock<std::mutex> lock(g_mutex);
+                    g_cv.wait_for(lock, receiverSleepCap, [this] { return !g_running || doorbellRung; });
+                    doorbellRung = false;
+                    continue;
+                }
+
+                if (receiveOne()) continue;
+
+                // spin briefly before paying for a sleep/wake cycle
+                bool got = false;
+                auto spinUntil = std::chrono::steady_clock::now() + receiverSpin;
+                while (!got && g_running && std::chrono::steady_clock::now() < spinUntil) {
+                    YieldProcessor();
+                    got = channel->availableToRead() > 0 && receiveOne();
                 }
-                //delete[] buffer;
+                if (got) continue;
+
+                std::unique_lock<std::mutex> lock(g_mutex);
+                if (!channel->trySleep()) continue;     // data slipped in while going to sleep
+                g_cv.wait_for(lock, receiverSleepCap, [this] { return !g_running || doorbellRung; });
+                doorbellRung = false;
+                channel->setPolling();
             }
+            delete pendingBlock;
+            pendingBlock = nullptr;
+            delete[] pendingBuffer;
+            pendingBuffer = nullptr;
+            });
+    }
+
+    // true if a message was completed (or dropped), false if nothing to do yet
+    bool receiveOne() {
+        return onReceiveBlock ? receiveBlock() : receiveBuffer();
+    }
+
+    // A fragmented message can span several wakeups, so the destination lives across
+    // iterations until the channel reports it complete (or aborted).
+    MessageBlock* pendingBlock = nullptr;
+    BYTE* pendingBuffer = nullptr;
+
+    bool receiveBlock() {
+        int readBytes = channel->readStream([this](uint32_t total) -> BYTE* {
+            if (total < 17) return nullptr;
+            pendingBlock = new MessageBlock(total);
+            return pendingBlock->getRawWritePtr();
             });
+        if (readBytes == 0) return false;
+
+        MessageBlock* msg = pendingBlock;
+        pendingBlock = nullptr;
+        if (readBytes < 0 || !msg) {
+            delete msg;
+            return true;
+        }
+        uint64_t traceId = countReceived(readBytes);
+        msg->setTotalSize((uint32_t)readBytes);     // the record's length, not the size the page wrote
+        msg->finalizeNetMsg();
+        msg->setTraceId(traceId);
+        threadPool->enqueue([this, msg]() { onReceiveBlock(msg); }, traceId);
+        return true;
+    }
+
+    // returns the trace id of the message just read, 0 if it is not sampled
+    uint64_t countReceived(int bytes) {
+        metrics::add(metrics::CHANNEL_MSGS_IN);
+        metrics::add(metrics::CHANNEL_BYTES_IN, (uint64_t)bytes);
+        metrics::setGauge(metrics::RING_IN_USED, (int64_t)channel->availableToRead());
+
+        uint64_t traceId = tracing::pageId(channel->getGeneration(), channel->getReadSeq());
+        tracing::point(tracing::RING_READ, traceId);
+        return traceId;
+    }
+
+    bool receiveBuffer() {
+        int readBytes = channel->readStream([this](uint32_t total) -> BYTE* {
+            pendingBuffer = new BYTE[total];
+            return pendingBuffer;
+            });
+        if (readBytes == 0) return false;
+
+        BYTE* buffer = pendingBuffer;
+        pendingBuffer = nullptr;
+        if (readBytes < 0) {
+            delete[] buffer;
+            return true;
+        }
+        uint64_t traceId = countReceived(readBytes);
+        threadPool->enqueue([this, buffer, readBytes]() {
+            onReceive(buffer, readBytes);
+            delete[] buffer;
+            }, traceId);
+        return true;
     }
 
 
  
 
+    // The shared buffer outlives documents: it is allocated once (again only if the size
+    // changed), reset in place for each new document and re-posted to it. The reset bumps
+    // the channel generation so nothing from the previous document is mistaken for new data.
     void setupSharedMemory(bool isLeftMaster = true) {
         if (!env || !webview) return;
 
@@ -237,19 +369,34 @@ private:
         wil::com_ptr<ICoreWebView2_17> webview17;
         if (FAILED(webview->QueryInterface(IID_PPV_ARGS(&webview17))) || !webview17) return;
 
-        UINT32 size = 10 * 1024 * 1024;
-        if (FAILED(env12->CreateSharedBuffer(size, &sharedBuffer)) || !sharedBuffer) return;//this line auto release previously allocated memory so don't worry about mem leak
-        if (FAILED(sharedBuffer->get_Buffer(&sharedPtr)) || !sharedPtr) return;
+        UINT32 size = channelSize;
+        if (!sharedBuffer || !channel || sharedBufferSize != size) {
+            wil::com_ptr<ICoreWebView2SharedBuffer> buffer;
+            BYTE* ptr = nullptr;
+            if (FAILED(env12->CreateSharedBuffer(size, &buffer)) || !buffer) return;
+            if (FAILED(buffer->get_Buffer(&ptr)) || !ptr) return;
+
+            bool receiving = receiverThread.joinable();
+            stopReceiverThread();       // keep the receiver off the channel while it is swapped
+            channel = std::make_unique<MessageChannel>(ptr, size, isLeftMaster);
+            sharedBuffer = buffer;      //this line auto release previously allocated memory so don't worry about mem leak
+            sharedPtr = ptr;
+            sharedBufferSize = size;
+            if (receiving) startReceiverThread();
+        }
+        else {
+            channel->reset();
+        }
 
         if (FAILED(webview17->PostSharedBufferToScript(sharedBuffer.get(),
             COREWEBVIEW2_SHARED_BUFFER_ACCESS_READ_WRITE, nullptr))) return;
-
-        channel = std::make_unique<MessageChannel>(sharedPtr, size, isLeftMaster);
-
     }
 
     void stopReceiverThread() {
-        g_running = false;              // tell thread to exit
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            g_running = false;          // tell thread to exit
+        }
         g_cv.notify_one();              // wake it up if waiting
         if (receiverThread.joinable())  // wait until it exits
             receiverThread.join();
@@ -0,0 +1,384 @@
+#pragma once
+#include <cstdint>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Traffic capture: every MessageBlock a NetworkManager sends or receives, with its connection
+// and timestamps, appended to a directory of memory-mapped segment files
+// (segment-000000.lscap, segment-000001.lscap, ...).
+//
+// A segment is preallocated and mapped whole. Writers reserve their record with one atomic
+// add on the segment's cursor and copy into the mapping; the record's size word is stored
+// last, so a reader of a live capture stops at the first record still being written. The
+// writer that overflows a segment closes it (cut to the records it holds) and maps the next.
+//
+// Segment: a 64-byte header, then records, each 8-byte aligned:
+//   RecordHeader (40 bytes, little endian), then the raw MessageBlock (header and payload)
+// A size of 0 ends the segment.
+namespace capture {
+
+constexpr uint64_t MAGIC = 0x003130504143534Cull;         // "LSCAP01"
+constexpr uint32_t VERSION = 1;
+constexpr uint32_t FILE_HEADER = 64;
+constexpr uint64_t DEFAULT_SEGMENT = 64ull << 20;
+constexpr uint64_t MIN_SEGMENT = 1ull << 20;
+
+enum Direction : uint8_t { IN = 0, OUT = 1 };
+
+struct FileHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t index;                 // segment number in the capture
+    uint64_t wallNs;                // when it was opened
+    uint64_t monoNs;
+    uint8_t reserved[32];
+};
+static_assert(sizeof(FileHeader) == FILE_HEADER);
+
+struct RecordHeader {
+    uint32_t size;                  // the whole record, padding included; stored last
+    uint8_t direction;
+    uint8_t tcp;
+    uint16_t localPort;             // our end of the connection
+    uint32_t localIP;               // 0 if the socket was not bound to one
+    uint32_t remoteIP;              // the peer, or a datagram's sender / destination
+    uint16_t remotePort;
+    uint16_t reserved;
+    uint32_t blockSize;             // MessageBlock::getTotalSize
+    uint64_t monoNs;                // Transport::now
+    uint64_t wallNs;                // Transport::wallNow
+};
+static_assert(sizeof(RecordHeader) == 40);
+
+inline uint32_t recordSize(uint32_t blockSize) {
+    return (uint32_t)((sizeof(RecordHeader) + blockSize + 7) & ~size_t(7));
+}
+
+inline std::string segmentName(uint32_t index) {
+    char name[32];
+    snprintf(name, sizeof(name), "segment-%06u.lscap", index);
+    return name;
+}
+
+// one segment file mapped whole, for writing (create) or reading (open)
+class Segment {
+public:
+    ~Segment() { close(0); }
+
+    static Segment* create(const std::string& path, uint64_t size, std::string& error) {
+        std::unique_ptr<Segment> s(new Segment());
+        s->writable = true;
+#ifdef _WIN32
+        s->file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (s->file == INVALID_HANDLE_VALUE) return fail(error, path);
+        s->mapping = CreateFileMappingA(s->file, nullptr, PAGE_READWRITE, DWORD(size >> 32), DWORD(size), nullptr);
+        if (!s->mapping) return fail(error, path);
+        s->base = (uint8_t*)MapViewOfFile(s->mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size);
+        if (!s->base) return fail(error, path);
+#else
+        s->fd = ::open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+        if (s->fd < 0 || ftruncate(s->fd, (off_t)size) != 0) return fail(error, path);
+        int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;              // fault the pages in here, not on the senders' threads
+#endif
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, s->fd, 0);
+        if (p == MAP_FAILED) return fail(error, path);
+        s->base = (uint8_t*)p;
+#endif
+        s->size = size;
+        return s.release();
+    }
+
+    static Segment* open(const std::string& path, std::string& error) {
+        std::unique_ptr<Segment> s(new Segment());
+        uint64_t size = 0;
+#ifdef _WIN32
+        s->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER length;
+        if (s->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(s->file, &length)) return fail(error, path);
+        size = (uint64_t)length.QuadPart;
+        if (size < FILE_HEADER) return fail(error, path, "not a capture segment");
+        s->mapping = CreateFileMappingA(s->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!s->mapping) return fail(error, path);
+        s->base = (uint8_t*)MapViewOfFile(s->mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!s->base) return fail(error, path);
+#else
+        struct stat st;
+        s->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (s->fd < 0 || fstat(s->fd, &st) != 0) return fail(error, path);
+        size = (uint64_t)st.st_size;
+        if (size < FILE_HEADER) return fail(error, path, "not a capture segment");
+        void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, s->fd, 0);
+        if (p == MAP_FAILED) return fail(error, path);
+        s->base = (uint8_t*)p;
+#endif
+        s->size = size;
+        const FileHeader* h = (const FileHeader*)s->base;
+        if (h->magic != MAGIC || h->version != VERSION) return fail(error, path, "not a capture segment");
+        return s.release();
+    }
+
+    uint8_t* data() const { return base; }
+    uint64_t length() const { return size; }
+
+    // offset after the last complete record
+    uint64_t end() const {
+        uint64_t at = FILE_HEADER;
+        while (at + sizeof(RecordHeader) <= size) {
+            uint32_t n = std::atomic_ref<uint32_t>(*(uint32_t*)(base + at)).load(std::memory_order_acquire);
+            if (!n || at + n > size) break;
+            at += n;
+        }
+        return at;
+    }
+
+    // unmaps; a written segment is cut to keep bytes (0: as it is)
+    void close(uint64_t keep) {
+#ifdef _WIN32
+        if (base) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) {
+            if (writable && keep) {
+                LARGE_INTEGER at;
+                at.QuadPart = (LONGLONG)keep;
+                SetFilePointerEx(file, at, nullptr, FILE_BEGIN);
+                SetEndOfFile(file);
+            }
+            CloseHandle(file);
+        }
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (base) munmap(base, size);
+        if (fd >= 0) {
+            if (writable && keep && ftruncate(fd, (off_t)keep) != 0) {}
+            ::close(fd);
+        }
+        fd = -1;
+#endif
+        base = nullptr;
+    }
+
+private:
+    uint8_t* base = nullptr;
+    uint64_t size = 0;
+    bool writable = false;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    Segment() = default;
+
+    static Segment* fail(std::string& error, const std::string& path, const char* why = nullptr) {
+#ifdef _WIN32
+        error = path + ": " + (why ? why : "error " + std::to_string(GetLastError()));
+#else
+        error = path + ": " + (why ? why : strerror(errno));
+#endif
+        return nullptr;
+    }
+};
+
+class Recorder {
+public:
+    ~Recorder() { stop(); }
+
+    // starts a capture into dir (created if needed), segments of segmentBytes; false with
+    // error set if the first segment cannot be made
+    bool start(const std::string& dir, uint64_t segmentBytes, uint64_t monoNs, uint64_t wallNs, std::string& error) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        closeSegment();
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec) {
+            error = dir + ": " + ec.message();
+            return false;
+        }
+        directory = dir;
+        segmentSize = std::max(segmentBytes, MIN_SEGMENT);
+        index = 0;
+        failure.clear();
+        records = 0;
+        dropped = 0;
+        if (!openSegment(monoNs, wallNs)) {
+            error = failure;
+            return false;
+        }
+        active.store(true, std::memory_order_release);
+        return true;
+    }
+
+    // closes the current segment; records still being written finish first
+    void stop() {
+        active.store(false, std::memory_order_release);
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        closeSegment();
+    }
+
+    bool running() const { return active.load(std::memory_order_relaxed); }
+
+    // any thread; a no-op while stopped
+    void record(Direction direction, bool tcp, uint32_t localIP, uint16_t localPort, uint32_t remoteIP, uint16_t remotePort,
+        const uint8_t* block, uint32_t blockSize, uint64_t monoNs, uint64_t wallNs) {
+        uint32_t n = recordSize(blockSize);
+        for (;;) {
+            Segment* full = nullptr;
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex);
+                if (!segment) return;
+                if (n > segment->length() - FILE_HEADER) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                uint64_t at = cursor.fetch_add(n, std::memory_order_relaxed);
+                if (at + n <= segment->length()) {
+                    uint8_t* p = segment->data() + at;
+                    RecordHeader h{ 0, direction, uint8_t(tcp), localPort, localIP, remoteIP, remotePort, 0, blockSize, monoNs, wallNs };
+                    std::memcpy(p, &h, sizeof(h));
+                    std::memcpy(p + sizeof(h), block, blockSize);
+                    std::atomic_ref<uint32_t>(*(uint32_t*)p).store(n, std::memory_order_release);
+                    records.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                full = segment.get();
+            }
+            rotate(full, monoNs, wallNs);
+        }
+    }
+
+    uint64_t recorded() const { return records.load(std::memory_order_relaxed); }
+    uint64_t droppedRecords() const { return dropped.load(std::memory_order_relaxed); }
+
+    // why the capture stopped by itself (a segment could not be made), "" if it did not
+    std::string error() {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return failure;
+    }
+
+private:
+    std::shared_mutex mutex;                    // shared: writers, exclusive: switching segments
+    std::atomic<bool> active{ false };
+    std::unique_ptr<Segment> segment;
+    std::atomic<uint64_t> cursor{ 0 };
+    std::string directory;
+    uint64_t segmentSize = DEFAULT_SEGMENT;
+    uint32_t index = 0;
+    std::string failure;
+    std::atomic<uint64_t> records{ 0 };
+    std::atomic<uint64_t> dropped{ 0 };         // larger than a segment
+
+    // the writer that found full out of room: closes it and opens the next, unless another
+    // writer got here first
+    void rotate(Segment* full, uint64_t monoNs, uint64_t wallNs) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        if (segment.get() != full) return;
+        closeSegment();
+        ++index;
+        if (!openSegment(monoNs, wallNs)) active.store(false, std::memory_order_release);
+    }
+
+    bool openSegment(uint64_t monoNs, uint64_t wallNs) {
+        segment.reset(Segment::create((std::filesystem::path(directory) / segmentName(index)).string(), segmentSize, failure));
+        if (!segment) return false;
+        FileHeader h{ MAGIC, VERSION, index, wallNs, monoNs, {} };
+        std::memcpy(segment->data(), &h, sizeof(h));
+        cursor.store(FILE_HEADER, std::memory_order_relaxed);
+        return true;
+    }
+
+    void closeSegment() {
+        if (!segment) return;
+        segment->close(segment->end());
+        segment.reset();
+    }
+};
+
+// a record as Reader returns it; block points into the mapped segment
+struct Record {
+    RecordHeader header;
+    const uint8_t* block;
+};
+
+// reads a capture directory's segments in order; also while it is still being written, up
+// to its last complete record
+class Reader {
+public:
+    bool open(const std::string& dir, std::string& error) {
+        paths.clear();
+        std::error_code ec;
+        for (uint32_t i = 0; std::filesystem::exists(std::filesystem::path(dir) / segmentName(i), ec); ++i)
+            paths.push_back((std::filesystem::path(dir) / segmentName(i)).string());
+        if (paths.empty()) {
+            error = dir + ": no capture segments";
+            return false;
+        }
+        return rewind(error);
+    }
+
+    bool rewind(std::string& error) {
+        next = 0;
+        segment.reset();
+        return openNext(error);
+    }
+
+    // false at the end of the capture
+    bool read(Record& r) {
+        std::string error;
+        while (segment) {
+            if (at + sizeof(RecordHeader) <= segment->length()) {
+                const uint8_t* p = segment->data() + at;
+                uint32_t n = std::atomic_ref<uint32_t>(*(uint32_t*)p).load(std::memory_order_acquire);
+                if (n && at + n <= segment->length()) {
+                    std::memcpy(&r.header, p, sizeof(RecordHeader));
+                    if (n >= recordSize(r.header.blockSize) && r.header.blockSize >= 17) {
+                        r.block = p + sizeof(RecordHeader);
+                        at += n;
+                        return true;
+                    }
+                }
+            }
+            if (!openNext(error)) break;
+        }
+        segment.reset();
+        return false;
+    }
+
+    size_t segments() const { return paths.size(); }
+
+private:
+    std::vector<std::string> paths;
+    size_t next = 0;
+    std::unique_ptr<Segment> segment;
+    uint64_t at = 0;
+
+    bool openNext(std::string& error) {
+        segment.reset();
+        if (next >= paths.size()) return false;
+        segment.reset(Segment::open(paths[next++], error));
+        at = FILE_HEADER;
+        return segment != nullptr;
+    }
+};
+
+} // namespace capture
@@ -0,0 +1,198 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// Per-message payload compression for the TCP path of NetworkBase.
+//
+// The codec is the LZ4 block format, implemented here so the native side needs no extra
+// library. A block can be compressed against a preset dictionary: the dictionary is treated
+// as history in front of the payload, which is what makes short JSON messages compress at
+// all. A compressed payload on the wire is:
+//     method byte, varint original size, LZ4 block
+namespace compression {
+
+enum Method : uint8_t {
+    NONE = 0,
+    LZ4 = 1,
+    LZ4_JSON = 2,       // LZ4 against the preset JSON dictionary below
+};
+
+// strings the room messages (ALL_PEERS, PEER_CONNECTED, CONNECT_*) are made of; later bytes
+// are cheaper to reference, so the most common ones go last
+constexpr char JSON_DICTIONARY[] =
+    "\"status\":\"disconnected\",\"status\":\"connecting\",\"roomId\":null,\"master\":{\"ip\":"
+    "\"photo\":\"https://lh3.googleusercontent.com/a/ACg8ocK=s96-c\",\"photo\":\"\","
+    "\"status\":\"connected\",\"roomId\":\"},{\"ip\":\",\"name\":\"\",\"port\":[{\"ip\":";
+
+inline const uint8_t* dictionaryFor(uint8_t method, size_t& len) {
+    if (method == LZ4_JSON) {
+        len = sizeof(JSON_DICTIONARY) - 1;
+        return (const uint8_t*)JSON_DICTIONARY;
+    }
+    len = 0;
+    return nullptr;
+}
+
+inline size_t compressBound(size_t n) { return n + n / 255 + 16; }
+
+namespace detail {
+
+constexpr int HASH_LOG = 12;
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t LAST_LITERALS = 5;     // a block ends with at least this many literals
+constexpr size_t MF_LIMIT = 12;         // and its last match starts at least this far from the end
+
+inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint32_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+inline bool putLength(uint8_t*& op, const uint8_t* end, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= end) return false;
+        *op++ = 255;
+    }
+    if (op >= end) return false;
+    *op++ = (uint8_t)len;
+    return true;
+}
+
+inline bool getLength(const uint8_t*& ip, const uint8_t* end, size_t& len) {
+    uint8_t b;
+    do {
+        if (ip >= end) return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+// one sequence: literals, then (unless it is the last) a match
+inline bool emit(uint8_t*& op, const uint8_t* end, const uint8_t* lit, size_t litLen, size_t offset, size_t matchLen) {
+    if (op >= end) return false;
+    uint8_t* token = op++;
+    *token = uint8_t((litLen < 15 ? litLen : 15) << 4);
+    if (litLen >= 15 && !putLength(op, end, litLen - 15)) return false;
+    if ((size_t)(end - op) < litLen) return false;
+    if (litLen) std::memcpy(op, lit, litLen);
+    op += litLen;
+
+    if (!matchLen) return true;
+    if (end - op < 2) return false;
+    *op++ = uint8_t(offset);
+    *op++ = uint8_t(offset >> 8);
+    size_t m = matchLen - MIN_MATCH;
+    *token |= uint8_t(m < 15 ? m : 15);
+    return m < 15 || putLength(op, end, m - 15);
+}
+
+} // namespace detail
+
+// compresses src into dst as one LZ4 block, using dict as history in front of src; returns
+// the compressed size, or 0 if it does not fit in dstCap
+inline size_t compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dstCap,
+                       const uint8_t* dict = nullptr, size_t dictLen = 0) {
+    using namespace detail;
+
+    // matches are found in one address space: [dict][src]
+    thread_local std::vector<uint8_t> joined;
+    const uint8_t* in = src;
+    if (dictLen) {
+        joined.resize(dictLen + len);
+        std::memcpy(joined.data(), dict, dictLen);
+        std::memcpy(joined.data() + dictLen, src, len);
+        in = joined.data();
+    }
+
+    uint32_t table[1 << HASH_LOG];          // position + 1, 0 = empty
+    std::memset(table, 0, sizeof(table));
+    for (size_t i = 0; i + MIN_MATCH <= dictLen; ++i)
+        table[hash(read32(in + i))] = uint32_t(i + 1);
+
+    uint8_t* op = dst;
+    const uint8_t* opEnd = dst + dstCap;
+    size_t end = dictLen + len;
+    size_t pos = dictLen, anchor = dictLen;
+
+    if (len >= MF_LIMIT + 1) {
+        size_t limit = end - MF_LIMIT;
+        while (pos < limit) {
+            uint32_t h = hash(read32(in + pos));
+            size_t ref = table[h];
+            table[h] = uint32_t(pos + 1);
+
+            if (ref && pos - (ref - 1) <= 65535 && read32(in + ref - 1) == read32(in + pos)) {
+                ref -= 1;
+                size_t matchLen = MIN_MATCH;
+                while (pos + matchLen < end - LAST_LITERALS && in[ref + matchLen] == in[pos + matchLen])
+                    ++matchLen;
+
+                if (!emit(op, opEnd, in + anchor, pos - anchor, pos - ref, matchLen)) return 0;
+                pos += matchLen;
+                anchor = pos;
+                if (pos - 2 >= dictLen && pos < limit)
+                    table[hash(read32(in + pos - 2))] = uint32_t(pos - 2 + 1);
+                continue;
+            }
+            pos += 1 + ((pos - anchor) >> 6);   // skip faster through data that does not match
+        }
+    }
+
+    if (!emit(op, opEnd, in + anchor, end - anchor, 0, 0)) return 0;
+    return size_t(op - dst);
+}
+
+// decodes one LZ4 block into dst, which must come out exactly dstLen bytes long; dict is the
+// history the block was compressed against. Returns false for malformed input.
+inline bool decompress(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen,
+                       const uint8_t* dict = nullptr, size_t dictLen = 0) {
+    using namespace detail;
+    const uint8_t* ip = src;
+    const uint8_t* ipEnd = src + srcLen;
+    size_t op = 0;
+
+    while (ip < ipEnd) {
+        uint8_t token = *ip++;
+
+        size_t litLen = token >> 4;
+        if (litLen == 15 && !getLength(ip, ipEnd, litLen)) return false;
+        if (litLen > size_t(ipEnd - ip) || litLen > dstLen - op) return false;
+        std::memcpy(dst + op, ip, litLen);
+        ip += litLen;
+        op += litLen;
+        if (ip == ipEnd) break;             // the last sequence has no match
+
+        if (ipEnd - ip < 2) return false;
+        size_t offset = size_t(ip[0]) | (size_t(ip[1]) << 8);
+        ip += 2;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !getLength(ip, ipEnd, matchLen)) return false;
+        matchLen += MIN_MATCH;
+        if (!offset || offset > op + dictLen || matchLen > dstLen - op) return false;
+
+        if (offset > op) {                  // starts inside the dictionary
+            size_t back = offset - op;
+            size_t n = back < matchLen ? back : matchLen;
+            std::memcpy(dst + op, dict + dictLen - back, n);
+            op += n;
+            matchLen -= n;
+        }
+        if (offset >= matchLen) {
+            std::memcpy(dst + op, dst + op - offset, matchLen);
+            op += matchLen;
+        }
+        else {
+            for (; matchLen; --matchLen, ++op) dst[op] = dst[op - offset];
+        }
+    }
+    return op == dstLen;
+}
+
+} // namespace compression
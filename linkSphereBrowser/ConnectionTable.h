@@ -0,0 +1,297 @@
+#pragma once
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// What a NetworkManager had set up, kept in a small memory-mapped file so that the next run
+// (after a crash or an update) can put it back without the page asking for each connection:
+// the TCP server port, the multicast port, the room and its members, and every connection
+// this side opened (TCP connects, bound UDP ports). Accepted connections are not kept, their
+// peers reconnect to us.
+//
+// Every change is written straight into the mapping, so it is on disk as far as the OS is
+// concerned once the call returns; a crash loses nothing. An entry's used byte is written
+// last, a member list's count after the members.
+//
+// File: Header (64 bytes), MAX_MEMBERS Member (8 bytes), MAX_ENTRIES Entry (24 bytes),
+// little endian. A file with another magic or version is started over.
+namespace conntable {
+
+constexpr uint64_t MAGIC = 0x3130424154534Cull;         // "LSTAB01"
+constexpr uint32_t VERSION = 1;
+constexpr uint32_t MAX_MEMBERS = 128;
+constexpr uint32_t MAX_ENTRIES = 256;
+
+// NetworkManager::restoreConnections
+constexpr uint32_t DEFAULT_PARALLEL = 16;       // connects in flight at once
+constexpr uint32_t RESTORE_ATTEMPTS = 6;        // then the entry is dropped
+constexpr uint32_t BACKOFF_BASE_MS = 100;
+constexpr uint32_t BACKOFF_CAP_MS = 5000;
+
+struct Header {
+    uint64_t magic;
+    uint32_t version;
+    uint16_t listenPort;            // TCP server, 0 if none
+    uint16_t multicastPort;
+    uint32_t roomHash;
+    uint32_t selfIP;
+    uint16_t selfPort;
+    uint16_t memberCount;           // stored after the members
+    uint32_t leaseMs;               // 0: not in a room
+    uint8_t reserved[32];
+};
+static_assert(sizeof(Header) == 64);
+
+struct Member {
+    uint32_t ip;
+    uint16_t port;
+    uint16_t reserved;
+};
+static_assert(sizeof(Member) == 8);
+
+struct Entry {
+    uint32_t dstIP;                 // 0 for UDP
+    uint16_t dstPort;
+    uint16_t srcPort;               // the bound port for UDP, 0 for TCP
+    uint8_t type;                   // 0x80 TCP, 0 UDP
+    uint8_t used;                   // stored last
+    uint16_t failures;              // connects failed in a row
+    uint32_t reserved;
+    uint64_t lastUpMs;              // wall clock of the last successful connect
+};
+static_assert(sizeof(Entry) == 24);
+
+constexpr uint64_t FILE_SIZE = sizeof(Header) + MAX_MEMBERS * sizeof(Member) + MAX_ENTRIES * sizeof(Entry);
+
+// what the file held when opened
+struct Snapshot {
+    uint16_t listenPort = 0;
+    uint16_t multicastPort = 0;
+    uint32_t roomHash = 0;
+    uint32_t selfIP = 0;
+    uint16_t selfPort = 0;
+    uint32_t leaseMs = 0;
+    std::vector<std::pair<uint32_t, uint16_t>> members;
+    std::vector<Entry> entries;
+};
+
+// delay before retry attempt (1, 2, ...): baseMs doubling up to capMs, the upper half of it
+// drawn from random so that peers restarted together do not retry in step
+inline uint32_t backoffMs(uint32_t attempt, uint32_t baseMs, uint32_t capMs, uint32_t random) {
+    uint64_t full = std::min<uint64_t>(capMs, uint64_t(baseMs) << std::min<uint32_t>(attempt ? attempt - 1 : 0, 20));
+    uint64_t half = full / 2;
+    return (uint32_t)(full - half + (half ? random % (half + 1) : 0));
+}
+
+// connects that went well before go first, most recently up first; entries in members
+// ahead of everything else, the room needs them before anything
+inline void orderForRestore(std::vector<Entry>& entries, const std::vector<std::pair<uint32_t, uint16_t>>& members) {
+    auto member = [&](const Entry& e) {
+        return e.type && std::find(members.begin(), members.end(), std::make_pair(e.dstIP, e.dstPort)) != members.end();
+    };
+    std::stable_sort(entries.begin(), entries.end(), [&](const Entry& a, const Entry& b) {
+        bool ma = member(a), mb = member(b);
+        if (ma != mb) return ma;
+        if (a.failures != b.failures) return a.failures < b.failures;
+        return a.lastUpMs > b.lastUpMs;
+    });
+}
+
+class Table {
+public:
+    ~Table() { close(); }
+
+    // maps path, creating it if needed; what it held is in snapshot()
+    bool open(const std::string& path, std::string& error) {
+        std::lock_guard<std::mutex> lock(mtx);
+        unmap();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return fail(error, path);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, DWORD(FILE_SIZE), nullptr);    // grows the file
+        if (!mapping) return fail(error, path);
+        base = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)FILE_SIZE);
+        if (!base) return fail(error, path);
+#else
+        struct stat st;
+        fd = ::open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+        if (fd < 0 || fstat(fd, &st) != 0) return fail(error, path);
+        if ((uint64_t)st.st_size != FILE_SIZE && ftruncate(fd, (off_t)FILE_SIZE) != 0) return fail(error, path);
+        void* p = mmap(nullptr, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) return fail(error, path);
+        base = (uint8_t*)p;
+#endif
+        if (header()->magic != MAGIC || header()->version != VERSION) {
+            std::memset(base, 0, FILE_SIZE);
+            header()->version = VERSION;
+            header()->magic = MAGIC;
+        }
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mtx);
+        unmap();
+    }
+
+    bool isOpen() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return base != nullptr;
+    }
+
+    Snapshot snapshot() {
+        Snapshot s;
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!base) return s;
+        const Header* h = header();
+        s.listenPort = h->listenPort;
+        s.multicastPort = h->multicastPort;
+        s.roomHash = h->roomHash;
+        s.selfIP = h->selfIP;
+        s.selfPort = h->selfPort;
+        s.leaseMs = h->leaseMs;
+        for (uint32_t i = 0; i < std::min<uint32_t>(h->memberCount, MAX_MEMBERS); ++i)
+            s.members.push_back({ members()[i].ip, members()[i].port });
+        for (uint32_t i = 0; i < MAX_ENTRIES; ++i) {
+            const Entry& e = entries()[i];
+            if (e.used && (e.type ? e.dstPort != 0 : e.srcPort != 0)) s.entries.push_back(e);
+        }
+        return s;
+    }
+
+    void setServer(uint16_t port) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (base) header()->listenPort = port;
+    }
+
+    void setMulticast(uint16_t port) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (base) header()->multicastPort = port;
+    }
+
+    // leaseMs 0: left the room, the members go too
+    void setRoom(uint32_t roomHash, uint32_t selfIP, uint16_t selfPort, uint32_t leaseMs) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!base) return;
+        Header* h = header();
+        h->leaseMs = 0;
+        h->memberCount = 0;
+        h->roomHash = roomHash;
+        h->selfIP = selfIP;
+        h->selfPort = selfPort;
+        std::atomic_ref<uint32_t>(h->leaseMs).store(leaseMs, std::memory_order_release);
+    }
+
+    template <class Peers>
+    void setMembers(const Peers& peers) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!base) return;
+        header()->memberCount = 0;
+        uint16_t n = 0;
+        for (const auto& p : peers) {
+            if (n == MAX_MEMBERS) break;
+            members()[n++] = { p.ip, p.port, 0 };
+        }
+        std::atomic_ref<uint16_t>(header()->memberCount).store(n, std::memory_order_release);
+    }
+
+    // a connection this side opened; a full table keeps the ones it has
+    void put(uint8_t type, uint16_t srcPort, uint32_t dstIP, uint16_t dstPort) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!base) return;
+        Entry* e = find(type, srcPort, dstIP, dstPort);
+        if (e) return;
+        for (uint32_t i = 0; i < MAX_ENTRIES && !e; ++i)
+            if (!entries()[i].used) e = &entries()[i];
+        if (!e) return;
+        bool tcp = (type & 0x80) != 0;
+        *e = Entry{ tcp ? dstIP : 0, tcp ? dstPort : uint16_t(0), tcp ? uint16_t(0) : srcPort, uint8_t(type & 0x80), 0, 0, 0, 0 };
+        std::atomic_ref<uint8_t>(e->used).store(1, std::memory_order_release);
+    }
+
+    void up(uint8_t type, uint16_t srcPort, uint32_t dstIP, uint16_t dstPort, uint64_t wallMs) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (Entry* e = base ? find(type, srcPort, dstIP, dstPort) : nullptr) {
+            e->failures = 0;
+            e->lastUpMs = wallMs;
+        }
+    }
+
+    void failed(uint8_t type, uint16_t srcPort, uint32_t dstIP, uint16_t dstPort) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (Entry* e = base ? find(type, srcPort, dstIP, dstPort) : nullptr)
+            if (e->failures != 0xFFFF) ++e->failures;
+    }
+
+    void erase(uint8_t type, uint16_t srcPort, uint32_t dstIP, uint16_t dstPort) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (Entry* e = base ? find(type, srcPort, dstIP, dstPort) : nullptr) e->used = 0;
+    }
+
+private:
+    std::mutex mtx;
+    uint8_t* base = nullptr;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    Header* header() { return (Header*)base; }
+    Member* members() { return (Member*)(base + sizeof(Header)); }
+    Entry* entries() { return (Entry*)(base + sizeof(Header) + MAX_MEMBERS * sizeof(Member)); }
+
+    // the key of NetworkManager's connection map: TCP by destination (connects always come
+    // from srcPort 0), UDP by bound port
+    Entry* find(uint8_t type, uint16_t srcPort, uint32_t dstIP, uint16_t dstPort) {
+        bool tcp = (type & 0x80) != 0;
+        for (uint32_t i = 0; i < MAX_ENTRIES; ++i) {
+            Entry& e = entries()[i];
+            if (!e.used || (e.type != 0) != tcp) continue;
+            if (tcp ? e.dstIP == dstIP && e.dstPort == dstPort : e.srcPort == srcPort) return &e;
+        }
+        return nullptr;
+    }
+
+    void unmap() {
+#ifdef _WIN32
+        if (base) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (base) munmap(base, FILE_SIZE);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        base = nullptr;
+    }
+
+    bool fail(std::string& error, const std::string& path) {
+#ifdef _WIN32
+        error = path + ": error " + std::to_string(GetLastError());
+#else
+        error = path + ": " + strerror(errno);
+#endif
+        unmap();
+        return false;
+    }
+};
+
+} // namespace conntable
@@ -0,0 +1,218 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "MessageChannel.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctime>
+#endif
+
+// Same-host transport: two LinkSphere processes connected over TCP on the same machine move
+// their traffic into a named shared-memory section holding one MessageChannel (one ring per
+// direction), so a message costs two memcpys instead of socket syscalls and framing.
+//
+// The TCP connection is set up as usual and stays open as the close / crash signal:
+//   - the connecting side sees the peer on its own address, creates a section and sends
+//     SHM_OFFER (its name) over TCP
+//   - the accepting side opens it and answers SHM_SWITCH(1), or SHM_SWITCH(0) to stay on TCP
+//     (different session or user, disabled, old section)
+//   - each side's SHM_SWITCH(1) is the last message it writes to the socket, everything after
+//     it goes into the ring; a receiver moves to the ring once the peer's switch arrives
+// So per direction messages keep their order across the switch.
+//
+// Section: a 64-byte header, then the MessageChannel buffer. The creator writes the left
+// region. The ring's doorbell flags decide when to wake the reader; the wakeup itself is a
+// named auto-reset event on Windows and a futex on the header's bell word elsewhere.
+namespace locallink {
+
+constexpr uint8_t SHM_OFFER = 0x95;         // MsgType.SHM_OFFER, section name
+constexpr uint8_t SHM_SWITCH = 0x96;        // MsgType.SHM_SWITCH, 1 = the rest comes through the ring
+constexpr uint32_t MAGIC = 0x4C53484Du;     // "LSHM"
+constexpr uint32_t HEADER_SIZE = 64;
+constexpr uint32_t SECTION_SIZE = 4 * 1024 * 1024;
+constexpr uint32_t PROBE_MS = 250;          // reader: how long the ring may sit idle before the socket is checked
+#ifdef _WIN32
+constexpr const char* PREFIX = "Local\\LinkSphere-";       // per logon session
+#else
+constexpr const char* PREFIX = "/linksphere-";
+#endif
+
+inline bool isSwitchOn(uint8_t type, const uint8_t* p, uint32_t len) {
+    return type == SHM_SWITCH && len >= 1 && p[0] == 1;
+}
+
+// one step of a spin wait
+inline void cpuRelax() {
+#ifdef _WIN32
+    YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+class Link {
+public:
+    // creator side, nullptr if the section could not be made
+    static Link* create(uint32_t size = SECTION_SIZE) {
+        static std::atomic<uint32_t> counter{ 0 };
+        std::unique_ptr<Link> l(new Link());
+        l->owner = true;
+        l->self = 0;
+#ifdef _WIN32
+        l->sectionName = PREFIX + std::to_string(GetCurrentProcessId()) + "-" + std::to_string(++counter);
+        l->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, size, l->sectionName.c_str());
+        if (!l->mapping || GetLastError() == ERROR_ALREADY_EXISTS) return nullptr;
+        l->base = (uint8_t*)MapViewOfFile(l->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        for (int i = 0; i < 2; ++i)
+            l->bells[i] = CreateEventA(nullptr, FALSE, FALSE, (l->sectionName + "-" + std::to_string(i)).c_str());
+        if (!l->base || !l->bells[0] || !l->bells[1]) return nullptr;
+#else
+        l->sectionName = PREFIX + std::to_string(getpid()) + "-" + std::to_string(++counter);
+        int fd = shm_open(l->sectionName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) return nullptr;
+        l->linked = true;
+        void* p = ftruncate(fd, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (p == MAP_FAILED) return nullptr;
+        l->base = (uint8_t*)p;
+        l->mappedSize = size;
+#endif
+        l->size = size;
+        std::memset(l->base, 0, HEADER_SIZE);           // the rings start zeroed, which is empty
+        l->word(4) = size;
+        std::atomic_ref<uint32_t>(l->word(0)).store(MAGIC, std::memory_order_release);
+        l->ring.reset(new MessageChannel(l->base + HEADER_SIZE, size - HEADER_SIZE, true));
+        return l.release();
+    }
+
+    // peer side, nullptr if the name is not ours or not reachable from this process
+    static Link* open(const std::string& name) {
+        if (name.compare(0, strlen(PREFIX), PREFIX) != 0 || name.size() > 64) return nullptr;
+        std::unique_ptr<Link> l(new Link());
+        l->sectionName = name;
+        l->self = 1;
+#ifdef _WIN32
+        l->mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+        if (!l->mapping) return nullptr;
+        l->base = (uint8_t*)MapViewOfFile(l->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        for (int i = 0; i < 2; ++i)
+            l->bells[i] = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, (name + "-" + std::to_string(i)).c_str());
+        MEMORY_BASIC_INFORMATION info{};
+        if (!l->base || !l->bells[0] || !l->bells[1] || !VirtualQuery(l->base, &info, sizeof(info))) return nullptr;
+        size_t mapped = info.RegionSize;
+#else
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) return nullptr;
+        struct stat st{};
+        void* p = fstat(fd, &st) == 0 && st.st_size >= HEADER_SIZE
+            ? mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (p == MAP_FAILED) return nullptr;
+        shm_unlink(name.c_str());       // both sides have it mapped, nothing else needs the name
+        l->base = (uint8_t*)p;
+        size_t mapped = (size_t)st.st_size;
+        l->mappedSize = mapped;
+#endif
+        if (std::atomic_ref<uint32_t>(l->word(0)).load(std::memory_order_acquire) != MAGIC) return nullptr;
+        l->size = l->word(4);
+        if (l->size > mapped || l->size < HEADER_SIZE + MessageChannel::CONTROL_HEADER_SIZE + 18) return nullptr;
+        l->ring.reset(new MessageChannel(l->base + HEADER_SIZE, l->size - HEADER_SIZE, false));
+        return l.release();
+    }
+
+    ~Link() {
+        ring.reset();
+#ifdef _WIN32
+        if (base) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        for (HANDLE h : bells) if (h) CloseHandle(h);
+#else
+        if (base) munmap(base, mappedSize);
+        if (owner && linked) shm_unlink(sectionName.c_str());     // peer never opened it
+#endif
+    }
+
+    const std::string& name() const { return sectionName; }
+    MessageChannel& channel() { return *ring; }
+
+    // writer: wakes the peer's reader if it went to sleep since the last ring
+    void ringIfAsleep() {
+        if (ring->needsDoorbell()) wake(1 - self);
+    }
+
+    // reader: advertises "asleep" and waits for the peer's ring. False if ms passed without one.
+    bool wait(uint32_t ms) {
+        uint32_t seen = std::atomic_ref<uint32_t>(bell(self)).load(std::memory_order_acquire);
+        if (!ring->trySleep()) return true;
+        bool rung = waitBell(seen, ms);
+        ring->setPolling();
+        return rung;
+    }
+
+    // this side is done: the peer's reader sees it once the ring is drained, ours wakes up
+    void close() {
+        std::atomic_ref<uint32_t>(word(16 + 4 * self)).store(1, std::memory_order_release);
+        wake(1 - self);
+        wake(self);
+    }
+
+    bool peerClosed() {
+        return std::atomic_ref<uint32_t>(word(16 + 4 * (1 - self))).load(std::memory_order_acquire) != 0;
+    }
+
+private:
+    // header: 0 magic, 4 size, 8/12 bell words, 16/20 closed flags; side 0 is the creator
+    std::string sectionName;
+    uint8_t* base = nullptr;
+    uint32_t size = 0;
+    int self = 0;
+    bool owner = false;
+    std::unique_ptr<MessageChannel> ring;
+#ifdef _WIN32
+    HANDLE mapping = nullptr;
+    HANDLE bells[2]{};
+#else
+    size_t mappedSize = 0;
+    bool linked = false;
+#endif
+
+    Link() = default;
+
+    uint32_t& word(uint32_t offset) { return *(uint32_t*)(base + offset); }
+    uint32_t& bell(int side) { return word(8 + 4 * side); }
+
+    void wake(int side) {
+        std::atomic_ref<uint32_t>(bell(side)).fetch_add(1, std::memory_order_acq_rel);
+#ifdef _WIN32
+        SetEvent(bells[side]);
+#else
+        syscall(SYS_futex, &bell(side), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#endif
+    }
+
+    bool waitBell(uint32_t seen, uint32_t ms) {
+#ifdef _WIN32
+        (void)seen;
+        return WaitForSingleObject(bells[self], ms) == WAIT_OBJECT_0;
+#else
+        timespec ts{ (time_t)(ms / 1000), (long)(ms % 1000) * 1000000 };
+        syscall(SYS_futex, &bell(self), FUTEX_WAIT, seen, &ts, nullptr, 0);     // returns at once if it was rung meanwhile
+        return std::atomic_ref<uint32_t>(bell(self)).load(std::memory_order_acquire) != seen;
+#endif
+    }
+};
+
+} // namespace locallink
@@ -0,0 +1,360 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "Metrics.h"
+
+// Asynchronous logging for the network threads. LS_LOG(level, format, args...) copies the
+// format pointer and the arguments in binary into a ring owned by the calling thread and
+// returns; a background thread drains the rings every few ms, formats the records in time
+// order and hands the lines to the sink (stdout, warnings and errors to stderr). A full ring
+// drops the record and counts it instead of waiting.
+//
+// format is a string literal with {} for each argument: integers, floating point, strings
+// (copied, cut to what fits in the record) and wide strings (non-ASCII shown as ?).
+//
+// Below the level nothing is evaluated past one relaxed load. Every call site can be sampled
+// per level (setSampling), and warnings and errors are rate limited per call site
+// (setRateLimit): of a storm of recv-failed only the first few each second are logged, and
+// the site's next line says how many were left out.
+namespace logging {
+
+enum class Level : uint8_t { Debug, Info, Warn, Error, Count };    // not ERROR: a macro in wingdi.h
+
+inline const char* const levelNames[(int)Level::Count] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+namespace detail {
+
+constexpr size_t RING = 256;                // records per thread
+constexpr size_t RECORD = 256;
+constexpr size_t MAX_ARGS = 8;
+constexpr uint32_t DRAIN_MS = 5;
+
+enum ArgType : uint8_t { I64, U64, F64, STR };
+
+struct Record {
+    const char* format;
+    uint64_t ts;                            // metrics::now
+    uint32_t suppressed;                    // left out by the rate limit since the site's last line
+    uint16_t tid;
+    uint8_t level;
+    uint8_t argCount;
+    uint8_t types[MAX_ARGS];
+    uint8_t used;                           // bytes of data
+    uint8_t data[RECORD - 33];              // 8 bytes per number, 1 byte length + text per string
+};
+static_assert(sizeof(Record) <= RECORD);
+
+// one writer (its thread), one reader (the logging thread)
+struct Buffer {
+    Record records[RING];
+    std::atomic<uint64_t> head{ 0 };
+    std::atomic<uint64_t> tail{ 0 };
+    std::atomic<uint64_t> dropped{ 0 };
+    uint16_t tid = 0;
+};
+
+inline std::atomic<uint8_t> threshold{ (uint8_t)Level::Info };
+inline std::atomic<uint32_t> sampleEvery[(int)Level::Count]{ 1, 1, 1, 1 };
+inline std::atomic<uint32_t> ratePerSecond{ 20 };
+
+// buffers outlive their threads, a new thread reuses a free one; never destroyed, like
+// tracing::detail::Registry, so threads can log until the process ends
+class Registry {
+public:
+    static Registry& instance() {
+        static Registry* r = new Registry();
+        return *r;
+    }
+
+    Buffer* acquire() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!drainer.joinable()) drainer = std::thread([this]() { run(); });
+        if (!spare.empty()) {
+            Buffer* b = spare.back();
+            spare.pop_back();
+            return b;
+        }
+        buffers.push_back(std::make_unique<Buffer>());
+        buffers.back()->tid = (uint16_t)buffers.size();
+        return buffers.back().get();
+    }
+
+    void release(Buffer* b) {
+        std::lock_guard<std::mutex> lock(mtx);
+        spare.push_back(b);
+    }
+
+    void setSink(std::function<void(Level, const char*)> s) {
+        std::lock_guard<std::mutex> lock(sinkMutex);
+        sink = std::move(s);
+    }
+
+    // returns once everything logged before the call has reached the sink
+    void flush() {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!drainer.joinable()) return;
+        uint64_t wanted = ++flushWanted;
+        wake.notify_one();
+        drained.wait(lock, [&]() { return flushDone >= wanted; });
+    }
+
+private:
+    std::mutex mtx;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    std::vector<Buffer*> spare;
+    std::thread drainer;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    uint64_t flushWanted = 0;               // under mtx
+    uint64_t flushDone = 0;
+    std::mutex sinkMutex;
+    std::function<void(Level, const char*)> sink;
+    std::vector<Record> batch;              // logging thread only
+    std::string line;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mtx);
+        for (;;) {
+            wake.wait_for(lock, std::chrono::milliseconds(DRAIN_MS), [&]() { return flushWanted > flushDone; });
+            uint64_t wanted = flushWanted;
+            uint64_t lost = 0;
+            for (auto& b : buffers) {
+                uint64_t t = b->tail.load(std::memory_order_relaxed);
+                uint64_t h = b->head.load(std::memory_order_acquire);
+                for (; t < h; ++t) batch.push_back(b->records[t % RING]);
+                b->tail.store(t, std::memory_order_release);
+                lost += b->dropped.exchange(0, std::memory_order_relaxed);
+            }
+            lock.unlock();
+            std::stable_sort(batch.begin(), batch.end(), [](const Record& a, const Record& b) { return a.ts < b.ts; });
+            {
+                std::lock_guard<std::mutex> sinkLock(sinkMutex);
+                for (const Record& r : batch) {
+                    format(r);
+                    emit((Level)r.level, line.c_str());
+                }
+                if (lost) {
+                    line = "log: " + std::to_string(lost) + " records dropped, a thread's ring was full";
+                    emit(Level::Warn, line.c_str());
+                }
+            }
+            batch.clear();
+            lock.lock();
+            if (wanted > flushDone) {
+                flushDone = wanted;
+                drained.notify_all();
+            }
+        }
+    }
+
+    void emit(Level level, const char* text) {
+        if (sink) return sink(level, text);
+        FILE* out = level >= Level::Warn ? stderr : stdout;
+        std::fputs(text, out);
+        std::fputc('\n', out);
+        std::fflush(out);
+    }
+
+    // "HH:MM:SS.mmm LEVEL [tid] message"
+    void format(const Record& r) {
+        static const int64_t epochOffsetNs = (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count() - (int64_t)metrics::now();
+        int64_t wall = (int64_t)r.ts + epochOffsetNs;
+        std::time_t seconds = (std::time_t)(wall / 1000000000);
+        std::tm local{};
+#ifdef _WIN32
+        localtime_s(&local, &seconds);
+#else
+        localtime_r(&seconds, &local);
+#endif
+        char prefix[48];
+        snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%03d %-5s [%u] ", local.tm_hour, local.tm_min, local.tm_sec,
+            (int)(wall / 1000000 % 1000), levelNames[r.level < (uint8_t)Level::Count ? r.level : 0], r.tid);
+        line = prefix;
+
+        const uint8_t* p = r.data;
+        const uint8_t* end = r.data + r.used;
+        int arg = 0;
+        for (const char* f = r.format; *f; ++f) {
+            if (f[0] != '{' || f[1] != '}') {
+                line += *f;
+                continue;
+            }
+            ++f;
+            if (arg >= r.argCount) {
+                line += "{}";
+                continue;
+            }
+            char text[32];
+            switch (r.types[arg++]) {
+            case I64: { int64_t v; std::memcpy(&v, p, 8); p += 8; snprintf(text, sizeof(text), "%lld", (long long)v); line += text; break; }
+            case U64: { uint64_t v; std::memcpy(&v, p, 8); p += 8; snprintf(text, sizeof(text), "%llu", (unsigned long long)v); line += text; break; }
+            case F64: { double v; std::memcpy(&v, p, 8); p += 8; snprintf(text, sizeof(text), "%g", v); line += text; break; }
+            default: {
+                uint8_t n = p < end ? *p++ : 0;
+                line.append((const char*)p, n);
+                p += n;
+                break;
+            }
+            }
+        }
+        if (r.suppressed) line += " (" + std::to_string(r.suppressed) + " more like it left out)";
+    }
+};
+
+struct BufferHandle {
+    Buffer* buffer = Registry::instance().acquire();
+    ~BufferHandle() { Registry::instance().release(buffer); }
+};
+
+inline Buffer& buffer() {
+    thread_local BufferHandle handle;
+    return *handle.buffer;
+}
+
+inline void putText(Record& r, const char* s, size_t n) {
+    size_t room = sizeof(r.data) - r.used;
+    if (!room) return;
+    n = std::min({ n, room - 1, size_t(255) });
+    r.types[r.argCount++] = STR;
+    r.data[r.used++] = (uint8_t)n;
+    std::memcpy(r.data + r.used, s, n);
+    r.used += (uint8_t)n;
+}
+
+template <typename T>
+void put(Record& r, const T& v) {
+    if (r.argCount == MAX_ARGS) return;
+    using D = std::decay_t<T>;
+    if constexpr (std::is_enum_v<D>) {
+        put(r, (std::underlying_type_t<D>)v);
+    }
+    else if constexpr (std::is_integral_v<D> || std::is_floating_point_v<D>) {
+        if (sizeof(r.data) - r.used < 8) return;
+        ArgType type = std::is_floating_point_v<D> ? F64 : std::is_signed_v<D> ? I64 : U64;
+        if (type == F64) { double d = (double)v; std::memcpy(r.data + r.used, &d, 8); }
+        else if (type == I64) { int64_t i = (int64_t)v; std::memcpy(r.data + r.used, &i, 8); }
+        else { uint64_t u = (uint64_t)v; std::memcpy(r.data + r.used, &u, 8); }
+        r.types[r.argCount++] = type;
+        r.used += 8;
+    }
+    else if constexpr (std::is_convertible_v<const D&, std::string_view>) {
+        if constexpr (std::is_pointer_v<T>)     // not arrays: they decay to a pointer D but are never null
+            if (!v) return putText(r, "(null)", 6);
+        std::string_view s(v);
+        putText(r, s.data(), s.size());
+    }
+    else if constexpr (std::is_convertible_v<const D&, std::wstring_view>) {
+        if constexpr (std::is_pointer_v<T>)
+            if (!v) return putText(r, "(null)", 6);
+        std::wstring_view w(v);
+        char narrow[RECORD];
+        size_t n = std::min(w.size(), sizeof(narrow));
+        for (size_t i = 0; i < n; ++i) narrow[i] = w[i] < 0x80 ? (char)w[i] : '?';
+        putText(r, narrow, n);
+    }
+    else {
+        static_assert(std::is_pointer_v<D>, "LS_LOG takes numbers and strings");
+        put(r, (uint64_t)(uintptr_t)v);
+    }
+}
+
+} // namespace detail
+
+// a call site's sampling and rate limit state, static at the call (LS_LOG)
+struct Site {
+    std::atomic<uint64_t> count{ 0 };
+    std::atomic<uint64_t> windowStart{ 0 };
+    std::atomic<uint32_t> inWindow{ 0 };
+    std::atomic<uint32_t> suppressed{ 0 };
+};
+
+inline bool enabled(Level level) {
+    return (uint8_t)level >= detail::threshold.load(std::memory_order_relaxed);
+}
+
+inline void setLevel(Level level) {
+    detail::threshold.store((uint8_t)level, std::memory_order_relaxed);
+}
+
+// keep one record in every n per call site at this level (1 = all)
+inline void setSampling(Level level, uint32_t n) {
+    detail::sampleEvery[(int)level].store(n ? n : 1, std::memory_order_relaxed);
+}
+
+// warnings and errors per call site and second, 0 = no limit
+inline void setRateLimit(uint32_t perSecond) {
+    detail::ratePerSecond.store(perSecond, std::memory_order_relaxed);
+}
+
+// runs on the logging thread, instead of stdout / stderr
+inline void setSink(std::function<void(Level, const char* line)> sink) {
+    detail::Registry::instance().setSink(std::move(sink));
+}
+
+inline void flush() {
+    detail::Registry::instance().flush();
+}
+
+template <typename... Args>
+void write(Site& site, Level level, const char* format, const Args&... args) {
+    uint32_t every = detail::sampleEvery[(int)level].load(std::memory_order_relaxed);
+    if (every > 1 && site.count.fetch_add(1, std::memory_order_relaxed) % every) return;
+
+    uint32_t suppressed = 0;
+    uint32_t limit = detail::ratePerSecond.load(std::memory_order_relaxed);
+    uint64_t now = metrics::now();
+    if (level >= Level::Warn && limit) {
+        uint64_t start = site.windowStart.load(std::memory_order_relaxed);
+        if (now - start >= 1000000000ull && site.windowStart.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+            site.inWindow.store(0, std::memory_order_relaxed);
+        }
+        if (site.inWindow.fetch_add(1, std::memory_order_relaxed) >= limit) {
+            site.suppressed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+    }
+
+    detail::Buffer& b = detail::buffer();
+    uint64_t h = b.head.load(std::memory_order_relaxed);
+    if (h - b.tail.load(std::memory_order_acquire) >= detail::RING) {
+        b.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    detail::Record& r = b.records[h % detail::RING];
+    r.format = format;
+    r.ts = now;
+    r.suppressed = suppressed;
+    r.tid = b.tid;
+    r.level = (uint8_t)level;
+    r.argCount = 0;
+    r.used = 0;
+    (detail::put(r, args), ...);
+    b.head.store(h + 1, std::memory_order_release);
+}
+
+} // namespace logging
+
+// LS_LOG(logging::Level::Warn, "recv failed on {}:{}", ip, port); arguments are not evaluated
+// below the level
+#define LS_LOG(level, ...) do { \
+    if (logging::enabled(level)) { \
+        static logging::Site logSite_; \
+        logging::write(logSite_, level, __VA_ARGS__); \
+    } \
+} while (0)
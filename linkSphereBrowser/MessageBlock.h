@@ -3,7 +3,8 @@
 #include <cstring>
 #include <memory>
 #include <stdexcept>
-#include <sstream>
+#include <string>
+#include <charconv>
 
 class MessageBlock {
 public:
@@ -15,24 +16,27 @@ public:
 
         dataStorage = std::make_unique<uint8_t[]>(size);
         std::memcpy(dataStorage.get(), dataPtr, size);
+        capacity = size;
 
         rawData = dataStorage.get();
         updateInternalPointers();
         setTotalSize(size);
     }
 
-    MessageBlock(uint32_t totalSize) {
+    MessageBlock(uint32_t totalSize) : MessageBlock(totalSize, totalSize) {}
+
+    // reserves room for the block to grow to `reserve` bytes without reallocating
+    MessageBlock(uint32_t totalSize, uint32_t reserve) {
         if (totalSize < 17)
             throw std::runtime_error("Total size must be at least 17");
 
-        dataStorage = std::make_unique<uint8_t[]>(totalSize);
+        capacity = reserve > totalSize ? reserve : totalSize;
+        dataStorage = std::make_unique<uint8_t[]>(capacity);
         updateInternalPointers();
         setTotalSize(totalSize);
     }
     
-    MessageBlock() {
-        MessageBlock(17);
-    }
+    MessageBlock() : MessageBlock(17) {}
 
 
 
@@ -42,7 +46,30 @@ public:
         return rawData + 12;
     }
 
+    // whole block including src/dst, for filling it straight from a stream
+    uint8_t* getRawWritePtr() {
+        return rawData;
+    }
+
+    uint8_t* getPayloadWritePtr() {
+        return rawData + 17;
+    }
+
+    // bytes the block can hold without reallocating
+    uint32_t getCapacity() const { return capacity; }
+
+    // local bookkeeping, never sent: when the block entered its current queue (metrics::now())
+    uint64_t getStamp() const { return stamp; }
+    void setStamp(uint64_t t) { stamp = t; }
+
+    // local bookkeeping as well (the v2 wire header can carry it): the trace id of a sampled
+    // message, 0 if it is not traced (see Tracing.h)
+    uint64_t getTraceId() const { return traceId; }
+    void setTraceId(uint64_t id) { traceId = id; }
+
+    // call after writing through one of the write pointers so cached fields match the bytes
     void finalizeNetMsg() {
+        type = typePtr[0];
     }
 
 
@@ -105,20 +132,12 @@ public:
         setDstPort(port);
     }
 
+    // reallocates only if the payload outgrows the reserved capacity
     void setPayload(const uint8_t* newPayload, uint32_t size) {
         uint32_t newTotal = size + 17;
-        auto newBuffer = std::make_unique<uint8_t[]>(newTotal);
+        reserve(newTotal);
 
-        // copy headers + type
-        std::memcpy(newBuffer.get(), rawData, 12);
-        newBuffer[16] = type;
-
-        // copy new payload
-        std::memcpy(newBuffer.get() + 17, newPayload, size);
-
-        dataStorage = std::move(newBuffer);
-        rawData = dataStorage.get();
-        updateInternalPointers();
+        std::memmove(rawData + 17, newPayload, size);
         setTotalSize(newTotal);
     }
 
@@ -126,14 +145,22 @@ public:
     // copies network message into internal buffer (starting at totalSize)
     void setNetMsg(const uint8_t* netPtr, uint32_t netSize) {
         uint32_t newSize = netSize + 12;
+        reserve(newSize);
 
-        dataStorage = std::make_unique<uint8_t[]>(newSize);
-        rawData = dataStorage.get();
-
-        std::memcpy(rawData + 12, netPtr, netSize);
+        std::memmove(rawData + 12, netPtr, netSize);
         updateInternalPointers();
         setTotalSize(newSize);
+    }
+
+    // grows storage to hold newSize bytes, keeping everything written so far
+    void reserve(uint32_t newSize) {
+        if (newSize <= capacity) return;
 
+        auto newBuffer = std::make_unique<uint8_t[]>(newSize);
+        std::memcpy(newBuffer.get(), rawData, capacity);
+        dataStorage = std::move(newBuffer);
+        capacity = newSize;
+        updateInternalPointers();
     }
 
     void setTotalSize(uint32_t newSize) {
@@ -148,17 +175,23 @@ public:
 
     // ----------------- STRING GETTERS -----------------
     std::string getSrcString() const {
-        std::stringstream ss;
-        ss << (int)src[0] << "." << (int)src[1] << "."
-            << (int)src[2] << "." << (int)src[3];
-        return ss.str();
+        char buf[16];
+        return std::string(buf, formatIP(src, buf));
     }
 
     std::string getDstString() const {
-        std::stringstream ss;
-        ss << (int)dst[0] << "." << (int)dst[1] << "."
-            << (int)dst[2] << "." << (int)dst[3];
-        return ss.str();
+        char buf[16];
+        return std::string(buf, formatIP(dst, buf));
+    }
+
+    // writes "a.b.c.d" into out (at least 16 bytes), returns its length
+    static size_t formatIP(const uint8_t* ip, char* out) {
+        char* p = out;
+        for (int i = 0; i < 4; ++i) {
+            if (i) *p++ = '.';
+            p = std::to_chars(p, out + 16, (int)ip[i]).ptr;
+        }
+        return p - out;
     }
 
     void setSrcIP(uint32_t ip) {
@@ -177,21 +210,28 @@ public:
 
     // ----------------- STRING SETTERS -----------------
     void setSrc(const std::string& ipPort) {
-        uint32_t a, b, c, d, port;
-        char dot, colon;
-        std::stringstream ss(ipPort);
-        ss >> a >> dot >> b >> dot >> c >> dot >> d >> colon >> port;
-        uint8_t tmp[4] = { (uint8_t)a, (uint8_t)b, (uint8_t)c, (uint8_t)d };
-        setSrc(tmp, (uint16_t)port);
+        uint8_t tmp[4];
+        uint16_t port = parseIPPort(ipPort, tmp);
+        setSrc(tmp, port);
     }
 
     void setDst(const std::string& ipPort) {
-        uint32_t a, b, c, d, port;
-        char dot, colon;
-        std::stringstream ss(ipPort);
-        ss >> a >> dot >> b >> dot >> c >> dot >> d >> colon >> port;
-        uint8_t tmp[4] = { (uint8_t)a, (uint8_t)b, (uint8_t)c, (uint8_t)d };
-        setDst(tmp, (uint16_t)port);
+        uint8_t tmp[4];
+        uint16_t port = parseIPPort(ipPort, tmp);
+        setDst(tmp, port);
+    }
+
+    // parses "a.b.c.d:port", missing parts read as 0
+    static uint16_t parseIPPort(const std::string& ipPort, uint8_t* ip) {
+        const char* p = ipPort.data();
+        const char* end = p + ipPort.size();
+        uint32_t parts[5]{};
+        for (int i = 0; i < 5 && p < end; ++i) {
+            p = std::from_chars(p, end, parts[i]).ptr;
+            if (p < end) ++p;       // skip '.' or ':'
+        }
+        for (int i = 0; i < 4; ++i) ip[i] = (uint8_t)parts[i];
+        return (uint16_t)parts[4];
     }
 
 private:
@@ -207,6 +247,9 @@ private:
 
 private:
     std::unique_ptr<uint8_t[]> dataStorage;
+    uint32_t capacity{};
+    uint64_t stamp{};
+    uint64_t traceId{};
     uint8_t* rawData{};
     uint8_t  type{};
     uint8_t* typePtr{};
@@ -0,0 +1,145 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include "MessageBlock.h"
+
+// Non-owning view over a message laid out like MessageBlock (src, dst, totalSize, type,
+// payload) that lives in someone else's buffer: a ring span, a receive buffer, a mapped file.
+// Headers are parsed and, for a mutable view, rewritten in place. Nothing is copied until
+// copy() is called, which is only needed when the message must outlive that buffer.
+template <typename Byte>
+class BasicMessageBlockView {
+public:
+    static constexpr uint32_t HEADER_SIZE = 17;
+
+    BasicMessageBlockView() = default;
+
+    // size is how many bytes of data are readable, the message may claim fewer
+    BasicMessageBlockView(Byte* data, uint32_t size) : rawData(data), available(size) {}
+
+    // true if the buffer holds a whole message with a sane size field
+    bool valid() const {
+        if (!rawData || available < HEADER_SIZE) return false;
+        uint32_t total = getTotalSize();
+        return total >= HEADER_SIZE && total <= available;
+    }
+
+    // --- accessors ---
+    uint32_t getTotalSize() const { return read32(rawData + 12); }
+    uint8_t getType() const { return rawData[16]; }
+    uint32_t getSrcIP() const { return read32(rawData); }
+    uint16_t getSrcPort() const { return read16(rawData + 4); }
+    uint32_t getDstIP() const { return read32(rawData + 6); }
+    uint16_t getDstPort() const { return read16(rawData + 10); }
+
+    Byte* getRawData() const { return rawData; }
+    Byte* getPayload() const { return rawData + HEADER_SIZE; }
+    uint32_t getPayloadSize() const { return getTotalSize() - HEADER_SIZE; }
+    Byte* getNetMsg() const { return rawData + 12; }
+    uint32_t getNetMsgSize() const { return getTotalSize() - 12; }
+
+    std::string getSrcString() const {
+        char buf[16];
+        return std::string(buf, MessageBlock::formatIP(rawData, buf));
+    }
+
+    std::string getDstString() const {
+        char buf[16];
+        return std::string(buf, MessageBlock::formatIP(rawData + 6, buf));
+    }
+
+    // --- in-place setters (mutable views only) ---
+    void setSrcIP(uint32_t ip) requires (!std::is_const_v<Byte>) { write32(rawData, ip); }
+    void setSrcPort(uint16_t port) requires (!std::is_const_v<Byte>) { write16(rawData + 4, port); }
+    void setDstIP(uint32_t ip) requires (!std::is_const_v<Byte>) { write32(rawData + 6, ip); }
+    void setDstPort(uint16_t port) requires (!std::is_const_v<Byte>) { write16(rawData + 10, port); }
+    void setTotalSize(uint32_t size) requires (!std::is_const_v<Byte>) { write32(rawData + 12, size); }
+    void setType(uint8_t type) requires (!std::is_const_v<Byte>) { rawData[16] = type; }
+
+    // owning copy, for when the message has to outlive the viewed buffer
+    MessageBlock* copy() const {
+        return new MessageBlock(rawData, getTotalSize());
+    }
+
+private:
+    static uint32_t read32(const uint8_t* p) {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    }
+
+    static uint16_t read16(const uint8_t* p) {
+        return uint16_t((p[0] << 8) | p[1]);
+    }
+
+    static void write32(uint8_t* p, uint32_t v) {
+        p[0] = (v >> 24) & 0xFF;
+        p[1] = (v >> 16) & 0xFF;
+        p[2] = (v >> 8) & 0xFF;
+        p[3] = v & 0xFF;
+    }
+
+    static void write16(uint8_t* p, uint16_t v) {
+        p[0] = (v >> 8) & 0xFF;
+        p[1] = v & 0xFF;
+    }
+
+    Byte* rawData{};
+    uint32_t available{};
+};
+
+using MessageBlockView = BasicMessageBlockView<uint8_t>;
+using ConstMessageBlockView = BasicMessageBlockView<const uint8_t>;
+
+
+// Builds a MessageBlock in place: the block is allocated once with room for the expected
+// payload, headers are set directly and the payload is written (or appended) straight into it.
+class MessageBlockBuilder {
+public:
+    explicit MessageBlockBuilder(uint32_t payloadReserve)
+        : block(std::make_unique<MessageBlock>(17, 17 + payloadReserve)) {}
+
+    MessageBlockBuilder& type(uint8_t t) { block->setType(t); return *this; }
+
+    MessageBlockBuilder& src(uint32_t ip, uint16_t port) {
+        block->setSrcIP(ip);
+        block->setSrcPort(port);
+        return *this;
+    }
+
+    MessageBlockBuilder& dst(uint32_t ip, uint16_t port) {
+        block->setDstIP(ip);
+        block->setDstPort(port);
+        return *this;
+    }
+
+    // write pointer for the payload, payloadCapacity() bytes are available
+    uint8_t* payload() { return block->getPayloadWritePtr(); }
+    uint32_t payloadCapacity() const { return block->getCapacity() - 17; }
+
+    MessageBlockBuilder& append(const void* data, uint32_t size) {
+        reserve(length + size);
+        if (size) std::memcpy(block->getPayloadWritePtr() + length, data, size);
+        length += size;
+        return *this;
+    }
+
+    void reserve(uint32_t payloadSize) {
+        if (payloadSize > payloadCapacity()) block->reserve(17 + payloadSize);
+    }
+
+    // payload was written through payload(); the caller owns the returned block
+    MessageBlock* finish(uint32_t payloadSize) {
+        reserve(payloadSize);
+        block->setTotalSize(17 + payloadSize);
+        return block.release();
+    }
+
+    // payload was built with append()
+    MessageBlock* finish() { return finish(length); }
+
+private:
+    std::unique_ptr<MessageBlock> block;
+    uint32_t length = 0;
+};
@@ -1,16 +1,45 @@
+#pragma once
 #include <cstdint>
 #include <cstring>
 #include <mutex>
+#include <atomic>
+#include <functional>
 using BYTE = uint8_t;
 
+// Every record in a ring is a 4-byte header followed by its body. The low 30 bits of the
+// header are the body length; the top bits mark fragments of a message that is too large
+// to fit in the ring at once:
+//   FRAG_MORE  - more fragments of this message follow this record
+//   FRAG_ABORT - writer gave up halfway, drop what was assembled so far (empty body)
+// The first fragment of a fragmented message carries the full message size in 4 extra
+// bytes right after the header, so the reader can size its destination before the rest arrives.
+//
+// The buffer starts with an 8-byte control header: a 4-byte generation counter (bumped by
+// reset(), both sides drop their local ring state when it changes) and 4 reserved bytes.
+// The two regions follow it.
+//
+// The flag byte in front of each region is a doorbell owned by that region's consumer:
+// bit 0 set = "asleep, ring me", bits 1-7 = sleep epoch, bumped every time it goes to sleep.
+// A producer rings (posts "dataReady") only the first time it sees a given asleep epoch, so
+// a burst of writes while the consumer is polling or already rung costs no notifications.
 class MessageChannel
 {
 public:
+    static constexpr uint32_t FRAG_MORE = 0x80000000u;
+    static constexpr uint32_t FRAG_ABORT = 0x40000000u;
+    static constexpr uint32_t FRAG_LEN_MASK = 0x3FFFFFFFu;
+    static constexpr size_t CONTROL_HEADER_SIZE = 8;
+
     MessageChannel(BYTE* sharedPtr, size_t totalSize, bool isLeftMaster)
     {
         if (!sharedPtr) throw "null";
-        if (totalSize < 18) throw "small";
+        if (totalSize < CONTROL_HEADER_SIZE + 18) throw "small";
+
+        generationPtr = sharedPtr;
+        readGeneration = writeGeneration = load32(generationPtr);
 
+        sharedPtr += CONTROL_HEADER_SIZE;
+        totalSize -= CONTROL_HEADER_SIZE;
         size_t half = totalSize / 2;
 
         uint32_t leftDataRegionSize = (uint32_t)(half - 9);
@@ -73,30 +102,113 @@ public:
         */
     }
 
+    // Empties both rings in place and bumps the generation, so the buffer can be handed to a
+    // new peer (e.g. the next document) without reallocating it. The other side notices the
+    // new generation and drops its local state; a writer blocked in writeStream bails out.
+    // Call from the side that owns the buffer, while the other side is detached.
+    void reset()
+    {
+        resetRequested = true;
+        std::scoped_lock lock(readLock, writeLock);
+
+        *masterFlag = 0;
+        *slaveFlag = 0;
+        store32(masterWrite, 0);
+        store32(masterRead, 0);
+        store32(slaveWrite, 0);
+        store32(slaveRead, 0);
+
+        uint32_t next = load32(generationPtr) + 1;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        store32(generationPtr, next);
+
+        syncReadGenerationUnsafe();
+        syncWriteGenerationUnsafe();
+        resetRequested = false;
+    }
+
+    // messages read completely in the current generation; the page counts its writes the
+    // same way, so the n-th message is the same one on both sides (see Tracing.h)
+    uint32_t getReadSeq() const
+    {
+        return readSeq;
+    }
+
+    uint32_t getGeneration()
+    {
+        return load32(generationPtr);
+    }
+
     // --- Master writing ---
     size_t availableToWrite()
     {
-        std::lock_guard<std::mutex> lock(writeLock);
+        std::lock_guard<std::recursive_mutex> lock(writeLock);
         return availableToWriteUnsafe();
     }
 
     int writeBuf(const BYTE* src, uint32_t size)
     {
-        std::lock_guard<std::mutex> lock(writeLock);
+        std::lock_guard<std::recursive_mutex> lock(writeLock);
 
-        if (!src || size == 0 || availableToWriteUnsafe() < size + 4 ) return 0; 
+        if (!src || size == 0 || size > FRAG_LEN_MASK) return 0;
+        syncWriteGenerationUnsafe();
+        if (abortPending && !writeAbortUnsafe()) return 0;
+        if (availableToWriteUnsafe() < size + 4) return 0;
 
-        uint32_t w = load32(masterWrite);
-
-        writeRegion(masterData, masterDataRegionSize, w, (BYTE*)&size, 4);
-        w = (w + 4) % masterDataRegionSize;
-
-        writeRegion(masterData, masterDataRegionSize, w, src, size);
-        w = (w + size) % masterDataRegionSize;
-
-        store32(masterWrite, w);
-        *masterFlag |= 1;
+        writeRecordUnsafe(0, 0, src, size);
+        return size;
+    }
 
+    // Writes a message of any size. If it fits it goes out as a single record like writeBuf,
+    // otherwise it is split into continuation records as the reader frees space.
+    // waitForSpace is called whenever the ring is too full to make progress (it should wake
+    // the reader and back off); returning false gives up. Giving up halfway leaves an abort
+    // record so the reader drops the partial message. Returns size, or 0 if nothing was sent.
+    int writeStream(const BYTE* src, uint32_t size, const std::function<bool()>& waitForSpace)
+    {
+        std::lock_guard<std::recursive_mutex> lock(writeLock);
+
+        if (!src || size == 0 || size > FRAG_LEN_MASK) return 0;
+        syncWriteGenerationUnsafe();
+
+        uint32_t maxFragment = masterDataRegionSize / 2;    // leave room for the reader to drain one half while we fill the other
+        uint32_t minFragment = maxFragment < 4096 ? maxFragment : 4096;
+        uint32_t done = 0;
+
+        while (done < size) {
+            if (resetRequested) return 0;       // ring is about to be emptied, nothing left to finish
+            if (abortPending && !writeAbortUnsafe()) {
+                if (!waitForSpace || !waitForSpace()) return 0;
+                continue;
+            }
+
+            uint32_t avail = (uint32_t)availableToWriteUnsafe();
+            uint32_t remaining = size - done;
+
+            if (done == 0 && avail >= remaining + 4) {     // whole message fits, no fragmentation needed
+                writeRecordUnsafe(0, 0, src, size);
+                return size;
+            }
+
+            uint32_t prefix = (done == 0) ? 4 : 0;
+            uint32_t want = remaining < maxFragment ? remaining : maxFragment;
+            uint32_t least = want < minFragment ? want : minFragment;
+
+            if (avail < 4 + prefix + least) {
+                if (!waitForSpace || !waitForSpace()) {
+                    if (done) writeAbortUnsafe();
+                    return 0;
+                }
+                continue;
+            }
+
+            uint32_t len = avail - 4 - prefix;
+            if (len > want) len = want;
+            uint32_t flags = (done + len < size) ? FRAG_MORE : 0;
+
+            writeRecordUnsafe(flags, done == 0 ? size : 0, src + done, len);
+            done += len;
+        }
         return size;
     }
 
@@ -109,49 +221,89 @@ public:
         
     }
 
+    // Size of the whole next message (also for a fragmented one that is partly read), 0 if
+    // its first record has not fully arrived yet.
     uint32_t sizeofNextMessage()
     {
         std::lock_guard<std::mutex> lock(readLock);
+        syncReadGenerationUnsafe();
 
-        if (availableToReadUnsafe() < 4) return 0;
+        if (readMsgSize) return readMsgSize;
+        return peekMessageSizeUnsafe();
+    }
 
-        uint32_t r = load32(masterRead);
-        uint32_t sz = 0;
 
-        // read 4-byte header safely using readRegion
-        readRegion(slaveData, slaveDataRegionSize, r, (BYTE*)&sz, 4);
+    // Reads the next message into dst. A fragmented message is copied in as its fragments
+    // arrive: 0 is returned until the last one is consumed, so keep calling with the same dst.
+    // Returns -1 if the writer aborted the message or the channel was reset under it.
+    int readBuf(BYTE* dst, uint32_t maxLen)
+    {
+        std::lock_guard<std::mutex> lock(readLock);
+        if (takeReadAbortUnsafe()) return -1;
 
-        return sz;
-    }
+        uint32_t total = readMsgSize ? readMsgSize : peekMessageSizeUnsafe();
+        if (total == 0 || total > maxLen) return 0;
 
+        return drainFragmentsUnsafe(dst);
+    }
 
-    int readBuf(BYTE* dst, uint32_t maxLen)
+    // Streams the next message straight into a destination chosen by the caller, without
+    // staging it. begin(totalSize) is called once per message and returns where the bytes
+    // go (nullptr consumes and drops the message). Same return values as readBuf.
+    template <typename BeginFn>
+    int readStream(BeginFn&& begin)
     {
         std::lock_guard<std::mutex> lock(readLock);
+        if (takeReadAbortUnsafe()) return -1;
 
-        uint32_t avail = (uint32_t)availableToReadUnsafe();
+        if (!readMsgSize) {
+            uint32_t total = peekMessageSizeUnsafe();
+            if (!total) return 0;
+            readMsgDst = begin(total);
+        }
+        return drainFragmentsUnsafe(readMsgDst);
+    }
 
-        if (avail < 4) return 0; // not enough for header
+    // --- Doorbell, producer side ---
+    // Call after writing. True once per consumer sleep: the caller must wake the consumer.
+    bool needsDoorbell()
+    {
+        std::lock_guard<std::recursive_mutex> lock(writeLock);
+        syncWriteGenerationUnsafe();
 
-        uint32_t r = load32(masterRead);
-        uint32_t sz = 0;
+        std::atomic_thread_fence(std::memory_order_seq_cst);   // write index visible before we look at the doorbell
+        BYTE state = std::atomic_ref<BYTE>(*masterFlag).load(std::memory_order_acquire);
+        if (!(state & DOORBELL_ASLEEP) || state == rungState) return false;
 
-        // read 4-byte header safely
-        readRegion(slaveData, slaveDataRegionSize, r, (BYTE*)&sz, 4);
+        rungState = state;
+        return true;
+    }
 
-        if (sz == 0 || sz > maxLen) return 0;
-        if (avail < sz + 4) return 0;
+    // --- Doorbell, consumer side ---
+    // Advertise "polling": producers stop ringing until the next trySleep.
+    void setPolling()
+    {
+        std::lock_guard<std::mutex> lock(readLock);
+        syncReadGenerationUnsafe();
 
-        r = (r + 4) % slaveDataRegionSize;
+        std::atomic_ref<BYTE>(*slaveFlag).store(BYTE(sleepEpoch << 1), std::memory_order_release);
+    }
+
+    // Advertise "asleep" and recheck the ring. Returns false (and stays polling) if data
+    // slipped in meanwhile; otherwise the next write will ring the doorbell.
+    bool trySleep()
+    {
+        std::lock_guard<std::mutex> lock(readLock);
+        syncReadGenerationUnsafe();
 
-        // read message payload
-        readRegion(slaveData, slaveDataRegionSize, r, dst, sz);
-        r = (r + sz) % slaveDataRegionSize;
+        sleepEpoch = (sleepEpoch + 1) & 0x7F;
+        std::atomic_ref<BYTE>(*slaveFlag).store(BYTE((sleepEpoch << 1) | DOORBELL_ASLEEP), std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
 
-        store32(masterRead, r);
-        *slaveFlag = 1; // optional notification
+        if (!recordReadyUnsafe()) return true;     // a half-written fragment is fine, its writer rings when done
 
-        return sz; // return actual bytes read
+        std::atomic_ref<BYTE>(*slaveFlag).store(BYTE(sleepEpoch << 1), std::memory_order_release);
+        return false;
     }
 
     BYTE *getMasterFlagPtr() {
@@ -164,6 +316,13 @@ public:
 
 private:
 
+    BYTE* generationPtr;
+    uint32_t readGeneration;    // generation the reader state below belongs to
+    uint32_t writeGeneration;   // generation the writer state below belongs to
+    bool readAborted = false;   // a reset dropped a message the reader was assembling
+    uint32_t readSeq = 0;
+    std::atomic<bool> resetRequested{ false };
+
     // --- Master/Slave pointers ---
     BYTE* masterFlag;
     BYTE* masterRead;    // master reads from slave
@@ -178,7 +337,18 @@ private:
     uint32_t slaveDataRegionSize;
 
     std::mutex readLock;
-    std::mutex writeLock;
+    std::recursive_mutex writeLock;     // recursive: waitForSpace may ring the doorbell from inside writeStream
+
+    // fragmented message being assembled by the reader
+    uint32_t readMsgSize = 0;
+    uint32_t readMsgDone = 0;
+    BYTE* readMsgDst = nullptr;
+
+    bool abortPending = false;  // writer gave up mid-message and still owes the reader an abort record
+
+    static constexpr BYTE DOORBELL_ASLEEP = 1;
+    BYTE rungState = 0;         // producer: consumer state we last rang for
+    BYTE sleepEpoch = 0;        // consumer: bumped on every trySleep
 
     size_t availableToWriteUnsafe() const 
     {
@@ -197,6 +367,172 @@ private:
         return (w >= r) ? (w - r) : (slaveDataRegionSize - (r - w));
     }
 
+    void writeRecordUnsafe(uint32_t flags, uint32_t totalSize, const BYTE* src, uint32_t len)
+    {
+        uint32_t w = load32(masterWrite);
+        uint32_t hdr = flags | len;
+
+        writeRegion(masterData, masterDataRegionSize, w, (BYTE*)&hdr, 4);
+        w = (w + 4) % masterDataRegionSize;
+
+        if (totalSize) {            // first fragment of a fragmented message
+            writeRegion(masterData, masterDataRegionSize, w, (BYTE*)&totalSize, 4);
+            w = (w + 4) % masterDataRegionSize;
+        }
+
+        if (len) {
+            writeRegion(masterData, masterDataRegionSize, w, src, len);
+            w = (w + len) % masterDataRegionSize;
+        }
+
+        store32(masterWrite, w);
+    }
+
+    bool writeAbortUnsafe()
+    {
+        abortPending = availableToWriteUnsafe() < 4;
+        if (!abortPending) writeRecordUnsafe(FRAG_ABORT, 0, nullptr, 0);
+        return !abortPending;
+    }
+
+    // true if the record at the read position has fully arrived
+    bool recordReadyUnsafe()
+    {
+        uint32_t avail = (uint32_t)availableToReadUnsafe();
+        if (avail < 4) return false;
+
+        uint32_t hdr = 0;
+        readRegion(slaveData, slaveDataRegionSize, load32(masterRead), (BYTE*)&hdr, 4);
+        if (hdr & FRAG_ABORT) return true;
+
+        uint32_t prefix = (!readMsgSize && (hdr & FRAG_MORE)) ? 4 : 0;
+        return avail >= 4 + prefix + (hdr & FRAG_LEN_MASK);
+    }
+
+    // Size of the message starting at the read position, once its first record is complete.
+    // Stray abort records (nothing in progress) are skipped.
+    uint32_t peekMessageSizeUnsafe()
+    {
+        for (;;) {
+            uint32_t avail = (uint32_t)availableToReadUnsafe();
+            if (avail < 4) return 0;
+
+            uint32_t r = load32(masterRead);
+            uint32_t hdr = 0;
+            readRegion(slaveData, slaveDataRegionSize, r, (BYTE*)&hdr, 4);
+
+            if (hdr & FRAG_ABORT) {
+                store32(masterRead, (r + 4) % slaveDataRegionSize);
+                continue;
+            }
+
+            uint32_t len = hdr & FRAG_LEN_MASK;
+            if (!(hdr & FRAG_MORE))
+                return (len && avail >= len + 4) ? len : 0;
+
+            if (avail < len + 8) return 0;
+            uint32_t total = 0;
+            readRegion(slaveData, slaveDataRegionSize, (r + 4) % slaveDataRegionSize, (BYTE*)&total, 4);
+            return total;
+        }
+    }
+
+    // Consumes every complete fragment of the current message that is in the ring, copying
+    // it to dst (nullptr drops it). Returns the message size once its last fragment is in,
+    // 0 while more are expected, -1 if the writer aborted it.
+    int drainFragmentsUnsafe(BYTE* dst)
+    {
+        for (;;) {
+            uint32_t avail = (uint32_t)availableToReadUnsafe();
+            if (avail < 4) return 0;
+
+            uint32_t r = load32(masterRead);
+            uint32_t hdr = 0;
+            readRegion(slaveData, slaveDataRegionSize, r, (BYTE*)&hdr, 4);
+
+            if (hdr & FRAG_ABORT) {
+                store32(masterRead, (r + 4) % slaveDataRegionSize);
+                bool inProgress = readMsgSize != 0;
+                resetReadMsg();
+                if (inProgress) return -1;
+                continue;
+            }
+
+            uint32_t len = hdr & FRAG_LEN_MASK;
+            bool first = (readMsgSize == 0);
+            uint32_t prefix = (first && (hdr & FRAG_MORE)) ? 4 : 0;
+
+            if (len == 0 && first) return 0;
+            if (avail < 4 + prefix + len) return 0;
+            r = (r + 4) % slaveDataRegionSize;
+
+            if (first) {
+                uint32_t total = len;
+                if (prefix) {
+                    readRegion(slaveData, slaveDataRegionSize, r, (BYTE*)&total, 4);
+                    r = (r + 4) % slaveDataRegionSize;
+                }
+                readMsgSize = total;
+                readMsgDone = 0;
+            }
+
+            bool corrupt = (readMsgDone + len > readMsgSize);
+            if (dst && !corrupt) readRegion(slaveData, slaveDataRegionSize, r, dst + readMsgDone, len);
+            r = (r + len) % slaveDataRegionSize;
+            readMsgDone += len;
+
+            store32(masterRead, r);
+
+            if (corrupt) {
+                resetReadMsg();
+                return -1;
+            }
+            if (!(hdr & FRAG_MORE)) {
+                int total = (readMsgDone == readMsgSize) ? (int)readMsgSize : -1;
+                if (total > 0) ++readSeq;
+                resetReadMsg();
+                return total;
+            }
+        }
+    }
+
+    void syncReadGenerationUnsafe()
+    {
+        uint32_t g = load32(generationPtr);
+        if (g == readGeneration) return;
+
+        readGeneration = g;
+        if (readMsgSize) readAborted = true;
+        resetReadMsg();
+        readSeq = 0;
+        sleepEpoch = 0;
+    }
+
+    void syncWriteGenerationUnsafe()
+    {
+        uint32_t g = load32(generationPtr);
+        if (g == writeGeneration) return;
+
+        writeGeneration = g;
+        abortPending = false;
+        rungState = 0;
+    }
+
+    bool takeReadAbortUnsafe()
+    {
+        syncReadGenerationUnsafe();
+        bool aborted = readAborted;
+        readAborted = false;
+        return aborted;
+    }
+
+    void resetReadMsg()
+    {
+        readMsgSize = 0;
+        readMsgDone = 0;
+        readMsgDst = nullptr;
+    }
+
     // --- Helpers ---
     static uint32_t load32(BYTE* p)
     {
@@ -0,0 +1,297 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Process-wide counters, gauges and latency histograms for the messaging path.
+//
+// Every thread records into its own shard, memory no other thread writes, so recording is a
+// plain load/add/store; snapshot() sums the shards under the registry lock. The shard of a
+// thread that exits is folded into a retired total and handed to the next new thread, so
+// per-connection threads do not grow the registry.
+namespace metrics {
+
+enum Counter {
+    TCP_MSGS_SENT, TCP_BYTES_SENT, TCP_MSGS_RECEIVED, TCP_BYTES_RECEIVED,
+    UDP_MSGS_SENT, UDP_BYTES_SENT, UDP_MSGS_RECEIVED, UDP_BYTES_RECEIVED,
+    SEND_FAILURES,              // socket errors on send
+    SEND_DROPS,                 // no connection to send on
+    RECV_DROPS,                 // malformed datagrams
+    MCAST_SENT,                 // room broadcasts sent as one group datagram
+    MCAST_FALLBACKS,            // unicast copies of a room broadcast, see Multicast.h
+    MCAST_DUPLICATES,           // room broadcasts received twice and dropped
+    CHANNEL_MSGS_IN, CHANNEL_BYTES_IN,      // page -> native
+    CHANNEL_MSGS_OUT, CHANNEL_BYTES_OUT,    // native -> page
+    CHANNEL_WRITE_FAILURES,
+    TEARDOWN_OVERDUE,           // connections whose threads outlived the teardown deadline
+    ADMIT_CONN_REJECTS,         // accepted connections closed at once, over a source's limit (Admission.h)
+    ADMIT_MSG_DROPS,            // received messages dropped by a source's or type's rate limit
+    ADMIT_BYTE_DROPS,
+    COUNTER_COUNT
+};
+
+enum Histogram {
+    POOL_QUEUE_WAIT_NS,         // ThreadPool enqueue -> task starts
+    POOL_QUEUE_DEPTH,           // tasks already queued, sampled at enqueue
+    SEND_QUEUE_WAIT_NS,         // sendMessage -> sender thread picks the message up
+    SEND_QUEUE_DEPTH,           // messages already queued on the connection, sampled at enqueue
+    SEND_WRITE_NS,              // socket write of one message
+    DISPATCH_WAIT_NS,           // message received -> receive callback starts
+    CHANNEL_WRITE_NS,           // writing one message into the page ring
+    TEARDOWN_NS,                // stopConnection -> the context is freed
+    HISTOGRAM_COUNT
+};
+
+enum Gauge {
+    RING_OUT_FREE,              // bytes free for native -> page, after the last write
+    RING_IN_USED,               // bytes page -> native not read yet, after the last read
+    GAUGE_COUNT
+};
+
+enum Direction { SENT = 0, RECEIVED = 1 };
+
+inline const char* const counterNames[COUNTER_COUNT] = {
+    "tcp_msgs_sent", "tcp_bytes_sent", "tcp_msgs_received", "tcp_bytes_received",
+    "udp_msgs_sent", "udp_bytes_sent", "udp_msgs_received", "udp_bytes_received",
+    "send_failures", "send_drops", "recv_drops",
+    "mcast_sent", "mcast_fallbacks", "mcast_duplicates",
+    "channel_msgs_in", "channel_bytes_in", "channel_msgs_out", "channel_bytes_out",
+    "channel_write_failures", "teardown_overdue",
+    "admit_conn_rejects", "admit_msg_drops", "admit_byte_drops",
+};
+
+inline const char* const histogramNames[HISTOGRAM_COUNT] = {
+    "pool_queue_wait_ns", "pool_queue_depth", "send_queue_wait_ns", "send_queue_depth",
+    "send_write_ns", "dispatch_wait_ns", "channel_write_ns", "teardown_ns",
+};
+
+inline const char* const gaugeNames[GAUGE_COUNT] = {
+    "ring_out_free", "ring_in_used",
+};
+
+// log-linear (HDR style) buckets: values below 8 are exact, above that every power of two
+// is split into 8 buckets, so a bucket is at most 12.5% wide
+constexpr int SUB_BUCKETS = 8;
+constexpr int BUCKETS = SUB_BUCKETS + (64 - 3) * SUB_BUCKETS;
+
+inline int bucketOf(uint64_t v) {
+    if (v < SUB_BUCKETS) return (int)v;
+    int e = 63;
+    while (!(v >> e)) --e;                  // e >= 3
+    return (e - 2) * SUB_BUCKETS + (int)((v >> (e - 3)) & (SUB_BUCKETS - 1));
+}
+
+// largest value that falls into bucket b
+inline uint64_t bucketLimit(int b) {
+    if (b < SUB_BUCKETS) return (uint64_t)b;
+    int e = b / SUB_BUCKETS + 2;
+    uint64_t low = (uint64_t(SUB_BUCKETS) | uint64_t(b % SUB_BUCKETS)) << (e - 3);
+    return low + (uint64_t(1) << (e - 3)) - 1;
+}
+
+inline uint64_t now() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct HistogramSnapshot {
+    uint64_t buckets[BUCKETS]{};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    // upper bound of the bucket holding the p-th percentile (0-100)
+    uint64_t percentile(double p) const {
+        if (!count) return 0;
+        uint64_t rank = (uint64_t)(p / 100.0 * (double)(count - 1)) + 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += buckets[b];
+            if (seen >= rank) return bucketLimit(b);
+        }
+        return bucketLimit(BUCKETS - 1);
+    }
+};
+
+struct Snapshot {
+    uint64_t counters[COUNTER_COUNT]{};
+    uint64_t typeMsgs[2][256]{};
+    uint64_t typeBytes[2][256]{};
+    HistogramSnapshot histograms[HISTOGRAM_COUNT];
+    int64_t gauges[GAUGE_COUNT]{};
+};
+
+namespace detail {
+
+struct Shard {
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    std::atomic<uint64_t> typeMsgs[2][256];
+    std::atomic<uint64_t> typeBytes[2][256];
+    std::atomic<uint64_t> buckets[HISTOGRAM_COUNT][BUCKETS];
+    std::atomic<uint64_t> sums[HISTOGRAM_COUNT];
+};
+
+// only the owning thread writes a shard, so increments need no read-modify-write
+inline void bump(std::atomic<uint64_t>& a, uint64_t n) {
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// moves the values of from into to; both are owned by the registry lock holder
+inline void fold(std::atomic<uint64_t>* to, std::atomic<uint64_t>* from, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        bump(to[i], from[i].load(std::memory_order_relaxed));
+        from[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+template <size_t N>
+inline void addTo(uint64_t* to, std::atomic<uint64_t> (&from)[N]) {
+    for (size_t i = 0; i < N; ++i) to[i] += from[i].load(std::memory_order_relaxed);
+}
+
+class Registry {
+public:
+    static Registry& instance() {
+        static Registry* r = new Registry();    // never destroyed: threads may still record at exit
+        return *r;
+    }
+
+    Shard* acquire() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!spare.empty()) {
+            Shard* s = spare.back();
+            spare.pop_back();
+            return s;
+        }
+        shards.push_back(std::make_unique<Shard>());
+        return shards.back().get();
+    }
+
+    void release(Shard* s) {
+        std::lock_guard<std::mutex> lock(mtx);
+        fold(retired.counters, s->counters, COUNTER_COUNT);
+        fold(&retired.typeMsgs[0][0], &s->typeMsgs[0][0], 2 * 256);
+        fold(&retired.typeBytes[0][0], &s->typeBytes[0][0], 2 * 256);
+        fold(&retired.buckets[0][0], &s->buckets[0][0], HISTOGRAM_COUNT * BUCKETS);
+        fold(retired.sums, s->sums, HISTOGRAM_COUNT);
+        spare.push_back(s);
+    }
+
+    void snapshot(Snapshot& out) {
+        std::lock_guard<std::mutex> lock(mtx);
+        add(out, retired);
+        for (auto& s : shards) add(out, *s);
+        for (int g = 0; g < GAUGE_COUNT; ++g) out.gauges[g] = gauges[g].load(std::memory_order_relaxed);
+    }
+
+    std::atomic<int64_t> gauges[GAUGE_COUNT]{};
+
+private:
+    static void add(Snapshot& out, Shard& s) {
+        addTo(out.counters, s.counters);
+        for (int d = 0; d < 2; ++d) {
+            addTo(out.typeMsgs[d], s.typeMsgs[d]);
+            addTo(out.typeBytes[d], s.typeBytes[d]);
+        }
+        for (int h = 0; h < HISTOGRAM_COUNT; ++h) {
+            HistogramSnapshot& hs = out.histograms[h];
+            for (int b = 0; b < BUCKETS; ++b) {
+                uint64_t n = s.buckets[h][b].load(std::memory_order_relaxed);
+                hs.buckets[b] += n;
+                hs.count += n;
+            }
+            hs.sum += s.sums[h].load(std::memory_order_relaxed);
+        }
+    }
+
+    std::mutex mtx;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<Shard*> spare;
+    Shard retired;
+};
+
+struct ShardHandle {
+    Shard* shard = Registry::instance().acquire();
+    ~ShardHandle() { Registry::instance().release(shard); }
+};
+
+inline Shard& local() {
+    thread_local ShardHandle handle;
+    return *handle.shard;
+}
+
+} // namespace detail
+
+inline void add(Counter c, uint64_t n = 1) {
+    detail::bump(detail::local().counters[c], n);
+}
+
+// one message of the given type (and its bytes) sent to / received from the network
+inline void countType(Direction d, uint8_t type, uint64_t bytes) {
+    detail::Shard& s = detail::local();
+    detail::bump(s.typeMsgs[d][type], 1);
+    detail::bump(s.typeBytes[d][type], bytes);
+}
+
+inline void record(Histogram h, uint64_t value) {
+    detail::Shard& s = detail::local();
+    detail::bump(s.buckets[h][bucketOf(value)], 1);
+    detail::bump(s.sums[h], value);
+}
+
+// time since start (a now() value); 0 means "not stamped" and is not recorded
+inline void recordSince(Histogram h, uint64_t start) {
+    if (start) record(h, now() - start);
+}
+
+inline void setGauge(Gauge g, int64_t value) {
+    detail::Registry::instance().gauges[g].store(value, std::memory_order_relaxed);
+}
+
+inline std::unique_ptr<Snapshot> snapshot() {
+    auto s = std::make_unique<Snapshot>();
+    detail::Registry::instance().snapshot(*s);
+    return s;
+}
+
+// one metric per line: "counter <name> <value>", "gauge <name> <value>",
+// "histogram <name> count= mean= p50= p90= p99= max=", "type <0xNN> sent= sent_bytes= ..."
+inline std::string dumpText(const Snapshot& s) {
+    std::string out;
+    char line[256];
+    for (int c = 0; c < COUNTER_COUNT; ++c) {
+        snprintf(line, sizeof(line), "counter %s %llu\n", counterNames[c], (unsigned long long)s.counters[c]);
+        out += line;
+    }
+    for (int g = 0; g < GAUGE_COUNT; ++g) {
+        snprintf(line, sizeof(line), "gauge %s %lld\n", gaugeNames[g], (long long)s.gauges[g]);
+        out += line;
+    }
+    for (int h = 0; h < HISTOGRAM_COUNT; ++h) {
+        const HistogramSnapshot& hs = s.histograms[h];
+        snprintf(line, sizeof(line), "histogram %s count=%llu mean=%llu p50=%llu p90=%llu p99=%llu max=%llu\n",
+            histogramNames[h], (unsigned long long)hs.count,
+            (unsigned long long)(hs.count ? hs.sum / hs.count : 0),
+            (unsigned long long)hs.percentile(50), (unsigned long long)hs.percentile(90),
+            (unsigned long long)hs.percentile(99), (unsigned long long)hs.percentile(100));
+        out += line;
+    }
+    for (int t = 0; t < 256; ++t) {
+        if (!s.typeMsgs[SENT][t] && !s.typeMsgs[RECEIVED][t]) continue;
+        snprintf(line, sizeof(line), "type 0x%02X sent=%llu sent_bytes=%llu received=%llu received_bytes=%llu\n", t,
+            (unsigned long long)s.typeMsgs[SENT][t], (unsigned long long)s.typeBytes[SENT][t],
+            (unsigned long long)s.typeMsgs[RECEIVED][t], (unsigned long long)s.typeBytes[RECEIVED][t]);
+        out += line;
+    }
+    return out;
+}
+
+inline std::string dumpText() {
+    return dumpText(*snapshot());
+}
+
+} // namespace metrics
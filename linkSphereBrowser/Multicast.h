@@ -0,0 +1,104 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+// Room broadcasts over LAN IP multicast, with unicast fallback.
+//
+// A message the page sends to ROOM_BROADCAST is wrapped once and multicast to the room's
+// group (one datagram, whatever the room size). Members that received a multicast from us
+// lately say so with MCAST_ACK over TCP; everyone else, and everyone when the group could not
+// be joined, also gets the same envelope over its TCP connection. The envelope carries the
+// sender and a sequence number, so a member that gets both copies delivers one.
+//
+//   envelope: version, sender ip, sender TCP port, sender epoch, seq, inner type, inner payload
+//
+// The epoch is picked when the sender joins a room, so a restarted sender is not mistaken
+// for old duplicates.
+namespace mcast {
+
+constexpr uint8_t MCAST_DATA = 0x34;        // MsgType.MCAST_DATA, envelope over the group (UDP)
+constexpr uint8_t MCAST_UNICAST = 0x93;     // MsgType.MCAST_UNICAST, the same over TCP
+constexpr uint8_t MCAST_ACK = 0x94;         // MsgType.MCAST_ACK, "your multicasts reach me"
+constexpr uint8_t VERSION = 1;
+constexpr uint32_t HEADER_SIZE = 1 + 4 + 2 + 4 + 8 + 1;
+
+constexpr uint32_t MAX_DATAGRAM = 1400;              // larger envelopes go over TCP only, no IP fragments
+constexpr uint32_t ROOM_BROADCAST = 0xFFFFFFFF;     // destination IP the page sends broadcasts to
+constexpr uint32_t ACK_EVERY_MS = 5000;             // receiver: least time between two acks
+constexpr uint32_t ACK_VALID_MS = 3 * ACK_EVERY_MS; // sender: unicast fallback after this
+
+// 239.255.0.0/16 is organisation-local scope; the room hash picks the group
+inline uint32_t groupFor(uint32_t roomHash) {
+    uint32_t low = (roomHash ^ (roomHash >> 16)) & 0xFFFF;
+    return 0xEFFF0000u | (low ? low : 1);
+}
+
+inline bool isGroup(uint32_t ip) { return (ip & 0xF0000000u) == 0xE0000000u; }
+
+struct Header {
+    uint32_t ip = 0;
+    uint16_t port = 0;
+    uint32_t epoch = 0;
+    uint64_t seq = 0;
+    uint8_t type = 0;
+};
+
+inline void put(uint8_t* p, uint64_t v, int n) {
+    for (int i = 0; i < n; ++i) p[i] = uint8_t(v >> (8 * i));
+}
+
+inline uint64_t get(const uint8_t* p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; ++i) v |= uint64_t(p[i]) << (8 * i);
+    return v;
+}
+
+inline void encodeHeader(uint8_t* out, const Header& h) {
+    out[0] = VERSION;
+    put(out + 1, h.ip, 4);
+    put(out + 5, h.port, 2);
+    put(out + 7, h.epoch, 4);
+    put(out + 11, h.seq, 8);
+    out[19] = h.type;
+}
+
+inline bool decodeHeader(const uint8_t* p, uint32_t len, Header& h) {
+    if (len < HEADER_SIZE || p[0] != VERSION) return false;
+    h.ip = (uint32_t)get(p + 1, 4);
+    h.port = (uint16_t)get(p + 5, 2);
+    h.epoch = (uint32_t)get(p + 7, 4);
+    h.seq = get(p + 11, 8);
+    h.type = p[19];
+    return true;
+}
+
+// per sender: the highest sequence number seen and a bitmap of the 64 below it, as in the
+// IPsec anti-replay window; anything older than the window counts as seen
+struct DedupWindow {
+    uint32_t epoch = 0;
+    uint64_t top = 0;
+    uint64_t bits = 0;          // bit i: top - i was seen
+    bool any = false;
+
+    bool accept(uint32_t e, uint64_t seq) {
+        if (!any || e != epoch) {
+            epoch = e;
+            top = seq;
+            bits = 1;
+            any = true;
+            return true;
+        }
+        if (seq > top) {
+            uint64_t shift = seq - top;
+            bits = shift >= 64 ? 1 : (bits << shift) | 1;
+            top = seq;
+            return true;
+        }
+        uint64_t back = top - seq;
+        if (back >= 64 || (bits & (uint64_t(1) << back))) return false;
+        bits |= uint64_t(1) << back;
+        return true;
+    }
+};
+
+} // namespace mcast
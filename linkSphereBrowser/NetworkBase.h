@@ -1,18 +1,55 @@
-#pragma once
-#include <winsock2.h>
-#include <ws2tcpip.h>
+﻿#pragma once
+#include "Transport.h"       // first: winsock2.h has to come before windows.h (LocalLink.h)
 #include <thread>
 #include <vector>
 #include <string>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <set>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <deque>
 #include "MessageBlock.h"
-#pragma comment(lib, "ws2_32.lib")
+#include "MessageBlockView.h"
+#include "WireFraming.h"
+#include "Compression.h"
+#include "Metrics.h"
+#include "Tracing.h"
+#include "PeerClock.h"
+#include "TimerWheel.h"
+#include "Multicast.h"
+#include "LocalLink.h"
+#include "Capture.h"
+#include "Log.h"
+#include "Admission.h"
 
 //#include <iostream>/*
 //using namespace std;*/
 
+// per connection, payload bytes before / after compression and the time spent on it
+struct CompressionStats {
+    std::atomic<uint64_t> rawBytes{ 0 };
+    std::atomic<uint64_t> wireBytes{ 0 };
+    std::atomic<uint64_t> compressedFrames{ 0 };
+    std::atomic<uint64_t> skippedFrames{ 0 };          // asked for compression, sent raw
+    std::atomic<uint64_t> compressNanos{ 0 };
+    std::atomic<uint64_t> decompressNanos{ 0 };
+};
+
+// per connection message counts, each field written by one thread (sender or receiver)
+struct ConnectionStats {
+    std::atomic<uint64_t> msgsSent{ 0 };
+    std::atomic<uint64_t> bytesSent{ 0 };
+    std::atomic<uint64_t> msgsReceived{ 0 };
+    std::atomic<uint64_t> bytesReceived{ 0 };
+    std::atomic<uint64_t> sendFailures{ 0 };
+};
+
 struct ConnectionContext {
     std::thread senderThread;
     std::thread receiverThread;
@@ -22,18 +59,64 @@ struct ConnectionContext {
     uint16_t srcPort{ 0 };
     uint16_t destPort{ 0 };
 
-    SOCKET sock = INVALID_SOCKET;
+    transport::Handle sock = transport::NONE;
     bool isTCP{false};
     bool isClient{false};
+    bool isGroup{false};                       // UDP socket joined to a multicast group
 
     std::atomic<bool> running{ true };
-    WSAEVENT interruptEvent = nullptr;
-    WSAEVENT connectEvent = nullptr;
+    std::atomic<bool> connecting{ false };     // TCP connecting side until the connect is done
+    std::mutex connectMutex;                   // the receiver thread waits on connectCV meanwhile
+    std::condition_variable connectCV;
 
 
     std::vector<MessageBlock*> outgoingQueue;
     std::mutex outgoingMutex;
     std::condition_variable outgoingCV;
+
+    // wire framing, see WireFraming.h
+    std::atomic<bool> peerSpeaksV2{ false };   // peer sent WIRE_HELLO
+    bool listedV2{ false };                    // receiver thread: counted in NetworkBase::v2Peers
+    uint64_t rxStamp{ 0 };                     // receiver thread: wall ns the last data read came in
+    bool sendingV2{ false };                   // sender thread already sent WIRE_SWITCH
+    wire::TypeDictionary txTypes;
+    wire::TypeDictionary rxTypes;
+
+    // compression, see Compression.h
+    std::atomic<bool> peerReadsLz4{ false };   // peer sent WIRE_CAP_LZ4
+    uint8_t compressBackoff[256]{};            // sender thread: messages of a type still sent raw
+    std::vector<uint8_t> compressBuf;          // sender thread
+    CompressionStats compression;
+
+    ConnectionStats stats;
+
+    // liveness, see NetworkBase::setLiveness
+    std::atomic<uint64_t> lastReceived{ 0 };   // metrics::now() of the last message from the peer
+    std::atomic<uint64_t> lastTraffic{ 0 };    // same, either direction, not counting PING / PONG
+    std::atomic<bool> answersPing{ false };
+    std::atomic<bool> peerDead{ false };
+    uint64_t idleReportedAt{ 0 };              // timer thread only
+    TimerWheel::TimerId connectTimer{ 0 };     // these three under NetworkBase::timerMutex
+    TimerWheel::TimerId heartbeatTimer{ 0 };
+    TimerWheel::TimerId livenessTimer{ 0 };
+
+    // same-host shared memory, see LocalLink.h
+    std::unique_ptr<locallink::Link> localLink;         // set / dropped under outgoingMutex
+    bool localSending{ false };                        // sender thread: our SHM_SWITCH went out
+    bool localReading{ false };                        // receiver thread: the peer's SHM_SWITCH came in
+
+    // in-process loopback, see NetworkBase::loopSend
+    bool loopback{ false };
+    ConnectionContext* loopPeer{ nullptr };            // under NetworkBase::loopMutex
+
+    // UDP: further sockets on srcPort, one receiver thread each; see NetworkBase::setShards
+    std::vector<transport::Handle> shardSocks;
+    std::vector<std::thread> shardThreads;
+
+    // teardown, see NetworkBase::stopConnection; under NetworkBase::reapMutex
+    int threadsLeft{ 0 };                              // sender / receiver threads not returned yet
+    uint64_t stoppedAt{ 0 };                           // metrics::now() of stopConnection
+    bool parked{ false };                              // overdue: threads detached, freed once they return
 };
 
 class NetworkBase {
@@ -42,12 +125,225 @@ protected:
     std::mutex incomingMutex;
     std::condition_variable incomingCV;
 
-    void (*notifyNetworkEvent)(const char* text) = nullptr;
+    std::function<void(const char* text)> notifyNetworkEvent;
+
+    // sockets, or the simulator; see Transport.h
+    std::shared_ptr<transport::Transport> transport;
+
+    std::atomic<bool> wireV2Enabled{ true };
+    // by peerKey of a TCP server we dialed and whose connection said hello, how many such
+    // connections are up. The pages send a peer's datagrams to its server's port number, so
+    // that ip:port gets v2 UDP too, until the last of them ends (a peer restarted without v2,
+    // or another process on the same host, gets v1).
+    std::map<uint64_t, uint32_t> v2Peers;
+    std::mutex v2PeerMutex;
+
+    std::atomic<bool> compressionEnabled{ true };
+    std::atomic<uint8_t> compressionMethods[256]{};     // compression::Method per message type
+    std::atomic<uint32_t> compressionThreshold{ 256 };
+
+    std::map<uint64_t, PeerClock> peerClocks;           // by peerKey(ip, port), see PeerClock.h
+    std::mutex peerClockMutex;
+
+    // one wheel with 1 ms ticks for every connection's heartbeat and timeouts, driven by
+    // timerThread; callbacks run on it with timerMutex held
+    TimerWheel timers{ transport->now() / 1000000 };
+    std::recursive_mutex timerMutex;
+    std::condition_variable_any timerCV;
+    std::thread timerThread;
+    bool timersRunning{ false };                        // under timerMutex
+
+    std::atomic<uint32_t> heartbeatMs{ 2000 };
+    std::atomic<uint32_t> deadAfterMs{ 6000 };
+    std::atomic<uint32_t> idleTimeoutMs{ 0 };
+    std::atomic<uint32_t> connectTimeoutMs{ 5000 };
+
+    std::atomic<bool> localLinkEnabled{ true };         // offer / accept shared memory to peers on this host
+    std::atomic<uint32_t> shards{ 1 };                  // sockets per listening / bound port, 0: one per core
+    admission::Gate admission;                          // see setAdmission
+
+    // control messages the owner handles natively (e.g. ROOM_LEASE), called on receiver
+    // threads; returning true consumes the message
+    std::function<bool(MessageBlock*)> nativeHandler;
+
+    // room multicast, see Multicast.h
+    ConnectionContext* groupCtx = nullptr;              // under groupMutex
+    mcast::Header groupSelf;                            // our ip, TCP port and epoch; under groupMutex
+    std::map<uint64_t, mcast::DedupWindow> groupSeen;   // by peerKey of the sender; under groupMutex
+    std::atomic<uint64_t> groupSeq{ 0 };
+    std::mutex groupMutex;
+    // receiver threads: a multicast from ip:port (TCP server) reached us
+    std::function<void(uint32_t ip, uint16_t port)> groupHeard;
+
+    // sender threads: a connect this side started to ip:port is up or has failed
+    std::function<void(uint32_t ip, uint16_t port, bool up)> connectFinished;
+
+    // every message sent and received while capturing, see Capture.h
+    capture::Recorder recorder;
+
+    // in-process loopback: messages sent on one context of a loopback pair, with their peer
+    // (under incomingMutex); the dispatcher runs the natives among them, see receiveLooped
+    std::deque<std::pair<ConnectionContext*, MessageBlock*>> loopQueue;
+    ConnectionContext* loopBusy = nullptr;              // under incomingMutex: receiveLooped is handling one for it
+    std::condition_variable loopIdle;
+    std::mutex loopMutex;                               // taken before incomingMutex
+
+    // connection teardown: stopConnection wakes a context's threads and queues it here, the
+    // reaper thread frees each once its threads have returned, see reaperLoop
+    static constexpr uint32_t TEARDOWN_DEADLINE_MS = 2000;
+    std::deque<ConnectionContext*> reapQueue;           // under reapMutex
+    std::mutex reapMutex;
+    std::condition_variable reapCV;
+    std::thread reaperThread;                           // runs from construction to drainTeardowns
+    bool reaping{ true };                               // under reapMutex
 public:
-    void setNetworkNotifyCallback(void (*ecb)(const char* text)) {
+    // net: the network to run on, the platform's sockets if null
+    explicit NetworkBase(std::shared_ptr<transport::Transport> net = nullptr)
+        : transport(net ? std::move(net) : transport::platformDefault()) {
+        setCompression(0x81, compression::LZ4_JSON);    // TCP_JSON
+        setCompression(0x82, compression::LZ4);         // TCP_BINARY
+        for (uint8_t t = 0x8A; t <= 0x8E; ++t)          // CONNECT_REQUEST .. PEER_REMOVED
+            setCompression(t, compression::LZ4_JSON);
+        reaperThread = std::thread([this]() { reaperLoop(); });
+    }
+
+    ~NetworkBase() {
+        drainTeardowns();
+    }
+
+    void setNetworkNotifyCallback(std::function<void(const char* text)> ecb) {
         notifyNetworkEvent = ecb;
     }
 
+    // compact v2 framing for peers that support it (see WireFraming.h); affects connections
+    // set up afterwards, old peers always get v1
+    void setWireV2(bool enabled) {
+        wireV2Enabled = enabled;
+    }
+
+    // how payloads of a message type are compressed on v2 connections whose peer can read it;
+    // payloads under the threshold, and types that keep not compressing, are sent raw
+    void setCompression(uint8_t type, uint8_t method) {
+        compressionMethods[type] = method;
+    }
+
+    void setCompressionThreshold(uint32_t bytes) {
+        compressionThreshold = bytes;
+    }
+
+    void setCompressionEnabled(bool enabled) {
+        compressionEnabled = enabled;
+    }
+
+    // TCP connections to another LinkSphere on this host go over shared memory (LocalLink.h);
+    // applies to connections made after this, ones already on shared memory stay there
+    void setLocalLink(bool enabled) {
+        localLinkEnabled = enabled;
+    }
+
+    // TCP servers and UDP ports bound from now on get n sockets sharing the port, each with its
+    // own accept or receive thread kept on one core, and the OS hands a new connection or a
+    // datagram to the socket of the core that took it in; an accepted connection's threads stay
+    // on that core too. Connection setup and datagrams per second then grow with the cores
+    // instead of queueing on one thread. 1 (default): one socket; 0: one per core. Ephemeral
+    // UDP ports and multicast stay one socket, and so does everything where the transport
+    // cannot share ports (Windows, the simulator).
+    void setShards(uint32_t n) {
+        shards = n;
+    }
+
+    // Limits on what each peer may cost us, see Admission.h: a connection accepted over a
+    // source's maxConnsPerIP is reset at once, a message over a source's or a type's rate is
+    // dropped before a MessageBlock is made for it (TCP reads past it). Drops count in the
+    // admit_* metrics and are logged once per source every admission::REPORT_EVERY_MS.
+    // Shared memory and in-process loopback connections are not limited.
+    void setAdmission(const admission::Limits& limits) {
+        admission.setLimits(limits);
+    }
+
+    admission::Limits admissionLimits() {
+        return admission.limits();
+    }
+
+    // who holds connections or had messages dropped, most dropped first
+    std::vector<admission::SourceStats> admissionSources() {
+        return admission.sources();
+    }
+
+    // per TCP connection, in ms, 0 turns one off:
+    //   heartbeat  PING interval (also feeds getPeerClock)
+    //   deadAfter  a peer that answered PINGs before and has sent nothing for this long is
+    //              reported "peer-dead", and "peer-alive" when it is heard from again
+    //   idle       no traffic besides PING / PONG for this long is reported "idle-timeout"
+    //   connect    outgoing connects still pending after this fail with "createConn-failed"
+    // Changes apply from each connection's next timer.
+    void setLiveness(uint32_t heartbeat, uint32_t deadAfter, uint32_t idle, uint32_t connect) {
+        heartbeatMs = heartbeat;
+        deadAfterMs = deadAfter;
+        idleTimeoutMs = idle;
+        connectTimeoutMs = connect;
+    }
+
+    // appends every message sent or received from now on to a capture in dir, segments of
+    // segmentMB; reports "capture-started-<dir>" or an "error-"
+    void startCapture(const std::string& dir, uint32_t segmentMB) {
+        std::string error;
+        if (!recorder.start(dir, uint64_t(segmentMB ? segmentMB : capture::DEFAULT_SEGMENT >> 20) << 20, transport->now(), transport->wallNow(), error)) {
+            if (notifyNetworkEvent) notifyNetworkEvent(("error-Capture failed: " + error).c_str());
+            return;
+        }
+        if (notifyNetworkEvent) notifyNetworkEvent(("capture-started-" + dir).c_str());
+    }
+
+    // reports "capture-stopped-<records>-<dropped>", dropped being messages too large for a segment
+    void stopCapture() {
+        std::string error = recorder.error();
+        recorder.stop();
+        if (!notifyNetworkEvent) return;
+        if (!error.empty()) notifyNetworkEvent(("error-Capture failed: " + error).c_str());
+        notifyNetworkEvent(("capture-stopped-" + std::to_string(recorder.recorded()) + "-" + std::to_string(recorder.droppedRecords())).c_str());
+    }
+
+    // mb as if a receiver thread had just read it, for replaying a capture (linkSphereReplay):
+    // native control messages go to their handler, the rest to the dispatcher. Takes mb.
+    void inject(MessageBlock* mb) {
+        mb->setStamp(metrics::now());
+        if (nativeHandler && nativeHandler(mb)) {
+            delete mb;
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(incomingMutex);
+            incomingQueue.push_back(mb);
+        }
+        incomingCV.notify_one();
+    }
+
+    void setPingInterval(uint32_t ms) {
+        heartbeatMs = ms;
+    }
+
+    static uint64_t peerKey(uint32_t ip, uint16_t port) {
+        return (uint64_t(ip) << 16) | port;
+    }
+
+    // RTT / jitter / offset measured with native PINGs to ip:port, false if none came back yet
+    bool getPeerClock(uint32_t ip, uint16_t port, PeerClock& out) {
+        std::lock_guard<std::mutex> lock(peerClockMutex);
+        auto it = peerClocks.find(peerKey(ip, port));
+        if (it == peerClocks.end()) return false;
+        out = it->second;
+        return true;
+    }
+
+    // queues a PING to dstIP:dstPort on ctx; its PONG is consumed here, never reaches the page
+    void sendPing(ConnectionContext* ctx, uint32_t dstIP, uint16_t dstPort) {
+        MessageBlockBuilder ping(clockmsg::PING_SIZE);
+        ping.type(clockmsg::PING).src(ctx->srcIP, ctx->srcPort).dst(dstIP, dstPort);
+        ping.payload()[0] = clockmsg::VERSION;     // t1 is written by the sender thread
+        queueOn(ctx, ping.finish(clockmsg::PING_SIZE));
+    }
+
 
     void emitConnectionError(
         const char* proto, uint16_t srcPort,
@@ -60,49 +356,127 @@ public:
             std::string(proto) + "::" + std::to_string(srcPort) + "::" +
             std::to_string(destIP) + ":" + std::to_string(destPort) + "-" +
             errorEvent + "-" +
-            getOSErrorString(WSAGetLastError())
+            transport->lastError()
             ).c_str());
     }
 
 
     // --------------------------------------------------------------
-    // TCP CREATE + THREADS
+    // TIMERS
     // --------------------------------------------------------------
+    void startTimers() {
+        std::lock_guard<std::recursive_mutex> lock(timerMutex);
+        if (timersRunning) return;
+        timersRunning = true;
+        timerThread = std::thread([this]() { timerLoop(); });
+    }
 
-   // ---------------- TCP CREATION ----------------
-
-    ConnectionContext* createTCP(uint32_t destIP, uint16_t destPort) {
-        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (s == INVALID_SOCKET) {
-            emitConnectionError("tcp", 0, destIP, destPort, "createConn-failed");
-            return nullptr;
+    void stopTimers() {
+        {
+            std::lock_guard<std::recursive_mutex> lock(timerMutex);
+            timersRunning = false;
         }
+        timerCV.notify_all();
+        if (timerThread.joinable()) timerThread.join();
+    }
 
-        BOOL flag = TRUE;
-        if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag)) == SOCKET_ERROR) {
-            emitConnectionError("tcp", 0, destIP, destPort, "createConn-failed");
+    void timerLoop() {
+        std::unique_lock<std::recursive_mutex> lock(timerMutex);
+        while (timersRunning) {
+            timers.advance(transport->now() / 1000000);
+            uint64_t wait = timers.ticksUntilNext();
+            if (wait == ~uint64_t(0)) timerCV.wait(lock);
+            else timerCV.wait_for(lock, transport->realDelay(wait));
         }
+    }
 
-        u_long nonBlocking = 1;
-        if (ioctlsocket(s, FIONBIO, &nonBlocking) == SOCKET_ERROR) {
-            emitConnectionError("tcp", 0, destIP, destPort, "createConn-failed");
-            closesocket(s);
-            return nullptr;
+    TimerWheel::TimerId scheduleTimer(uint32_t ms, TimerWheel::Callback cb) {
+        TimerWheel::TimerId id;
+        {
+            std::lock_guard<std::recursive_mutex> lock(timerMutex);
+            timers.advance(transport->now() / 1000000);   // count from now, not from the last tick
+            id = timers.schedule(ms, std::move(cb));
         }
+        timerCV.notify_one();
+        return id;
+    }
 
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(destPort);
-        addr.sin_addr.s_addr = htonl(destIP);
+    void cancelTimer(TimerWheel::TimerId& id) {
+        std::lock_guard<std::recursive_mutex> lock(timerMutex);
+        timers.cancel(id);
+        id = 0;
+    }
+
+    // starts heartbeat and liveness checks once a TCP connection is up
+    void armLiveness(ConnectionContext* ctx) {
+        std::lock_guard<std::recursive_mutex> lock(timerMutex);
+        if (!ctx->running) return;
+        ctx->lastReceived = ctx->lastTraffic = transport->now();
+        ctx->heartbeatTimer = scheduleTimer(1, [this, ctx]() { heartbeat(ctx); });
+        ctx->livenessTimer = scheduleTimer(1, [this, ctx]() { checkLiveness(ctx); });
+    }
+
+    // after this no timer callback runs for ctx, so it can be deleted
+    void disarmTimers(ConnectionContext* ctx) {
+        std::lock_guard<std::recursive_mutex> lock(timerMutex);
+        cancelTimer(ctx->connectTimer);
+        cancelTimer(ctx->heartbeatTimer);
+        cancelTimer(ctx->livenessTimer);
+    }
+
+    void heartbeat(ConnectionContext* ctx) {
+        uint32_t ms = heartbeatMs;
+        if (ms && ctx->running) sendPing(ctx, ctx->destIP, ctx->destPort);
+        ctx->heartbeatTimer = scheduleTimer(ms ? ms : 1000, [this, ctx]() { heartbeat(ctx); });
+    }
+
+    // runs again when the earliest timeout could expire, so a silent peer is reported within
+    // a tick of its deadline
+    void checkLiveness(ConnectionContext* ctx) {
+        uint64_t now = transport->now();
+        uint64_t next = 1000;
+
+        uint64_t dead = deadAfterMs;
+        if (dead && ctx->answersPing && !ctx->peerDead) {
+            uint64_t silent = (now - ctx->lastReceived) / 1000000;
+            if (silent >= dead) {
+                ctx->peerDead = true;
+                emitConnectionEvent(ctx, "peer-dead");
+            }
+            else next = std::min(next, dead - silent);
+        }
 
-        int r = connect(s, (sockaddr*)&addr, sizeof(addr));
-        if (r == SOCKET_ERROR) {
-            int err = WSAGetLastError();
-            if (err != WSAEWOULDBLOCK && err != WSAEINPROGRESS) {
-                emitConnectionError("tcp", 0, destIP, destPort, "createConn-failed");
-                closesocket(s);
-                return nullptr;
+        uint64_t idle = idleTimeoutMs;
+        uint64_t last = ctx->lastTraffic;
+        if (idle && last != ctx->idleReportedAt) {
+            uint64_t quiet = (now - last) / 1000000;
+            if (quiet >= idle) {
+                ctx->idleReportedAt = last;         // once per quiet period
+                emitConnectionEvent(ctx, "idle-timeout");
             }
+            else next = std::min(next, idle - quiet);
+        }
+
+        ctx->livenessTimer = scheduleTimer((uint32_t)std::max<uint64_t>(next, 1), [this, ctx]() { checkLiveness(ctx); });
+    }
+
+    void emitConnectionEvent(ConnectionContext* ctx, const char* event) {
+        if (!notifyNetworkEvent) return;
+        notifyNetworkEvent((std::string(ctx->isTCP ? "tcp" : "udp") + "::" + std::to_string(ctx->srcPort) + "::" +
+            std::to_string(ctx->destIP) + ":" + std::to_string(ctx->destPort) + "-" + event).c_str());
+    }
+
+    // --------------------------------------------------------------
+    // TCP CREATE + THREADS
+    // --------------------------------------------------------------
+
+   // ---------------- TCP CREATION ----------------
+
+    ConnectionContext* createTCP(uint32_t destIP, uint16_t destPort) {
+        transport::Handle s = transport->connect(destIP, destPort);
+        if (s == transport::NONE) {
+            emitConnectionError("tcp", 0, destIP, destPort, "createConn-failed");
+            return nullptr;
         }
 
         ConnectionContext* ctx = new ConnectionContext();
@@ -112,29 +486,27 @@ public:
         ctx->isTCP = true;
         ctx->isClient = true;
         ctx->running = true;
+        ctx->connecting = true;
 
-        ctx->connectEvent = WSACreateEvent();
-        ctx->interruptEvent = WSACreateEvent();
-
-        if (!ctx->connectEvent || !ctx->interruptEvent ||
-            WSAEventSelect(s, ctx->connectEvent, FD_CONNECT | FD_CLOSE) == SOCKET_ERROR) {
-
-            emitConnectionError("tcp", 0, destIP, destPort, "createConn-failed");
-            closesocket(s);
-            delete ctx;
-            return nullptr;
-        }
-
-        ctx->senderThread = std::thread([this, ctx]() {
+        ctx->senderThread = connectionThread(ctx, [this, ctx]() {
             if (!waitTillConnectOrInterrupt(ctx)) return;
             tcpSender(ctx);
             });
 
-        ctx->receiverThread = std::thread([this, ctx]() {
+        ctx->receiverThread = connectionThread(ctx, [this, ctx]() {
             if (!waitUntilConnected(ctx)) return;
             tcpReceiver(ctx);
+            unlistV2Peer(ctx);
             });
 
+        if (uint32_t ms = connectTimeoutMs) {
+            std::lock_guard<std::recursive_mutex> lock(timerMutex);
+            ctx->connectTimer = scheduleTimer(ms, [this, ctx]() {       // wakes the connect wait, which then fails
+                ctx->connectTimer = 0;
+                transport->interrupt(ctx->sock);
+                });
+        }
+
         return ctx;
     }
 
@@ -142,32 +514,15 @@ public:
     // ---------------- CONNECT WAIT ----------------
 
     bool waitTillConnectOrInterrupt(ConnectionContext* ctx) {
-        WSAEVENT events[2] = {
-            ctx->connectEvent,
-            ctx->interruptEvent
-        };
-
-        DWORD w = WSAWaitForMultipleEvents(2, events, FALSE, INFINITE, FALSE);
-        if (w != WSA_WAIT_EVENT_0) {
+        if (!transport->waitConnected(ctx->sock)) {
             emitConnectionError("tcp", 0, ctx->destIP, ctx->destPort, "createConn-failed");
             ctx->running = false;
-            WSASetEvent(ctx->interruptEvent);
+            if (connectFinished) connectFinished(ctx->destIP, ctx->destPort, false);
+            connectDone(ctx);
             return false;
         }
 
-        WSANETWORKEVENTS ne{};
-        if (WSAEnumNetworkEvents(ctx->sock, ctx->connectEvent, &ne) == SOCKET_ERROR ||
-            ne.iErrorCode[FD_CONNECT_BIT] != 0) {
-
-            emitConnectionError("tcp", 0, ctx->destIP, ctx->destPort, "createConn-failed");
-            ctx->running = false;
-            WSASetEvent(ctx->interruptEvent);
-            return false;
-        }
-
-        WSAEventSelect(ctx->sock, NULL, 0);
-        u_long blocking = 0;
-        ioctlsocket(ctx->sock, FIONBIO, &blocking);
+        cancelTimer(ctx->connectTimer);
 
         // SUCCESS EVENT
         if (notifyNetworkEvent) {
@@ -178,47 +533,40 @@ public:
                 "-createConn-success"
                 ).c_str());
         }
-        WSASetEvent(ctx->interruptEvent);
-        WSACloseEvent(ctx->connectEvent);
-        ctx->connectEvent = NULL;
-        ctx->running = true;
-        return true;
+        if (connectFinished) connectFinished(ctx->destIP, ctx->destPort, true);
+        connectDone(ctx);
+        return ctx->running;
     }
 
 
     bool waitUntilConnected(ConnectionContext* ctx) {
-        WaitForSingleObject(ctx->interruptEvent, WSA_INFINITE);
+        std::unique_lock<std::mutex> lock(ctx->connectMutex);
+        ctx->connectCV.wait(lock, [ctx]() { return !ctx->connecting; });
         return ctx->running;
     }
 
+    // the connect finished, failed or was given up on: the receiver thread stops waiting
+    void connectDone(ConnectionContext* ctx) {
+        {
+            std::lock_guard<std::mutex> lock(ctx->connectMutex);
+            ctx->connecting = false;
+        }
+        ctx->connectCV.notify_all();
+    }
+
 
     // --------------------------------------------------------------
     // UDP CREATE + THREADS
     // --------------------------------------------------------------
     ConnectionContext* createUDP(uint16_t srcPort)
     {
-        SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-        if (s == INVALID_SOCKET) {
+        std::vector<transport::Handle> socks = openShards(srcPort, false);
+        transport::Handle s = socks.empty() ? transport->bindUDP(srcPort) : socks[0];
+        if (s == transport::NONE) {
             emitConnectionError("udp", srcPort, 0, 0, "createConn-failed");
             return nullptr;
         }
 
-        int opt = 1;
-        if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt)) == SOCKET_ERROR) {
-            emitConnectionError("udp", srcPort, 0, 0, "createConn-failed");
-        }
-
-        sockaddr_in srcAddr{};
-        srcAddr.sin_family = AF_INET;
-        srcAddr.sin_port = htons(srcPort);
-        srcAddr.sin_addr.s_addr = INADDR_ANY;
-
-        if (bind(s, (sockaddr*)&srcAddr, sizeof(srcAddr)) == SOCKET_ERROR) {
-            emitConnectionError("udp", srcPort, 0, 0, "createConn-failed");
-            closesocket(s);
-            return nullptr;
-        }
-
         ConnectionContext* ctx = new ConnectionContext();
         ctx->sock = s;
         ctx->srcPort = srcPort;
@@ -234,12 +582,112 @@ public:
                 ).c_str());
         }
 
-        ctx->senderThread = std::thread([this, ctx]() { udpSender(ctx); });
-        ctx->receiverThread = std::thread([this, ctx]() { udpReceiver(ctx); });
+        ctx->senderThread = connectionThread(ctx, [this, ctx]() { udpSender(ctx); });
+        if (socks.size() < 2) {
+            ctx->receiverThread = connectionThread(ctx, [this, ctx, s]() { udpReceiver(ctx, s); });
+            return ctx;
+        }
+        ctx->shardSocks.assign(socks.begin() + 1, socks.end());
+        for (uint32_t i = 0; i < socks.size(); ++i) {
+            std::thread t = connectionThread(ctx, [this, ctx, i, h = socks[i]]() {
+                transport->pinThread(i);
+                udpReceiver(ctx, h);
+                });
+            if (i == 0) ctx->receiverThread = std::move(t);
+            else ctx->shardThreads.push_back(std::move(t));
+        }
 
         return ctx;
     }
 
+    // --------------------------------------------------------------
+    // MULTICAST GROUP
+    // --------------------------------------------------------------
+    // who we are in envelopes we send; a new epoch, so receivers drop their old windows for us
+    void setGroupSelf(uint32_t selfIP, uint16_t selfPort) {
+        std::lock_guard<std::mutex> lock(groupMutex);
+        groupSelf.ip = selfIP;
+        groupSelf.port = selfPort;
+        groupSelf.epoch = (uint32_t)(clockmsg::wallNow() / 1000) ^ (uint32_t)(uintptr_t)this;
+        groupSeen.clear();
+    }
+
+    // joins group:port on the interface with address ifaceIP (host order, 0 for the default);
+    // replaces the group joined before
+    bool joinGroup(uint32_t group, uint16_t port, uint32_t ifaceIP) {
+        leaveGroup();
+
+        transport::Handle s = transport->joinGroup(group, port, ifaceIP);
+        if (s == transport::NONE) {
+            emitConnectionError("mcast", port, group, port, "join-failed");
+            return false;
+        }
+
+        ConnectionContext* ctx = new ConnectionContext();
+        ctx->sock = s;
+        ctx->srcIP = ifaceIP;
+        ctx->srcPort = port;
+        ctx->destIP = group;
+        ctx->destPort = port;
+        ctx->isGroup = true;
+        ctx->senderThread = connectionThread(ctx, [this, ctx]() { udpSender(ctx); });
+        ctx->receiverThread = connectionThread(ctx, [this, ctx, s]() { udpReceiver(ctx, s); });
+        {
+            std::lock_guard<std::mutex> lock(groupMutex);
+            groupCtx = ctx;
+        }
+        if (notifyNetworkEvent)
+            notifyNetworkEvent(("mcast::" + std::to_string(port) + "::" + std::to_string(group) + ":" + std::to_string(port) + "-join-success").c_str());
+        return true;
+    }
+
+    // closes the socket first: with several members of a room on one host the port is shared,
+    // so the loopback wakeup stopConnection uses could reach another member's socket
+    void leaveGroup() {
+        ConnectionContext* ctx = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(groupMutex);
+            std::swap(ctx, groupCtx);
+        }
+        if (!ctx) return;
+
+        ctx->running = false;
+        ctx->outgoingCV.notify_all();
+        transport->close(ctx->sock);
+        if (ctx->senderThread.joinable()) ctx->senderThread.join();
+        if (ctx->receiverThread.joinable()) ctx->receiverThread.join();
+        for (auto msg : ctx->outgoingQueue) delete msg;
+        delete ctx;
+    }
+
+    // envelope for msg with the next sequence number, empty before setGroupSelf
+    std::vector<uint8_t> wrapForGroup(const MessageBlock* msg) {
+        mcast::Header h;
+        {
+            std::lock_guard<std::mutex> lock(groupMutex);
+            h = groupSelf;
+        }
+        if (!h.port) return {};
+        h.seq = ++groupSeq;
+        h.type = msg->getType();
+        std::vector<uint8_t> out(mcast::HEADER_SIZE + msg->getPayloadSize());
+        mcast::encodeHeader(out.data(), h);
+        std::memcpy(out.data() + mcast::HEADER_SIZE, msg->getPayload(), msg->getPayloadSize());
+        return out;
+    }
+
+    // one datagram to the group; false if no group is joined or the envelope is too large
+    bool multicast(const std::vector<uint8_t>& envelope) {
+        if (envelope.size() > mcast::MAX_DATAGRAM) return false;
+        std::lock_guard<std::mutex> lock(groupMutex);
+        if (!groupCtx || !groupCtx->running) return false;
+        MessageBlock* msg = MessageBlockBuilder((uint32_t)envelope.size()).type(mcast::MCAST_DATA)
+            .dst(groupCtx->destIP, groupCtx->destPort).append(envelope.data(), (uint32_t)envelope.size()).finish();
+        queueOn(groupCtx, msg);
+        metrics::add(metrics::MCAST_SENT);
+        return true;
+    }
+
 
 
 protected:
@@ -249,23 +697,17 @@ protected:
             " Dest: " + std::to_string(ctx->destIP) + ":" + std::to_string(ctx->destPort);
     }*/
 
-    std::string getOSErrorString(int code) {
-        char* errMsg = nullptr;
-        FormatMessageA(
-            FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-            nullptr, code,
-            MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-            (LPSTR)&errMsg, 0, nullptr
-        );
-        std::string msg = errMsg ? errMsg : "Unknown OS error";
-        if (errMsg) LocalFree(errMsg);
-        return msg;
-    }
-
     // --------------------------------------------------------------
     // TCP SENDER
     // --------------------------------------------------------------
     void tcpSender(ConnectionContext* ctx) {
+        armLiveness(ctx);
+        if (wireV2Enabled) {
+            uint8_t hello[8] = { 0, 0, 0, (uint8_t)wire::WIRE_HELLO, 0, 0, 0, (uint8_t)wire::WIRE_CAP_LZ4 };
+            if (!tcpSendAll(ctx, hello, compressionEnabled ? 8 : 4, nullptr, 0)) return;
+        }
+        if (ctx->isClient) offerLocalLink(ctx);
+
         while (ctx->running) {
             MessageBlock* msg = nullptr;
             {
@@ -283,33 +725,313 @@ protected:
             }
 
             if (!msg) continue;
+            metrics::recordSince(metrics::SEND_QUEUE_WAIT_NS, msg->getStamp());
+            uint64_t writeStart = metrics::now();
+            uint64_t wireBytes = 0;
+
+            if (!ctx->localSending && !ctx->sendingV2 && ctx->peerSpeaksV2) {
+                uint8_t sw[4] = { 0, 0, 0, (uint8_t)wire::WIRE_SWITCH };
+                ctx->sendingV2 = true;
+                if (!tcpSendAll(ctx, sw, 4, nullptr, 0)) {
+                    countSendFailure(ctx);
+                    delete msg;
+                    continue;
+                }
+            }
 
-            const char* ptr = reinterpret_cast<const char*>(msg->getNetMsg());
-            int toSend = (int)msg->getNetMsgSize();
             bool failed = false;
-
-            while (toSend > 0 && ctx->running) {
-                int s = send(ctx->sock, ptr, toSend, 0);
-                if (s == SOCKET_ERROR) {
-                    emitConnectionError( "tcp",ctx->srcPort,ctx->destIP,ctx->destPort,"send-failed");
-                    ctx->running = false;
-                    failed = true;
-                    break;
+            stampClockMessage(msg);
+            if (ctx->localSending) {
+                failed = !localSend(ctx, msg);
+                wireBytes = msg->getTotalSize();
+            }
+            else if (ctx->sendingV2) {
+                const uint8_t* body = msg->getPayload();
+                uint32_t bodyLen = msg->getPayloadSize();
+                bool compressed = tryCompress(ctx, msg);
+                if (compressed) {
+                    body = ctx->compressBuf.data();
+                    bodyLen = (uint32_t)ctx->compressBuf.size();
                 }
-                ptr += s;
-                toSend -= s;
+                uint8_t hdr[wire::MAX_V2_HEADER];
+                size_t h = wire::encodeV2Header(hdr, msg->getType(), bodyLen, ctx->txTypes, compressed, msg->getTraceId());
+                failed = !tcpSendAll(ctx, hdr, (uint32_t)h, body, bodyLen);
+                wireBytes = h + bodyLen;
+            }
+            else {
+                failed = !tcpSendAll(ctx, msg->getNetMsg(), msg->getNetMsgSize(), nullptr, 0);
+                wireBytes = msg->getNetMsgSize();
             }
 
             if (!failed && ctx->running) {
+                metrics::recordSince(metrics::SEND_WRITE_NS, writeStart);
+                countSent(ctx, msg, wireBytes);
                 if (notifyNetworkEvent) {
                     //notifyNetworkEvent((std::string("tcp::"+to_string(ctx->srcPort) + "::") + std::to_string(ctx->destIP) + ":" + std::to_string(ctx->destPort) + "-send-success").c_str());
                 }
             }
+            else if (failed) countSendFailure(ctx);
 
+            if (!failed && locallink::isSwitchOn(msg->getType(), msg->getPayload(), msg->getPayloadSize()))
+                ctx->localSending = true;       // that was the last write to the socket
             delete msg;
         }
     }
 
+    // bookkeeping for one message put on / taken off the wire
+    void countSent(ConnectionContext* ctx, MessageBlock* msg, uint64_t bytes) {
+        tracing::point(tracing::WIRE_SEND, msg->getTraceId());
+        metrics::add(ctx->isTCP ? metrics::TCP_MSGS_SENT : metrics::UDP_MSGS_SENT);
+        metrics::add(ctx->isTCP ? metrics::TCP_BYTES_SENT : metrics::UDP_BYTES_SENT, bytes);
+        metrics::countType(metrics::SENT, msg->getType(), bytes);
+        ctx->stats.msgsSent++;
+        ctx->stats.bytesSent += bytes;
+        if (msg->getType() != clockmsg::PING && msg->getType() != clockmsg::PONG) ctx->lastTraffic = transport->now();
+        if (recorder.running()) captureMessage(capture::OUT, ctx, msg);
+    }
+
+    // our end is ctx's; the other is ctx's peer over TCP, else the datagram's sender or destination
+    void captureMessage(capture::Direction direction, ConnectionContext* ctx, MessageBlock* mb) {
+        bool in = direction == capture::IN;
+        uint32_t remoteIP = ctx->isTCP ? ctx->destIP : in ? mb->getSrcIP() : mb->getDstIP();
+        uint16_t remotePort = ctx->isTCP ? ctx->destPort : in ? mb->getSrcPort() : mb->getDstPort();
+        recorder.record(direction, ctx->isTCP, ctx->srcIP, ctx->srcPort, remoteIP, remotePort,
+            mb->getRawData(), mb->getTotalSize(), transport->now(), transport->wallNow());
+    }
+
+    void countSendFailure(ConnectionContext* ctx) {
+        metrics::add(metrics::SEND_FAILURES);
+        ctx->stats.sendFailures++;
+    }
+
+    // traceId: carried by the frame, 0 if it had none (the message may get sampled here)
+    void countReceived(ConnectionContext* ctx, MessageBlock* mb, uint64_t bytes, uint64_t traceId = 0) {
+        if (!traceId) traceId = tracing::sample();
+        mb->setTraceId(traceId);
+        tracing::point(tracing::WIRE_RECEIVE, traceId);
+        metrics::add(ctx->isTCP ? metrics::TCP_MSGS_RECEIVED : metrics::UDP_MSGS_RECEIVED);
+        metrics::add(ctx->isTCP ? metrics::TCP_BYTES_RECEIVED : metrics::UDP_BYTES_RECEIVED, bytes);
+        metrics::countType(metrics::RECEIVED, mb->getType(), bytes);
+        ctx->stats.msgsReceived++;
+        ctx->stats.bytesReceived += bytes;
+        mb->setStamp(metrics::now());       // dispatch wait starts here
+        uint64_t now = transport->now();
+        ctx->lastReceived = now;
+        if (mb->getType() != clockmsg::PING && mb->getType() != clockmsg::PONG) ctx->lastTraffic = now;
+        if (ctx->peerDead.load(std::memory_order_relaxed) && ctx->peerDead.exchange(false))
+            emitConnectionEvent(ctx, "peer-alive");
+        if (recorder.running()) captureMessage(capture::IN, ctx, mb);
+    }
+
+    void queueOn(ConnectionContext* ctx, MessageBlock* msg) {
+        if (ctx->loopback) return loopSend(ctx, msg);
+        msg->setStamp(metrics::now());
+        {
+            std::lock_guard<std::mutex> lock(ctx->outgoingMutex);
+            ctx->outgoingQueue.push_back(msg);
+        }
+        ctx->outgoingCV.notify_one();
+    }
+
+    // sender thread, right before the write: the send time of a PING (t1) or PONG (t3)
+    void stampClockMessage(MessageBlock* msg) {
+        uint8_t* p = msg->getPayloadWritePtr();
+        if (clockmsg::isPing(msg->getType(), p, msg->getPayloadSize())) clockmsg::put64(p + 1, transport->wallNow());
+        else if (clockmsg::isPong(msg->getType(), p, msg->getPayloadSize())) clockmsg::put64(p + 17, transport->wallNow());
+    }
+
+    // messages answered natively instead of being handed to the page
+    bool consumeNative(ConnectionContext* ctx, MessageBlock* mb, uint64_t rxTime) {
+        if (ctx->isTCP && handleLocalLink(ctx, mb)) return true;
+        if (unwrapGroupMessage(ctx, mb)) return true;
+        if (handleClockMessage(ctx, mb, rxTime)) return true;
+        if (nativeHandler && nativeHandler(mb)) {
+            delete mb;
+            return true;
+        }
+        return false;
+    }
+
+    // receiver thread: an envelope from the group or its unicast copy becomes the message it
+    // carries, from the sender's TCP server address, unless the other copy came first. Anything
+    // else arriving on the group socket is dropped. Returns true if mb was consumed.
+    bool unwrapGroupMessage(ConnectionContext* ctx, MessageBlock* mb) {
+        uint8_t type = mb->getType();
+        bool envelope = type == (ctx->isGroup ? mcast::MCAST_DATA : mcast::MCAST_UNICAST);
+        if (!envelope && !ctx->isGroup) return false;
+
+        mcast::Header h;
+        if (!envelope || !mcast::decodeHeader(mb->getPayload(), mb->getPayloadSize(), h)) {
+            metrics::add(metrics::RECV_DROPS);
+            delete mb;
+            return true;
+        }
+
+        bool fresh = false;
+        {
+            std::lock_guard<std::mutex> lock(groupMutex);
+            if (h.ip == groupSelf.ip && h.port == groupSelf.port) {     // our own, looped back
+                delete mb;
+                return true;
+            }
+            fresh = groupSeen[peerKey(h.ip, h.port)].accept(h.epoch, h.seq);
+        }
+        if (ctx->isGroup && groupHeard) groupHeard(h.ip, h.port);
+        if (!fresh) {
+            metrics::add(metrics::MCAST_DUPLICATES);
+            delete mb;
+            return true;
+        }
+
+        uint32_t size = mb->getPayloadSize() - mcast::HEADER_SIZE;
+        MessageBlock* inner = MessageBlockBuilder(size).type(h.type).src(h.ip, h.port).dst(mb->getDstIP(), mb->getDstPort())
+            .append(mb->getPayload() + mcast::HEADER_SIZE, size).finish();
+        inner->setTraceId(mb->getTraceId());
+        inner->setStamp(mb->getStamp());
+        delete mb;
+        {
+            std::lock_guard<std::mutex> lock(incomingMutex);
+            incomingQueue.push_back(inner);
+        }
+        incomingCV.notify_one();
+        return true;
+    }
+
+    // receiver thread: answers a PING and folds a PONG into the peer's estimates, both without
+    // going through the dispatcher. rxTime is when the message came in (Transport::recvStamped).
+    // Returns true if mb was consumed (and deleted).
+    bool handleClockMessage(ConnectionContext* ctx, MessageBlock* mb, uint64_t rxTime) {
+        const uint8_t* p = mb->getPayload();
+        uint32_t size = mb->getPayloadSize();
+
+        if (clockmsg::isPing(mb->getType(), p, size)) {
+            MessageBlockBuilder pong(clockmsg::PONG_SIZE);
+            pong.type(clockmsg::PONG).src(mb->getDstIP(), mb->getDstPort()).dst(mb->getSrcIP(), mb->getSrcPort());
+            uint8_t* q = pong.payload();
+            q[0] = clockmsg::VERSION;
+            std::memcpy(q + 1, p + 1, 8);                   // t1
+            clockmsg::put64(q + 9, rxTime);                 // t2, t3 is written by the sender thread
+            clockmsg::put64(q + 17, 0);
+            queueOn(ctx, pong.finish(clockmsg::PONG_SIZE));
+            delete mb;
+            return true;
+        }
+
+        if (clockmsg::isPong(mb->getType(), p, size)) {
+            int64_t t1 = (int64_t)clockmsg::get64(p + 1);
+            int64_t t2 = (int64_t)clockmsg::get64(p + 9);
+            int64_t t3 = (int64_t)clockmsg::get64(p + 17);
+            int64_t t4 = (int64_t)rxTime;
+            ctx->answersPing = true;
+            int64_t rtt = (t4 - t1) - (t3 - t2);
+            int64_t offset = ((t2 - t1) + (t3 - t4)) / 2;
+
+            uint32_t ip = mb->getSrcIP();
+            uint16_t port = mb->getSrcPort();
+            delete mb;
+            if (rtt < 0 || rtt > 60'000'000'000LL || t3 < t2) return true;     // not ours, or a clock jumped
+
+            PeerClock c;
+            bool report;
+            {
+                std::lock_guard<std::mutex> lock(peerClockMutex);
+                PeerClock& pc = peerClocks[peerKey(ip, port)];
+                pc.update(rtt, offset);
+                report = pc.takeReport();
+                c = pc;
+            }
+            if (report && notifyNetworkEvent) {
+                char text[160];
+                snprintf(text, sizeof(text), "peerClock-%u:%u-%lld-%lld-%lld", ip, port,
+                    (long long)(c.srtt / 1000), (long long)(c.jitter / 1000), (long long)(c.offset / 1000));
+                notifyNetworkEvent(text);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // compresses msg's payload into ctx->compressBuf when its type asks for it and it pays off;
+    // the compressor is capped at 7/8 of the input, so incompressible data (encoded media)
+    // fails fast, and that type is then sent raw for a while
+    bool tryCompress(ConnectionContext* ctx, MessageBlock* msg) {
+        uint8_t type = msg->getType();
+        uint8_t method = compressionMethods[type];
+        uint32_t size = msg->getPayloadSize();
+        if (method == compression::NONE || !compressionEnabled || !ctx->peerReadsLz4 || size < compressionThreshold)
+            return false;
+        if (ctx->compressBackoff[type]) {
+            --ctx->compressBackoff[type];
+            ctx->compression.skippedFrames++;
+            return false;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        size_t dictLen = 0;
+        const uint8_t* dict = compression::dictionaryFor(method, dictLen);
+        const uint8_t* src = msg->getPayload();
+        std::vector<uint8_t>& buf = ctx->compressBuf;
+        size_t n = 0;
+
+        const size_t probe = 4096;
+        bool worthIt = true;
+        if (size > 16 * probe) {            // big payload: try a sample before spending time on all of it
+            buf.resize(probe);
+            worthIt = compression::compress(src, probe, buf.data(), probe - probe / 8, dict, dictLen) != 0;
+        }
+        if (worthIt) {
+            buf.resize(1 + wire::MAX_VARINT + size);
+            buf[0] = method;
+            size_t h = 1 + wire::putVarint(buf.data() + 1, size);
+            size_t cap = size - size / 8;
+            n = cap > h ? compression::compress(src, size, buf.data() + h, cap - h, dict, dictLen) : 0;
+            if (n) buf.resize(h + n);
+        }
+        ctx->compression.compressNanos += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+        if (!n) {
+            ctx->compressBackoff[type] = 16;
+            ctx->compression.skippedFrames++;
+            return false;
+        }
+        ctx->compression.rawBytes += size;
+        ctx->compression.wireBytes += buf.size();
+        ctx->compression.compressedFrames++;
+        return true;
+    }
+
+    // sends head then body (may be empty) as one gathered write, so a small frame header
+    // never ends up in a packet of its own
+    bool tcpSendAll(ConnectionContext* ctx, const uint8_t* head, uint32_t headLen, const uint8_t* body, uint32_t bodyLen) {
+        transport::Buffer bufs[2] = {
+            { head, headLen },
+            { body, bodyLen }
+        };
+        int count = bodyLen ? 2 : 1;
+        transport::Buffer* next = bufs;
+
+        while (count > 0 && ctx->running) {
+            int r = transport->send(ctx->sock, next, count);
+            if (r < 0) {
+                emitConnectionError("tcp", ctx->srcPort, ctx->destIP, ctx->destPort, "send-failed");
+                ctx->running = false;
+                return false;
+            }
+            uint32_t sent = (uint32_t)r;
+            while (count > 0 && sent >= next->len) {    // drop fully sent buffers, trim a partial one
+                sent -= next->len;
+                ++next;
+                --count;
+            }
+            if (count > 0) {
+                next->data += sent;
+                next->len -= sent;
+            }
+        }
+        return count == 0;
+    }
+
     // --------------------------------------------------------------
     // TCP RECEIVER
     // --------------------------------------------------------------
@@ -319,15 +1041,15 @@ protected:
             int received = 0;
             while (received < 4 && ctx->running) {
 
-                int r = recv(ctx->sock, (char*)sizeBuffer + received, 4 - received, 0);
+                int r = transport->recvStamped(ctx->sock, sizeBuffer + received, 4 - received, ctx->rxStamp);
                 if (r < 0) {
                     emitConnectionError("tcp", ctx->srcPort, ctx->destIP, ctx->destPort, "recv-failed");
                     ctx->running = false;
                     return;
                 }
                 if (r == 0) {
-                    notifyNetworkEvent((std::string("tcp::"+std::to_string(ctx->srcPort) + "::") + std::to_string(ctx->destIP) + ":" + std::to_string(ctx->destPort) + "-socket-close").c_str());
-                    shutdown(ctx->sock, SD_BOTH);   //for other side to know i am done too
+                    if (notifyNetworkEvent) notifyNetworkEvent((std::string("tcp::"+std::to_string(ctx->srcPort) + "::") + std::to_string(ctx->destIP) + ":" + std::to_string(ctx->destPort) + "-socket-close").c_str());
+                    transport->shutdown(ctx->sock);   //for other side to know i am done too
                     ctx->running = false;
                     return;
                 }
@@ -335,18 +1057,47 @@ protected:
             }
 
             uint32_t totalSize = (sizeBuffer[0] << 24) | (sizeBuffer[1] << 16) | (sizeBuffer[2] << 8) | sizeBuffer[3];
+            if (totalSize == wire::WIRE_HELLO) {
+                if (wireV2Enabled) {
+                    ctx->peerSpeaksV2 = true;
+                    if (ctx->isClient && !ctx->listedV2) {
+                        std::lock_guard<std::mutex> lock(v2PeerMutex);
+                        v2Peers[peerKey(ctx->destIP, ctx->destPort)]++;
+                        ctx->listedV2 = true;
+                    }
+                }
+                continue;
+            }
+            if (totalSize == wire::WIRE_CAP_LZ4) {
+                ctx->peerReadsLz4 = true;
+                continue;
+            }
+            if (totalSize == wire::WIRE_SWITCH) {
+                tcpReceiverV2(ctx);
+                return;
+            }
             if (totalSize <17) continue;
 
+            // with traffic limits the type byte is read on its own, to decide before allocating
+            uint8_t type = 0;
+            bool typeRead = admission.limitsTraffic();
+            if (typeRead) {
+                int got = 0;
+                if (!tcpRecvSome(ctx, &type, 1, got)) return;
+                if (!admitted(ctx->destIP, type, totalSize - 12)) {
+                    if (!tcpSkip(ctx, totalSize - 12 - 5)) return;
+                    continue;
+                }
+            }
+
             MessageBlock* mb = new MessageBlock(totalSize);
-            mb->setDstPort(ctx->srcPort);                                       //this is the abstraction so sender need not to know which port they used to send but still receiver know where are they receiving
-            mb->setSrcPort(ctx->destPort);
-            mb->setSrcIP(ctx->destIP);
-            mb->setDstIP(ctx->srcIP);
+            stampReceived(ctx, mb);
             uint32_t netMsgSize = mb->getNetMsgSize();
             uint8_t* ptr = mb->getNetMsgWritePtr();
             received = 4;
-            while (received < netMsgSize && ctx->running) {
-                int r = recv(ctx->sock, (char*)ptr + received, netMsgSize - received, 0);
+            if (typeRead) ptr[received++] = type;
+            while ((uint32_t)received < netMsgSize && ctx->running) {
+                int r = transport->recvStamped(ctx->sock, ptr + received, netMsgSize - received, ctx->rxStamp);
                 if (r < 0) {
                     emitConnectionError("tcp", ctx->srcPort, ctx->destIP, ctx->destPort, "recv-failed");
                     ctx->running = false;
@@ -354,12 +1105,100 @@ protected:
                     return;
                 }
                 if (r == 0) {
-                    shutdown(ctx->sock, SD_BOTH);   //for other side to know i am done too
+                    transport->shutdown(ctx->sock);   //for other side to know i am done too
                     delete mb;
                     return;
                 }
                 received += r;
             }
+            uint64_t rxTime = ctx->rxStamp;
+            mb->finalizeNetMsg();
+            countReceived(ctx, mb, netMsgSize);
+            if (consumeNative(ctx, mb, rxTime)) {
+                if (ctx->localReading) return localReceiver(ctx);
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(incomingMutex);
+                incomingQueue.push_back(mb);
+            }
+            incomingCV.notify_one();
+        }
+    }
+
+    // v2 frames are parsed out of a receive buffer, so a burst of small frames costs one recv
+    // instead of two per message; payloads larger than what is buffered are received
+    // straight into their MessageBlock
+    void tcpReceiverV2(ConnectionContext* ctx) {
+        const size_t bufferSize = 64 * 1024;
+        std::unique_ptr<uint8_t[]> buffer(new uint8_t[bufferSize]);
+        size_t start = 0, end = 0;
+        std::vector<uint8_t> packed;        // compressed payloads
+
+        // copies n payload bytes to dst, buffered ones first
+        auto readInto = [&](uint8_t* dst, uint32_t n) {
+            uint32_t got = (uint32_t)std::min<size_t>(n, end - start);
+            std::memcpy(dst, buffer.get() + start, got);
+            start += got;
+            if (start == end) start = end = 0;
+
+            while (got < n) {
+                int r = 0;
+                if (!tcpRecvSome(ctx, dst + got, (int)(n - got), r)) return false;
+                got += r;
+            }
+            return true;
+        };
+
+        while (ctx->running) {
+            uint8_t type = 0;
+            uint32_t payloadLen = 0;
+            bool compressed = false;
+            uint64_t traceId = 0;
+            int h = wire::decodeV2Header(buffer.get() + start, end - start, type, payloadLen, compressed, traceId, ctx->rxTypes);
+            if (h < 0) return protocolError(ctx);
+            if (h == 0) {
+                if (start > 0) {
+                    std::memmove(buffer.get(), buffer.get() + start, end - start);
+                    end -= start;
+                    start = 0;
+                }
+                int r = 0;
+                if (!tcpRecvSome(ctx, buffer.get() + end, (int)(bufferSize - end), r)) return;
+                end += r;
+                continue;
+            }
+            start += h;
+
+            if (admission.limitsTraffic() && !admitted(ctx->destIP, type, h + payloadLen)) {
+                uint32_t buffered = (uint32_t)std::min<size_t>(payloadLen, end - start);
+                start += buffered;
+                if (start == end) start = end = 0;
+                if (!tcpSkip(ctx, payloadLen - buffered)) return;
+                continue;
+            }
+
+            MessageBlock* mb = nullptr;
+            if (compressed) {
+                packed.resize(payloadLen);
+                if (!readInto(packed.data(), payloadLen)) return;
+                mb = decompressPayload(ctx, packed.data(), payloadLen);
+                if (!mb) return protocolError(ctx);
+            }
+            else {
+                MessageBlockBuilder b(payloadLen);
+                if (!readInto(b.payload(), payloadLen)) return;
+                mb = b.finish(payloadLen);
+            }
+            uint64_t rxTime = ctx->rxStamp;        // of the last read, which brought in the frame's end
+            stampReceived(ctx, mb);
+            mb->setType(type);
+            countReceived(ctx, mb, h + payloadLen, traceId);
+            if (consumeNative(ctx, mb, rxTime)) {
+                if (ctx->localReading) return localReceiver(ctx);
+                continue;
+            }
 
             {
                 std::lock_guard<std::mutex> lock(incomingMutex);
@@ -369,6 +1208,283 @@ protected:
         }
     }
 
+    // builds a block from a compressed v2 payload, nullptr if it is malformed
+    MessageBlock* decompressPayload(ConnectionContext* ctx, const uint8_t* in, uint32_t len) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t size = 0;
+        int n = len ? wire::getVarint(in + 1, len - 1, size) : -1;
+        if (n <= 0 || (in[0] != compression::LZ4 && in[0] != compression::LZ4_JSON)) return nullptr;
+        if (size > (uint64_t)len * 255 || size > 0xFFFFFFFFull - 17) return nullptr;     // more than LZ4 can expand to
+
+        size_t dictLen = 0;
+        const uint8_t* dict = compression::dictionaryFor(in[0], dictLen);
+        MessageBlockBuilder b((uint32_t)size);
+        if (!compression::decompress(in + 1 + n, len - 1 - n, b.payload(), (size_t)size, dict, dictLen)) return nullptr;
+        MessageBlock* mb = b.finish((uint32_t)size);
+        ctx->compression.decompressNanos += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        return mb;
+    }
+
+    void protocolError(ConnectionContext* ctx) {
+        emitConnectionError("tcp", ctx->srcPort, ctx->destIP, ctx->destPort, "recv-failed");
+        transport->shutdown(ctx->sock);
+        ctx->running = false;
+    }
+
+    // reads n bytes past a dropped message; false once the connection is done
+    bool tcpSkip(ConnectionContext* ctx, uint32_t n) {
+        uint8_t sink[4096];
+        while (n) {
+            int r = 0;
+            if (!tcpRecvSome(ctx, sink, (int)std::min<uint32_t>(n, sizeof(sink)), r)) return false;
+            n -= (uint32_t)r;
+        }
+        return true;
+    }
+
+    // false: drop the message, counted; see setAdmission
+    bool admitted(uint32_t ip, uint8_t type, uint32_t bytes) {
+        if (!admission.limitsTraffic()) return true;
+        bool report = false;
+        if (admission.admit(ip, type, bytes, metrics::now(), report)) return true;
+        metrics::add(metrics::ADMIT_MSG_DROPS);
+        metrics::add(metrics::ADMIT_BYTE_DROPS, bytes);
+        if (report)
+            LS_LOG(logging::Level::Warn, "admission: dropping messages from {} over its rate (type {}, {} bytes)", ip, (int)type, bytes);
+        return false;
+    }
+
+    // false once the connection is done (error, or peer closed)
+    bool tcpRecvSome(ConnectionContext* ctx, uint8_t* buf, int len, int& got) {
+        int r = transport->recvStamped(ctx->sock, buf, len, ctx->rxStamp);
+        if (r < 0) {
+            emitConnectionError("tcp", ctx->srcPort, ctx->destIP, ctx->destPort, "recv-failed");
+            ctx->running = false;
+            return false;
+        }
+        if (r == 0) {
+            if (notifyNetworkEvent)
+                notifyNetworkEvent((std::string("tcp::" + std::to_string(ctx->srcPort) + "::") + std::to_string(ctx->destIP) + ":" + std::to_string(ctx->destPort) + "-socket-close").c_str());
+            transport->shutdown(ctx->sock);   //for other side to know i am done too
+            ctx->running = false;
+            return false;
+        }
+        got = r;
+        return true;
+    }
+
+    void stampReceived(ConnectionContext* ctx, MessageBlock* mb) {
+        mb->setDstPort(ctx->srcPort);                                       //this is the abstraction so sender need not to know which port they used to send but still receiver know where are they receiving
+        mb->setSrcPort(ctx->destPort);
+        mb->setSrcIP(ctx->destIP);
+        mb->setDstIP(ctx->srcIP);
+    }
+
+    // --------------------------------------------------------------
+    // SAME-HOST SHARED MEMORY, see LocalLink.h
+    // --------------------------------------------------------------
+    // a peer on this machine is reached at (or connects from) the address of our own end
+    bool peerOnThisHost(ConnectionContext* ctx) {
+        uint32_t localIP = 0, peerIP = 0;
+        uint16_t localPort = 0, peerPort = 0;
+        return transport->localAddress(ctx->sock, localIP, localPort) &&
+            transport->peerAddress(ctx->sock, peerIP, peerPort) && localIP == peerIP;
+    }
+
+    // sender thread of the connecting side
+    void offerLocalLink(ConnectionContext* ctx) {
+        if (!localLinkEnabled || !peerOnThisHost(ctx)) return;
+        locallink::Link* link = locallink::Link::create();
+        if (!link) return;
+
+        const std::string& name = link->name();
+        MessageBlock* offer = MessageBlockBuilder((uint32_t)name.size()).type(locallink::SHM_OFFER)
+            .append(name.data(), (uint32_t)name.size()).finish();
+        {
+            std::lock_guard<std::mutex> lock(ctx->outgoingMutex);
+            ctx->localLink.reset(link);
+        }
+        queueOn(ctx, offer);
+    }
+
+    MessageBlock* localSwitch(bool on) {
+        uint8_t flag = on ? 1 : 0;
+        return MessageBlockBuilder(1).type(locallink::SHM_SWITCH).append(&flag, 1).finish();
+    }
+
+    // receiver thread: the handshake. Our switch is queued behind whatever is waiting to be
+    // sent, the sender moves to the ring once it is out. Returns true if mb was consumed.
+    bool handleLocalLink(ConnectionContext* ctx, MessageBlock* mb) {
+        uint8_t type = mb->getType();
+        if (type != locallink::SHM_OFFER && type != locallink::SHM_SWITCH) return false;
+        const uint8_t* p = mb->getPayload();
+        uint32_t size = mb->getPayloadSize();
+
+        if (type == locallink::SHM_OFFER) {
+            locallink::Link* link = nullptr;
+            if (localLinkEnabled && !ctx->isClient && !ctx->localLink && peerOnThisHost(ctx))
+                link = locallink::Link::open(std::string((const char*)p, size));
+            if (link) {
+                std::lock_guard<std::mutex> lock(ctx->outgoingMutex);
+                ctx->localLink.reset(link);
+            }
+            queueOn(ctx, localSwitch(link != nullptr));
+        }
+        else if (locallink::isSwitchOn(type, p, size) && ctx->localLink) {
+            if (ctx->isClient) queueOn(ctx, localSwitch(true));
+            ctx->localReading = true;
+        }
+        else if (ctx->isClient && !ctx->localReading) {     // declined, stay on TCP
+            std::lock_guard<std::mutex> lock(ctx->outgoingMutex);
+            ctx->localLink.reset();
+        }
+        delete mb;
+        return true;
+    }
+
+    // sender thread, after our switch: the block goes into the ring as is, address header
+    // included; the receiver rewrites it like one off the socket
+    bool localSend(ConnectionContext* ctx, MessageBlock* msg) {
+        locallink::Link* link = ctx->localLink.get();
+        int sent = link->channel().writeStream(msg->getRawData(), msg->getTotalSize(), [ctx, link]() {
+            link->ringIfAsleep();
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            return ctx->running && !link->peerClosed();
+            });
+        link->ringIfAsleep();
+        return sent != 0;
+    }
+
+    // receiver thread, after the peer's switch. The socket stays silent from here on; it is
+    // only checked when the ring has been idle for a while, to notice a peer that died
+    // without closing the link.
+    void localReceiver(ConnectionContext* ctx) {
+        locallink::Link* link = ctx->localLink.get();
+        MessageChannel& ring = link->channel();
+        MessageBlock* pending = nullptr;
+        // spinning before a sleep saves the wakeup in bursts, but on one core it only delays the writer
+        auto spin = std::chrono::microseconds(std::thread::hardware_concurrency() > 1 ? 50 : 0);
+
+        while (ctx->running) {
+            int n = ring.readStream([&pending](uint32_t total) -> BYTE* {
+                if (total < 17) return nullptr;
+                pending = new MessageBlock(total);
+                return pending->getRawWritePtr();
+                });
+            if (n != 0) {
+                MessageBlock* mb = pending;
+                pending = nullptr;
+                if (n < 0 || !mb) {
+                    delete mb;
+                    continue;
+                }
+                uint64_t rxTime = transport->wallNow();
+                mb->setTotalSize((uint32_t)n);      // the record's length, not the size the peer wrote
+                mb->finalizeNetMsg();
+                stampReceived(ctx, mb);
+                countReceived(ctx, mb, (uint64_t)n);
+                if (consumeNative(ctx, mb, rxTime)) continue;
+
+                {
+                    std::lock_guard<std::mutex> lock(incomingMutex);
+                    incomingQueue.push_back(mb);
+                }
+                incomingCV.notify_one();
+                continue;
+            }
+
+            bool got = false;
+            auto spinUntil = std::chrono::steady_clock::now() + spin;
+            while (!got && ctx->running && std::chrono::steady_clock::now() < spinUntil) {
+                locallink::cpuRelax();
+                got = ring.availableToRead() > 0;
+            }
+            if (got) continue;
+
+            bool gone = link->peerClosed() && ring.availableToRead() == 0;     // its last writes come before the flag
+            if (!gone && !link->wait(locallink::PROBE_MS)) gone = transport->peerClosed(ctx->sock);
+            if (gone && ctx->running) {
+                if (notifyNetworkEvent)
+                    notifyNetworkEvent((std::string("tcp::" + std::to_string(ctx->srcPort) + "::") + std::to_string(ctx->destIP) + ":" + std::to_string(ctx->destPort) + "-socket-close").c_str());
+                transport->shutdown(ctx->sock);
+                ctx->running = false;
+            }
+        }
+        delete pending;
+    }
+
+    // --------------------------------------------------------------
+    // IN-PROCESS LOOPBACK
+    // --------------------------------------------------------------
+    // A TCP connection to our own server is a pair of contexts without socket or threads (see
+    // NetworkManager::createLoopback). Sending on one is receiving on the other, right on the
+    // caller's thread: the block gets the addresses the socket path would give it and is queued
+    // for the dispatcher, in the order it was sent. Natives are not run here, the caller may
+    // hold mapMutex or a subsystem lock they take.
+    void loopSend(ConnectionContext* ctx, MessageBlock* msg) {
+        std::lock_guard<std::mutex> lock(loopMutex);
+        ConnectionContext* to = ctx->loopPeer;
+        if (!to || !ctx->running) {
+            countSendFailure(ctx);
+            delete msg;
+            return;
+        }
+        uint64_t bytes = msg->getNetMsgSize();
+        stampClockMessage(msg);
+        countSent(ctx, msg, bytes);
+        stampReceived(to, msg);
+        countReceived(to, msg, bytes, msg->getTraceId());
+        {
+            std::lock_guard<std::mutex> qlock(incomingMutex);
+            loopQueue.push_back({ to, msg });
+        }
+        incomingCV.notify_one();
+    }
+
+    // dispatcher, with incomingMutex held through lock: natives of looped messages are handled
+    // with the lock released, the rest join incomingQueue
+    void receiveLooped(std::unique_lock<std::mutex>& lock) {
+        while (!loopQueue.empty()) {
+            auto [ctx, mb] = loopQueue.front();
+            loopQueue.pop_front();
+            loopBusy = ctx;
+            lock.unlock();
+            bool consumed = consumeNative(ctx, mb, transport->wallNow());
+            lock.lock();
+            loopBusy = nullptr;
+            loopIdle.notify_all();
+            if (!consumed) incomingQueue.push_back(mb);
+        }
+    }
+
+    // the peer sees the close like a socket close; what it sent us and is still queued is dropped
+    void stopLoopback(ConnectionContext* ctx) {
+        ctx->running = false;
+        ConnectionContext* peer = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(loopMutex);
+            peer = ctx->loopPeer;
+            ctx->loopPeer = nullptr;
+            if (peer) peer->loopPeer = nullptr;
+        }
+        if (peer && peer->running.exchange(false) && notifyNetworkEvent)
+            notifyNetworkEvent((std::string("tcp::" + std::to_string(peer->srcPort) + "::") + std::to_string(peer->destIP) + ":" + std::to_string(peer->destPort) + "-socket-close").c_str());
+        {
+            std::unique_lock<std::mutex> lock(incomingMutex);
+            loopIdle.wait(lock, [this, ctx]() { return loopBusy != ctx; });
+            for (auto it = loopQueue.begin(); it != loopQueue.end();) {
+                if (it->first != ctx) {
+                    ++it;
+                    continue;
+                }
+                delete it->second;
+                it = loopQueue.erase(it);
+            }
+        }
+        delete ctx;
+    }
+
     // --------------------------------------------------------------
     // UDP SENDER
     // --------------------------------------------------------------
@@ -389,26 +1505,34 @@ protected:
             }
 
             if (msg) {
-                const char* ptr = reinterpret_cast<const char*>(msg->getNetMsg());
-                sockaddr_in addr{};
-                addr.sin_family = AF_INET;
-                addr.sin_port = htons(msg->getDstPort());
-                addr.sin_addr.s_addr = htonl(msg->getDstIP()); // already uint32_t in network byte order
-
-                int toSend = (int)msg->getNetMsgSize();
-                bool failed = false;
-                while (toSend > 0 && ctx->running) {
-                    int s = sendto(ctx->sock, ptr, toSend, 0, (sockaddr*)&addr, sizeof(addr));
-                    if (s == SOCKET_ERROR) {
-                        emitConnectionError("udp", ctx->srcPort, ctx->destIP, ctx->destPort, "send-failed");
-                        failed = true;
-                        break;
+                metrics::recordSince(metrics::SEND_QUEUE_WAIT_NS, msg->getStamp());
+                uint64_t writeStart = metrics::now();
+                uint64_t wireBytes = msg->getNetMsgSize();
+                stampClockMessage(msg);
+
+                uint8_t hdr[2 + wire::TRACE_ID_SIZE] = { wire::WIRE_UDP_V2, msg->getType() };
+                transport::Buffer bufs[2] = { { msg->getNetMsg(), msg->getNetMsgSize() } };
+                int count = 1;
+                if (wireV2Enabled && isV2Peer(msg->getDstIP(), msg->getDstPort())) {
+                    uint32_t h = 2;
+                    if (msg->getTraceId()) {
+                        hdr[0] |= wire::WIRE_UDP_TRACED;
+                        wire::putTraceId(hdr + 2, msg->getTraceId());
+                        h += wire::TRACE_ID_SIZE;
                     }
-                    ptr += s;
-                    toSend -= s;
+                    bufs[0] = { hdr, h };
+                    bufs[1] = { msg->getPayload(), msg->getPayloadSize() };
+                    count = 2;
+                    wireBytes = h + msg->getPayloadSize();
                 }
 
-                if (!failed && ctx->running) {
+                bool failed = transport->sendTo(ctx->sock, bufs, count, msg->getDstIP(), msg->getDstPort()) < 0;
+                if (failed) emitConnectionError("udp", ctx->srcPort, ctx->destIP, ctx->destPort, "send-failed");
+
+                if (failed) countSendFailure(ctx);
+                else if (ctx->running) {
+                    metrics::recordSince(metrics::SEND_WRITE_NS, writeStart);
+                    countSent(ctx, msg, wireBytes);
                     if (notifyNetworkEvent) {
                         //notifyNetworkEvent((std::string("udp::"+to_string(ctx->srcPort) + "::") + std::to_string(ctx->destIP) + ":" + std::to_string(ctx->destPort) + " - send - success").c_str());
                     }
@@ -421,36 +1545,59 @@ protected:
     // --------------------------------------------------------------
     // UDP RECEIVER
     // --------------------------------------------------------------
-    void udpReceiver(ConnectionContext* ctx) {
+    // on s, ctx->sock or one of its shardSocks
+    void udpReceiver(ConnectionContext* ctx, transport::Handle s) {
         const int bufferSize = 1024 * 64;
         uint8_t* buffer = new uint8_t[bufferSize];
     
-        sockaddr_storage from{};
-
         while (ctx->running) {
-            int fromLen = sizeof(from);
-            int r = recvfrom(ctx->sock, (char*)buffer, bufferSize, 0, (sockaddr*)&from, &fromLen);
-            if (r == 0 && isLoopback(from)) {
+            uint32_t fromIP = 0;
+            uint16_t fromPort = 0;
+            uint64_t rxTime = 0;
+            int r = transport->recvFromStamped(s, buffer, bufferSize, fromIP, fromPort, rxTime);
+            if (r == 0 && (fromIP & 0xFF000000) == 0x7F000000) {      // stopConnection's wakeup
                 ctx->running = false;
                 continue;
             }
-            if (r == SOCKET_ERROR){
-                emitConnectionError("udp", ctx->srcPort, ctx->destIP, ctx->destPort, "recv-failed");
+            if (r < 0){
+                if (ctx->running) {     // a group socket is stopped by closing it
+                    emitConnectionError("udp", ctx->srcPort, ctx->destIP, ctx->destPort, "recv-failed");
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));     // a dead socket fails at once, every time
+                }
                 continue;
             }
 
-            MessageBlock* mb = new MessageBlock();
-            mb->setNetMsg((uint8_t*)buffer, r);
-
-            if (from.ss_family == AF_INET) {
-                sockaddr_in* a = (sockaddr_in*)&from;
-
-                mb->setSrcIP(ntohl(a->sin_addr.s_addr));      // network order
-                mb->setSrcPort(ntohs(a->sin_port));    // host order
-
-                mb->setDstIP(ctx->srcIP);
-                mb->setDstPort(ctx->srcPort);
+            // the datagram is a v1 net message (totalSize, type, payload) or a v2 one (marker,
+            // type, payload): check it in place and copy it once into a block of the right size
+            MessageBlock* mb = nullptr;
+            uint64_t traceId = 0;
+            if (r > 0 && buffer[0] != 0) {
+                uint8_t flags = buffer[0] & wire::WIRE_UDP_FLAGS_MASK;
+                int h = (flags & wire::WIRE_UDP_TRACED) ? 2 + (int)wire::TRACE_ID_SIZE : 2;
+                if ((buffer[0] & ~wire::WIRE_UDP_FLAGS_MASK) != wire::WIRE_UDP_V2 ||
+                    (flags & ~wire::WIRE_UDP_TRACED) || r < h) {
+                    metrics::add(metrics::RECV_DROPS);
+                    continue;
+                }
+                if (!admitted(fromIP, buffer[1], (uint32_t)r)) continue;
+                if (flags & wire::WIRE_UDP_TRACED) traceId = wire::getTraceId(buffer + 2);
+                mb = MessageBlockBuilder((uint32_t)(r - h)).type(buffer[1]).append(buffer + h, (uint32_t)(r - h)).finish();
+            }
+            else {
+                if (r < 5) {
+                    metrics::add(metrics::RECV_DROPS);
+                    continue;
+                }
+                if (!admitted(fromIP, buffer[4], (uint32_t)r)) continue;
+                mb = MessageBlockBuilder((uint32_t)r - 5).type(buffer[4]).append(buffer + 5, (uint32_t)r - 5).finish();
             }
+
+            mb->setSrcIP(fromIP);
+            mb->setSrcPort(fromPort);
+            mb->setDstIP(ctx->srcIP);
+            mb->setDstPort(ctx->srcPort);
+            countReceived(ctx, mb, (uint64_t)r, traceId);
+            if (consumeNative(ctx, mb, rxTime)) continue;
             {
                 std::lock_guard<std::mutex> lock(incomingMutex);
                 incomingQueue.push_back(mb);
@@ -461,63 +1608,196 @@ protected:
         delete[] buffer;
 
     }
-    bool isLoopback(const sockaddr_storage& addr) {
-        if (addr.ss_family == AF_INET) {
-            auto* a = (sockaddr_in*)&addr;
-            uint32_t ip = ntohl(a->sin_addr.s_addr);
-            return (ip & 0xFF000000) == 0x7F000000;
-        }
-
-        if (addr.ss_family == AF_INET6) {
-            auto* a = (sockaddr_in6*)&addr;
-            static const in6_addr loopback = IN6ADDR_LOOPBACK_INIT;
-            return memcmp(&a->sin6_addr, &loopback, sizeof(in6_addr)) == 0;
-        }
+    bool isV2Peer(uint32_t ip, uint16_t port) {
+        std::lock_guard<std::mutex> lock(v2PeerMutex);
+        return v2Peers.count(peerKey(ip, port)) != 0;
+    }
 
-        return false;
+    void unlistV2Peer(ConnectionContext* ctx) {
+        if (!ctx->listedV2) return;
+        std::lock_guard<std::mutex> lock(v2PeerMutex);
+        auto it = v2Peers.find(peerKey(ctx->destIP, ctx->destPort));
+        if (it != v2Peers.end() && !--it->second) v2Peers.erase(it);
+        ctx->listedV2 = false;
     }
 
+    // Tears ctx down without waiting for it: it is marked stopped and handed to the reaper,
+    // which wakes its threads and frees it once they have returned. Nothing may use ctx after
+    // this; its timers are cancelled here, the socket stays open until the threads are gone.
     void stopConnection(ConnectionContext* ctx) {
         if (!ctx) return;
+        if (ctx->loopback) return stopLoopback(ctx);
 
         ctx->running = false;
-        ctx->outgoingCV.notify_all();
-        SOCKET to_close = ctx->sock;
-        
-        if (to_close != INVALID_SOCKET) {
-            if (ctx->isTCP) {
-                WSASetEvent(ctx->interruptEvent);
-                //std::cout << "we enter stop connection"+std::to_string(to_close) +"\n";
-                shutdown(to_close, SD_BOTH);
-                //std::cout << "we exit stop connection" + std::to_string(to_close) + "\n";
+        disarmTimers(ctx);
 
+        {
+            std::lock_guard<std::mutex> lock(reapMutex);
+            ctx->stoppedAt = metrics::now();
+            reapQueue.push_back(ctx);
+        }
+        reapCV.notify_all();
+    }
+
+    // n sockets sharing port (see setShards), listening for TCP, bound for UDP; none if
+    // sharding is off or the transport cannot do it
+    std::vector<transport::Handle> openShards(uint16_t port, bool tcp) {
+        std::vector<transport::Handle> socks;
+        uint32_t n = shards;
+        if (!n) n = std::max(1u, std::thread::hardware_concurrency());
+        if (n < 2 || !port) return socks;
+        for (uint32_t i = 0; i < n; ++i) {
+            transport::Handle s = tcp ? transport->listenShard(port, i, n) : transport->bindUDPShard(port, i, n);
+            if (s == transport::NONE) {
+                for (transport::Handle o : socks) transport->close(o);
+                socks.clear();
+                break;
             }
-            else {
-                sockaddr_in a{};
-                a.sin_family = AF_INET;
-                a.sin_port = htons(ctx->srcPort);
-                a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socks.push_back(s);
+        }
+        return socks;
+    }
 
-                sendto(ctx->sock, nullptr, 0, 0, (sockaddr*)&a, sizeof(a));
+    // every context stopped so far is freed when this returns, parked ones included; for the
+    // owner's destructor, once nothing else stops connections. Ones stopped after the reaper
+    // has gone are freed right here.
+    void drainTeardowns() {
+        std::thread reaper;
+        {
+            std::lock_guard<std::mutex> lock(reapMutex);
+            reaping = false;
+            reaper = std::move(reaperThread);
+        }
+        reapCV.notify_all();
+        if (reaper.joinable()) reaper.join();
 
-            }
+        std::deque<ConnectionContext*> left;
+        {
+            std::lock_guard<std::mutex> lock(reapMutex);
+            left.swap(reapQueue);
+        }
+        for (ConnectionContext* ctx : left) {
+            wakeThreads(ctx);
+            reclaim(ctx);
         }
+    }
 
-        if (ctx->senderThread.joinable()) ctx->senderThread.join();
+    // a sender or receiver thread of ctx, counted in ctx->threadsLeft until it returns
+    template <class F>
+    std::thread connectionThread(ConnectionContext* ctx, F body) {
+        {
+            std::lock_guard<std::mutex> lock(reapMutex);
+            ++ctx->threadsLeft;
+        }
+        return std::thread([this, ctx, body = std::move(body)]() mutable {
+            F(std::move(body))();       // captures gone before the count drops
+            // notified under the lock: once a parked ctx is down to 0 the owner may be gone
+            // as soon as the lock is released
+            std::lock_guard<std::mutex> lock(reapMutex);
+            --ctx->threadsLeft;
+            reapCV.notify_all();
+            });
+    }
 
-        if (ctx->receiverThread.joinable()) ctx->receiverThread.join();
+private:
+    // gets every blocking call of ctx's threads to return: none of these wait
+    void wakeThreads(ConnectionContext* ctx) {
+        ctx->outgoingCV.notify_all();
+        {
+            std::lock_guard<std::mutex> lock(ctx->outgoingMutex);
+            if (ctx->localLink) ctx->localLink->close();
+        }
+        transport::Handle s = ctx->sock;
+        if (s == transport::NONE) return;
+        if (ctx->isTCP) {
+            transport->interrupt(s);
+            connectDone(ctx);
+            transport->shutdown(s);
+        }
+        else if (!ctx->shardSocks.empty()) {
+            // the datagram below would reach one shard; shards are POSIX only, where shutdown
+            // wakes recvFrom
+            transport->shutdown(s);
+            for (transport::Handle h : ctx->shardSocks) transport->shutdown(h);
+        }
+        else {
+            uint32_t ip = 0;
+            uint16_t port = ctx->srcPort;
+            if (!port) transport->localAddress(s, ip, port);           // bound to an ephemeral port
+            transport->sendTo(s, nullptr, 0, 0x7F000001, port);         // 127.0.0.1, wakes recvFrom
+        }
+    }
 
+    // Wakes the threads of every context stopped since its last round, then frees contexts in
+    // whatever order their threads return, so one slow context does not hold up the others.
+    // One still running TEARDOWN_DEADLINE_MS after its stop is woken again, logged and
+    // counted, then parked: its threads are detached and the reaper goes on with the rest,
+    // freeing it whenever they do return. Its socket stays open until then, so a thread still
+    // blocked on it never reads from a reused handle.
+    void reaperLoop() {
+        std::unique_lock<std::mutex> lock(reapMutex);
+        size_t woken = 0;                                   // reapQueue[0, woken) had wakeThreads
+        for (;;) {
+            if (woken < reapQueue.size()) {
+                std::vector<ConnectionContext*> wake(reapQueue.begin() + woken, reapQueue.end());
+                woken = reapQueue.size();
+                lock.unlock();
+                for (ConnectionContext* c : wake) wakeThreads(c);
+                lock.lock();
+                continue;
+            }
+            uint64_t now = metrics::now();
+            uint64_t due = ~uint64_t(0);
+            ConnectionContext* ctx = nullptr;
+            for (auto it = reapQueue.begin(); it != reapQueue.end(); ++it) {
+                uint64_t deadline = (*it)->stoppedAt + uint64_t(TEARDOWN_DEADLINE_MS) * 1000000;
+                if ((*it)->threadsLeft == 0 || (!(*it)->parked && deadline <= now)) {
+                    ctx = *it;
+                    break;
+                }
+                if (!(*it)->parked) due = std::min(due, deadline);
+            }
+            if (!ctx) {
+                if (!reaping && reapQueue.empty()) return;
+                if (due == ~uint64_t(0)) reapCV.wait(lock);
+                else reapCV.wait_for(lock, std::chrono::nanoseconds(due - now));
+                continue;
+            }
+            if (ctx->threadsLeft != 0) {
+                ctx->parked = true;             // stays queued, and counted in woken
+                lock.unlock();
+                metrics::add(metrics::TEARDOWN_OVERDUE);
+                LS_LOG(logging::Level::Warn, "{}::{}::{}:{} still running {} ms after its stop, parked", ctx->isTCP ? "tcp" : "udp",
+                    ctx->srcPort, ctx->destIP, ctx->destPort, TEARDOWN_DEADLINE_MS);
+                wakeThreads(ctx);
+                if (ctx->senderThread.joinable()) ctx->senderThread.detach();
+                if (ctx->receiverThread.joinable()) ctx->receiverThread.detach();
+                for (std::thread& t : ctx->shardThreads) if (t.joinable()) t.detach();
+                lock.lock();
+                continue;
+            }
+            reapQueue.erase(std::find(reapQueue.begin(), reapQueue.end(), ctx));
+            --woken;
+            lock.unlock();
+            reclaim(ctx);
+            lock.lock();
+        }
+    }
 
-        //if(ctx)
-        if (to_close != INVALID_SOCKET) { closesocket(to_close); }
-        ctx->sock = INVALID_SOCKET;
+    // the threads have returned (or are about to, unless detached when parked): closes the
+    // socket without lingering, since whatever was still queued is dropped anyway, and frees ctx
+    void reclaim(ConnectionContext* ctx) {
+        if (ctx->senderThread.joinable()) ctx->senderThread.join();
+        if (ctx->receiverThread.joinable()) ctx->receiverThread.join();
+        for (std::thread& t : ctx->shardThreads) if (t.joinable()) t.join();
+        if (ctx->sock != transport::NONE) transport->abort(ctx->sock);
+        ctx->sock = transport::NONE;
+        for (transport::Handle h : ctx->shardSocks) transport->abort(h);
+        ctx->shardSocks.clear();
         for (auto msg : ctx->outgoingQueue) delete msg;
         ctx->outgoingQueue.clear();
-        if (ctx->interruptEvent)
-            WSACloseEvent(ctx->interruptEvent);
-
+        metrics::recordSince(metrics::TEARDOWN_NS, ctx->stoppedAt);
         delete ctx;
-
     }
 
 };
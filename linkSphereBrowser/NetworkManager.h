@@ -7,12 +7,16 @@
 #include <mutex>
 #include <atomic>
 #include <thread>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include <deque>
+#include <random>
+#include <condition_variable>
 #include "ThreadPool.h"
+#include "RoomElection.h"
+#include "RelayTree.h"
+#include "Presence.h"
+#include "ConnectionTable.h"
 
 //using namespace std;
-#pragma comment(lib, "ws2_32.lib")
 
 //#include <iostream>/*
 //using namespace std;*/
@@ -33,16 +37,88 @@ class NetworkManager : public NetworkBase {
 private:
     std::map<ConnKey, ConnectionContext*> connectionMap;
     std::mutex mapMutex;
+    std::set<ConnKey> creating;                     // keys a createConnection is setting up; under mapMutex
+    std::condition_variable creatingCV;
+    // gives a key in creating back however createConnection leaves, throwing included
+    struct Creating {
+        NetworkManager* owner;
+        ConnKey key;
+        ~Creating() {
+            {
+                std::lock_guard<std::mutex> lock(owner->mapMutex);
+                owner->creating.erase(key);
+            }
+            owner->creatingCV.notify_all();
+        }
+    };
 
     std::thread dispatcherThread;
     std::atomic<bool> dispatcherRunning{ true };
-    void (*onMessageReceive)(const uint8_t* data, uint32_t size) = nullptr;
+    std::function<void(const uint8_t* data, uint32_t size)> onMessageReceive;
 
-    SOCKET tcpServerSock = INVALID_SOCKET;
-    std::thread tcpServerThread;
+    static constexpr int ACCEPT_BURST = 16;         // connections one accept loop takes per wakeup
+    std::vector<transport::Handle> tcpServerSocks;  // one, or one per shard (setShards)
+    std::vector<std::thread> tcpServerThreads;      // an accept loop for each
     std::atomic<bool> serverRunning{ false };
     uint16_t listeningPort{ 0 };
+    std::set<uint32_t> ownIPs;                      // this machine's addresses; under mapMutex, see createLoopback
     ThreadPool* threadPool;
+
+    RoomElection election;                  // see RoomElection.h
+    std::mutex electionMutex;
+    TimerWheel::TimerId electionTimer{ 0 }; // under timerMutex
+
+    // relay tree, see RelayTree.h; all under relayMutex, taken after electionMutex
+    std::mutex relayMutex;
+    relay::Node relaySelf;
+    relay::Node relayMaster;
+    uint64_t relayTerm{ 0 };
+    std::vector<relay::Node> relayMembers;
+    std::map<uint64_t, uint16_t> relayCapacity;     // reported by members, used by the master
+    uint16_t ownCapacity{ relay::DEFAULT_CAPACITY };
+    std::map<uint64_t, relay::Place> relayPlan;     // last plan the master sent
+    relay::Place ownPlace;
+    bool ownPlaceKnown{ false };
+
+    // room broadcasts, see Multicast.h; under broadcastMutex
+    std::mutex broadcastMutex;
+    uint16_t multicastPort{ 0 };                    // 0: unicast only
+    uint32_t roomGroup{ 0 };                        // group of the room we are in, 0 if none
+    uint32_t roomSelfIP{ 0 };
+    uint16_t roomSelfPort{ 0 };
+    std::vector<uint64_t> broadcastMembers;         // peerKey of every other member
+    std::map<uint64_t, uint64_t> groupAcks;         // member -> ms of its last MCAST_ACK
+    std::map<uint64_t, uint64_t> groupAcksSent;     // sender -> ms of our last MCAST_ACK to it
+
+    // office presence, see Presence.h; under presenceMutex
+    presence::Engine presenceEngine;
+    std::mutex presenceMutex;
+    uint16_t presencePort{ 0 };                     // the page's discovery UDP port
+    TimerWheel::TimerId presenceTimer{ 0 };         // under timerMutex
+
+    // what to set up again after a restart, see ConnectionTable.h and restoreConnections
+    conntable::Table connTable;
+    struct Restoring {
+        uint8_t type;
+        uint16_t srcPort;
+        uint32_t ip;
+        uint16_t port;
+        uint32_t attempts{ 0 };
+        int result{ -1 };                           // connectFinished while restoreOne still ran: 1 up, 0 failed
+        bool awaiting{ false };                     // restoreOne is done, connectFinished ends the attempt
+    };
+    std::mutex restoreMutex;                        // the rest of these under it
+    std::condition_variable restoreIdle;
+    std::map<ConnKey, Restoring> restoring;         // entries neither up nor given up on yet
+    std::deque<ConnKey> restoreQueue;               // waiting for a slot
+    uint32_t restoreParallel{ 0 };
+    uint32_t restoreInFlight{ 0 };                  // queued on the pool or connecting
+    uint32_t restoreRunning{ 0 };                   // restoreOne calls under way
+    uint32_t restoreUp{ 0 };
+    uint32_t restoreFailed{ 0 };
+    uint64_t restoreStartedAt{ 0 };                 // transport->now(), 0 when no restore runs
+    std::minstd_rand restoreRandom{ (uint32_t)metrics::now() };
+    bool closing{ false };                          // the destructor started
 private:
     ConnKey makeKey(uint8_t t, uint32_t /*srcIP*/, uint16_t sp,
         uint32_t dstIP, uint16_t dp)
@@ -67,34 +143,100 @@ private:
 
 
 public:
-    NetworkManager(void (*mcb)(const uint8_t* data, uint32_t size)=nullptr, void (*ecb)(const char* text)=nullptr){
-        threadPool = new ThreadPool(4);
+    // net: the network to run on (e.g. a sim::Host), the platform's sockets if null;
+    // poolThreads: workers running mcb
+    NetworkManager(std::function<void(const uint8_t* data, uint32_t size)> mcb = nullptr, std::function<void(const char* text)> ecb = nullptr,
+        std::shared_ptr<transport::Transport> net = nullptr, size_t poolThreads = 4) : NetworkBase(std::move(net)) {
+        threadPool = new ThreadPool(poolThreads);
         onMessageReceive=mcb;
         notifyNetworkEvent=ecb;
-        WSADATA wsa;
-        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-            if (notifyNetworkEvent) notifyNetworkEvent("error-WSAStartup failed");
-        }
 
         dispatcherThread = std::thread([this]() { dispatcherLoop(); });
+        startTimers();
+
+        election.send = [this](const RoomElection::Peer& to, const uint8_t* lease, uint32_t len) {
+            sendLease(to, lease, len);
+        };
+        election.onMaster = [this](const RoomElection::Peer& m, uint64_t term) {
+            if (notifyNetworkEvent)
+                notifyNetworkEvent(("roomMaster-" + std::to_string(m.ip) + ":" + std::to_string(m.port) + "-" + std::to_string(term)).c_str());
+            std::lock_guard<std::mutex> lock(relayMutex);
+            relayMaster = { m.ip, m.port };
+            relayTerm = term;
+            relayPlan.clear();
+            ownPlaceKnown = false;                      // the page starts over with the new master
+            if (relayMaster == relaySelf) replanRelays();
+            else sendRelayReport();
+        };
+        nativeHandler = [this](MessageBlock* mb) {
+            switch (mb->getType()) {
+            case RoomElection::ROOM_LEASE:
+                {
+                    std::lock_guard<std::mutex> lock(electionMutex);
+                    election.receive(mb->getPayload(), mb->getPayloadSize(), transport->now() / 1000000);
+                }
+                rearmElection();
+                return true;
+            case relay::RELAY_PLAN:
+                onRelayPlan(mb->getSrcIP(), mb->getPayload(), mb->getPayloadSize());
+                return true;
+            case relay::RELAY_REPORT:
+                onRelayReport(mb->getSrcIP(), mb->getPayload(), mb->getPayloadSize());
+                return true;
+            case mcast::MCAST_ACK:
+                onGroupAck(mb->getSrcIP(), mb->getPayload(), mb->getPayloadSize());
+                return true;
+            case presence::PRESENCE_PROBE:
+            case presence::PRESENCE_ACK:
+            case presence::PRESENCE_PROBE_REQ:
+            case presence::PRESENCE_DIGEST:
+            case presence::PRESENCE_DELTA:
+                {
+                    std::lock_guard<std::mutex> lock(presenceMutex);
+                    presenceEngine.receive(mb->getSrcIP(), mb->getSrcPort(), mb->getType(),
+                        mb->getPayload(), mb->getPayloadSize(), transport->now() / 1000000);
+                }
+                rearmPresence();
+                return true;
+            default:
+                return false;
+            }
+        };
+        groupHeard = [this](uint32_t ip, uint16_t port) { ackGroup(ip, port); };
+        presenceEngine.send = [this](uint32_t ip, uint16_t port, uint8_t type, const uint8_t* data, uint32_t len) {
+            sendControl(type, ip, port, data, len, presencePort);
+        };
+        connectFinished = [this](uint32_t ip, uint16_t port, bool up) { onConnectFinished(ip, port, up); };
         //startTCPServer();
     }
 
     ~NetworkManager() {
-        
-        shutdownAll();
-
+        {
+            std::unique_lock<std::mutex> lock(restoreMutex);
+            closing = true;
+            restoreIdle.wait(lock, [this]() { return restoreRunning == 0; });
+        }
+        // nothing left that could stop a connection, or hand work to the pool, from here on
+        stopTimers();
+        stopTCPServer();
         dispatcherRunning = false;
         incomingCV.notify_all();
-
-        serverRunning = false;
-
-        if (tcpServerSock != INVALID_SOCKET) closesocket(tcpServerSock);
-
-        if (tcpServerThread.joinable()) tcpServerThread.join();
         if (dispatcherThread.joinable()) dispatcherThread.join();
+        threadPool->shutdown();
+
+        leaveGroup();
+        shutdownAll();
+        drainTeardowns();                       // their threads still call into this
+        {
+            std::lock_guard<std::mutex> lock(incomingMutex);   // received after the dispatcher went
+            for (MessageBlock* m : incomingQueue)
+                delete m;
+            incomingQueue.clear();
+            for (auto& looped : loopQueue)
+                delete looped.second;
+            loopQueue.clear();
+        }
         delete threadPool;
-        WSACleanup();
     }
 
     bool removeConnection(uint8_t type, uint32_t srcIP, uint16_t srcPort, uint32_t dstIP, uint16_t dstPort) {
@@ -110,6 +252,9 @@ public:
             }
         }
 
+        connTable.erase(type, srcPort, dstIP, dstPort);
+        forgetRestore(key);
+
         if (!ctx) {
             // Notify failure if nothing was found
             if (notifyNetworkEvent) {
@@ -121,16 +266,13 @@ public:
             return false;
         }
 
-        // Stop the connection
+        // Stop the connection; it deletes ctx, so the notification is made first
+        std::string done = std::string(ctx->isTCP ? "tcp" : "udp") + "::" + std::to_string(ctx->srcPort) + "::" +
+            std::to_string(ctx->destIP) + ":" + std::to_string(ctx->destPort) + "-removeConn-success";
         stopConnection(ctx);
 
         // Notify success
-        if (notifyNetworkEvent) {
-            std::string proto = ctx->isTCP ? "tcp" : "udp";
-            notifyNetworkEvent((proto + "::" + std::to_string(ctx->srcPort) + "::" +
-                std::to_string(ctx->destIP) + ":" + std::to_string(ctx->destPort) +
-                "-removeConn-success").c_str());
-        }
+        if (notifyNetworkEvent) notifyNetworkEvent(done.c_str());
 
         return true;
     }
@@ -138,13 +280,13 @@ public:
 
     bool removeConnection(uint8_t type, const std::string& srcIp, uint16_t srcPort, const std::string& dstIp, uint16_t dstPort) {
         uint32_t srcIP{}, dstIP{};
-        if (inet_pton(AF_INET, srcIp.c_str(), &srcIP) != 1) return false;
-        if (inet_pton(AF_INET, dstIp.c_str(), &dstIP) != 1) return false;
+        if (!transport::parseIPv4(srcIp, srcIP)) return false;
+        if (!transport::parseIPv4(dstIp, dstIP)) return false;
         return removeConnection(type, srcIP, srcPort, dstIP, dstPort);
     }
 
 
-    void setMessageCallback(void (*cb)(const uint8_t* data, uint32_t size)) {
+    void setMessageCallback(std::function<void(const uint8_t* data, uint32_t size)> cb) {
         onMessageReceive = cb;
     }
 
@@ -155,115 +297,212 @@ public:
             else stopTCPServer();
         }
 
-        tcpServerSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (tcpServerSock == INVALID_SOCKET) {
-            if (notifyNetworkEvent) notifyNetworkEvent("error-TCP Server: Failed to create socket");
-            return false;
-        }
-        // Disable Nagle
-        BOOL flag = TRUE;
-        setsockopt(tcpServerSock, IPPROTO_TCP, TCP_NODELAY,
-            (char*)&flag, sizeof(flag));
-
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(port);
-        addr.sin_addr.s_addr = INADDR_ANY;
-        BOOL opt = TRUE;
-        setsockopt(tcpServerSock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
-
-        if (bind(tcpServerSock, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
-            int errCode = WSAGetLastError();
-            if (notifyNetworkEvent) notifyNetworkEvent(("error-TCP Server bind failed. OS Error: " + getOSErrorString(errCode)).c_str());
-            return false;
-        }
-        if (listen(tcpServerSock, SOMAXCONN) == SOCKET_ERROR) {
-            int errCode = WSAGetLastError();
-            if (notifyNetworkEvent) notifyNetworkEvent(("error-TCP Server listen failed. OS Error: " + getOSErrorString(errCode)).c_str());
+        std::vector<transport::Handle> socks = openShards(port, true);
+        if (socks.empty()) socks.push_back(transport->listen(port));
+        if (socks[0] == transport::NONE) {
+            if (notifyNetworkEvent) notifyNetworkEvent(("error-TCP Server listen failed. OS Error: " + transport->lastError()).c_str());
             return false;
         }
         listeningPort = port;
         serverRunning = true;
-        tcpServerThread = std::thread([this]() { tcpAcceptLoop(); });
+        tcpServerSocks = socks;
+        for (uint32_t i = 0; i < socks.size(); ++i)
+            tcpServerThreads.emplace_back([this, i, listener = socks[i], sharded = socks.size() > 1]() {
+                if (sharded) transport->pinThread(i);     // the connections accepted here stay on core i
+                tcpAcceptLoop(listener);
+                });
+        refreshOwnIPs();
+        connTable.setServer(port);
         return true;
     }
 
+    // keeps what this manager sets up (server, room, the connections it opens) in the file at
+    // path, which restoreConnections sets up again after a restart; an "error-" if it fails
+    bool openConnectionTable(const std::string& path) {
+        std::string error;
+        if (connTable.open(path, error)) return true;
+        if (notifyNetworkEvent) notifyNetworkEvent(("error-Connection table failed: " + error).c_str());
+        return false;
+    }
+
+    // sets up what the connection table holds: the TCP server, multicast and the room, and
+    // every connection, up to parallel connects at a time, room members first. A failed connect
+    // is retried with backoff (see conntable::backoffMs), after RESTORE_ATTEMPTS it is dropped
+    // from the table. Reports "restore-done-<up>-<failed>-<ms>".
+    void restoreConnections(uint32_t parallel = conntable::DEFAULT_PARALLEL) {
+        conntable::Snapshot snap = connTable.snapshot();
+        conntable::orderForRestore(snap.entries, snap.members);
+        {
+            std::lock_guard<std::mutex> lock(restoreMutex);
+            if (closing) return;
+            restoreParallel = std::max<uint32_t>(parallel, 1);
+            if (!restoreStartedAt) {
+                restoreStartedAt = transport->now();
+                restoreUp = restoreFailed = 0;
+            }
+            for (const conntable::Entry& e : snap.entries) {
+                ConnKey key = makeKey(e.type, 0, e.srcPort, e.dstIP, e.dstPort);
+                if (restoring.count(key)) continue;
+                restoring[key] = { e.type, e.srcPort, e.dstIP, e.dstPort };
+                restoreQueue.push_back(key);
+            }
+        }
+        if (snap.listenPort) startTCPServer(snap.listenPort);
+        pumpRestore();
+
+        if (snap.multicastPort) setMulticast(snap.multicastPort);
+        if (snap.leaseMs) {
+            std::vector<RoomElection::Peer> members;
+            for (auto& [ip, port] : snap.members) members.push_back({ ip, port });
+            setRoom(snap.roomHash, snap.selfIP, snap.selfPort, snap.leaseMs);
+            applyRoomMembers(members);          // their connections are among the entries
+        }
+    }
+
 private:
     void stopTCPServer() {
 
         serverRunning = false;
 
-        // Closing the listening socket will unblock accept()
-        if (tcpServerSock != INVALID_SOCKET) {
-            closesocket(tcpServerSock);
-            tcpServerSock = INVALID_SOCKET;
-        }
+        // Closing the listening sockets will unblock accept()
+        for (transport::Handle s : tcpServerSocks) transport->close(s);
+        tcpServerSocks.clear();
 
-        // Join the accept loop thread
-        if (tcpServerThread.joinable()) tcpServerThread.join();
+        // Join the accept loop threads
+        for (std::thread& t : tcpServerThreads) if (t.joinable()) t.join();
+        tcpServerThreads.clear();
 
         listeningPort = 0;
     }
 
-    void tcpAcceptLoop() {
+    // listener: stopTCPServer clears tcpServerSocks while this still runs
+    void tcpAcceptLoop(transport::Handle listener) {
+        transport::Handle accepted[ACCEPT_BURST];
         while (serverRunning) {
-            SOCKET clientSock = accept(tcpServerSock, nullptr, nullptr);
-            if (!serverRunning) break;
-            if (clientSock == INVALID_SOCKET) {
-                int errCode = WSAGetLastError();
-                if (notifyNetworkEvent) notifyNetworkEvent(("error-TCP accept failed. OS Error: " + getOSErrorString(errCode)).c_str());
+            int n = transport->acceptBurst(listener, accepted, ACCEPT_BURST);
+            if (!serverRunning) {
+                for (int i = 0; i < n; ++i) transport->close(accepted[i]);
+                break;
+            }
+            if (n == 0) {
+                if (notifyNetworkEvent) notifyNetworkEvent(("error-TCP accept failed. OS Error: " + transport->lastError()).c_str());
                 continue;
             }
+            for (int i = 0; i < n; ++i) publishAccepted(accepted[i]);
+        }
+    }
+
+    void publishAccepted(transport::Handle clientSock) {
+        uint32_t destIP = 0, srcIP = 0;
+        uint16_t destPort = 0, srcPort = 0;
+        if (!transport->peerAddress(clientSock, destIP, destPort) ||
+            !transport->localAddress(clientSock, srcIP, srcPort)) {
+            if (notifyNetworkEvent)
+                notifyNetworkEvent(("error-TCP endpoint discovery failed. OS Error: " + transport->lastError()).c_str());
+            transport->close(clientSock);
+            return;
+        }
+        if (!admission.admitConnection(destIP)) {
+            metrics::add(metrics::ADMIT_CONN_REJECTS);
+            LS_LOG(logging::Level::Debug, "admission: connection from {}:{} over its limit, reset", destIP, destPort);
+            transport->abort(clientSock);
+            return;
+        }
 
-            sockaddr_in peer{}, local{};
-            int peerLen = sizeof(peer);
-            int localLen = sizeof(local);
 
-            if (getpeername(clientSock, (sockaddr*)&peer, &peerLen) != 0 ||
-                getsockname(clientSock, (sockaddr*)&local, &localLen) != 0) {
-                int errCode = WSAGetLastError();
-                if (notifyNetworkEvent)
-                    notifyNetworkEvent(("error-TCP endpoint discovery failed. OS Error: " + getOSErrorString(errCode)).c_str());
-                closesocket(clientSock);
-                continue;
-            }
+        ConnectionContext* ctx = new ConnectionContext();
+        ctx->sock = clientSock;
+        ctx->isTCP = true;
+        ctx->isClient = false;
+        ctx->destIP = destIP;
+        ctx->destPort = destPort;
+        ctx->srcIP = srcIP;
+        ctx->srcPort = listeningPort;
+
+        ConnKey k = makeKey((1<<7), srcIP, listeningPort, destIP, destPort);;
+        {
+            std::lock_guard<std::mutex> lock(mapMutex);
+            connectionMap[k] = ctx;
+        }
+        // Notify about new connection using ThreadPool safely
+        if (notifyNetworkEvent) {
+            std::string s = "connected-" + std::to_string(srcIP) + ":" + std::to_string(ctx->srcPort) +
+                "::" + std::to_string(destIP) + ":" + std::to_string(ctx->destPort);
 
-            uint32_t destIP = ntohl(peer.sin_addr.s_addr);    // network byte order
-            uint16_t destPort = ntohs(peer.sin_port);    // host order
 
-            uint32_t srcIP = ntohl(local.sin_addr.s_addr);   // network byte order
-            uint16_t srcPort = ntohs(local.sin_port);   // host order
+            // Capture ws by value
+            threadPool->enqueue([cb = notifyNetworkEvent, s]() {
+                cb(s.c_str());
+                });
+        }
 
+        ctx->senderThread = connectionThread(ctx, [this, ctx]() { tcpSender(ctx); });
+        ctx->receiverThread = connectionThread(ctx, [this, ctx]() {
+            tcpReceiver(ctx);
+            admission.releaseConnection(ctx->destIP);      // the peer is gone or we dropped it
+            });
+    }
 
-            ConnectionContext* ctx = new ConnectionContext();
-            ctx->sock = clientSock;
-            ctx->isTCP = true;
-            ctx->isClient = false;
-            ctx->destIP = destIP;
-            ctx->destPort = destPort;
-            ctx->srcIP = srcIP;
-            ctx->srcPort = listeningPort;
+    void refreshOwnIPs() {
+        std::vector<uint32_t> found = transport->localIPs();
+        std::set<uint32_t> ips(found.begin(), found.end());
+        std::lock_guard<std::mutex> lock(mapMutex);
+        ownIPs.swap(ips);
+    }
 
-            ConnKey k = makeKey((1<<7), srcIP, listeningPort, destIP, destPort);;
-            {
-                std::lock_guard<std::mutex> lock(mapMutex);
-                connectionMap[k] = ctx;
-            }
-            // Notify about new connection using ThreadPool safely
-            if (notifyNetworkEvent) {
-                std::string s = "connected-" + std::to_string(srcIP) + ":" + std::to_string(ctx->srcPort) +
-                    "::" + std::to_string(destIP) + ":" + std::to_string(ctx->destPort);
+    bool isOwnServer(uint32_t ip, uint16_t port) {
+        if (!serverRunning || port != listeningPort) return false;
+        if ((ip & 0xFF000000) == 0x7F000000) return true;
+        std::lock_guard<std::mutex> lock(mapMutex);
+        return ownIPs.count(ip) != 0;
+    }
 
+    // A TCP connection to our own server, e.g. the room master's own RoomClient. Instead of a
+    // socket, an accept and four threads it is a loopback pair of contexts (see
+    // NetworkBase::loopSend) giving the same events and addresses as connect + accept: the
+    // accepted side is published like publishAccepted does, the connecting side is returned.
+    // The client port the server side sees is picked below 1024, where no OS hands out
+    // ephemeral ports, so it never collides with a real connection from this machine.
+    ConnectionContext* createLoopback(uint32_t ip) {
+        ConnectionContext* server = new ConnectionContext();
+        server->isTCP = true;
+        server->loopback = true;
+        server->srcIP = ip;
+        server->srcPort = listeningPort;
+        server->destIP = ip;
+        {
+            std::lock_guard<std::mutex> lock(mapMutex);
+            for (uint16_t port = 1023; port > 0 && !server->destPort; --port)
+                if (!connectionMap.count(makeKey(0x80, ip, listeningPort, ip, port))) server->destPort = port;
+            if (server->destPort) connectionMap[makeKey(0x80, ip, listeningPort, ip, server->destPort)] = server;
+        }
+        if (!server->destPort) {
+            delete server;
+            emitConnectionError("tcp", 0, ip, listeningPort, "createConn-failed");
+            return nullptr;
+        }
 
-                // Capture ws by value
-                threadPool->enqueue([cb = notifyNetworkEvent, s]() {
-                    cb(s.c_str());
-                    });
-            }
+        ConnectionContext* client = new ConnectionContext();
+        client->isTCP = true;
+        client->isClient = true;
+        client->loopback = true;
+        client->destIP = ip;
+        client->destPort = listeningPort;
+        {
+            std::lock_guard<std::mutex> lock(loopMutex);
+            client->loopPeer = server;
+            server->loopPeer = client;
+        }
 
-            ctx->senderThread = std::thread([this, ctx]() { tcpSender(ctx); });
-            ctx->receiverThread = std::thread([this, ctx]() { tcpReceiver(ctx); });
+        if (notifyNetworkEvent) {
+            notifyNetworkEvent(("tcp::0::" + std::to_string(ip) + ":" + std::to_string(listeningPort) + "-createConn-success").c_str());
+            std::string s = "connected-" + std::to_string(ip) + ":" + std::to_string(server->srcPort) +
+                "::" + std::to_string(ip) + ":" + std::to_string(server->destPort);
+            threadPool->enqueue([cb = notifyNetworkEvent, s]() {
+                cb(s.c_str());
+                });
         }
+        return client;
     }
 
 public:
@@ -274,11 +513,14 @@ public:
         ConnectionContext* tostop=nullptr;
         // -------- fast path: lookup only --------
         {
-            std::lock_guard<std::mutex> lock(mapMutex);
+            // one creator per key: a second sendMessage racing the first one for a new
+            // connection waits for it instead of binding or connecting a duplicate
+            std::unique_lock<std::mutex> lock(mapMutex);
+            creatingCV.wait(lock, [this, &key]() { return !creating.count(key); });
             auto it = connectionMap.find(key);
             if (it != connectionMap.end() && it->second->running) {
                 ConnectionContext* ctx = it->second;
-                if ( notifyOnExist && notifyNetworkEvent && !(ctx->isTCP && ctx->connectEvent)) {
+                if ( notifyOnExist && notifyNetworkEvent && !ctx->connecting) {
                     notifyNetworkEvent((std::string(ctx->isTCP ? "tcp" : "udp") + "::" + std::to_string(srcPort) + "::"
                         + std::to_string(dstIP) + ":" + std::to_string(dstPort) + "-createConn-success").c_str());
                 }
@@ -288,7 +530,9 @@ public:
                 tostop = it->second;
                 connectionMap.erase(it);
             }
+            creating.insert(key);
         }
+        Creating claim{ this, key };
 
         if (tostop) {
             stopConnection(tostop);
@@ -297,12 +541,14 @@ public:
 
         // -------- slow path: create outside lock --------
         if (type & 0x80 && srcPort != 0) {
-            notifyNetworkEvent((std::string((type & 0x80) ? "tcp" : "udp") + "::" + std::to_string(srcPort) + "::"
+            if (notifyNetworkEvent) notifyNetworkEvent((std::string((type & 0x80) ? "tcp" : "udp") + "::" + std::to_string(srcPort) + "::"
                 + std::to_string(dstIP) + ":" + std::to_string(dstPort) + "-createConn-failed-attempt to create connection from server side").c_str());            \
             return nullptr;
         }
 
-        ConnectionContext *ctx = (type & 0x80) ? createTCP(dstIP, dstPort) : createUDP(srcPort);
+        ConnectionContext* ctx = !(type & 0x80) ? createUDP(srcPort)
+            : isOwnServer(dstIP, dstPort) ? createLoopback(dstIP)
+            : createTCP(dstIP, dstPort);
 
         // -------- publish under lock --------
         {
@@ -316,6 +562,7 @@ public:
             else if (ctx)// No existing connection, insert the new one
                 connectionMap[key] = ctx;
         }
+        if (ctx && !tostop && ((type & 0x80) || srcPort)) connTable.put(type, srcPort, dstIP, dstPort);
 
         if (tostop) {
             stopConnection(tostop);
@@ -331,8 +578,8 @@ public:
         const std::string& dstIp, uint16_t dstPort)
     {
         uint32_t srcIP{}, dstIP{};
-        if (inet_pton(AF_INET, srcIp.c_str(), &srcIP) != 1) return nullptr;
-        if (inet_pton(AF_INET, dstIp.c_str(), &dstIP) != 1) return nullptr;
+        if (!transport::parseIPv4(srcIp, srcIP)) return nullptr;
+        if (!transport::parseIPv4(dstIp, dstIP)) return nullptr;
 
         return createConnection(type, srcIP, srcPort, dstIP, dstPort);
     }
@@ -340,9 +587,19 @@ public:
 
     bool sendMessage(const BYTE* rawData, uint32_t size)
     {
-        if (size < 17) return false;
+        ConstMessageBlockView view(rawData, size);
+        if (size < 17 || !view.valid()) return false;
 
-        MessageBlock* msg = new MessageBlock(rawData, size);
+        MessageBlock* msg = view.copy();    // queued, so it has to outlive the caller's buffer
+        msg->setTraceId(tracing::current());
+        return sendMessage(msg);
+    }
+
+    // takes ownership of msg, deleted here if it cannot be queued
+    bool sendMessage(MessageBlock* msg)
+    {
+        if (!msg) return false;
+        if (msg->getDstIP() == mcast::ROOM_BROADCAST) return broadcastToRoom(msg);
         // -------- create connection if it is not already exist --------
 
         createConnection(
@@ -362,15 +619,25 @@ public:
                 msg->getDstIP(), msg->getDstPort()
             ));
             if (it == connectionMap.end()) {
+                metrics::add(metrics::SEND_DROPS);
                 delete msg;
                 return false;
             }
             ConnectionContext* ctx = it->second;
 
+            msg->setStamp(metrics::now());
+            tracing::point(tracing::SEND_ENQUEUE, msg->getTraceId());
+            if (ctx->loopback) {
+                loopSend(ctx, msg);
+                return true;
+            }
+            size_t depth;
             {
                 std::lock_guard<std::mutex> lock(ctx->outgoingMutex);
+                depth = ctx->outgoingQueue.size();
                 ctx->outgoingQueue.push_back(msg);
             }
+            metrics::record(metrics::SEND_QUEUE_DEPTH, depth);
 
             ctx->outgoingCV.notify_one();
         }
@@ -380,34 +647,556 @@ public:
 
 
 
+    // sends one native PING over an existing connection; the result shows up in getPeerClock,
+    // dumpMetrics and a "peerClock-..." event; the heartbeat's own pings only send that event
+    // when srtt or offset moved, see PeerClock::takeReport
+    bool ping(uint8_t type, uint16_t srcPort, uint32_t dstIP, uint16_t dstPort) {
+        {
+            std::lock_guard<std::mutex> clockLock(peerClockMutex);
+            auto pc = peerClocks.find(peerKey(dstIP, dstPort));
+            if (pc != peerClocks.end()) pc->second.reportNext();
+        }
+        std::lock_guard<std::mutex> lock(mapMutex);
+        auto it = connectionMap.find(makeKey(type, 0, srcPort, dstIP, dstPort));
+        if (it == connectionMap.end() || !it->second->running) return false;
+        sendPing(it->second, dstIP, dstPort);
+        return true;
+    }
+
+    // room broadcasts (messages to mcast::ROOM_BROADCAST) go out as one multicast datagram on
+    // this UDP port, plus unicast copies for members it does not reach; 0 sends unicast only
+    void setMulticast(uint16_t port) {
+        {
+            std::lock_guard<std::mutex> lock(broadcastMutex);
+            if (port == multicastPort) return;
+            multicastPort = port;
+        }
+        connTable.setMulticast(port);
+        rejoinGroup();
+    }
+
+    // joins room roomHash as selfIP:selfPort (the TCP server) with the given lease, 0 leaves;
+    // the outcome is reported as "roomMaster-<ip>:<port>-<term>"
+    void setRoom(uint32_t roomHash, uint32_t selfIP, uint16_t selfPort, uint32_t leaseMs) {
+        {
+            std::lock_guard<std::mutex> lock(electionMutex);
+            election.setRoom(roomHash, { selfIP, selfPort }, leaseMs);
+        }
+        connTable.setRoom(roomHash, selfIP, selfPort, leaseMs);
+        {
+            std::lock_guard<std::mutex> lock(relayMutex);
+            relaySelf = { selfIP, selfPort };
+            relayMaster = {};
+            relayTerm = 0;
+            relayMembers.clear();
+            relayCapacity.clear();
+            relayPlan.clear();
+            ownPlaceKnown = false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(broadcastMutex);
+            roomGroup = leaseMs ? mcast::groupFor(roomHash) : 0;
+            roomSelfIP = selfIP;
+            roomSelfPort = selfPort;
+            broadcastMembers.clear();
+            groupAcks.clear();
+            groupAcksSent.clear();
+        }
+        setGroupSelf(selfIP, selfPort);
+        rejoinGroup();
+        rearmElection();
+    }
+
+    // the room's members (ip, TCP server port); each gets a TCP connection now, so leases and a
+    // new master's traffic never wait for connection setup
+    void setRoomMembers(const std::vector<RoomElection::Peer>& members) {
+        for (const RoomElection::Peer& p : members)
+            createConnection(RoomElection::ROOM_LEASE, 0, 0, p.ip, p.port, false);
+        applyRoomMembers(members);
+    }
+
+    // how many members this one can mix for, as measured by the page; reported to the master,
+    // which plans the relay tree from it. The outcome is "relayPlan-<parent>-<children>".
+    void setRelayCapacity(uint16_t children) {
+        std::lock_guard<std::mutex> lock(relayMutex);
+        if (children == ownCapacity) return;
+        ownCapacity = children;
+        if (relayMaster == relaySelf) replanRelays();
+        else sendRelayReport();
+    }
+
+    void electRoomMaster() {
+        {
+            std::lock_guard<std::mutex> lock(electionMutex);
+            election.elect(transport->now() / 1000000);
+        }
+        rearmElection();
+    }
+
+    // office presence (Presence.h) on the page's discovery UDP socket, as ip with its TCP server
+    // port; info is the page's user info (JSON, opaque here). Changes are reported as
+    // "presence-{"full":0|1,"up":[{"ip","tcpPort","discoveryPort","info"}],"gone":[ip]}"
+    void startPresence(uint32_t ip, uint16_t tcpPort, uint16_t discoveryPort, const std::string& info) {
+        {
+            std::lock_guard<std::mutex> lock(presenceMutex);
+            presencePort = discoveryPort;
+            presenceEngine.start(ip, tcpPort, discoveryPort, transport->wallNow() / 1000000, transport->now() / 1000000);
+            presenceEngine.setInfo(info);
+        }
+        rearmPresence();
+    }
+
+    void setPresenceInfo(const std::string& info) {
+        std::lock_guard<std::mutex> lock(presenceMutex);
+        presenceEngine.setInfo(info);
+    }
+
+    // (ip, discovery port) of members known from the directory, asked first
+    void seedPresence(const std::vector<std::pair<uint32_t, uint16_t>>& peers) {
+        {
+            std::lock_guard<std::mutex> lock(presenceMutex);
+            for (auto& [ip, port] : peers) presenceEngine.seed(ip, port);
+        }
+        rearmPresence();
+    }
+
+    void stopPresence() {
+        std::lock_guard<std::mutex> lock(presenceMutex);
+        presenceEngine.stop();
+    }
+
+    // every member known right now, as a "presence-" event with full 1
+    void presenceSnapshot() {
+        std::lock_guard<std::mutex> lock(presenceMutex);
+        std::vector<const presence::Record*> all;
+        for (auto& [ip, r] : presenceEngine.all())
+            if (ip != presenceEngine.selfIP()) all.push_back(&r);
+        notifyPresence(true, all, {});
+    }
+
 private:
+    // the room's state for members, without setting up their connections
+    void applyRoomMembers(const std::vector<RoomElection::Peer>& members) {
+        connTable.setMembers(members);
+        {
+            std::lock_guard<std::mutex> lock(electionMutex);
+            election.setMembers(members, transport->now() / 1000000);
+        }
+        {
+            std::lock_guard<std::mutex> lock(relayMutex);
+            relayMembers.clear();
+            for (const RoomElection::Peer& p : members) relayMembers.push_back({ p.ip, p.port });
+            if (relayMaster == relaySelf) replanRelays();
+        }
+        {
+            std::lock_guard<std::mutex> lock(broadcastMutex);
+            broadcastMembers.clear();
+            for (const RoomElection::Peer& p : members)
+                if (p.ip != roomSelfIP || p.port != roomSelfPort) broadcastMembers.push_back(peerKey(p.ip, p.port));
+        }
+        rearmElection();
+    }
+
+    // hands queued restore entries to the pool while slots are free; reports the end of a restore
+    void pumpRestore() {
+        std::vector<ConnKey> launch;
+        std::string done;
+        {
+            std::lock_guard<std::mutex> lock(restoreMutex);
+            if (closing) return;
+            while (restoreInFlight < restoreParallel && !restoreQueue.empty()) {
+                launch.push_back(restoreQueue.front());
+                restoreQueue.pop_front();
+                ++restoreInFlight;
+            }
+            if (restoring.empty() && restoreStartedAt) {
+                done = "restore-done-" + std::to_string(restoreUp) + "-" + std::to_string(restoreFailed) + "-" +
+                    std::to_string((transport->now() - restoreStartedAt) / 1000000);
+                restoreStartedAt = 0;
+            }
+        }
+        for (const ConnKey& key : launch)
+            threadPool->enqueue([this, key]() { restoreOne(key); });
+        if (!done.empty() && notifyNetworkEvent) notifyNetworkEvent(done.c_str());
+    }
+
+    // one attempt on a pool thread; a TCP connect still under way is finished by onConnectFinished
+    void restoreOne(ConnKey key) {
+        Restoring r;
+        {
+            std::lock_guard<std::mutex> lock(restoreMutex);
+            auto it = restoring.find(key);
+            if (closing || it == restoring.end()) {
+                --restoreInFlight;
+                return;
+            }
+            it->second.result = -1;
+            r = it->second;
+            ++restoreRunning;
+        }
+        int state = 0;
+        if (createConnection(r.type, 0, r.srcPort, r.ip, r.port, false)) {
+            std::lock_guard<std::mutex> lock(mapMutex);
+            auto it = connectionMap.find(key);
+            if (it != connectionMap.end() && it->second->running) state = it->second->connecting ? -1 : 1;
+        }
+        uint32_t retryIn = 0;
+        {
+            std::lock_guard<std::mutex> lock(restoreMutex);
+            --restoreRunning;
+            auto it = restoring.find(key);
+            if (it == restoring.end()) --restoreInFlight;
+            else if (it->second.result >= 0) retryIn = finishRestore(it, it->second.result == 1);
+            else if (state < 0) it->second.awaiting = true;
+            else retryIn = finishRestore(it, state == 1);
+        }
+        restoreIdle.notify_all();
+        retryRestore(key, retryIn);
+    }
+
+    // under restoreMutex: the attempt on it is over; how long until the next one, 0 for none
+    uint32_t finishRestore(std::map<ConnKey, Restoring>::iterator it, bool up) {
+        --restoreInFlight;
+        Restoring& r = it->second;
+        if (up) {
+            ++restoreUp;
+            restoring.erase(it);
+            return 0;
+        }
+        if (++r.attempts >= conntable::RESTORE_ATTEMPTS) {
+            ++restoreFailed;
+            connTable.erase(r.type, r.srcPort, r.ip, r.port);
+            restoring.erase(it);
+            return 0;
+        }
+        r.awaiting = false;
+        return conntable::backoffMs(r.attempts, conntable::BACKOFF_BASE_MS, conntable::BACKOFF_CAP_MS, (uint32_t)restoreRandom());
+    }
+
+    // timer callbacks must not set up connections: the retry goes back in the queue
+    void retryRestore(ConnKey key, uint32_t ms) {
+        if (ms) scheduleTimer(ms, [this, key]() {
+            {
+                std::lock_guard<std::mutex> lock(restoreMutex);
+                if (!restoring.count(key)) return;
+                restoreQueue.push_back(key);
+            }
+            pumpRestore();
+            });
+        else pumpRestore();
+    }
+
+    // sender threads, for every connect this side made
+    void onConnectFinished(uint32_t ip, uint16_t port, bool up) {
+        ConnKey key = makeKey(0x80, 0, 0, ip, port);
+        uint32_t retryIn = 0;
+        {
+            std::lock_guard<std::mutex> lock(restoreMutex);
+            if (closing) return;               // connects the destructor interrupted did not fail
+            if (up) connTable.up(0x80, 0, ip, port, transport->wallNow() / 1000000);
+            else connTable.failed(0x80, 0, ip, port);
+            auto it = restoring.find(key);
+            if (it == restoring.end()) return;
+            if (!it->second.awaiting) {
+                it->second.result = up;
+                return;
+            }
+            retryIn = finishRestore(it, up);
+        }
+        retryRestore(key, retryIn);
+    }
+
+    // the page removed the connection: no more attempts on it
+    void forgetRestore(const ConnKey& key) {
+        {
+            std::lock_guard<std::mutex> lock(restoreMutex);
+            auto it = restoring.find(key);
+            if (it == restoring.end()) return;
+            if (it->second.awaiting) --restoreInFlight;
+            restoring.erase(it);
+        }
+        pumpRestore();
+    }
+
+    // runs whatever the election has due and schedules its next wakeup
+    void rearmElection() {
+        std::lock_guard<std::recursive_mutex> lock(timerMutex);
+        cancelTimer(electionTimer);
+        uint64_t wait;
+        {
+            std::lock_guard<std::mutex> elock(electionMutex);
+            wait = election.poll(transport->now() / 1000000);
+        }
+        if (wait != ~uint64_t(0))
+            electionTimer = scheduleTimer((uint32_t)std::max<uint64_t>(wait, 1), [this]() { rearmElection(); });
+    }
+
+    // runs whatever presence has due, reports the changes and schedules the next wakeup
+    void rearmPresence() {
+        std::lock_guard<std::recursive_mutex> lock(timerMutex);
+        cancelTimer(presenceTimer);
+        uint64_t wait;
+        {
+            std::lock_guard<std::mutex> plock(presenceMutex);
+            wait = presenceEngine.poll(transport->now() / 1000000);
+            std::vector<const presence::Record*> changed;
+            std::vector<uint32_t> dropped;
+            if (presenceEngine.takeDiff(changed, dropped)) notifyPresence(false, changed, dropped);
+        }
+        if (wait != ~uint64_t(0))
+            presenceTimer = scheduleTimer((uint32_t)std::max<uint64_t>(wait, 1), [this]() { rearmPresence(); });
+    }
+
+    // under presenceMutex
+    void notifyPresence(bool full, const std::vector<const presence::Record*>& up, const std::vector<uint32_t>& gone) {
+        if (!notifyNetworkEvent) return;
+        std::string out = std::string("presence-{\"full\":") + (full ? "1" : "0") + ",\"up\":[";
+        for (size_t i = 0; i < up.size(); ++i) {
+            out += (i ? ",{\"ip\":" : "{\"ip\":") + std::to_string(up[i]->ip) +
+                ",\"tcpPort\":" + std::to_string(up[i]->tcpPort) +
+                ",\"discoveryPort\":" + std::to_string(up[i]->discoveryPort) + ",\"info\":\"";
+            for (unsigned char c : up[i]->info) {              // a JSON string, parsed by the page
+                if (c == '"' || c == '\\') out += '\\';
+                if (c < 0x20) {
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    out += esc;
+                }
+                else out += char(c);
+            }
+            out += "\"}";
+        }
+        out += "],\"gone\":[";
+        for (size_t i = 0; i < gone.size(); ++i) out += (i ? "," : "") + std::to_string(gone[i]);
+        out += "]}";
+        notifyNetworkEvent(out.c_str());
+    }
+
+    void sendLease(const RoomElection::Peer& to, const uint8_t* lease, uint32_t len) {
+        sendControl(RoomElection::ROOM_LEASE, to.ip, to.port, lease, len);
+    }
+
+    // queued on an existing connection only: this runs on timer and receiver threads, which
+    // must not set up or tear down connections. UDP types go out on the socket bound to srcPort.
+    void sendControl(uint8_t type, uint32_t ip, uint16_t port, const uint8_t* data, uint32_t len, uint16_t srcPort = 0) {
+        std::lock_guard<std::mutex> lock(mapMutex);
+        auto it = connectionMap.find(makeKey(type, 0, srcPort, ip, port));
+        if (it == connectionMap.end() || !it->second->running) {
+            metrics::add(metrics::SEND_DROPS);
+            return;
+        }
+        queueOn(it->second, MessageBlockBuilder(len).type(type).dst(ip, port).append(data, len).finish());
+    }
+
+    void rejoinGroup() {
+        uint32_t group, iface;
+        uint16_t port;
+        {
+            std::lock_guard<std::mutex> lock(broadcastMutex);
+            group = roomGroup;
+            port = multicastPort;
+            iface = roomSelfIP;
+            groupAcks.clear();
+        }
+        if (group && port) joinGroup(group, port, iface);
+        else leaveGroup();
+    }
+
+    // one group datagram, and the envelope over TCP to every member that has not acknowledged
+    // our multicasts lately (all of them without a group); msg is consumed
+    bool broadcastToRoom(MessageBlock* msg) {
+        std::vector<uint8_t> envelope = wrapForGroup(msg);
+        delete msg;
+        if (envelope.empty()) {
+            metrics::add(metrics::SEND_DROPS);
+            return false;
+        }
+        bool grouped = multicast(envelope);
+
+        std::vector<uint64_t> unicast;
+        {
+            std::lock_guard<std::mutex> lock(broadcastMutex);
+            uint64_t now = transport->now() / 1000000;
+            for (uint64_t member : broadcastMembers) {
+                auto ack = groupAcks.find(member);
+                if (!grouped || ack == groupAcks.end() || now - ack->second > mcast::ACK_VALID_MS)
+                    unicast.push_back(member);
+            }
+        }
+        for (uint64_t member : unicast) {
+            sendControl(mcast::MCAST_UNICAST, uint32_t(member >> 16), uint16_t(member), envelope.data(), (uint32_t)envelope.size());
+            metrics::add(metrics::MCAST_FALLBACKS);
+        }
+        return true;
+    }
+
+    // receiver thread of the group: tells ip:port its multicasts reach us, at most every ACK_EVERY_MS
+    void ackGroup(uint32_t ip, uint16_t port) {
+        uint8_t ack[3];
+        {
+            std::lock_guard<std::mutex> lock(broadcastMutex);
+            uint64_t now = transport->now() / 1000000;
+            uint64_t& last = groupAcksSent[peerKey(ip, port)];
+            if (last && now - last < mcast::ACK_EVERY_MS) return;
+            last = now;
+            ack[0] = mcast::VERSION;
+            mcast::put(ack + 1, roomSelfPort, 2);
+        }
+        sendControl(mcast::MCAST_ACK, ip, port, ack, sizeof(ack));
+    }
+
+    // MCAST_ACK payload: version, the sender's TCP server port
+    void onGroupAck(uint32_t fromIP, const uint8_t* p, uint32_t len) {
+        if (len != 3 || p[0] != mcast::VERSION) return;
+        std::lock_guard<std::mutex> lock(broadcastMutex);
+        groupAcks[peerKey(fromIP, (uint16_t)mcast::get(p + 1, 2))] = transport->now() / 1000000;
+    }
+
+    // master, under relayMutex: plans the tree and sends every member whose place changed
+    void replanRelays() {
+        if (!relaySelf.port) return;
+        std::vector<relay::Member> members;
+        for (const relay::Node& n : relayMembers) {
+            relay::Member m{ n };
+            auto cap = relayCapacity.find(n.key());
+            if (cap != relayCapacity.end()) m.capacity = cap->second;
+            PeerClock clock;
+            if (getPeerClock(n.ip, n.port, clock)) m.rttNs = (int64_t)clock.srtt;
+            members.push_back(m);
+        }
+
+        std::map<uint64_t, relay::Place> plan = relay::plan(relaySelf, ownCapacity, members);
+        for (auto& [key, place] : plan) {
+            auto old = relayPlan.find(key);
+            if (old != relayPlan.end() && old->second == place) continue;
+            if (key == relaySelf.key()) {
+                applyRelayPlace(place);
+                continue;
+            }
+            std::vector<uint8_t> msg = relay::encodePlan(relayTerm, place);
+            sendControl(relay::RELAY_PLAN, uint32_t(key >> 16), uint16_t(key), msg.data(), (uint32_t)msg.size());
+        }
+        relayPlan.swap(plan);
+    }
+
+    // under relayMutex
+    void sendRelayReport() {
+        if (!relayMaster.ip) return;
+        std::vector<uint8_t> msg = relay::encodeReport(relaySelf.port, ownCapacity);
+        sendControl(relay::RELAY_REPORT, relayMaster.ip, relayMaster.port, msg.data(), (uint32_t)msg.size());
+    }
+
+    // a report also means the member has just taken this master, and may have dropped a plan
+    // sent before that, see onRelayPlan: its place is sent again
+    void onRelayReport(uint32_t fromIP, const uint8_t* p, uint32_t len) {
+        uint16_t port = 0, capacity = 0;
+        if (!relay::decodeReport(p, len, port, capacity)) return;
+        std::lock_guard<std::mutex> lock(relayMutex);
+        if (!(relayMaster == relaySelf)) return;
+        relayCapacity[relay::Node{ fromIP, port }.key()] = capacity;
+        relayPlan.erase(relay::Node{ fromIP, port }.key());
+        replanRelays();
+    }
+
+    // only the master this peer elected, for its term: one that comes before our own lease is
+    // dropped, and the report onMaster sends gets it sent again
+    void onRelayPlan(uint32_t fromIP, const uint8_t* p, uint32_t len) {
+        uint64_t term = 0;
+        relay::Place place;
+        if (!relay::decodePlan(p, len, term, place)) return;
+        std::lock_guard<std::mutex> lock(relayMutex);
+        if (fromIP != relayMaster.ip || term != relayTerm) return;
+        applyRelayPlace(place);
+    }
+
+    // under relayMutex: tells the page where it sits, "relayPlan-<ip>:<port>-<ip>:<port>,..."
+    // with parent 0:0 at the root
+    void applyRelayPlace(const relay::Place& place) {
+        if (ownPlaceKnown && ownPlace == place) return;
+        ownPlace = place;
+        ownPlaceKnown = true;
+        if (!notifyNetworkEvent) return;
+        std::string text = "relayPlan-" + std::to_string(place.parent.ip) + ":" + std::to_string(place.parent.port) + "-";
+        for (size_t i = 0; i < place.children.size(); ++i)
+            text += (i ? "," : "") + std::to_string(place.children[i].ip) + ":" + std::to_string(place.children[i].port);
+        notifyNetworkEvent(text.c_str());
+    }
+
     void dispatcherLoop() {
         while (dispatcherRunning) {
             std::vector<MessageBlock*> batch;
             {
                 std::unique_lock<std::mutex> lock(incomingMutex);
-                incomingCV.wait(lock, [this] { return !incomingQueue.empty() || !dispatcherRunning; });
+                incomingCV.wait(lock, [this] { return !incomingQueue.empty() || !loopQueue.empty() || !dispatcherRunning; });
                 if (!dispatcherRunning) {
                     for (MessageBlock* m : incomingQueue)
                         delete m;
                     incomingQueue.clear();
+                    for (auto& looped : loopQueue)
+                        delete looped.second;
+                    loopQueue.clear();
                     return;
                 }
+                receiveLooped(lock);
                 batch.swap(incomingQueue);
             }
 
             for (MessageBlock* msg : batch) {
+                tracing::point(tracing::DISPATCH, msg->getTraceId());
                 threadPool->enqueue([this, msg]() {
+                    metrics::recordSince(metrics::DISPATCH_WAIT_NS, msg->getStamp());
                     if (msg && onMessageReceive) onMessageReceive(msg->getRawData(), msg->getTotalSize()); //you need to update this 
                     delete msg;
-                });
+                }, msg->getTraceId());
                 
             }
         }
     }
 
 public:
+    // metrics::dumpText() plus one line per connection:
+    // "conn <tcp|udp> <srcPort>::<dstIP>:<dstPort> sent= sent_bytes= received= received_bytes=
+    //  send_failures= queued= compressed= raw_bytes= wire_bytes= compress_us= decompress_us="
+    // and one per pinged peer: "peer <ip>:<port> srtt_us= jitter_us= offset_us= min_rtt_us= samples="
+    std::string dumpMetrics() {
+        std::string out = metrics::dumpText();
+        std::lock_guard<std::mutex> lock(mapMutex);
+        for (auto& [key, ctx] : connectionMap) {
+            size_t queued;
+            {
+                std::lock_guard<std::mutex> qlock(ctx->outgoingMutex);
+                queued = ctx->outgoingQueue.size();
+            }
+            const ConnectionStats& st = ctx->stats;
+            const CompressionStats& cs = ctx->compression;
+            char line[512];
+            snprintf(line, sizeof(line),
+                "conn %s %u::%u:%u sent=%llu sent_bytes=%llu received=%llu received_bytes=%llu send_failures=%llu queued=%zu "
+                "compressed=%llu raw_bytes=%llu wire_bytes=%llu compress_us=%llu decompress_us=%llu\n",
+                ctx->isTCP ? "tcp" : "udp", ctx->srcPort, ctx->destIP, ctx->destPort,
+                (unsigned long long)st.msgsSent, (unsigned long long)st.bytesSent,
+                (unsigned long long)st.msgsReceived, (unsigned long long)st.bytesReceived,
+                (unsigned long long)st.sendFailures, queued,
+                (unsigned long long)cs.compressedFrames, (unsigned long long)cs.rawBytes, (unsigned long long)cs.wireBytes,
+                (unsigned long long)(cs.compressNanos / 1000), (unsigned long long)(cs.decompressNanos / 1000));
+            out += line;
+        }
+
+        std::lock_guard<std::mutex> clockLock(peerClockMutex);
+        for (auto& [key, c] : peerClocks) {
+            char line[256];
+            snprintf(line, sizeof(line), "peer %u:%u srtt_us=%.1f jitter_us=%.1f offset_us=%.1f min_rtt_us=%.1f samples=%llu\n",
+                (unsigned)(key >> 16), (unsigned)(key & 0xFFFF), c.srtt / 1000, c.jitter / 1000, c.offset / 1000,
+                (double)c.minRtt / 1000, (unsigned long long)c.samples);
+            out += line;
+        }
+        return out;
+    }
+
+    // returns once every connection has been told to stop, however many there are; their
+    // threads and sockets are reclaimed in the background (see stopConnection)
     void shutdownAll() {
+        stopTCPServer();                        // first, so nothing is accepted meanwhile
         std::vector<ConnectionContext*> toStop;
         {
             std::lock_guard<std::mutex> lock(mapMutex);
@@ -417,6 +1206,5 @@ public:
         }
         for (auto* ctx : toStop)
             stopConnection(ctx);
-        stopTCPServer();
     }
 }; 
\ No newline at end of file
@@ -0,0 +1,110 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+// Native PING/PONG: round trip time and clock offset per peer, measured without the page.
+//
+//   PING payload: version, t1                  t1 = sender's clock when the PING is written
+//   PONG payload: version, t1, t2, t3          t2 = peer's clock when the PING came off the
+//                                              socket, t3 = peer's clock when the PONG is written
+// and t4 is our clock when the PONG comes off the socket. As in NTP:
+//   rtt    = (t4 - t1) - (t3 - t2)
+//   offset = ((t2 - t1) + (t3 - t4)) / 2       peer clock minus ours
+// Times are nanoseconds since the Unix epoch, little endian. t1 and t3 are filled in by the
+// sender thread right before the write and t2/t4 right after the receive, so queueing in
+// the dispatcher or the page does not show up as network time.
+namespace clockmsg {
+
+constexpr uint8_t PING = 0x30;      // MsgType.PING
+constexpr uint8_t PONG = 0x31;      // MsgType.PONG
+constexpr uint8_t VERSION = 1;
+constexpr uint32_t PING_SIZE = 1 + 8;
+constexpr uint32_t PONG_SIZE = 1 + 3 * 8;
+
+inline uint64_t wallNow() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline void put64(uint8_t* p, uint64_t v) {
+    for (int i = 0; i < 8; ++i) p[i] = uint8_t(v >> (8 * i));
+}
+
+inline uint64_t get64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v |= uint64_t(p[i]) << (8 * i);
+    return v;
+}
+
+inline bool isPing(uint8_t type, const uint8_t* payload, uint32_t size) {
+    return type == PING && size == PING_SIZE && payload[0] == VERSION;
+}
+
+inline bool isPong(uint8_t type, const uint8_t* payload, uint32_t size) {
+    return type == PONG && size == PONG_SIZE && payload[0] == VERSION;
+}
+
+} // namespace clockmsg
+
+// Smoothed estimates for one peer, in nanoseconds. RTT and jitter follow RFC 6298 (srtt,
+// rttvar). The offset is taken from the lowest-RTT sample of the last few, like NTP's clock
+// filter: that sample had the least queueing, so the least asymmetry.
+struct PeerClock {
+    static constexpr int WINDOW = 8;
+    static constexpr double REPORT_STEP = 1'000'000;   // ns; smaller moves than this (or 10%) go unreported
+
+    double srtt = 0;
+    double jitter = 0;
+    double offset = 0;
+    int64_t minRtt = 0;
+    uint64_t samples = 0;
+
+    void update(int64_t rtt, int64_t sampleOffset) {
+        if (samples == 0) {
+            srtt = (double)rtt;
+            jitter = rtt / 2.0;
+            minRtt = rtt;
+        }
+        else {
+            jitter = 0.75 * jitter + 0.25 * std::abs(srtt - (double)rtt);
+            srtt = 0.875 * srtt + 0.125 * (double)rtt;
+            if (rtt < minRtt) minRtt = rtt;
+        }
+
+        window[samples % WINDOW] = { rtt, sampleOffset };
+        ++samples;
+
+        int n = samples < WINDOW ? (int)samples : WINDOW;
+        int best = 0;
+        for (int i = 1; i < n; ++i)
+            if (window[i].rtt < window[best].rtt) best = i;
+        offset = samples == 1 ? (double)sampleOffset : 0.875 * offset + 0.125 * (double)window[best].offset;
+    }
+
+    // whether srtt or offset moved enough since the last time this said so to be worth
+    // telling the page; the first sample always is
+    bool takeReport() {
+        double step = std::max(REPORT_STEP, reportedSrtt / 10);
+        if (reported && std::abs(srtt - reportedSrtt) <= step && std::abs(offset - reportedOffset) <= step)
+            return false;
+        reported = true;
+        reportedSrtt = srtt;
+        reportedOffset = offset;
+        return true;
+    }
+
+    // the next sample is reported whatever it says, for a page that asked
+    void reportNext() { reported = false; }
+
+private:
+    struct Sample {
+        int64_t rtt;
+        int64_t offset;
+    };
+    Sample window[WINDOW]{};
+    bool reported = false;
+    double reportedSrtt = 0;
+    double reportedOffset = 0;
+};
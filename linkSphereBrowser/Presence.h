@@ -0,0 +1,616 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Office presence, run natively on the page's discovery UDP socket.
+//
+// Every member owns one record: TCP and discovery port, the page's user info (opaque JSON), a
+// version that grows when the info changes and an incarnation that grows when the member has
+// to refute a rumor of its death. Liveness follows SWIM (Das, Gupta, Motivala): each period
+// (PERIOD_MS, jittered) a member probes the next member of a shuffled list; without an ack
+// within PROBE_TIMEOUT_MS it asks INDIRECT others to probe for it, and if the period ends
+// without an ack the target becomes suspect. A suspect that does not refute (a higher
+// incarnation) within a time that grows with log(members) is declared dead and dropped.
+//
+// Changes, suspicions and deaths are small delta entries (ip, version, incarnation)
+// piggybacked on probes and acks, each sent about LAMBDA * log2(members) times, so a member
+// sends one probe and one ack per period whatever the size of the office. A member that hears
+// of a record newer than its own pulls the record from whoever told it. Every ANTI_ENTROPY_MS one random member also gets
+// a digest (ip, version, incarnation of every record) and answers with what is missing on
+// either side, which repairs anything the rumors missed and brings a new member up to date.
+// A dropped record is kept as a tombstone for TOMBSTONE_MS so late rumors cannot revive it.
+//
+//   PROBE      version, seq, relay ip, relay port, entries     relay: who an indirect probe is for
+//   ACK        version, seq, acker ip, relay ip, relay port, entries
+//   PROBE_REQ  version, seq, target ip, target port, entries
+//   DIGEST     version, first ip, last ip, count, (ip, version, incarnation)...
+//   DELTA      version, entries, want count, wanted ips
+//   entries    count, then kind, ip, version, incarnation each; FULL (DELTA only) adds TCP
+//              port, discovery port, info length and info
+//
+// No sockets or threads here: the owner feeds in time and datagrams, sends what `send` is
+// given and calls poll() again after the delay it returns. Times are milliseconds.
+namespace presence {
+
+constexpr uint8_t PRESENCE_PROBE = 0x35;        // MsgType.PRESENCE_PROBE
+constexpr uint8_t PRESENCE_ACK = 0x36;          // MsgType.PRESENCE_ACK
+constexpr uint8_t PRESENCE_PROBE_REQ = 0x37;    // MsgType.PRESENCE_PROBE_REQ
+constexpr uint8_t PRESENCE_DIGEST = 0x38;       // MsgType.PRESENCE_DIGEST
+constexpr uint8_t PRESENCE_DELTA = 0x39;        // MsgType.PRESENCE_DELTA
+constexpr uint8_t VERSION = 1;
+
+constexpr uint32_t MAX_DATAGRAM = 1200;
+constexpr uint32_t MAX_INFO = 768;
+constexpr uint32_t PERIOD_MS = 1000;
+constexpr uint32_t PROBE_TIMEOUT_MS = 300;
+constexpr uint32_t ANTI_ENTROPY_MS = 30000;
+constexpr uint32_t TOMBSTONE_MS = 120000;
+constexpr int INDIRECT = 3;
+constexpr int LAMBDA = 3;
+
+enum Kind : uint8_t { ALIVE = 1, SUSPECT = 2, DEAD = 3, FULL = 4 };
+constexpr uint32_t ENTRY_SIZE = 1 + 4 + 8 + 4;
+constexpr uint32_t FULL_EXTRA = 2 + 2 + 2;
+constexpr uint32_t DIGEST_ENTRY = 4 + 8 + 4;
+
+// (version, incarnation) order: a newer version wins whatever the incarnation
+inline bool older(uint64_t v1, uint32_t i1, uint64_t v2, uint32_t i2) {
+    return v1 < v2 || (v1 == v2 && i1 < i2);
+}
+
+struct Record {
+    uint32_t ip = 0;
+    uint16_t tcpPort = 0;
+    uint16_t discoveryPort = 0;
+    uint64_t version = 0;
+    uint32_t incarnation = 0;
+    std::string info;
+    bool suspect = false;
+    uint64_t suspectUntil = 0;
+};
+
+class Engine {
+public:
+    std::function<void(uint32_t ip, uint16_t port, uint8_t type, const uint8_t* data, uint32_t len)> send;
+
+    // version: above any this member used before, e.g. wall clock ms
+    void start(uint32_t ip, uint16_t tcpPort, uint16_t discoveryPort, uint64_t version, uint64_t now) {
+        records.clear();
+        tombstones.clear();
+        suspects.clear();
+        rumors.clear();
+        probeOrder.clear();
+        up.clear();
+        gone.clear();
+        pulling.clear();
+        self = ip;
+        Record& me = records[ip];
+        me.ip = ip;
+        me.tcpPort = tcpPort;
+        me.discoveryPort = discoveryPort;
+        me.version = version;
+        rng.seed((uint32_t)(version ^ ip));
+        probe = Probe{};
+        learned = false;
+        nextProbe = now;
+        nextAntiEntropy = now;                  // the first one brings us up to date
+        running = true;
+        spread(ALIVE, ip);
+    }
+
+    void stop() {
+        running = false;
+        records.clear();
+        seeds.clear();
+    }
+
+    void setInfo(const std::string& info) {
+        if (!running) return;
+        Record& me = records[self];
+        std::string clipped = info.substr(0, MAX_INFO);
+        if (me.info == clipped) return;
+        me.info = clipped;
+        ++me.version;
+        spread(ALIVE, self);
+    }
+
+    // members known from elsewhere (e.g. the directory), contacted while no other is known
+    void seed(uint32_t ip, uint16_t discoveryPort) {
+        if (ip != self && discoveryPort) seeds[ip] = discoveryPort;
+    }
+
+    void receive(uint32_t fromIP, uint16_t fromPort, uint8_t type, const uint8_t* p, uint32_t len, uint64_t now) {
+        if (!running || len < 1 || p[0] != VERSION) return;
+        Reader in{ p, len, 1 };
+        std::vector<uint32_t> wanted;
+        switch (type) {
+        case PRESENCE_PROBE: {
+            uint32_t s = (uint32_t)in.get(4), relayIP = (uint32_t)in.get(4);
+            uint16_t relayPort = (uint16_t)in.get(2);
+            if (!readEntries(in, now, wanted)) return;
+            std::vector<uint8_t> ack = header(s);
+            put(ack, self, 4);
+            put(ack, relayIP, 4);
+            put(ack, relayPort, 2);
+            sendWithRumors(fromIP, fromPort, PRESENCE_ACK, ack);
+            break;
+        }
+        case PRESENCE_ACK: {
+            uint32_t s = (uint32_t)in.get(4), acker = (uint32_t)in.get(4), relayIP = (uint32_t)in.get(4);
+            uint16_t relayPort = (uint16_t)in.get(2);
+            if (!readEntries(in, now, wanted)) return;
+            if (relayIP) {                      // we probed for someone else: pass it on
+                std::vector<uint8_t> ack = header(s);
+                put(ack, acker, 4);
+                put(ack, 0, 6);
+                sendWithRumors(relayIP, relayPort, PRESENCE_ACK, ack);
+            }
+            else if (s == probe.seq && acker == probe.ip) probe.acked = true;
+            break;
+        }
+        case PRESENCE_PROBE_REQ: {
+            uint32_t s = (uint32_t)in.get(4), target = (uint32_t)in.get(4);
+            uint16_t targetPort = (uint16_t)in.get(2);
+            if (!readEntries(in, now, wanted)) return;
+            std::vector<uint8_t> req = header(s);
+            put(req, fromIP, 4);
+            put(req, fromPort, 2);
+            sendWithRumors(target, targetPort, PRESENCE_PROBE, req);
+            break;
+        }
+        case PRESENCE_DIGEST:
+            receiveDigest(fromIP, fromPort, in);
+            return;
+        case PRESENCE_DELTA:
+            receiveDelta(fromIP, fromPort, in, now);
+            return;
+        default:
+            return;
+        }
+        if (!wanted.empty()) sendDelta(fromIP, fromPort, {}, wanted);
+    }
+
+    // does what is due at `now`; returns ms until it has to run again, ~0 for never
+    uint64_t poll(uint64_t now) {
+        if (!running) return ~uint64_t(0);
+
+        while (!suspects.empty() && suspects.begin()->first <= now) {
+            uint32_t ip = suspects.begin()->second;
+            suspects.erase(suspects.begin());
+            auto r = records.find(ip);
+            if (r == records.end() || !r->second.suspect || r->second.suspectUntil > now) continue;
+            drop(ip, now);
+            spread(DEAD, ip);
+        }
+        for (auto it = tombstones.begin(); it != tombstones.end();)
+            it = it->second.until <= now ? tombstones.erase(it) : std::next(it);
+
+        if (probe.timeoutAt && now >= probe.timeoutAt) {
+            probe.timeoutAt = 0;
+            if (!probe.acked) askOthers();
+        }
+        if (now >= nextProbe) {
+            if (probe.ip && !probe.acked) suspect(probe.ip, now);
+            startProbe(now);
+            nextProbe = now + jitter(PERIOD_MS);
+        }
+        if (now >= nextAntiEntropy) {
+            auto to = pickTargets(1, 0);
+            if (!to.empty()) sendDigest(to[0].first, to[0].second);
+            nextAntiEntropy = now + jitter(learned ? 2 * PERIOD_MS : ANTI_ENTROPY_MS);     // quicker while the office fills up
+            learned = false;
+        }
+
+        uint64_t next = std::min(nextProbe, nextAntiEntropy);
+        if (probe.timeoutAt) next = std::min(next, probe.timeoutAt);
+        if (!suspects.empty()) next = std::min(next, suspects.begin()->first);
+        return next > now ? next - now : 1;
+    }
+
+    // records of others added or changed, and ips dropped, since the last call
+    bool takeDiff(std::vector<const Record*>& changed, std::vector<uint32_t>& dropped) {
+        for (uint32_t ip : up) {
+            auto it = records.find(ip);
+            if (it != records.end()) changed.push_back(&it->second);
+        }
+        dropped.assign(gone.begin(), gone.end());
+        up.clear();
+        gone.clear();
+        return !changed.empty() || !dropped.empty();
+    }
+
+    const std::map<uint32_t, Record>& all() const { return records; }
+    uint32_t selfIP() const { return self; }
+    bool isRunning() const { return running; }
+
+private:
+    struct Tombstone {
+        uint64_t version;
+        uint32_t incarnation;
+        uint64_t until;
+    };
+
+    struct Probe {
+        uint32_t ip = 0;
+        uint16_t port = 0;
+        uint32_t seq = 0;
+        bool acked = false;
+        uint64_t timeoutAt = 0;
+    };
+
+    struct Rumor {
+        Kind kind;
+        int left;
+    };
+
+    struct Reader {
+        const uint8_t* p;
+        uint32_t len;
+        uint32_t at;
+        bool bad = false;
+        uint64_t get(int n) {
+            if (bad || at + n > len) { bad = true; return 0; }
+            uint64_t v = Engine::get(p + at, n);
+            at += n;
+            return v;
+        }
+    };
+
+    uint64_t jitter(uint32_t ms) { return ms * 3 / 4 + rng() % (ms / 2 + 1); }     // 0.75 .. 1.25 x
+
+    uint64_t log2Members() const { return (uint64_t)std::log2((double)records.size() + 1); }
+
+    void spread(Kind kind, uint32_t ip) { rumors[ip] = { kind, LAMBDA * (int)(log2Members() + 1) }; }
+
+    void suspect(uint32_t ip, uint64_t now) {
+        auto r = records.find(ip);
+        if (r == records.end() || r->second.suspect) return;
+        r->second.suspect = true;
+        r->second.suspectUntil = now + PERIOD_MS * (3 + 2 * log2Members());
+        suspects.insert({ r->second.suspectUntil, ip });
+        spread(SUSPECT, ip);
+    }
+
+    void drop(uint32_t ip, uint64_t now) {
+        auto r = records.find(ip);
+        if (r == records.end() || ip == self) return;
+        tombstones[ip] = { r->second.version, r->second.incarnation, now + TOMBSTONE_MS };
+        records.erase(r);
+        up.erase(ip);
+        gone.insert(ip);
+    }
+
+    bool buried(uint32_t ip, uint64_t version, uint32_t incarnation) const {
+        auto t = tombstones.find(ip);
+        return t != tombstones.end() && !older(t->second.version, t->second.incarnation, version, incarnation);
+    }
+
+    void startProbe(uint64_t now) {
+        probe = Probe{};
+        if (probeOrder.empty()) {
+            for (auto& [ip, r] : records)
+                if (ip != self) probeOrder.push_back(ip);
+            std::shuffle(probeOrder.begin(), probeOrder.end(), rng);
+        }
+        while (!probeOrder.empty() && !probe.ip) {
+            auto r = records.find(probeOrder.back());
+            probeOrder.pop_back();
+            if (r == records.end()) continue;
+            probe.ip = r->first;
+            probe.port = r->second.discoveryPort;
+        }
+        if (probe.ip) {
+            sendProbe(probe.ip, probe.port, now);
+            return;
+        }
+        auto to = pickTargets(1, 0);            // nobody known yet: knock on a seed, never suspected
+        if (!to.empty()) sendProbe(to[0].first, to[0].second, now);
+    }
+
+    void sendProbe(uint32_t ip, uint16_t port, uint64_t now) {
+        probe.seq = ++seq;
+        probe.timeoutAt = now + PROBE_TIMEOUT_MS;
+        std::vector<uint8_t> msg = header(probe.seq);
+        put(msg, 0, 6);
+        sendWithRumors(ip, port, PRESENCE_PROBE, msg);
+    }
+
+    void askOthers() {
+        if (!probe.ip) return;
+        for (auto& [ip, port] : pickTargets(INDIRECT, probe.ip)) {
+            std::vector<uint8_t> msg = header(probe.seq);
+            put(msg, probe.ip, 4);
+            put(msg, probe.port, 2);
+            sendWithRumors(ip, port, PRESENCE_PROBE_REQ, msg);
+        }
+    }
+
+    // (ip, discovery port) of up to n random members other than us and `except`; seeds fill
+    // in while too few members are known
+    std::vector<std::pair<uint32_t, uint16_t>> pickTargets(size_t n, uint32_t except) {
+        std::vector<std::pair<uint32_t, uint16_t>> all;
+        for (auto& [ip, r] : records)
+            if (ip != self && ip != except) all.push_back({ ip, r.discoveryPort });
+        if (all.size() < n)
+            for (auto& [ip, port] : seeds)
+                if (ip != except && !records.count(ip)) all.push_back({ ip, port });
+        for (size_t i = 0; i < n && i < all.size(); ++i)
+            std::swap(all[i], all[i + rng() % (all.size() - i)]);
+        if (all.size() > n) all.resize(n);
+        return all;
+    }
+
+    std::vector<uint8_t> header(uint32_t s) {
+        std::vector<uint8_t> out{ VERSION };
+        put(out, s, 4);
+        return out;
+    }
+
+    // appends the rumors that fit and sends. Suspicions, deaths and our own record go first,
+    // so a refutation is not queued behind a burst of joins; then the least sent.
+    void sendWithRumors(uint32_t ip, uint16_t port, uint8_t type, std::vector<uint8_t>& msg) {
+        std::vector<std::tuple<bool, int, uint32_t>> order;
+        for (auto& [rip, r] : rumors) order.push_back({ r.kind == ALIVE && rip != self, -r.left, rip });
+        std::sort(order.begin(), order.end());
+
+        size_t countAt = msg.size();
+        put(msg, 0, 2);
+        uint16_t count = 0;
+        for (auto& [_, __, rip] : order) {
+            auto it = rumors.find(rip);
+            if (!appendEntry(msg, it->second.kind, rip, MAX_DATAGRAM)) {
+                if (!records.count(rip) && !tombstones.count(rip)) rumors.erase(it);
+                continue;
+            }
+            ++count;
+            if (--it->second.left <= 0) rumors.erase(it);
+        }
+        msg[countAt] = uint8_t(count);
+        msg[countAt + 1] = uint8_t(count >> 8);
+        if (send) send(ip, port, type, msg.data(), (uint32_t)msg.size());
+    }
+
+    // false if the entry would take `out` past `limit` or its subject is gone
+    bool appendEntry(std::vector<uint8_t>& out, Kind kind, uint32_t ip, size_t limit) {
+        uint64_t version;
+        uint32_t incarnation;
+        auto r = records.find(ip);
+        if (kind == DEAD) {
+            auto t = tombstones.find(ip);
+            if (t == tombstones.end()) return false;
+            version = t->second.version;
+            incarnation = t->second.incarnation;
+        }
+        else {
+            if (r == records.end()) return false;
+            version = r->second.version;
+            incarnation = r->second.incarnation;
+        }
+
+        size_t size = ENTRY_SIZE + (kind == FULL ? FULL_EXTRA + r->second.info.size() : 0);
+        if (out.size() + size > limit) return false;
+        out.push_back(kind);
+        put(out, ip, 4);
+        put(out, version, 8);
+        put(out, incarnation, 4);
+        if (kind == FULL) {
+            put(out, r->second.tcpPort, 2);
+            put(out, r->second.discoveryPort, 2);
+            put(out, r->second.info.size(), 2);
+            out.insert(out.end(), r->second.info.begin(), r->second.info.end());
+        }
+        return true;
+    }
+
+    // applies the entries; records that are newer elsewhere but not in hand land in `wanted`
+    bool readEntries(Reader& in, uint64_t now, std::vector<uint32_t>& wanted) {
+        uint32_t n = (uint32_t)in.get(2);
+        for (uint32_t i = 0; i < n && !in.bad; ++i) {
+            Kind kind = (Kind)in.get(1);
+            uint32_t ip = (uint32_t)in.get(4);
+            uint64_t version = in.get(8);
+            uint32_t incarnation = (uint32_t)in.get(4);
+            Record full;
+            if (kind == FULL) {
+                full.tcpPort = (uint16_t)in.get(2);
+                full.discoveryPort = (uint16_t)in.get(2);
+                uint32_t infoLen = (uint32_t)in.get(2);
+                if (in.bad || infoLen > MAX_INFO || in.at + infoLen > in.len) return false;
+                full.info.assign((const char*)in.p + in.at, infoLen);
+                in.at += infoLen;
+            }
+            if (in.bad) return false;
+            apply(kind, ip, version, incarnation, full, now, wanted);
+        }
+        return !in.bad;
+    }
+
+    void apply(Kind kind, uint32_t ip, uint64_t version, uint32_t incarnation, Record& full, uint64_t now,
+               std::vector<uint32_t>& wanted) {
+        auto r = records.find(ip);
+        if (ip == self) {                       // a rumor of our death: outbid it
+            Record& me = r->second;
+            if ((kind == SUSPECT || kind == DEAD) && !older(version, incarnation, me.version, me.incarnation)) {
+                me.version = version;
+                me.incarnation = incarnation + 1;
+                spread(ALIVE, self);
+            }
+            return;
+        }
+
+        switch (kind) {
+        case ALIVE:
+            if (buried(ip, version, incarnation)) return;
+            if (r == records.end() || r->second.version < version) {
+                auto asked = pulling.find(ip);
+                if (asked == pulling.end() || now >= asked->second + PERIOD_MS) {
+                    pulling[ip] = now;
+                    wanted.push_back(ip);
+                }
+                return;
+            }
+            if (r->second.version > version || r->second.incarnation >= incarnation) return;
+            r->second.incarnation = incarnation;
+            r->second.suspect = false;
+            spread(ALIVE, ip);
+            return;
+        case FULL: {
+            if (buried(ip, version, incarnation)) return;
+            if (r != records.end() && !older(r->second.version, r->second.incarnation, version, incarnation)) return;
+            bool added = r == records.end();
+            if (added || r->second.info != full.info || r->second.tcpPort != full.tcpPort) up.insert(ip);
+            if (added) {
+                probeOrder.insert(probeOrder.begin() + rng() % (probeOrder.size() + 1), ip);
+                learned = true;
+            }
+            full.ip = ip;
+            full.version = version;
+            full.incarnation = incarnation;
+            records[ip] = full;
+            tombstones.erase(ip);
+            pulling.erase(ip);
+            spread(ALIVE, ip);
+            return;
+        }
+        case SUSPECT:
+            if (r == records.end() || r->second.version < version) {
+                if (!buried(ip, version, incarnation)) wanted.push_back(ip);
+                return;
+            }
+            if (r->second.version > version || r->second.incarnation > incarnation) return;
+            if (r->second.incarnation == incarnation && r->second.suspect) return;
+            r->second.incarnation = incarnation;
+            r->second.suspect = false;
+            suspect(ip, now);
+            return;
+        case DEAD:
+            if (r == records.end() || older(version, incarnation, r->second.version, r->second.incarnation)) return;
+            drop(ip, now);
+            tombstones[ip] = { version, incarnation, now + TOMBSTONE_MS };
+            spread(DEAD, ip);
+            return;
+        }
+    }
+
+    // chunks cover consecutive ip ranges, so a record missing from a chunk is missing for real
+    void sendDigest(uint32_t ip, uint16_t port) {
+        std::vector<uint8_t> entries;
+        uint32_t first = 0;
+        for (auto& [rip, r] : records) {
+            put(entries, rip, 4);
+            put(entries, r.version, 8);
+            put(entries, r.incarnation, 4);
+            if (entries.size() + DIGEST_ENTRY > MAX_DATAGRAM - 11 && rip != 0xFFFFFFFF) {
+                sendDigestChunk(ip, port, first, rip, entries);
+                entries.clear();
+                first = rip + 1;
+            }
+        }
+        sendDigestChunk(ip, port, first, 0xFFFFFFFF, entries);
+    }
+
+    void sendDigestChunk(uint32_t ip, uint16_t port, uint32_t first, uint32_t last, const std::vector<uint8_t>& entries) {
+        std::vector<uint8_t> msg{ VERSION };
+        put(msg, first, 4);
+        put(msg, last, 4);
+        put(msg, entries.size() / DIGEST_ENTRY, 2);
+        msg.insert(msg.end(), entries.begin(), entries.end());
+        if (send) send(ip, port, PRESENCE_DIGEST, msg.data(), (uint32_t)msg.size());
+    }
+
+    // answers with the records the digest lacks or has older, and asks for those it has newer
+    void receiveDigest(uint32_t fromIP, uint16_t fromPort, Reader& in) {
+        uint32_t first = (uint32_t)in.get(4), last = (uint32_t)in.get(4), n = (uint32_t)in.get(2);
+        if (in.bad || in.len != in.at + n * DIGEST_ENTRY) return;
+
+        std::map<uint32_t, std::pair<uint64_t, uint32_t>> theirs;
+        std::vector<uint32_t> wanted;
+        std::vector<std::pair<Kind, uint32_t>> push;
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t ip = (uint32_t)in.get(4);
+            uint64_t version = in.get(8);
+            uint32_t incarnation = (uint32_t)in.get(4);
+            theirs[ip] = { version, incarnation };
+            auto r = records.find(ip);
+            if (buried(ip, version, incarnation)) push.push_back({ DEAD, ip });
+            else if (ip != self && (r == records.end() || older(r->second.version, r->second.incarnation, version, incarnation)))
+                wanted.push_back(ip);
+        }
+        for (auto it = records.lower_bound(first); it != records.end() && it->first <= last; ++it) {
+            auto t = theirs.find(it->first);
+            if (t == theirs.end() || older(t->second.first, t->second.second, it->second.version, it->second.incarnation))
+                push.push_back({ FULL, it->first });
+        }
+        if (!push.empty() || !wanted.empty()) sendDelta(fromIP, fromPort, push, wanted);
+    }
+
+    void receiveDelta(uint32_t fromIP, uint16_t fromPort, Reader& in, uint64_t now) {
+        std::vector<uint32_t> wanted;
+        if (!readEntries(in, now, wanted)) return;
+        uint32_t n = (uint32_t)in.get(2);
+        std::vector<std::pair<Kind, uint32_t>> push;
+        for (uint32_t i = 0; i < n && !in.bad; ++i) {
+            uint32_t ip = (uint32_t)in.get(4);
+            if (records.count(ip)) push.push_back({ FULL, ip });
+        }
+        if (!push.empty() || !wanted.empty()) sendDelta(fromIP, fromPort, push, wanted);
+    }
+
+    // as many datagrams as it takes: entries first, wanted ips in the room left
+    void sendDelta(uint32_t ip, uint16_t port, const std::vector<std::pair<Kind, uint32_t>>& push, const std::vector<uint32_t>& wanted) {
+        size_t next = 0, nextWant = 0;
+        do {
+            std::vector<uint8_t> msg{ VERSION };
+            put(msg, 0, 2);
+            uint16_t count = 0;
+            for (; next < push.size(); ++next) {
+                if (appendEntry(msg, push[next].first, push[next].second, MAX_DATAGRAM - 2)) ++count;
+                else if (records.count(push[next].second) || tombstones.count(push[next].second)) break;
+            }
+            msg[1] = uint8_t(count);
+            msg[2] = uint8_t(count >> 8);
+            size_t n = std::min((MAX_DATAGRAM - 2 - msg.size()) / 4, wanted.size() - nextWant);
+            put(msg, n, 2);
+            for (size_t i = 0; i < n; ++i) put(msg, wanted[nextWant++], 4);
+            if (send) send(ip, port, PRESENCE_DELTA, msg.data(), (uint32_t)msg.size());
+        } while (next < push.size() || nextWant < wanted.size());
+    }
+
+    static void put(std::vector<uint8_t>& out, uint64_t v, int n) {
+        for (int i = 0; i < n; ++i) out.push_back(uint8_t(v >> (8 * i)));
+    }
+
+    static uint64_t get(const uint8_t* p, int n) {
+        uint64_t v = 0;
+        for (int i = 0; i < n; ++i) v |= uint64_t(p[i]) << (8 * i);
+        return v;
+    }
+
+    bool running = false;
+    uint32_t self = 0;
+    uint32_t seq = 0;
+    std::map<uint32_t, Record> records;                     // by ip, ours included
+    std::map<uint32_t, Tombstone> tombstones;
+    std::set<std::pair<uint64_t, uint32_t>> suspects;       // (deadline, ip)
+    std::map<uint32_t, Rumor> rumors;                       // by subject ip, the latest news only
+    std::map<uint32_t, uint64_t> pulling;                   // records asked for, and when
+    std::map<uint32_t, uint16_t> seeds;
+    std::vector<uint32_t> probeOrder;
+    Probe probe;
+    uint64_t nextProbe = 0;
+    uint64_t nextAntiEntropy = 0;
+    bool learned = false;                                   // members added since the last digest
+    std::set<uint32_t> up;                                  // for takeDiff
+    std::set<uint32_t> gone;
+    std::mt19937 rng;
+};
+
+} // namespace presence
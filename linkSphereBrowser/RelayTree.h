@@ -0,0 +1,131 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Relay tree for room audio: which member mixes for which.
+//
+// A member's mixer serves a handful of children; past that its uplink (one encoded stream
+// per child) or CPU (one decode + encode per child) runs out. The master plans a tree in
+// which members with spare capacity mix for others: every node mixes its children, itself,
+// and, unless it is the root, the link to its parent, which gets the mix of the whole
+// subtree and sends back the mix of everything outside it. Each listener still hears every
+// other member, the root only serves its direct children.
+//
+// Members report how many children they can take (RELAY_REPORT, measured by the page from
+// mixer cost and uplink). The master replans whenever members or reports change and sends
+// each member whose place changed its RELAY_PLAN, tagged with the election term so a plan
+// from a deposed master is ignored.
+namespace relay {
+
+constexpr uint8_t RELAY_PLAN = 0x91;        // MsgType.RELAY_PLAN
+constexpr uint8_t RELAY_REPORT = 0x92;      // MsgType.RELAY_REPORT
+constexpr uint8_t VERSION = 1;
+constexpr uint16_t DEFAULT_CAPACITY = 8;    // children assumed for a member that did not report
+
+struct Node {
+    uint32_t ip = 0;
+    uint16_t port = 0;
+    uint64_t key() const { return (uint64_t(ip) << 16) | port; }
+    bool operator==(const Node& o) const { return ip == o.ip && port == o.port; }
+};
+
+struct Place {
+    Node parent;                            // ip 0 for the root
+    std::vector<Node> children;
+    bool operator==(const Place& o) const { return parent == o.parent && children == o.children; }
+};
+
+struct Member {
+    Node node;
+    uint16_t capacity = DEFAULT_CAPACITY;
+    int64_t rttNs = 0;                      // to the root, 0 if unknown
+};
+
+// breadth-first: members sorted by capacity (then RTT to the root) fill the free child slots
+// of the shallowest nodes first, so the strongest members end up as relays near the root
+// and the tree is as shallow as the capacities allow
+inline std::map<uint64_t, Place> plan(const Node& root, uint16_t rootCapacity, std::vector<Member> members) {
+    std::sort(members.begin(), members.end(), [](const Member& a, const Member& b) {
+        if (a.capacity != b.capacity) return a.capacity > b.capacity;
+        if (a.rttNs != b.rttNs) return a.rttNs < b.rttNs;
+        return a.node.key() < b.node.key();
+        });
+
+    std::map<uint64_t, Place> out;
+    out[root.key()] = Place{};
+    struct Open { Node node; uint16_t free; };
+    std::vector<Open> open{ { root, std::max<uint16_t>(rootCapacity, 1) } };
+    size_t next = 0;
+
+    for (const Member& m : members) {
+        if (m.node == root) continue;
+        while (next < open.size() && open[next].free == 0) ++next;
+        if (next == open.size()) {          // capacities do not cover everyone: overload the root
+            open.push_back({ root, uint16_t(members.size()) });
+            continue;
+        }
+        Open& parent = open[next];
+        --parent.free;
+        out[parent.node.key()].children.push_back(m.node);
+        out[m.node.key()].parent = parent.node;
+        if (m.capacity) open.push_back({ m.node, m.capacity });
+    }
+    return out;
+}
+
+inline void put(std::vector<uint8_t>& out, uint64_t v, int n) {
+    for (int i = 0; i < n; ++i) out.push_back(uint8_t(v >> (8 * i)));
+}
+
+inline uint64_t get(const uint8_t* p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; ++i) v |= uint64_t(p[i]) << (8 * i);
+    return v;
+}
+
+// RELAY_PLAN payload: version, term, parent ip/port, child count, children ip/port
+inline std::vector<uint8_t> encodePlan(uint64_t term, const Place& place) {
+    std::vector<uint8_t> out;
+    out.push_back(VERSION);
+    put(out, term, 8);
+    put(out, place.parent.ip, 4);
+    put(out, place.parent.port, 2);
+    put(out, place.children.size(), 2);
+    for (const Node& c : place.children) {
+        put(out, c.ip, 4);
+        put(out, c.port, 2);
+    }
+    return out;
+}
+
+inline bool decodePlan(const uint8_t* p, uint32_t len, uint64_t& term, Place& place) {
+    if (len < 17 || p[0] != VERSION) return false;
+    uint32_t n = (uint32_t)get(p + 15, 2);
+    if (len != 17 + 6 * n) return false;
+    term = get(p + 1, 8);
+    place.parent = { (uint32_t)get(p + 9, 4), (uint16_t)get(p + 13, 2) };
+    place.children.clear();
+    for (uint32_t i = 0; i < n; ++i)
+        place.children.push_back({ (uint32_t)get(p + 17 + 6 * i, 4), (uint16_t)get(p + 21 + 6 * i, 2) });
+    return true;
+}
+
+// RELAY_REPORT payload: version, sender's TCP server port, children it can take
+inline std::vector<uint8_t> encodeReport(uint16_t port, uint16_t capacity) {
+    std::vector<uint8_t> out;
+    out.push_back(VERSION);
+    put(out, port, 2);
+    put(out, capacity, 2);
+    return out;
+}
+
+inline bool decodeReport(const uint8_t* p, uint32_t len, uint16_t& port, uint16_t& capacity) {
+    if (len != 5 || p[0] != VERSION) return false;
+    port = (uint16_t)get(p + 1, 2);
+    capacity = (uint16_t)get(p + 3, 2);
+    return true;
+}
+
+} // namespace relay
@@ -0,0 +1,181 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <set>
+#include <vector>
+
+// Lease-based master election for a room, run natively so a failover costs a lease timeout
+// plus one message instead of JS vote rounds over the WebView bridge.
+//
+// The master sends ROOM_LEASE to every member each lease / 3 ms. A lease carries a term, the
+// fencing token: it grows by one with every takeover, a node only follows leases of the
+// highest term it has seen, and the page gets it with every change so it can ignore a stale
+// master. When a follower's lease runs out, every node ranks the members it knows (the old
+// master excluded) by (ip, port) and the highest takes over at once; if that candidate sends
+// nothing within one lease it is skipped as well. Nodes that agree on the member list so
+// agree on the new master without exchanging votes.
+//
+// No sockets or threads here: the owner feeds in time, members and received leases, sends
+// what `send` is given and calls poll() again after the delay it returns.
+class RoomElection {
+public:
+    static constexpr uint8_t ROOM_LEASE = 0x90;     // MsgType.ROOM_LEASE
+    static constexpr uint8_t VERSION = 1;
+    static constexpr uint32_t LEASE_SIZE = 1 + 4 + 8 + 4 + 2 + 4;
+
+    struct Peer {
+        uint32_t ip = 0;
+        uint16_t port = 0;
+        uint64_t key() const { return (uint64_t(ip) << 16) | port; }
+        bool operator==(const Peer& o) const { return ip == o.ip && port == o.port; }
+    };
+
+    enum Role { IDLE, FOLLOWER, ELECTING, MASTER };
+
+    std::function<void(const Peer& to, const uint8_t* lease, uint32_t len)> send;
+    std::function<void(const Peer& master, uint64_t term)> onMaster;
+
+    // joins a room; leaseMs 0 leaves it
+    void setRoom(uint32_t roomHash, Peer me, uint32_t leaseMs) {
+        room = roomHash;
+        self = me;
+        lease = leaseMs;
+        role = IDLE;
+        master = Peer{};
+        suspected.clear();
+        if (!leaseMs) members.clear();
+    }
+
+    // everyone else in the room; a master leases new members right away. A peer that failed
+    // as master or candidate stays skipped until it leaves the list or sends a lease.
+    void setMembers(const std::vector<Peer>& peers, uint64_t now) {
+        members.clear();
+        std::set<uint64_t> keep;
+        for (const Peer& p : peers) {
+            if (p == self) continue;
+            members.push_back(p);
+            if (suspected.count(p.key())) keep.insert(p.key());
+        }
+        suspected.swap(keep);
+        if (role == MASTER) nextBeat = now;
+    }
+
+    // the page lost its master (e.g. heard no audio from it): pick one now. While a lease is
+    // valid the current master is announced again instead, so a hiccup does not depose it.
+    void elect(uint64_t now) {
+        if (!lease || role == ELECTING) return;
+        if (role == MASTER || (role == FOLLOWER && now < leaseEnd)) {
+            if (onMaster) onMaster(master, term);
+            return;
+        }
+        if (role == FOLLOWER) suspected.insert(master.key());
+        role = ELECTING;
+        pickCandidate(now);
+    }
+
+    // a ROOM_LEASE payload from the network
+    void receive(const uint8_t* p, uint32_t len, uint64_t now) {
+        if (!lease || len != LEASE_SIZE || p[0] != VERSION || get(p + 1, 4) != room) return;
+        uint64_t t = get(p + 5, 8);
+        Peer from{ (uint32_t)get(p + 13, 4), (uint16_t)get(p + 17, 2) };
+        uint32_t theirLease = (uint32_t)get(p + 19, 4);
+        if (from == self) return;
+
+        if (t < term || (t == term && role == MASTER && from.key() < self.key())) {
+            if (role == MASTER) sendLease(from);        // fence off the stale master
+            return;
+        }
+
+        bool changed = t != term || !(from == master) || role != FOLLOWER;
+        term = t;
+        master = from;
+        role = FOLLOWER;
+        leaseEnd = now + (theirLease ? theirLease : lease);
+        suspected.erase(from.key());
+        if (changed && onMaster) onMaster(master, term);
+    }
+
+    // does what is due at `now`; returns ms until it has to run again, ~0 for never
+    uint64_t poll(uint64_t now) {
+        if (!lease) return ~uint64_t(0);
+        switch (role) {
+        case MASTER:
+            if (now >= nextBeat) {
+                for (const Peer& p : members) sendLease(p);
+                nextBeat = now + beatMs();
+            }
+            return nextBeat - now;
+        case FOLLOWER:
+            if (now < leaseEnd) return leaseEnd - now;
+            suspected.insert(master.key());
+            role = ELECTING;
+            pickCandidate(now);
+            return poll(now);
+        case ELECTING:
+            if (now < candidateEnd) return candidateEnd - now;
+            suspected.insert(candidate.key());
+            pickCandidate(now);
+            return poll(now);
+        default:
+            return ~uint64_t(0);
+        }
+    }
+
+    Role getRole() const { return role; }
+    Peer getMaster() const { return master; }
+    uint64_t getTerm() const { return term; }
+
+private:
+    uint64_t beatMs() const { return lease / 3 ? lease / 3 : 1; }
+
+    void pickCandidate(uint64_t now) {
+        Peer best = self;
+        for (const Peer& p : members)
+            if (!suspected.count(p.key()) && p.key() > best.key()) best = p;
+
+        if (best == self) {
+            ++term;
+            role = MASTER;
+            master = self;
+            nextBeat = now;
+            if (onMaster) onMaster(master, term);
+            return;
+        }
+        candidate = best;
+        candidateEnd = now + lease;
+    }
+
+    void sendLease(const Peer& to) {
+        uint8_t out[LEASE_SIZE];
+        out[0] = VERSION;
+        put(out + 1, room, 4);
+        put(out + 5, term, 8);
+        put(out + 13, self.ip, 4);
+        put(out + 17, self.port, 2);
+        put(out + 19, lease, 4);
+        if (send) send(to, out, LEASE_SIZE);
+    }
+
+    static void put(uint8_t* p, uint64_t v, int n) {
+        for (int i = 0; i < n; ++i) p[i] = uint8_t(v >> (8 * i));
+    }
+
+    static uint64_t get(const uint8_t* p, int n) {
+        uint64_t v = 0;
+        for (int i = 0; i < n; ++i) v |= uint64_t(p[i]) << (8 * i);
+        return v;
+    }
+
+    uint32_t room = 0;
+    uint32_t lease = 0;
+    Peer self;
+    std::vector<Peer> members;
+    Role role = IDLE;
+    Peer master;
+    uint64_t term = 0;
+    uint64_t leaseEnd = 0;
+    uint64_t nextBeat = 0;
+    Peer candidate;
+    uint64_t candidateEnd = 0;
+    std::set<uint64_t> suspected;
+};
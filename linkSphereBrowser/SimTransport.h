@@ -0,0 +1,921 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <queue>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "Transport.h"
+
+// In-process network simulator: NetworkManagers, one per sim::Host, talking over a virtual LAN
+// inside one process, no sockets involved. E.g.
+//   sim::Network lan(seed);
+//   NetworkManager a(onMessageA, onEventA, lan.addHost(ipA)), b(onMessageB, onEventB, lan.addHost(ipB));
+//   lan.setLink(ipA, ipB, { 20000, 5000, 0.02 });      // 20 ms, 5 ms jitter, 2% loss
+//   lan.run(5'000'000'000);                            // 5 s of virtual time
+//
+// Time is virtual: packets are events on the network's clock, which only moves in advance()
+// and run(), or with real time at some rate (runRealtime). NetworkBase's timers, heartbeats
+// and liveness checks read it too (Transport::now), so a 30 s outage takes as long as the test
+// wants it to.
+//
+// Reproducible from the seed: every loss and jitter decision is a hash of (seed, flow, packet
+// number in the flow), so the same traffic meets the same network whatever the thread timing.
+// Not reproducible: NetworkManager's threads are real, so how flows sharing a link interleave
+// (and queue behind each other on a bandwidth limit) and what a thread gets done between two
+// steps still vary from run to run.
+//
+// Per direction between two hosts (LinkModel):
+//   - latency plus uniform jitter; datagrams can overtake each other, TCP keeps its order
+//   - loss, with bursts (two-state Gilbert model); a lost TCP segment arrives RTO later
+//     instead, holding up everything behind it
+//   - bandwidth behind a bottleneck buffer: datagrams beyond it are dropped; TCP senders block
+//     once TCP_WINDOW bytes are unread by the peer, which is also how a slow reader pushes back
+// Traffic to the host's own address or 127/8 is delivered at once.
+//
+// Faults: partition / isolate, crash (silent, peers notice by timeouts only) and restart,
+// stall (a host stops reading), resetConnections (RST), clock skew.
+namespace sim {
+
+using transport::Handle;
+using transport::Buffer;
+
+struct LinkModel {
+    uint32_t latencyUs = 200;           // one way
+    uint32_t jitterUs = 0;              // uniform, on top of the latency
+    double loss = 0;                    // chance a packet is lost
+    double burst = 0;                   // chance the packet after a lost one is lost too
+    uint64_t bytesPerSec = 0;           // 0: unlimited
+    uint32_t queueBytes = 64 * 1024;    // bottleneck buffer in front of the bandwidth limit
+};
+
+struct Stats {
+    uint64_t packets = 0;               // datagrams and TCP segments sent between hosts
+    uint64_t bytes = 0;
+    uint64_t delivered = 0;
+    uint64_t lost = 0;                  // by the loss model; TCP ones are retransmitted
+    uint64_t queueDrops = 0;            // datagrams: bottleneck or receive buffer full
+    uint64_t unreachable = 0;           // datagrams: no host, socket or path; TCP: gave up
+};
+
+constexpr uint32_t TCP_WINDOW = 256 * 1024;
+constexpr uint32_t UDP_RECEIVE_BUFFER = 1024 * 1024;
+constexpr uint64_t RTO_NS = 200'000'000;            // first retransmission, doubled per try
+constexpr int MAX_RETRIES = 7;                      // about 25 s, then the connection is reset
+constexpr int SYN_RETRIES = 3;                      // 1 s, 2 s, 4 s, then the connect times out
+constexpr uint64_t START_NS = 1'000'000'000;        // virtual now() at creation, 0 means "never" in places
+constexpr uint64_t WALL_EPOCH_NS = 1'700'000'000'000'000'000ull;     // virtual wallNow() at now() == 0
+
+class Host;
+
+class Network {
+public:
+    explicit Network(uint64_t seed = 1) : seed(seed) {}
+
+    ~Network() {
+        runRealtime(0);
+    }
+
+    Network(const Network&) = delete;
+    Network& operator=(const Network&) = delete;
+
+    // a machine with address ip, to hand to a NetworkManager; the network has to outlive it
+    std::shared_ptr<Host> addHost(uint32_t ip);
+
+    // ---------------- clock ----------------
+
+    uint64_t now() {
+        std::lock_guard<std::mutex> lock(m);
+        return clock;
+    }
+
+    uint64_t wallNow(uint32_t ip) {
+        std::lock_guard<std::mutex> lock(m);
+        return WALL_EPOCH_NS + clock + hosts[ip].skew;
+    }
+
+    // moves the clock ns ahead, delivering whatever is due on the way in time order
+    void advance(uint64_t ns) {
+        std::lock_guard<std::mutex> lock(m);
+        uint64_t target = clock + ns;
+        while (!events.empty() && events.top().at <= target) {
+            Event ev = events.top();
+            events.pop();
+            clock = std::max(clock, ev.at);
+            ev.fire();
+        }
+        clock = target;
+    }
+
+    // advance() in steps, giving the real threads `pause` to react after each
+    void run(uint64_t ns, uint64_t stepNs = 1'000'000, std::chrono::microseconds pause = std::chrono::microseconds(200)) {
+        for (uint64_t done = 0; done < ns; done += stepNs) {
+            advance(std::min(stepNs, ns - done));
+            std::this_thread::sleep_for(pause);
+        }
+    }
+
+    // the clock follows real time times rate on a thread of its own, 0 stops it
+    void runRealtime(double rate) {
+        pumpRunning = false;
+        if (pumpThread.joinable()) pumpThread.join();
+        if (rate <= 0) return;
+        pumpRunning = true;
+        pumpThread = std::thread([this, rate]() {
+            auto last = std::chrono::steady_clock::now();
+            while (pumpRunning) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                auto t = std::chrono::steady_clock::now();
+                advance(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(t - last).count() * rate));
+                last = t;
+            }
+            });
+    }
+
+    size_t pendingEvents() {
+        std::lock_guard<std::mutex> lock(m);
+        return events.size();
+    }
+
+    // ---------------- model ----------------
+
+    void setDefaultLink(const LinkModel& model) {
+        std::lock_guard<std::mutex> lock(m);
+        defaultLink = model;
+    }
+
+    // traffic from `from` to `to`; set both directions for a symmetric link
+    void setLink(uint32_t from, uint32_t to, const LinkModel& model) {
+        std::lock_guard<std::mutex> lock(m);
+        links[pair(from, to)] = model;
+    }
+
+    // ---------------- faults ----------------
+
+    // nothing gets through between a and b, either way, until healed
+    void partition(uint32_t a, uint32_t b, bool cut) {
+        std::lock_guard<std::mutex> lock(m);
+        if (cut) {
+            cuts.insert(pair(a, b));
+            cuts.insert(pair(b, a));
+        }
+        else {
+            cuts.erase(pair(a, b));
+            cuts.erase(pair(b, a));
+        }
+    }
+
+    // ip is cut off from everyone
+    void isolate(uint32_t ip, bool cut) {
+        std::lock_guard<std::mutex> lock(m);
+        hosts[ip].isolated = cut;
+    }
+
+    // the machine dies without a word: its sockets fail, peers hear nothing from it
+    void crash(uint32_t ip) {
+        std::lock_guard<std::mutex> lock(m);
+        hosts[ip].crashed = true;
+        for (auto& [h, s] : sockets) {
+            if (s->ip != ip) continue;
+            s->dead = true;
+            unbind(h, *s);
+            s->cv.notify_all();
+        }
+    }
+
+    // back up, with none of its old sockets; connections to them are reset when next used
+    void restart(uint32_t ip) {
+        std::lock_guard<std::mutex> lock(m);
+        hosts[ip].crashed = false;
+    }
+
+    // ip stops reading from its sockets (a slow or hung peer), data piles up at it
+    void stall(uint32_t ip, bool stalled) {
+        std::lock_guard<std::mutex> lock(m);
+        hosts[ip].stalled = stalled;
+        for (auto& [h, s] : sockets)
+            if (s->ip == ip) s->cv.notify_all();
+    }
+
+    // every TCP connection of ip is reset, both ends see it at once
+    void resetConnections(uint32_t ip) {
+        std::lock_guard<std::mutex> lock(m);
+        for (auto& [h, s] : sockets) {
+            if (s->ip != ip || s->kind != Socket::TCP) continue;
+            s->reset = true;
+            s->cv.notify_all();
+            if (auto p = get(s->peer)) {
+                p->reset = true;
+                p->cv.notify_all();
+            }
+        }
+    }
+
+    // ip's wall clock (PING / PONG timestamps) runs ns ahead of the others
+    void skewClock(uint32_t ip, int64_t ns) {
+        std::lock_guard<std::mutex> lock(m);
+        hosts[ip].skew = ns;
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(m);
+        return counters;
+    }
+
+private:
+    friend class Host;
+
+    struct Socket {
+        enum Kind { TCP, LISTENER, UDP } kind = TCP;
+        uint32_t ip = 0;                    // the host it lives on
+        uint16_t port = 0;
+        uint32_t localIP = 0;               // address it reports, 127.0.0.1 when dialed that way
+        uint32_t peerIP = 0;                // TCP
+        uint16_t peerPort = 0;
+        uint32_t remoteHost = 0;            // TCP: the host the peer lives on
+        Handle peer = transport::NONE;      // TCP: the other end
+        uint32_t group = 0;                 // UDP joined to a group
+        bool connecting = false, connected = false, refused = false, interrupted = false;
+        bool shut = false, finSent = false, eof = false, reset = false, dead = false, closed = false;
+        std::deque<uint8_t> stream;         // TCP, received and unread
+        uint64_t unacked = 0;               // TCP, sent and not yet read by the peer
+        struct Datagram {
+            uint32_t ip;
+            uint16_t port;
+            std::vector<uint8_t> data;
+        };
+        std::deque<Datagram> datagrams;
+        uint64_t queued = 0;                // bytes in datagrams
+        std::deque<Handle> backlog;         // listener
+        std::condition_variable cv;
+    };
+
+    struct HostState {
+        bool crashed = false;
+        bool stalled = false;
+        bool isolated = false;
+        int64_t skew = 0;
+        uint16_t nextPort = 49152;
+    };
+
+    // per flow, for the loss model and TCP ordering
+    struct FlowState {
+        uint64_t seq = 0;
+        bool lostLast = false;
+        uint64_t lastAt = 0;
+    };
+
+    struct Segment {
+        uint64_t at;
+        std::vector<uint8_t> data;
+        bool fin;
+        int tries;
+    };
+
+    // what one TCP end sent that has not arrived yet; outlives the socket until delivered
+    struct TcpFlow {
+        Handle to = transport::NONE;
+        uint32_t src = 0, dst = 0;
+        uint64_t key = 0;
+        FlowState state;
+        std::deque<Segment> queue;
+    };
+
+    struct Event {
+        uint64_t at;
+        uint64_t order;                     // same time: in the order scheduled
+        std::function<void()> fire;
+        bool operator>(const Event& o) const { return at != o.at ? at > o.at : order > o.order; }
+    };
+
+    std::mutex m;                           // everything below, and every Socket
+    uint64_t seed;
+    uint64_t clock = START_NS;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    uint64_t eventOrder = 0;
+    std::thread pumpThread;
+    std::atomic<bool> pumpRunning{ false };
+
+    std::map<uint32_t, HostState> hosts;
+    std::map<Handle, std::shared_ptr<Socket>> sockets;
+    Handle nextHandle = 1;
+    std::map<uint64_t, Handle> listeners;               // by pair(ip, port)
+    std::map<uint64_t, Handle> udpPorts;                // by pair(ip, port)
+    std::multimap<uint64_t, Handle> groups;             // by pair(group, port)
+    std::map<Handle, TcpFlow> tcpFlows;                 // by sending end
+    std::map<uint64_t, FlowState> udpFlows;             // by flowKey
+
+    LinkModel defaultLink;
+    std::map<uint64_t, LinkModel> links;                // by pair(from, to)
+    std::map<uint64_t, uint64_t> busyUntil;             // by pair(from, to): bandwidth in use until
+    std::set<uint64_t> cuts;                            // by pair(from, to)
+    Stats counters;
+
+    static inline thread_local std::string error;       // Host::lastError
+
+    static uint64_t pair(uint32_t a, uint32_t b) { return (uint64_t(a) << 32) | b; }
+
+    static uint64_t mix(uint64_t x) {                   // splitmix64
+        x += 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+    static uint64_t flowKey(uint32_t srcIP, uint16_t srcPort, uint32_t dstIP, uint16_t dstPort, bool tcp) {
+        return mix(pair(srcIP, dstIP)) ^ ((uint64_t(srcPort) << 17) | (uint64_t(dstPort) << 1) | (tcp ? 1 : 0));
+    }
+
+    // uniform in [0, 1): decision `salt` about packet seq of a flow
+    double chance(uint64_t flow, uint64_t seq, uint64_t salt) {
+        return double(mix(seed ^ mix(flow ^ mix(seq * 4 + salt))) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    void schedule(uint64_t at, std::function<void()> fire) {
+        events.push({ at, ++eventOrder, std::move(fire) });
+    }
+
+    std::shared_ptr<Socket> get(Handle h) {
+        auto it = sockets.find(h);
+        return it == sockets.end() ? nullptr : it->second;
+    }
+
+    Handle add(std::shared_ptr<Socket> s) {
+        Handle h = nextHandle++;
+        sockets[h] = std::move(s);
+        return h;
+    }
+
+    static bool isLocal(uint32_t self, uint32_t ip) {
+        return ip == self || (ip & 0xFF000000) == 0x7F000000;
+    }
+
+    bool crashed(uint32_t ip) {
+        auto it = hosts.find(ip);
+        return it == hosts.end() || it->second.crashed;
+    }
+
+    bool stalled(uint32_t ip) {
+        return hosts[ip].stalled;
+    }
+
+    bool pathUp(uint32_t from, uint32_t to) {
+        return !crashed(to) && !hosts[from].isolated && !hosts[to].isolated && !cuts.count(pair(from, to));
+    }
+
+    const LinkModel& model(uint32_t from, uint32_t to) {
+        auto it = links.find(pair(from, to));
+        return it == links.end() ? defaultLink : it->second;
+    }
+
+    uint16_t ephemeral(uint32_t ip) {
+        HostState& h = hosts[ip];
+        uint16_t port = h.nextPort;
+        h.nextPort = h.nextPort == 65535 ? 49152 : h.nextPort + 1;
+        return port;
+    }
+
+    struct Departure {
+        uint64_t at = 0;
+        bool lost = false;
+        bool dropped = false;               // bottleneck buffer full
+    };
+
+    // when a packet of `bytes` sent now on a flow from one host to another arrives
+    Departure depart(uint32_t from, uint32_t to, FlowState& f, uint64_t key, uint64_t bytes, bool tcp) {
+        const LinkModel& lm = model(from, to);
+        uint64_t seq = f.seq++;
+        Departure d;
+        double p = f.lostLast ? lm.burst : lm.loss;
+        d.lost = p > 0 && chance(key, seq, 0) < p;
+        f.lostLast = d.lost;
+
+        uint64_t start = clock;
+        if (lm.bytesPerSec) {
+            uint64_t& freeAt = busyUntil[pair(from, to)];
+            if (freeAt > clock) {
+                uint64_t backlog = (freeAt - clock) * lm.bytesPerSec / 1000000000;
+                if (!tcp && backlog + bytes > lm.queueBytes) {
+                    d.dropped = true;
+                    return d;
+                }
+                start = freeAt;
+            }
+            freeAt = start + bytes * 1000000000 / lm.bytesPerSec;
+            start = freeAt;
+        }
+        uint64_t jitter = lm.jitterUs ? uint64_t(chance(key, seq, 1) * lm.jitterUs * 1000) : 0;
+        d.at = start + lm.latencyUs * 1000ull + jitter;
+        return d;
+    }
+
+    // drops the socket from the lookups of its host
+    void unbind(Handle h, Socket& s) {
+        auto l = listeners.find(pair(s.ip, s.port));
+        if (s.kind == Socket::LISTENER && l != listeners.end() && l->second == h) listeners.erase(l);
+        auto u = udpPorts.find(pair(s.ip, s.port));
+        if (s.kind == Socket::UDP && u != udpPorts.end() && u->second == h) udpPorts.erase(u);
+        if (s.kind == Socket::UDP && s.group) {
+            auto range = groups.equal_range(pair(s.group, s.port));
+            for (auto it = range.first; it != range.second; ++it)
+                if (it->second == h) {
+                    groups.erase(it);
+                    break;
+                }
+        }
+    }
+
+    static std::vector<uint8_t> gather(const Buffer* bufs, int count, uint64_t limit = ~uint64_t(0)) {
+        std::vector<uint8_t> out;
+        for (int i = 0; i < count && out.size() < limit; ++i) {
+            uint64_t n = std::min<uint64_t>(bufs[i].len, limit - out.size());
+            out.insert(out.end(), bufs[i].data, bufs[i].data + n);
+        }
+        return out;
+    }
+
+    int fail(const char* why) {
+        error = why;
+        return -1;
+    }
+
+    Handle failHandle(const char* why) {
+        error = why;
+        return transport::NONE;
+    }
+
+    // ---------------- TCP ----------------
+
+    Handle connect(uint32_t self, uint32_t ip, uint16_t port) {
+        std::lock_guard<std::mutex> lock(m);
+        if (crashed(self)) return failHandle("host is down");
+        auto s = std::make_shared<Socket>();
+        s->ip = self;
+        s->port = ephemeral(self);
+        s->localIP = (ip & 0xFF000000) == 0x7F000000 ? ip : self;
+        s->peerIP = ip;
+        s->peerPort = port;
+        s->remoteHost = isLocal(self, ip) ? self : ip;
+        s->connecting = true;
+        Handle h = add(s);
+        if (s->remoteHost == self) synArrives(h, 0);
+        else schedule(clock + model(self, s->remoteHost).latencyUs * 1000ull, [this, h]() { synArrives(h, 0); });
+        return h;
+    }
+
+    // the connect reaches the other host, or is retried like a lost SYN
+    void synArrives(Handle h, int tries) {
+        auto c = get(h);
+        if (!c || !c->connecting || c->interrupted) return;
+        uint32_t dst = c->remoteHost;
+        if (dst != c->ip && !pathUp(c->ip, dst)) {
+            if (tries >= SYN_RETRIES) {
+                c->connecting = false;
+                c->cv.notify_all();
+                return;
+            }
+            schedule(clock + (1000000000ull << tries), [this, h, tries]() { synArrives(h, tries + 1); });
+            return;
+        }
+
+        uint64_t back = dst == c->ip ? 0 : model(dst, c->ip).latencyUs * 1000ull;
+        auto l = listeners.find(pair(dst, c->peerPort));
+        auto listener = l == listeners.end() ? nullptr : get(l->second);
+        if (!listener) {
+            auto refuse = [this, h]() {
+                if (auto c = get(h)) {
+                    c->connecting = false;
+                    c->refused = true;
+                    c->cv.notify_all();
+                }
+            };
+            if (back) schedule(clock + back, refuse);
+            else refuse();
+            return;
+        }
+
+        auto s = std::make_shared<Socket>();
+        s->ip = dst;
+        s->port = c->peerPort;
+        s->localIP = c->peerIP;
+        s->peerIP = c->localIP;
+        s->peerPort = c->port;
+        s->remoteHost = c->ip;
+        s->connected = true;
+        s->peer = h;
+        Handle sh = add(s);
+        c->peer = sh;
+        listener->backlog.push_back(sh);
+        listener->cv.notify_all();
+
+        auto accepted = [this, h]() {
+            if (auto c = get(h)) {
+                if (!c->connecting) return;
+                c->connecting = false;
+                c->connected = true;
+                c->cv.notify_all();
+            }
+        };
+        if (back) schedule(clock + back, accepted);
+        else accepted();
+    }
+
+    bool waitConnected(Handle h) {
+        std::unique_lock<std::mutex> lock(m);
+        auto s = get(h);
+        if (!s) return fail("not a socket") == 0;
+        s->cv.wait(lock, [&]() { return !s->connecting || s->interrupted || s->closed || s->dead; });
+        if (s->connected && !s->interrupted && !s->closed && !s->dead) return true;
+        error = s->interrupted ? "connect interrupted" : s->dead ? "host is down" :
+            s->refused ? "connection refused" : "connection timed out";
+        return false;
+    }
+
+    void interrupt(Handle h) {
+        std::lock_guard<std::mutex> lock(m);
+        if (auto s = get(h)) {
+            s->interrupted = true;
+            s->cv.notify_all();
+        }
+    }
+
+    Handle listen(uint32_t self, uint16_t port) {
+        std::lock_guard<std::mutex> lock(m);
+        if (crashed(self)) return failHandle("host is down");
+        if (listeners.count(pair(self, port))) return failHandle("address in use");
+        auto s = std::make_shared<Socket>();
+        s->kind = Socket::LISTENER;
+        s->ip = self;
+        s->port = port;
+        s->localIP = self;
+        Handle h = add(s);
+        listeners[pair(self, port)] = h;
+        return h;
+    }
+
+    Handle accept(Handle listener) {
+        std::unique_lock<std::mutex> lock(m);
+        auto s = get(listener);
+        if (!s || s->kind != Socket::LISTENER) return failHandle("not a listening socket");
+        // a crashed host's listener just goes quiet, as the machine would
+        s->cv.wait(lock, [&]() { return !s->backlog.empty() || s->closed; });
+        if (s->closed) return failHandle("socket closed");
+        Handle h = s->backlog.front();
+        s->backlog.pop_front();
+        return h;
+    }
+
+    int send(Handle h, const Buffer* bufs, int count) {
+        std::unique_lock<std::mutex> lock(m);
+        auto s = get(h);
+        if (!s || s->kind != Socket::TCP) return fail("not a connection");
+        s->cv.wait(lock, [&]() { return s->unacked < TCP_WINDOW || s->shut || s->reset || s->closed || s->dead; });
+        if (s->dead) return fail("host is down");
+        if (s->shut || s->closed) return fail("socket shut down");
+        if (s->reset) return fail("connection reset");
+        if (!s->connected) return fail("not connected");
+
+        std::vector<uint8_t> data = gather(bufs, count, TCP_WINDOW - s->unacked);
+        int n = (int)data.size();
+        s->unacked += n;
+        transmit(h, *s, std::move(data), false);
+        return n;
+    }
+
+    // TCP data (or the FIN) from the socket h into its flow
+    void transmit(Handle h, Socket& s, std::vector<uint8_t> data, bool fin) {
+        if (s.remoteHost == s.ip) {
+            if (auto to = get(s.peer)) arrive(*to, data, fin);
+            return;
+        }
+        TcpFlow& f = tcpFlows[h];
+        if (!f.key) {
+            f.to = s.peer;
+            f.src = s.ip;
+            f.dst = s.remoteHost;
+            f.key = flowKey(s.ip, s.port, s.remoteHost, s.peerPort, true) | 1;
+        }
+        Departure d = depart(f.src, f.dst, f.state, f.key, data.size() + 40, true);
+        counters.packets++;
+        counters.bytes += data.size();
+        uint64_t at = d.at;
+        if (d.lost) {
+            counters.lost++;
+            at += RTO_NS;
+        }
+        at = std::max(at, f.state.lastAt);
+        f.state.lastAt = at;
+        f.queue.push_back({ at, std::move(data), fin, 0 });
+        schedule(at, [this, h]() { pump(h); });
+    }
+
+    // delivers what is due on h's flow, in order; a segment that cannot get through is retried
+    // with backoff and holds up the ones behind it
+    void pump(Handle from) {
+        auto it = tcpFlows.find(from);
+        if (it == tcpFlows.end()) return;
+        TcpFlow& f = it->second;
+        while (!f.queue.empty() && f.queue.front().at <= clock) {
+            Segment& seg = f.queue.front();
+            if (!pathUp(f.src, f.dst)) {
+                if (++seg.tries > MAX_RETRIES) {
+                    counters.unreachable++;
+                    f.queue.clear();
+                    resetEnd(from);
+                    break;
+                }
+                seg.at = clock + (RTO_NS << seg.tries);
+                schedule(seg.at, [this, from]() { pump(from); });
+                break;
+            }
+            auto to = get(f.to);
+            if (!to || to->closed || to->dead || to->reset) {
+                // nobody there any more: an RST goes back, behind whatever that end sent last (its FIN)
+                f.queue.clear();
+                uint64_t at = clock + model(f.dst, f.src).latencyUs * 1000ull;
+                auto back = tcpFlows.find(f.to);
+                if (back != tcpFlows.end()) at = std::max(at, back->second.state.lastAt);
+                schedule(at, [this, from]() { resetEnd(from); });
+                break;
+            }
+            arrive(*to, seg.data, seg.fin);
+            counters.delivered++;
+            f.queue.pop_front();
+        }
+        if (f.queue.empty() && !get(from)) tcpFlows.erase(it);
+    }
+
+    void arrive(Socket& to, const std::vector<uint8_t>& data, bool fin) {
+        to.stream.insert(to.stream.end(), data.begin(), data.end());
+        if (fin) to.eof = true;
+        to.cv.notify_all();
+    }
+
+    void resetEnd(Handle h) {
+        if (auto s = get(h)) {
+            s->reset = true;
+            s->cv.notify_all();
+        }
+    }
+
+    int recv(Handle h, uint8_t* buf, int len) {
+        std::unique_lock<std::mutex> lock(m);
+        auto s = get(h);
+        if (!s || s->kind != Socket::TCP) return fail("not a connection");
+        s->cv.wait(lock, [&]() {
+            return s->shut || s->closed || s->dead || s->reset || (!stalled(s->ip) && (!s->stream.empty() || s->eof));
+            });
+        if (s->dead) return fail("host is down");
+        if (s->closed) return fail("socket closed");
+        if (s->shut) return 0;
+        // what arrived before an RST, the FIN included, is still read
+        if (s->stream.empty()) return s->eof ? 0 : fail("connection reset");
+
+        int n = (int)std::min<size_t>((size_t)len, s->stream.size());
+        std::copy(s->stream.begin(), s->stream.begin() + n, buf);
+        s->stream.erase(s->stream.begin(), s->stream.begin() + n);
+        if (auto p = get(s->peer)) {            // window opens again
+            p->unacked -= std::min<uint64_t>(p->unacked, (uint64_t)n);
+            p->cv.notify_all();
+        }
+        return n;
+    }
+
+    bool peerClosed(Handle h) {
+        std::lock_guard<std::mutex> lock(m);
+        auto s = get(h);
+        return !s || (s->stream.empty() && (s->eof || s->reset || s->dead));
+    }
+
+    bool localAddress(Handle h, uint32_t& ip, uint16_t& port) {
+        std::lock_guard<std::mutex> lock(m);
+        auto s = get(h);
+        if (!s) return fail("not a socket") == 0;
+        ip = s->localIP;
+        port = s->port;
+        return true;
+    }
+
+    bool peerAddress(Handle h, uint32_t& ip, uint16_t& port) {
+        std::lock_guard<std::mutex> lock(m);
+        auto s = get(h);
+        if (!s || s->kind != Socket::TCP || !s->connected) return fail("not connected") == 0;
+        ip = s->peerIP;
+        port = s->peerPort;
+        return true;
+    }
+
+    // ---------------- UDP ----------------
+
+    Handle bindUDP(uint32_t self, uint16_t port) {
+        std::lock_guard<std::mutex> lock(m);
+        if (crashed(self)) return failHandle("host is down");
+        if (!port) port = ephemeral(self);
+        if (udpPorts.count(pair(self, port))) return failHandle("address in use");
+        auto s = std::make_shared<Socket>();
+        s->kind = Socket::UDP;
+        s->ip = self;
+        s->port = port;
+        s->localIP = self;
+        Handle h = add(s);
+        udpPorts[pair(self, port)] = h;
+        return h;
+    }
+
+    Handle joinGroup(uint32_t self, uint32_t group, uint16_t port, uint32_t ifaceIP) {
+        std::lock_guard<std::mutex> lock(m);
+        if (crashed(self)) return failHandle("host is down");
+        auto s = std::make_shared<Socket>();
+        s->kind = Socket::UDP;
+        s->ip = self;
+        s->port = port;
+        s->localIP = ifaceIP ? ifaceIP : self;
+        s->group = group;
+        Handle h = add(s);
+        groups.insert({ pair(group, port), h });
+        return h;
+    }
+
+    int sendTo(Handle h, const Buffer* bufs, int count, uint32_t ip, uint16_t port) {
+        std::lock_guard<std::mutex> lock(m);
+        auto s = get(h);
+        if (!s || s->kind != Socket::UDP) return fail("not a datagram socket");
+        if (s->dead) return fail("host is down");
+        std::vector<uint8_t> data = gather(bufs, count);
+
+        if ((ip >> 28) == 0xE) {                // multicast: every member, ours included
+            auto range = groups.equal_range(pair(ip, port));
+            for (auto it = range.first; it != range.second; ++it) {
+                auto member = get(it->second);
+                if (!member) continue;
+                if (member->ip == s->ip) deliver(it->second, *member, s->localIP, s->port, data);
+                else datagram(*s, member->ip, port, it->second, data);
+            }
+        }
+        else if (isLocal(s->ip, ip)) {
+            Handle to = findUDP(s->ip, port);
+            if (auto r = get(to)) deliver(to, *r, (ip & 0xFF000000) == 0x7F000000 ? ip : s->ip, s->port, data);
+            else counters.unreachable++;
+        }
+        else datagram(*s, ip, port, transport::NONE, data);
+        return (int)data.size();
+    }
+
+    // one datagram onto the link to host `to`; target is a group member, or NONE for whatever is bound to port
+    void datagram(Socket& s, uint32_t to, uint16_t port, Handle target, const std::vector<uint8_t>& data) {
+        uint64_t key = flowKey(s.ip, s.port, to, port, false);
+        Departure d = depart(s.ip, to, udpFlows[key], key, data.size() + 28, false);
+        counters.packets++;
+        counters.bytes += data.size();
+        if (d.dropped) {
+            counters.queueDrops++;
+            return;
+        }
+        if (d.lost) {
+            counters.lost++;
+            return;
+        }
+        schedule(d.at, [this, from = s.ip, fromPort = s.port, to, port, target, data]() {
+            Handle h = target != transport::NONE ? target : findUDP(to, port);
+            auto r = get(h);
+            if (!pathUp(from, to) || !r) {
+                counters.unreachable++;
+                return;
+            }
+            deliver(h, *r, from, fromPort, data);
+        });
+    }
+
+    // the socket bound to ip:port, or a group socket on it
+    Handle findUDP(uint32_t ip, uint16_t port) {
+        auto u = udpPorts.find(pair(ip, port));
+        if (u != udpPorts.end()) return u->second;
+        for (auto& [key, h] : groups) {
+            auto s = get(h);
+            if (s && s->ip == ip && s->port == port) return h;
+        }
+        return transport::NONE;
+    }
+
+    void deliver(Handle, Socket& r, uint32_t fromIP, uint16_t fromPort, const std::vector<uint8_t>& data) {
+        if (r.closed || r.dead) {
+            counters.unreachable++;
+            return;
+        }
+        if (r.queued + data.size() > UDP_RECEIVE_BUFFER) {
+            counters.queueDrops++;
+            return;
+        }
+        r.datagrams.push_back({ fromIP, fromPort, data });
+        r.queued += data.size();
+        counters.delivered++;
+        r.cv.notify_all();
+    }
+
+    int recvFrom(Handle h, uint8_t* buf, int len, uint32_t& ip, uint16_t& port) {
+        std::unique_lock<std::mutex> lock(m);
+        auto s = get(h);
+        if (!s || s->kind != Socket::UDP) return fail("not a datagram socket");
+        s->cv.wait(lock, [&]() { return s->closed || s->dead || (!stalled(s->ip) && !s->datagrams.empty()); });
+        if (s->dead) return fail("host is down");
+        if (s->closed) return fail("socket closed");
+        Socket::Datagram d = std::move(s->datagrams.front());
+        s->datagrams.pop_front();
+        s->queued -= d.data.size();
+        int n = (int)std::min<size_t>((size_t)len, d.data.size());
+        if (n) std::memcpy(buf, d.data.data(), n);
+        ip = d.ip;
+        port = d.port;
+        return n;
+    }
+
+    // ---------------- both ----------------
+
+    void shutdown(Handle h) {
+        std::lock_guard<std::mutex> lock(m);
+        auto s = get(h);
+        if (!s) return;
+        s->shut = true;
+        s->cv.notify_all();
+        sendFin(h, *s);
+    }
+
+    void sendFin(Handle h, Socket& s) {
+        if (s.kind != Socket::TCP || !s.connected || s.finSent || s.dead || s.reset) return;
+        s.finSent = true;
+        transmit(h, s, {}, true);
+    }
+
+    void close(Handle h) {
+        std::unique_lock<std::mutex> lock(m);
+        auto s = get(h);
+        if (!s) return;
+        sendFin(h, *s);
+        unbind(h, *s);
+        std::deque<Handle> pending;
+        pending.swap(s->backlog);
+        s->closed = true;
+        s->cv.notify_all();
+        sockets.erase(h);
+        auto f = tcpFlows.find(h);
+        if (f != tcpFlows.end() && f->second.queue.empty()) tcpFlows.erase(f);
+        lock.unlock();
+        for (Handle p : pending) close(p);      // accepted but never picked up
+    }
+};
+
+// one machine on a Network, the Transport its NetworkManager runs on
+class Host : public transport::Transport {
+public:
+    Host(Network& net, uint32_t ip) : net(net), ip(ip) {}
+
+    uint32_t address() const { return ip; }
+
+    Handle connect(uint32_t to, uint16_t port) override { return net.connect(ip, to, port); }
+    bool waitConnected(Handle h) override { return net.waitConnected(h); }
+    void interrupt(Handle h) override { net.interrupt(h); }
+    Handle listen(uint16_t port) override { return net.listen(ip, port); }
+    Handle accept(Handle listener) override { return net.accept(listener); }
+    int send(Handle h, const Buffer* bufs, int count) override { return net.send(h, bufs, count); }
+    int recv(Handle h, uint8_t* buf, int len) override { return net.recv(h, buf, len); }
+    bool peerClosed(Handle h) override { return net.peerClosed(h); }
+    bool localAddress(Handle h, uint32_t& a, uint16_t& port) override { return net.localAddress(h, a, port); }
+    bool peerAddress(Handle h, uint32_t& a, uint16_t& port) override { return net.peerAddress(h, a, port); }
+    Handle bindUDP(uint16_t port) override { return net.bindUDP(ip, port); }
+    Handle joinGroup(uint32_t group, uint16_t port, uint32_t ifaceIP) override { return net.joinGroup(ip, group, port, ifaceIP); }
+    int sendTo(Handle h, const Buffer* bufs, int count, uint32_t to, uint16_t port) override { return net.sendTo(h, bufs, count, to, port); }
+    int recvFrom(Handle h, uint8_t* buf, int len, uint32_t& from, uint16_t& port) override { return net.recvFrom(h, buf, len, from, port); }
+    void shutdown(Handle h) override { net.shutdown(h); }
+    void close(Handle h) override { net.close(h); }
+    std::string lastError() override { return Network::error; }
+    std::vector<uint32_t> localIPs() override { return { ip }; }
+
+    uint64_t now() override { return net.now(); }
+    uint64_t wallNow() override { return net.wallNow(ip); }
+    // virtual time can jump (advance), so the timer thread looks again every real ms
+    std::chrono::nanoseconds realDelay(uint64_t ms) override { return std::chrono::milliseconds(std::min<uint64_t>(ms, 1)); }
+
+private:
+    Network& net;
+    uint32_t ip;
+};
+
+inline std::shared_ptr<Host> Network::addHost(uint32_t ip) {
+    {
+        std::lock_guard<std::mutex> lock(m);
+        hosts[ip];
+    }
+    return std::make_shared<Host>(*this, ip);
+}
+
+} // namespace sim
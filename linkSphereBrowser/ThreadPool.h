@@ -5,6 +5,9 @@
 #include <mutex>
 #include <condition_variable>
 #include <functional>
+#include "Metrics.h"
+#include "Tracing.h"
+#include "Log.h"
 
 class ThreadPool {
 public:
@@ -15,21 +18,28 @@ public:
             workers.emplace_back([this] {
                 for (;;) {
                     std::function<void()> task;
+                    uint64_t queuedAt = 0;
+                    uint64_t traceId = 0;
                     {
                         std::unique_lock<std::mutex> lock(mtx);
                         cv.wait(lock, [this] { return stop || !tasks.empty(); });
                         if (stop && tasks.empty()) return;
-                        task = std::move(tasks.front());
+                        task = std::move(tasks.front().task);
+                        queuedAt = tasks.front().queuedAt;
+                        traceId = tasks.front().traceId;
                         tasks.pop();
                     }
+                    metrics::recordSince(metrics::POOL_QUEUE_WAIT_NS, queuedAt);
+                    tracing::point(tracing::POOL_DEQUEUE, traceId);
+                    tracing::Scope traceScope(traceId);
                     try {
                         task();
                     }
                     catch (const std::exception& e) {
-                        std::cerr << "[ThreadPool] " << e.what() << std::endl;
+                        LS_LOG(logging::Level::Error, "[ThreadPool] {}", e.what());
                     }
                     catch (...) {
-                        std::cerr << "[ThreadPool] unknown exception\n";
+                        LS_LOG(logging::Level::Error, "[ThreadPool] unknown exception");
                     }
                 }
                 });
@@ -37,6 +47,11 @@ public:
     }
 
     ~ThreadPool() {
+        shutdown();
+    }
+
+    // runs what is queued, then joins the workers; tasks enqueued afterwards are dropped
+    void shutdown() {
         {
             std::lock_guard<std::mutex> lock(mtx);
             stop = true;
@@ -46,17 +61,28 @@ public:
             if (t.joinable()) t.join();
     }
 
-    void enqueue(std::function<void()> task) {
+    // traceId: the sampled message the task works for, tracing::current() while it runs
+    void enqueue(std::function<void()> task, uint64_t traceId = 0) {
+        size_t depth;
         {
             std::lock_guard<std::mutex> lock(mtx);
-            tasks.push(std::move(task));
+            if (stop) return;
+            depth = tasks.size();
+            tasks.push({ std::move(task), metrics::now(), traceId });
         }
+        metrics::record(metrics::POOL_QUEUE_DEPTH, depth);
         cv.notify_one();
     }
 
 private:
+    struct Task {
+        std::function<void()> task;
+        uint64_t queuedAt;
+        uint64_t traceId;
+    };
+
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+    std::queue<Task> tasks;
     std::mutex mtx;
     std::condition_variable cv;
     bool stop;
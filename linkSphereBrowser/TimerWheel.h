@@ -0,0 +1,163 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Hierarchical timer wheel (Varghese & Lauck), as used for the per-connection heartbeats and
+// timeouts in NetworkBase.
+//
+// LEVELS wheels of SLOTS slots each; a slot of level n spans SLOTS^n ticks. A timer goes into
+// the lowest level whose span reaches its deadline and is moved one level down each time the
+// wheel below wraps, so schedule and cancel are O(1) (unlinking from an intrusive list) and a
+// tick only touches one slot, plus a cascade every SLOTS ticks.
+//
+// Not thread safe: the owner serialises schedule, cancel and advance. Callbacks run inside
+// advance() and may schedule or cancel timers, including rescheduling themselves.
+class TimerWheel {
+public:
+    using Callback = std::function<void()>;
+    using TimerId = uint64_t;                   // 0 is never a valid id
+
+    static constexpr int SLOT_BITS = 8;
+    static constexpr uint32_t SLOTS = 1u << SLOT_BITS;
+    static constexpr int LEVELS = 4;            // with 1 ms ticks: 256 ms, 65 s, 4.6 h, 49 days
+
+    explicit TimerWheel(uint64_t nowTick = 0) : current(nowTick) {
+        for (auto& level : wheel)
+            for (auto& head : level) head = NIL;
+    }
+
+    // runs cb once `ticks` ticks from now (at least one)
+    TimerId schedule(uint64_t ticks, Callback cb) {
+        uint32_t n = allocate();
+        Node& node = nodes[n];
+        node.deadline = current + (ticks ? ticks : 1);
+        node.callback = std::move(cb);
+        link(n);
+        ++active;
+        return (uint64_t(node.generation) << 32) | n;
+    }
+
+    // false if the timer already fired or was cancelled
+    bool cancel(TimerId id) {
+        uint32_t n = uint32_t(id);
+        if (!id || n >= nodes.size() || nodes[n].generation != uint32_t(id >> 32) || !nodes[n].linked)
+            return false;
+        unlink(n);
+        release(n);
+        --active;
+        return true;
+    }
+
+    // moves the wheel to nowTick, running every timer that is due on the way
+    void advance(uint64_t nowTick) {
+        while (current < nowTick) {
+            ++current;
+            for (int level = 1; level < LEVELS; ++level) {
+                if ((current >> (SLOT_BITS * (level - 1))) & (SLOTS - 1)) break;
+                cascade(level, uint32_t(current >> (SLOT_BITS * level)) & (SLOTS - 1));
+            }
+
+            uint32_t& head = wheel[0][current & (SLOTS - 1)];
+            while (head != NIL) {
+                uint32_t n = head;
+                unlink(n);
+                Callback cb = std::move(nodes[n].callback);
+                release(n);
+                --active;
+                cb();
+            }
+        }
+    }
+
+    // ticks until advance() may have something to do: the next occupied slot of the lowest
+    // wheel, or the next cascade; ~0 if no timer is pending
+    uint64_t ticksUntilNext() const {
+        if (!active) return ~uint64_t(0);
+        uint64_t toWrap = SLOTS - (current & (SLOTS - 1));
+        for (uint64_t d = 1; d < toWrap; ++d)
+            if (wheel[0][(current + d) & (SLOTS - 1)] != NIL) return d;
+        return toWrap;
+    }
+
+    uint64_t now() const { return current; }
+    size_t size() const { return active; }
+
+private:
+    static constexpr uint32_t NIL = ~0u;
+
+    struct Node {
+        uint64_t deadline = 0;
+        Callback callback;
+        uint32_t prev = NIL, next = NIL;
+        uint32_t generation = 1;
+        uint16_t level = 0, slot = 0;
+        bool linked = false;
+    };
+
+    void link(uint32_t n) {
+        Node& node = nodes[n];
+        uint64_t delta = node.deadline > current ? node.deadline - current : 0;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) ++level;
+        uint64_t deadline = node.deadline;
+        if (level == LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * LEVELS)))
+            deadline = current + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;      // beyond the top wheel: park at its end
+
+        node.level = uint16_t(level);
+        node.slot = uint16_t((deadline >> (SLOT_BITS * level)) & (SLOTS - 1));
+        uint32_t& head = wheel[level][node.slot];
+        node.prev = NIL;
+        node.next = head;
+        if (head != NIL) nodes[head].prev = n;
+        head = n;
+        node.linked = true;
+    }
+
+    void unlink(uint32_t n) {
+        Node& node = nodes[n];
+        if (node.prev != NIL) nodes[node.prev].next = node.next;
+        else wheel[node.level][node.slot] = node.next;
+        if (node.next != NIL) nodes[node.next].prev = node.prev;
+        node.prev = node.next = NIL;
+        node.linked = false;
+    }
+
+    // re-files every timer of a higher level slot into the levels below
+    void cascade(int level, uint32_t slot) {
+        uint32_t n = wheel[level][slot];
+        wheel[level][slot] = NIL;
+        while (n != NIL) {
+            uint32_t next = nodes[n].next;
+            nodes[n].linked = false;
+            link(n);
+            n = next;
+        }
+    }
+
+    uint32_t allocate() {
+        if (freeList != NIL) {
+            uint32_t n = freeList;
+            freeList = nodes[n].next;
+            nodes[n].next = NIL;
+            return n;
+        }
+        nodes.emplace_back();
+        return uint32_t(nodes.size() - 1);
+    }
+
+    void release(uint32_t n) {
+        Node& node = nodes[n];
+        node.callback = nullptr;
+        node.linked = false;
+        ++node.generation;
+        node.next = freeList;
+        freeList = n;
+    }
+
+    uint32_t wheel[LEVELS][SLOTS];
+    std::vector<Node> nodes;                    // slab, indexed by the low half of a TimerId
+    uint32_t freeList = NIL;
+    uint64_t current;
+    size_t active = 0;
+};
@@ -0,0 +1,207 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include "Metrics.h"
+
+// Sampled message tracing, exported in Chrome Trace Event format (chrome://tracing, Perfetto).
+//
+// A sampled message carries a non-zero trace id: in MessageBlock::getTraceId(), in the v2
+// wire header, and as tracing::current() while a pool task runs on its behalf. Each hop it
+// passes records (id, stage, time) into a ring owned by the recording thread. A message
+// that is not sampled has id 0, so a trace point is a single well-predicted branch and
+// nothing is recorded while sampling is off.
+//
+// Messages from the page are sampled by their position in the page channel: the n-th
+// message of channel generation g gets id (g << 32) | n when n is a multiple of the sample
+// rate. The page computes the same id for its JS_WRITE point without sending anything.
+namespace tracing {
+
+enum Stage : uint8_t {
+    JS_WRITE,           // recorded by the page (MessageHandler.js)
+    RING_READ,          // page message complete in MessageChannel
+    POOL_DEQUEUE,       // ThreadPool starts the task carrying it
+    SEND_ENQUEUE,       // NetworkManager::sendMessage queued it on a connection
+    WIRE_SEND,          // sender thread finished the socket write
+    WIRE_RECEIVE,       // receiver thread completed the frame
+    DISPATCH,           // dispatcher handed it to the pool
+    RING_WRITE,         // written into the page ring
+    STAGE_COUNT
+};
+
+inline const char* const stageNames[STAGE_COUNT] = {
+    "js_write", "ring_read", "pool_dequeue", "send_enqueue",
+    "wire_send", "wire_receive", "dispatch", "ring_write",
+};
+
+namespace detail {
+
+constexpr size_t RING = 4096;       // events kept per thread
+
+// written by one thread, read by the exporter while it may still be written
+struct Slot {
+    std::atomic<uint64_t> id{ 0 };
+    std::atomic<uint64_t> ts{ 0 };
+    std::atomic<uint8_t> stage{ 0 };
+};
+
+struct Buffer {
+    Slot slots[RING];
+    std::atomic<uint64_t> head{ 0 };
+    uint32_t tid = 0;
+};
+
+struct Event {
+    uint64_t id;
+    uint64_t ts;
+    uint8_t stage;
+    uint32_t tid;
+};
+
+inline std::atomic<uint32_t> sampleEvery{ 0 };
+inline std::atomic<uint64_t> localCount{ 0 };
+inline const uint64_t localNonce = std::random_device{}() & 0x7FFFFFFF;
+inline thread_local uint64_t currentId = 0;
+
+// buffers outlive their threads, a new thread reuses a free one and keeps appending to it
+class Registry {
+public:
+    static Registry& instance() {
+        static Registry* r = new Registry();    // never destroyed, like metrics::detail::Registry
+        return *r;
+    }
+
+    Buffer* acquire() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!spare.empty()) {
+            Buffer* b = spare.back();
+            spare.pop_back();
+            return b;
+        }
+        buffers.push_back(std::make_unique<Buffer>());
+        buffers.back()->tid = (uint32_t)buffers.size();
+        return buffers.back().get();
+    }
+
+    void release(Buffer* b) {
+        std::lock_guard<std::mutex> lock(mtx);
+        spare.push_back(b);
+    }
+
+    // copies every event still held; slots the writer may have overwritten during the copy
+    // are dropped
+    void collect(std::vector<Event>& out) {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto& b : buffers) {
+            uint64_t end = b->head.load(std::memory_order_acquire);
+            uint64_t begin = end > RING ? end - RING : 0;
+            size_t first = out.size();
+            for (uint64_t i = begin; i < end; ++i) {
+                const Slot& s = b->slots[i % RING];
+                out.push_back({ s.id.load(std::memory_order_relaxed), s.ts.load(std::memory_order_relaxed),
+                    s.stage.load(std::memory_order_relaxed), b->tid });
+            }
+            // the writer may be filling slot `now` already, which held index now - RING
+            uint64_t now = b->head.load(std::memory_order_acquire);
+            uint64_t safeFrom = now + 1 > RING ? now + 1 - RING : 0;
+            uint64_t stale = safeFrom > begin ? std::min(safeFrom - begin, end - begin) : 0;
+            out.erase(out.begin() + first, out.begin() + first + (size_t)stale);
+        }
+    }
+
+private:
+    std::mutex mtx;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    std::vector<Buffer*> spare;
+};
+
+struct BufferHandle {
+    Buffer* buffer = Registry::instance().acquire();
+    ~BufferHandle() { Registry::instance().release(buffer); }
+};
+
+inline void record(Stage stage, uint64_t id) {
+    thread_local BufferHandle handle;
+    Buffer& b = *handle.buffer;
+    uint64_t h = b.head.load(std::memory_order_relaxed);
+    Slot& s = b.slots[h % RING];
+    s.id.store(id, std::memory_order_relaxed);
+    s.ts.store(metrics::now(), std::memory_order_relaxed);
+    s.stage.store(stage, std::memory_order_relaxed);
+    b.head.store(h + 1, std::memory_order_release);
+}
+
+} // namespace detail
+
+// trace one message in every n, 0 turns tracing off
+inline void setSampleEvery(uint32_t n) {
+    detail::sampleEvery.store(n, std::memory_order_relaxed);
+}
+
+// id of the seq-th message of page channel generation, 0 if it is not sampled
+inline uint64_t pageId(uint32_t generation, uint32_t seq) {
+    uint32_t n = detail::sampleEvery.load(std::memory_order_relaxed);
+    if (!n || seq % n) return 0;
+    return (uint64_t(generation & 0x7FFFFFFF) << 32) | seq;
+}
+
+// id for a message that enters here without one (e.g. from a peer on v1 framing)
+inline uint64_t sample() {
+    uint32_t n = detail::sampleEvery.load(std::memory_order_relaxed);
+    if (!n) return 0;
+    uint64_t c = detail::localCount.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (c % n) return 0;
+    return (uint64_t(1) << 63) | (detail::localNonce << 32) | (c & 0xFFFFFFFF);
+}
+
+inline void point(Stage stage, uint64_t id) {
+    if (id) detail::record(stage, id);
+}
+
+// trace id of the message the current pool task works for
+inline uint64_t current() {
+    return detail::currentId;
+}
+
+struct Scope {
+    uint64_t previous;
+    explicit Scope(uint64_t id) : previous(detail::currentId) { detail::currentId = id; }
+    ~Scope() { detail::currentId = previous; }
+};
+
+// {"traceEvents":[...]}: one complete event per trace point, lasting until the next point of
+// the same message, timestamps in microseconds since the Unix epoch so dumps of the page and
+// of other processes line up
+inline std::string dumpChromeJson() {
+    std::vector<detail::Event> events;
+    detail::Registry::instance().collect(events);
+    std::sort(events.begin(), events.end(), [](const detail::Event& a, const detail::Event& b) {
+        return a.id != b.id ? a.id < b.id : a.ts < b.ts;
+        });
+
+    int64_t epochOffsetNs = (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count() - (int64_t)metrics::now();
+
+    std::string out = "{\"traceEvents\":[";
+    char line[256];
+    for (size_t i = 0; i < events.size(); ++i) {
+        const detail::Event& e = events[i];
+        uint64_t dur = (i + 1 < events.size() && events[i + 1].id == e.id) ? events[i + 1].ts - e.ts : 0;
+        snprintf(line, sizeof(line),
+            "%s{\"name\":\"%s\",\"cat\":\"msg\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"trace\":\"%016llx\"}}",
+            i ? "," : "", e.stage < STAGE_COUNT ? stageNames[e.stage] : "unknown",
+            (double)((int64_t)e.ts + epochOffsetNs) / 1000.0, (double)dur / 1000.0, e.tid, (unsigned long long)e.id);
+        out += line;
+    }
+    out += "],\"displayTimeUnit\":\"ns\"}";
+    return out;
+}
+
+} // namespace tracing
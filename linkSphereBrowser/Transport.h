@@ -0,0 +1,800 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <array>
+#include <stdexcept>
+#include "Metrics.h"
+#include "PeerClock.h"
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "getLocalIPs.h"
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#endif
+#endif
+
+// What NetworkBase needs from the network, so the same connection code runs on real sockets
+// (SocketTransport) or on the simulator (SimTransport.h). Addresses and ports are in host
+// order. Calls block like the socket calls they stand for and may come from any thread;
+// shutdown and close make calls blocked on the same handle return.
+namespace transport {
+
+using Handle = uint64_t;
+constexpr Handle NONE = ~Handle(0);
+
+struct Buffer {
+    const uint8_t* data;
+    uint32_t len;
+};
+
+class Transport {
+public:
+    virtual ~Transport() = default;
+
+    // TCP, connecting side: starts a connect (TCP_NODELAY), NONE if that failed at once;
+    // waitConnected blocks until it is done, false if it failed or interrupt() was called
+    virtual Handle connect(uint32_t ip, uint16_t port) = 0;
+    virtual bool waitConnected(Handle h) = 0;
+    virtual void interrupt(Handle h) = 0;
+
+    // TCP, accepting side; accept returns NONE on failure and once the listener is closed
+    virtual Handle listen(uint16_t port) = 0;
+    virtual Handle accept(Handle listener) = 0;
+    // blocks like accept for the first connection, then takes the ones already waiting, up to
+    // max; 0 on failure and once the listener is closed
+    virtual int acceptBurst(Handle listener, Handle* out, int /*max*/) {
+        out[0] = accept(listener);
+        return out[0] == NONE ? 0 : 1;
+    }
+
+    // bytes written (can be fewer than given) or -1; bytes read, 0 once the peer closed, or -1
+    virtual int send(Handle h, const Buffer* bufs, int count) = 0;
+    virtual int recv(Handle h, uint8_t* buf, int len) = 0;
+    // without blocking: the peer closed or reset the connection and nothing is left to read
+    virtual bool peerClosed(Handle h) = 0;
+    virtual bool localAddress(Handle h, uint32_t& ip, uint16_t& port) = 0;
+    virtual bool peerAddress(Handle h, uint32_t& ip, uint16_t& port) = 0;
+
+    // UDP: a socket on port (any interface), or one joined to group:port on interface ifaceIP
+    virtual Handle bindUDP(uint16_t port) = 0;
+    virtual Handle joinGroup(uint32_t group, uint16_t port, uint32_t ifaceIP) = 0;
+    virtual int sendTo(Handle h, const Buffer* bufs, int count, uint32_t ip, uint16_t port) = 0;
+    virtual int recvFrom(Handle h, uint8_t* buf, int len, uint32_t& ip, uint16_t& port) = 0;
+
+    // recv / recvFrom that also give the wall ns (as wallNow) the data came in at, for PING /
+    // PONG: the kernel's receive timestamp where the transport has one (Linux sockets, TCP and
+    // UDP; on TCP that of the last segment read), else the time the call returned
+    virtual int recvStamped(Handle h, uint8_t* buf, int len, uint64_t& stamp) {
+        int r = recv(h, buf, len);
+        stamp = wallNow();
+        return r;
+    }
+
+    virtual int recvFromStamped(Handle h, uint8_t* buf, int len, uint32_t& ip, uint16_t& port, uint64_t& stamp) {
+        int r = recvFrom(h, buf, len, ip, port);
+        stamp = wallNow();
+        return r;
+    }
+
+    // Socket shard of shards bound to the same port, listening or UDP: the OS hands each new
+    // connection or datagram to the shard of the core that took it in. NONE where ports cannot
+    // be shared that way, the caller then falls back to listen / bindUDP.
+    virtual Handle listenShard(uint16_t /*port*/, uint32_t /*shard*/, uint32_t /*shards*/) { return NONE; }
+    virtual Handle bindUDPShard(uint16_t /*port*/, uint32_t /*shard*/, uint32_t /*shards*/) { return NONE; }
+    // keeps the calling thread, and threads it starts, on core cpu; for the shards' threads
+    virtual void pinThread(uint32_t /*cpu*/) {}
+
+    virtual void shutdown(Handle h) = 0;
+    virtual void close(Handle h) = 0;
+    // close without lingering: unsent data is dropped, a TCP peer gets a reset
+    virtual void abort(Handle h) { close(h); }
+
+    // why the last failed call on this thread failed
+    virtual std::string lastError() = 0;
+    // this machine's IPv4 addresses
+    virtual std::vector<uint32_t> localIPs() = 0;
+
+    // monotonic ns the timers and liveness checks run on, wall ns for PING / PONG
+    virtual uint64_t now() { return metrics::now(); }
+    virtual uint64_t wallNow() { return clockmsg::wallNow(); }
+    // how long the timer thread may sleep, in real time, for ms of now() to pass
+    virtual std::chrono::nanoseconds realDelay(uint64_t ms) { return std::chrono::milliseconds(ms); }
+};
+
+// dotted quad to a host order address
+inline bool parseIPv4(const std::string& text, uint32_t& ip) {
+    uint32_t parts[4];
+    char tail = 0;
+    if (sscanf(text.c_str(), "%u.%u.%u.%u%c", &parts[0], &parts[1], &parts[2], &parts[3], &tail) != 4) return false;
+    ip = 0;
+    for (uint32_t p : parts) {
+        if (p > 255) return false;
+        ip = (ip << 8) | p;
+    }
+    return true;
+}
+
+#ifdef _WIN32
+class SocketTransport : public Transport {
+public:
+    SocketTransport() {
+        WSADATA wsa;
+        started = WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+    }
+
+    ~SocketTransport() override {
+        for (auto& [s, events] : pending) {
+            WSACloseEvent(events.first);
+            WSACloseEvent(events.second);
+        }
+        if (started) WSACleanup();
+    }
+
+    Handle connect(uint32_t ip, uint16_t port) override {
+        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (s == INVALID_SOCKET) return NONE;
+
+        BOOL flag = TRUE;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag));
+
+        u_long nonBlocking = 1;
+        if (ioctlsocket(s, FIONBIO, &nonBlocking) == SOCKET_ERROR) return fail(s);
+
+        sockaddr_in addr = toAddr(ip, port);
+        if (::connect(s, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+            int err = WSAGetLastError();
+            if (err != WSAEWOULDBLOCK && err != WSAEINPROGRESS) return fail(s);
+        }
+
+        WSAEVENT connectEvent = WSACreateEvent();
+        WSAEVENT interruptEvent = WSACreateEvent();
+        if (!connectEvent || !interruptEvent ||
+            WSAEventSelect(s, connectEvent, FD_CONNECT | FD_CLOSE) == SOCKET_ERROR) {
+            int err = WSAGetLastError();
+            if (connectEvent) WSACloseEvent(connectEvent);
+            if (interruptEvent) WSACloseEvent(interruptEvent);
+            closesocket(s);
+            WSASetLastError(err);
+            return NONE;
+        }
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        pending[s] = { connectEvent, interruptEvent };
+        return s;
+    }
+
+    bool waitConnected(Handle h) override {
+        SOCKET s = (SOCKET)h;
+        WSAEVENT events[2];
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            auto it = pending.find(s);
+            if (it == pending.end()) return false;
+            events[0] = it->second.first;
+            events[1] = it->second.second;
+        }
+
+        DWORD w = WSAWaitForMultipleEvents(2, events, FALSE, INFINITE, FALSE);
+        WSANETWORKEVENTS ne{};
+        bool ok = w == WSA_WAIT_EVENT_0 &&
+            WSAEnumNetworkEvents(s, events[0], &ne) != SOCKET_ERROR && ne.iErrorCode[FD_CONNECT_BIT] == 0;
+        if (w == WSA_WAIT_EVENT_0 && !ok && ne.iErrorCode[FD_CONNECT_BIT]) WSASetLastError(ne.iErrorCode[FD_CONNECT_BIT]);
+        if (!ok) return false;
+
+        WSAEventSelect(s, NULL, 0);
+        u_long blocking = 0;
+        ioctlsocket(s, FIONBIO, &blocking);
+        dropPending(s);
+        return true;
+    }
+
+    void interrupt(Handle h) override {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        auto it = pending.find((SOCKET)h);
+        if (it != pending.end()) WSASetEvent(it->second.second);
+    }
+
+    Handle listen(uint16_t port) override {
+        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (s == INVALID_SOCKET) return NONE;
+        BOOL flag = TRUE;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag));      // inherited by accepted sockets
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char*)&flag, sizeof(flag));
+
+        sockaddr_in addr = toAddr(INADDR_ANY, port);
+        if (bind(s, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || ::listen(s, SOMAXCONN) == SOCKET_ERROR)
+            return fail(s);
+        return s;
+    }
+
+    Handle accept(Handle listener) override {
+        SOCKET s = ::accept((SOCKET)listener, nullptr, nullptr);
+        return s == INVALID_SOCKET ? NONE : s;
+    }
+
+    int send(Handle h, const Buffer* bufs, int count) override {
+        WSABUF wsa[2];
+        DWORD sent = 0;
+        if (count > 2 || WSASend((SOCKET)h, toWsa(bufs, count, wsa), count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR)
+            return -1;
+        return (int)sent;
+    }
+
+    int recv(Handle h, uint8_t* buf, int len) override {
+        return ::recv((SOCKET)h, (char*)buf, len, 0);
+    }
+
+    bool peerClosed(Handle h) override {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET((SOCKET)h, &readable);
+        timeval now{ 0, 0 };
+        if (select(0, &readable, nullptr, nullptr, &now) <= 0) return false;
+        char c;
+        return ::recv((SOCKET)h, &c, 1, MSG_PEEK) <= 0;
+    }
+
+    bool localAddress(Handle h, uint32_t& ip, uint16_t& port) override {
+        sockaddr_in a{};
+        int len = sizeof(a);
+        if (getsockname((SOCKET)h, (sockaddr*)&a, &len) != 0) return false;
+        ip = ntohl(a.sin_addr.s_addr);
+        port = ntohs(a.sin_port);
+        return true;
+    }
+
+    bool peerAddress(Handle h, uint32_t& ip, uint16_t& port) override {
+        sockaddr_in a{};
+        int len = sizeof(a);
+        if (getpeername((SOCKET)h, (sockaddr*)&a, &len) != 0) return false;
+        ip = ntohl(a.sin_addr.s_addr);
+        port = ntohs(a.sin_port);
+        return true;
+    }
+
+    Handle bindUDP(uint16_t port) override {
+        SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (s == INVALID_SOCKET) return NONE;
+        int opt = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
+        sockaddr_in addr = toAddr(INADDR_ANY, port);
+        if (bind(s, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) return fail(s);
+        return s;
+    }
+
+    Handle joinGroup(uint32_t group, uint16_t port, uint32_t ifaceIP) override {
+        SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (s == INVALID_SOCKET) return NONE;
+
+        int opt = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));   // every member on this host binds the port
+
+        sockaddr_in addr = toAddr(INADDR_ANY, port);
+        ip_mreq mreq{};
+        mreq.imr_multiaddr.s_addr = htonl(group);
+        mreq.imr_interface.s_addr = htonl(ifaceIP);
+        in_addr iface{};
+        iface.s_addr = htonl(ifaceIP);
+        int ttl = 1;            // stays on the LAN
+        int loop = 1;           // other members on this host, and loopback testing
+
+        if (bind(s, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&mreq, sizeof(mreq)) == SOCKET_ERROR ||
+            setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&iface, sizeof(iface)) == SOCKET_ERROR ||
+            setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl)) == SOCKET_ERROR ||
+            setsockopt(s, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop)) == SOCKET_ERROR)
+            return fail(s);
+        return s;
+    }
+
+    int sendTo(Handle h, const Buffer* bufs, int count, uint32_t ip, uint16_t port) override {
+        sockaddr_in addr = toAddr(ip, port);
+        if (count == 0) return sendto((SOCKET)h, nullptr, 0, 0, (sockaddr*)&addr, sizeof(addr));
+        WSABUF wsa[2];
+        DWORD sent = 0;
+        if (count > 2 || WSASendTo((SOCKET)h, toWsa(bufs, count, wsa), count, &sent, 0, (sockaddr*)&addr, sizeof(addr), nullptr, nullptr) == SOCKET_ERROR)
+            return -1;
+        return (int)sent;
+    }
+
+    int recvFrom(Handle h, uint8_t* buf, int len, uint32_t& ip, uint16_t& port) override {
+        sockaddr_storage from{};
+        int fromLen = sizeof(from);
+        int r = recvfrom((SOCKET)h, (char*)buf, len, 0, (sockaddr*)&from, &fromLen);
+        ip = 0;
+        port = 0;
+        if (r >= 0 && from.ss_family == AF_INET) {
+            sockaddr_in* a = (sockaddr_in*)&from;
+            ip = ntohl(a->sin_addr.s_addr);
+            port = ntohs(a->sin_port);
+        }
+        else if (r >= 0 && from.ss_family == AF_INET6) {
+            static const in6_addr loopback = IN6ADDR_LOOPBACK_INIT;
+            if (memcmp(&((sockaddr_in6*)&from)->sin6_addr, &loopback, sizeof(in6_addr)) == 0) ip = INADDR_LOOPBACK;
+        }
+        return r;
+    }
+
+    void shutdown(Handle h) override {
+        ::shutdown((SOCKET)h, SD_BOTH);
+    }
+
+    void close(Handle h) override {
+        dropPending((SOCKET)h);
+        closesocket((SOCKET)h);
+    }
+
+    void abort(Handle h) override {
+        linger off{ 1, 0 };
+        setsockopt((SOCKET)h, SOL_SOCKET, SO_LINGER, (const char*)&off, sizeof(off));
+        close(h);
+    }
+
+    std::string lastError() override {
+        char* errMsg = nullptr;
+        FormatMessageA(
+            FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+            nullptr, WSAGetLastError(),
+            MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+            (LPSTR)&errMsg, 0, nullptr
+        );
+        std::string msg = errMsg ? errMsg : "Unknown OS error";
+        if (errMsg) LocalFree(errMsg);
+        return msg;
+    }
+
+    std::vector<uint32_t> localIPs() override {
+        std::vector<uint32_t> ips;
+        for (const std::wstring& entry : getLocalIPs()) {       // "ip|type[|default]"
+            uint32_t ip = 0;
+            if (parseIPv4(std::string(entry.begin(), entry.begin() + std::min(entry.find(L'|'), entry.size())), ip))
+                ips.push_back(ip);
+        }
+        return ips;
+    }
+
+private:
+    bool started = false;
+    // connects still in progress: FD_CONNECT event, interrupt event
+    std::map<SOCKET, std::pair<WSAEVENT, WSAEVENT>> pending;
+    std::mutex pendingMutex;
+
+    static sockaddr_in toAddr(uint32_t ip, uint16_t port) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(ip);
+        return addr;
+    }
+
+    static WSABUF* toWsa(const Buffer* bufs, int count, WSABUF* out) {
+        for (int i = 0; i < count; ++i) out[i] = { (ULONG)bufs[i].len, (CHAR*)bufs[i].data };
+        return out;
+    }
+
+    // closes s keeping the error that made us give up on it
+    static Handle fail(SOCKET s) {
+        int err = WSAGetLastError();
+        closesocket(s);
+        WSASetLastError(err);
+        return NONE;
+    }
+
+    void dropPending(SOCKET s) {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        auto it = pending.find(s);
+        if (it == pending.end()) return;
+        WSACloseEvent(it->second.first);
+        WSACloseEvent(it->second.second);
+        pending.erase(it);
+    }
+};
+#else
+// BSD sockets (Linux, the headless relay node). close() shuts the socket down first: unlike
+// closesocket it would not wake a thread blocked in accept or recvfrom on it.
+class SocketTransport : public Transport {
+public:
+    ~SocketTransport() override {
+        for (auto& [fd, wake] : pending) {
+            ::close(wake[0]);
+            ::close(wake[1]);
+        }
+    }
+
+    Handle connect(uint32_t ip, uint16_t port) override {
+        int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (s < 0) return NONE;
+
+        int flag = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        if (fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) < 0) return fail(s);
+        stampReceives(s);
+
+        sockaddr_in addr = toAddr(ip, port);
+        if (::connect(s, (sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) return fail(s);
+
+        std::array<int, 2> wake;
+        if (pipe2(wake.data(), O_CLOEXEC | O_NONBLOCK) < 0) return fail(s);
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        pending[s] = wake;
+        return (Handle)s;
+    }
+
+    bool waitConnected(Handle h) override {
+        int s = (int)h;
+        int wake = -1;
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            auto it = pending.find(s);
+            if (it == pending.end()) return false;
+            wake = it->second[0];
+        }
+
+        pollfd fds[2] = { { s, POLLOUT, 0 }, { wake, POLLIN, 0 } };
+        int r;
+        do r = poll(fds, 2, -1); while (r < 0 && errno == EINTR);
+        if (r < 0) return false;
+        if (fds[1].revents) {
+            errno = EINTR;
+            return false;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) < 0) return false;
+        if (err) {
+            errno = err;
+            return false;
+        }
+
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) & ~O_NONBLOCK);
+        dropPending(s);
+        return true;
+    }
+
+    void interrupt(Handle h) override {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        auto it = pending.find((int)h);
+        if (it != pending.end()) (void)!write(it->second[1], "x", 1);
+    }
+
+    Handle listen(uint16_t port) override {
+        int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (s < 0) return NONE;
+        int flag = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));      // inherited by accepted sockets
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+        sockaddr_in addr = toAddr(INADDR_ANY, port);
+        if (bind(s, (sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(s, SOMAXCONN) < 0) return fail(s);
+        return (Handle)s;
+    }
+
+    Handle accept(Handle listener) override {
+        int s;
+        do s = accept4((int)listener, nullptr, nullptr, SOCK_CLOEXEC); while (s < 0 && errno == EINTR);
+        if (s < 0) return NONE;
+        stampReceives(s);
+        return (Handle)s;
+    }
+
+    // one thread accepts on a listener, so a connection poll saw is still there for accept4
+    int acceptBurst(Handle listener, Handle* out, int max) override {
+        int n = 0;
+        while (n < max) {
+            pollfd fd = { (int)listener, POLLIN, 0 };
+            if (n && poll(&fd, 1, 0) <= 0) break;
+            Handle h = accept(listener);
+            if (h == NONE) break;
+            out[n++] = h;
+        }
+        return n;
+    }
+
+    int send(Handle h, const Buffer* bufs, int count) override {
+        iovec iov[2];
+        if (count > 2) return -1;
+        for (int i = 0; i < count; ++i) iov[i] = { (void*)bufs[i].data, bufs[i].len };
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent;
+        do sent = sendmsg((int)h, &msg, MSG_NOSIGNAL); while (sent < 0 && errno == EINTR);
+        return (int)sent;
+    }
+
+    int recv(Handle h, uint8_t* buf, int len) override {
+        ssize_t r;
+        do r = ::recv((int)h, buf, len, 0); while (r < 0 && errno == EINTR);
+        return (int)r;
+    }
+
+    bool peerClosed(Handle h) override {
+        pollfd fd = { (int)h, POLLIN, 0 };
+        if (poll(&fd, 1, 0) <= 0) return false;
+        char c;
+        return ::recv((int)h, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0;
+    }
+
+    bool localAddress(Handle h, uint32_t& ip, uint16_t& port) override {
+        sockaddr_in a{};
+        socklen_t len = sizeof(a);
+        if (getsockname((int)h, (sockaddr*)&a, &len) != 0) return false;
+        ip = ntohl(a.sin_addr.s_addr);
+        port = ntohs(a.sin_port);
+        return true;
+    }
+
+    bool peerAddress(Handle h, uint32_t& ip, uint16_t& port) override {
+        sockaddr_in a{};
+        socklen_t len = sizeof(a);
+        if (getpeername((int)h, (sockaddr*)&a, &len) != 0) return false;
+        ip = ntohl(a.sin_addr.s_addr);
+        port = ntohs(a.sin_port);
+        return true;
+    }
+
+    Handle bindUDP(uint16_t port) override {
+        int s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+        if (s < 0) return NONE;
+        int opt = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        stampReceives(s);
+        sockaddr_in addr = toAddr(INADDR_ANY, port);
+        if (bind(s, (sockaddr*)&addr, sizeof(addr)) < 0) return fail(s);
+        return (Handle)s;
+    }
+
+    Handle joinGroup(uint32_t group, uint16_t port, uint32_t ifaceIP) override {
+        int s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+        if (s < 0) return NONE;
+
+        int opt = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));   // every member on this host binds the port
+        stampReceives(s);
+
+        sockaddr_in addr = toAddr(INADDR_ANY, port);
+        ip_mreq mreq{};
+        mreq.imr_multiaddr.s_addr = htonl(group);
+        mreq.imr_interface.s_addr = htonl(ifaceIP);
+        in_addr iface{};
+        iface.s_addr = htonl(ifaceIP);
+        unsigned char ttl = 1;      // stays on the LAN
+        unsigned char loop = 1;     // other members on this host, and loopback testing
+
+        if (bind(s, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+            setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 ||
+            setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0 ||
+            setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+            setsockopt(s, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
+            return fail(s);
+        return (Handle)s;
+    }
+
+    int sendTo(Handle h, const Buffer* bufs, int count, uint32_t ip, uint16_t port) override {
+        sockaddr_in addr = toAddr(ip, port);
+        iovec iov[2];
+        if (count > 2) return -1;
+        for (int i = 0; i < count; ++i) iov[i] = { (void*)bufs[i].data, bufs[i].len };
+        msghdr msg{};
+        msg.msg_name = &addr;
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent;
+        do sent = sendmsg((int)h, &msg, MSG_NOSIGNAL); while (sent < 0 && errno == EINTR);
+        return (int)sent;
+    }
+
+    int recvFrom(Handle h, uint8_t* buf, int len, uint32_t& ip, uint16_t& port) override {
+        sockaddr_storage from{};
+        socklen_t fromLen = sizeof(from);
+        ssize_t r;
+        do r = recvfrom((int)h, buf, len, 0, (sockaddr*)&from, &fromLen); while (r < 0 && errno == EINTR);
+        return sender(r, from, ip, port);
+    }
+
+#ifdef __linux__
+    int recvStamped(Handle h, uint8_t* buf, int len, uint64_t& stamp) override {
+        return recvWithStamp((int)h, buf, len, nullptr, stamp);
+    }
+
+    int recvFromStamped(Handle h, uint8_t* buf, int len, uint32_t& ip, uint16_t& port, uint64_t& stamp) override {
+        sockaddr_storage from{};
+        return sender(recvWithStamp((int)h, buf, len, &from, stamp), from, ip, port);
+    }
+#endif
+
+    void shutdown(Handle h) override {
+        ::shutdown((int)h, SHUT_RDWR);
+    }
+
+    void close(Handle h) override {
+        dropPending((int)h);
+        ::shutdown((int)h, SHUT_RDWR);
+        ::close((int)h);
+    }
+
+    void abort(Handle h) override {
+        linger off{ 1, 0 };
+        setsockopt((int)h, SOL_SOCKET, SO_LINGER, &off, sizeof(off));
+        close(h);
+    }
+
+#ifdef __linux__
+    Handle listenShard(uint16_t port, uint32_t shard, uint32_t shards) override {
+        int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (s < 0) return NONE;
+        int flag = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0) return fail(s);
+
+        sockaddr_in addr = toAddr(INADDR_ANY, port);
+        if (bind(s, (sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(s, SOMAXCONN) < 0) return fail(s);
+        if (shard == 0) steerByCpu(s, shards);
+        return (Handle)s;
+    }
+
+    Handle bindUDPShard(uint16_t port, uint32_t shard, uint32_t shards) override {
+        int s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+        if (s < 0) return NONE;
+        int opt = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) return fail(s);
+        stampReceives(s);
+        sockaddr_in addr = toAddr(INADDR_ANY, port);
+        if (bind(s, (sockaddr*)&addr, sizeof(addr)) < 0) return fail(s);
+        if (shard == 0) steerByCpu(s, shards);
+        return (Handle)s;
+    }
+
+    void pinThread(uint32_t cpu) override {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu % CPU_SETSIZE, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+
+    std::string lastError() override {
+        return strerror(errno);
+    }
+
+    std::vector<uint32_t> localIPs() override {
+        std::vector<uint32_t> ips;
+        ifaddrs* list = nullptr;
+        if (getifaddrs(&list) != 0) return ips;
+        for (ifaddrs* a = list; a; a = a->ifa_next)
+            if (a->ifa_addr && a->ifa_addr->sa_family == AF_INET)
+                ips.push_back(ntohl(((sockaddr_in*)a->ifa_addr)->sin_addr.s_addr));
+        freeifaddrs(list);
+        return ips;
+    }
+
+private:
+    // connects still in progress: the pipe interrupt() writes to
+    std::map<int, std::array<int, 2>> pending;
+    std::mutex pendingMutex;
+
+    static sockaddr_in toAddr(uint32_t ip, uint16_t port) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(ip);
+        return addr;
+    }
+
+    // recvFrom's result for r bytes from from
+    static int sender(ssize_t r, const sockaddr_storage& from, uint32_t& ip, uint16_t& port) {
+        ip = 0;
+        port = 0;
+        if (r == 0 && from.ss_family == AF_UNSPEC) {        // shut down by close(), not a datagram
+            errno = ESHUTDOWN;
+            return -1;
+        }
+        if (r >= 0 && from.ss_family == AF_INET) {
+            const sockaddr_in* a = (const sockaddr_in*)&from;
+            ip = ntohl(a->sin_addr.s_addr);
+            port = ntohs(a->sin_port);
+        }
+        return (int)r;
+    }
+
+    // software receive timestamps on s, read back by recvWithStamp
+    static void stampReceives(int s) {
+#ifdef __linux__
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+#else
+        (void)s;
+#endif
+    }
+
+#ifdef __linux__
+    // the port group s is the first of picks its socket by the receiving core (the shards join
+    // in order, shard i is socket i); where the kernel refuses the program it hashes the
+    // addresses instead, still spread but not core-local
+    static void steerByCpu(int s, uint32_t shards) {
+        sock_filter code[] = {
+            { BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t(SKF_AD_OFF + SKF_AD_CPU) },
+            { BPF_ALU | BPF_MOD | BPF_K, 0, 0, shards },
+            { BPF_RET | BPF_A, 0, 0, 0 },
+        };
+        sock_fprog prog = { (unsigned short)(sizeof(code) / sizeof(code[0])), code };
+        setsockopt(s, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+    }
+
+    // recv(from) through recvmsg, with the SCM_TIMESTAMPING stamp of what was read; wallNow()
+    // if the kernel attached none
+    int recvWithStamp(int s, uint8_t* buf, int len, sockaddr_storage* from, uint64_t& stamp) {
+        iovec iov = { buf, (size_t)len };
+        alignas(cmsghdr) char control[CMSG_SPACE(3 * sizeof(timespec))];
+        msghdr msg{};
+        msg.msg_name = from;
+        msg.msg_namelen = from ? sizeof(*from) : 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t r;
+        do r = recvmsg(s, &msg, 0); while (r < 0 && errno == EINTR);
+        stamp = 0;
+        for (cmsghdr* c = r > 0 ? CMSG_FIRSTHDR(&msg) : nullptr; c; c = CMSG_NXTHDR(&msg, c))
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+                timespec ts;                                    // [0] is the software stamp
+                std::memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                stamp = uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+            }
+        if (!stamp) stamp = wallNow();
+        return (int)r;
+    }
+#endif
+
+    // closes s keeping the error that made us give up on it
+    static Handle fail(int s) {
+        int err = errno;
+        ::close(s);
+        errno = err;
+        return NONE;
+    }
+
+    void dropPending(int s) {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        auto it = pending.find(s);
+        if (it == pending.end()) return;
+        ::close(it->second[0]);
+        ::close(it->second[1]);
+        pending.erase(it);
+    }
+};
+#endif
+
+// the real network of this platform
+inline std::shared_ptr<Transport> platformDefault() {
+    return std::make_shared<SocketTransport>();
+}
+
+} // namespace transport
@@ -0,0 +1,133 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// Wire framing shared by the TCP and UDP paths of NetworkBase.
+//
+// v1 (what every peer understands): a TCP frame / UDP datagram is the net message of a
+// MessageBlock: 4-byte big-endian totalSize (payload + 17), type byte, payload.
+//
+// v2 (negotiated per connection, falls back to v1 for old peers):
+//   TCP: right after connecting both sides send WIRE_HELLO, a 4-byte v1 size field below 17
+//        that old receivers already skip. A side that receives the peer's hello sends
+//        WIRE_SWITCH in-band and from then on writes v2 frames:
+//            varint((payloadLen << 5) | (traced << 4) | (compressed << 3) | code)
+//            [literal type byte if code == 7] [8-byte trace id if traced] payload
+//        code 0-6 is a slot in the per-direction type dictionary; code 7 carries the type
+//        byte literally and appends it to the dictionary while slots are free. Both ends
+//        fill the dictionary in frame order, so they stay in step without extra messages.
+//        The compressed bit is only set towards peers that also sent WIRE_CAP_LZ4; the
+//        payload is then in the format described in Compression.h. The trace id (little
+//        endian) is only sent for messages sampled by Tracing.h.
+//   UDP: sent only to the ip:port of a TCP server we dialed and that said hello, while that
+//        connection is up (pages send a peer's datagrams to its server's port number):
+//            (WIRE_UDP_V2 | flags) type [8-byte trace id if flags & WIRE_UDP_TRACED] payload
+//        A v1 datagram always starts with 0x00 (sizes are far below 16 MB), so the first
+//        byte tells the formats apart. The other flag bits are reserved for further
+//        optional fields and must be 0.
+namespace wire {
+
+constexpr uint32_t WIRE_HELLO = 2;          // "I can read v2"
+constexpr uint32_t WIRE_SWITCH = 3;         // "everything after this is v2"
+constexpr uint32_t WIRE_CAP_LZ4 = 4;        // "I can read compressed v2 frames"
+constexpr uint8_t WIRE_UDP_V2 = 0xB0;
+constexpr uint8_t WIRE_UDP_FLAGS_MASK = 0x0F;
+constexpr uint8_t WIRE_UDP_TRACED = 0x01;
+constexpr size_t TRACE_ID_SIZE = 8;
+
+constexpr uint32_t TYPE_LITERAL = 7;
+constexpr size_t MAX_VARINT = 6;
+constexpr size_t MAX_V2_HEADER = MAX_VARINT + 1 + TRACE_ID_SIZE;   // + literal type + trace id
+
+struct TypeDictionary {
+    uint8_t types[TYPE_LITERAL]{};
+    uint8_t count = 0;
+
+    int find(uint8_t type) const {
+        for (int i = 0; i < count; ++i)
+            if (types[i] == type) return i;
+        return -1;
+    }
+
+    void add(uint8_t type) {
+        if (count < TYPE_LITERAL && find(type) < 0) types[count++] = type;
+    }
+};
+
+inline size_t putVarint(uint8_t* out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = uint8_t(v) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = uint8_t(v);
+    return n;
+}
+
+inline void putTraceId(uint8_t* out, uint64_t id) {
+    for (size_t i = 0; i < TRACE_ID_SIZE; ++i) out[i] = uint8_t(id >> (8 * i));
+}
+
+inline uint64_t getTraceId(const uint8_t* in) {
+    uint64_t id = 0;
+    for (size_t i = 0; i < TRACE_ID_SIZE; ++i) id |= uint64_t(in[i]) << (8 * i);
+    return id;
+}
+
+// returns bytes used, 0 if more input is needed, -1 if malformed
+inline int getVarint(const uint8_t* in, size_t len, uint64_t& v) {
+    v = 0;
+    for (size_t i = 0; i < len && i < MAX_VARINT; ++i) {
+        v |= uint64_t(in[i] & 0x7F) << (7 * i);
+        if (!(in[i] & 0x80)) return int(i + 1);
+    }
+    return len >= MAX_VARINT ? -1 : 0;
+}
+
+// encodes a v2 TCP frame header into out (MAX_V2_HEADER bytes), updating the dictionary
+inline size_t encodeV2Header(uint8_t* out, uint8_t type, uint32_t payloadLen, TypeDictionary& dict,
+                             bool compressed = false, uint64_t traceId = 0) {
+    int slot = dict.find(type);
+    uint32_t code = slot >= 0 ? uint32_t(slot) : TYPE_LITERAL;
+
+    size_t n = putVarint(out, (uint64_t(payloadLen) << 5) | (traceId ? 16 : 0) | (compressed ? 8 : 0) | code);
+    if (code == TYPE_LITERAL) {
+        out[n++] = type;
+        dict.add(type);
+    }
+    if (traceId) {
+        putTraceId(out + n, traceId);
+        n += TRACE_ID_SIZE;
+    }
+    return n;
+}
+
+// decodes a v2 TCP frame header; returns bytes used, 0 if more input is needed, -1 if malformed
+inline int decodeV2Header(const uint8_t* in, size_t len, uint8_t& type, uint32_t& payloadLen,
+                          bool& compressed, uint64_t& traceId, TypeDictionary& dict) {
+    uint64_t v = 0;
+    int n = getVarint(in, len, v);
+    if (n <= 0) return n;
+    if ((v >> 5) > 0xFFFFFFFFull - 17) return -1;
+
+    uint32_t code = uint32_t(v & 7);
+    compressed = (v & 8) != 0;
+    bool traced = (v & 16) != 0;
+    payloadLen = uint32_t(v >> 5);
+
+    // everything must be there before the dictionary is touched
+    size_t need = size_t(n) + (code == TYPE_LITERAL ? 1 : 0) + (traced ? TRACE_ID_SIZE : 0);
+    if (len < need) return 0;
+
+    if (code == TYPE_LITERAL) {
+        type = in[n++];
+        dict.add(type);
+    }
+    else if (code >= dict.count) return -1;
+    else type = dict.types[code];
+
+    traceId = traced ? getTraceId(in + n) : 0;
+    return int(need);
+}
+
+} // namespace wire
@@ -0,0 +1,1209 @@
+// Headless load generator and benchmark for the native core.
+//
+// Every peer is what the app runs minus the WebView: a NetworkManager plus a MessageChannel
+// pair standing in for its page. Messages are generated on the page side of the ring, read
+// into MessageBlocks and handed to sendMessage on a ThreadPool like onBrowserMessage does,
+// and on the receiving peer go from the network callback into the ring and out on the page
+// side again, where their end-to-end latency is taken.
+//
+// Mixes (--mix, default all):
+//   audio  CLIENT_AUDIO over TCP, 50 frames/s from every peer to every other peer
+//   mouse  MOUSE_MOVE over UDP from every peer to the next one
+//   bulk   TCP_BINARY as fast as it drains, a window of chunks in flight per peer
+//   churn  a separate client connects to the peers in turn, sends one message, disconnects
+//   bcast  (not in the default) room broadcasts at --mouse-hz from every peer: all peers join
+//          one room with LAN multicast on --multicast PORT (Multicast.h), so each goes out as
+//          one group datagram plus TCP copies until the members' MCAST_ACKs are in. A replayer
+//          on an address of its own joins the group too and sends every datagram it hears
+//          again 50 ms later. The dedup windows have to drop both kinds of copy: the report
+//          counts broadcasts a page got twice, which should stay 0.
+//
+// Reports, for the measured window after the warmup: per mix sent / received, msgs/s, MB/s,
+// end-to-end and page -> native ring latency (p50 / p99 / p99.9), process CPU and heap
+// allocations per delivered message, and the per-stage histograms of Metrics.h. --json
+// writes the same as one JSON object for tracking regressions.
+//
+// --doorbell each notifies the reading side of a ring after every message and has it read one
+// message per notification, the way pages were fed before the rings' sleep flag; the default,
+// sleep, notifies only a reader that said it is asleep (MessageChannel::needsDoorbell).
+//
+// --net sockets (default) runs over 127.0.0.1; peers on one host also talk over LocalLink
+// unless --no-locallink. --net sim runs on a sim::Network with zero latency instead, which
+// measures the code path without the OS network stack.
+//
+// --flood N adds a misbehaving sender: N datagrams/s of MOUSE_MOVE spread over the peers,
+// from an address of its own (127.0.0.2 on loopback sockets). With --admit msgs/s,bytes/s
+// the peers limit every source's MOUSE_MOVE to that (Admission.h), the type the flood is
+// made of; the mixes' latency with and without shows what the flood costs the honest peers.
+// --admit-source limits everything a source sends instead, which caps the honest peers'
+// bulk as well once it is set below their rate: bulk chunks dropped that way are given up
+// on after half a second, so the mix slows down rather than stalling.
+//
+// --failover N runs the mixes on --net sim with every peer in one room (NetworkManager::setRoom,
+// --lease ms) and crashes the room's master N times, one after the other: each time it is timed
+// from the crash until every surviving peer reports the same new master with a higher term.
+// Needs --peers N + 2 at least; the crashed peers drop out of the traffic.
+//
+// --storm N replaces the mixes with a connection storm against one NetworkManager: N TCP
+// connects at once from --storm-clients threads, timed until the server has published every
+// one, then the same threads flood its UDP port for --seconds. Compare --shards 1 with
+// --shards 0 (one socket per core, NetworkBase::setShards) for how setup and datagram rates
+// scale.
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <new>
+#include <algorithm>
+#include <set>
+#include <deque>
+#include <tuple>
+#include <functional>
+#include "NetworkManager.h"
+#include "SimTransport.h"
+#include "MessageChannel.h"
+#include "MessageBlock.h"
+#include "ThreadPool.h"
+#include "Metrics.h"
+#ifndef _WIN32
+#include <ctime>
+#endif
+
+// every heap allocation in the process, for allocations per message
+static std::atomic<uint64_t> allocCount{ 0 };
+static std::atomic<uint64_t> allocBytes{ 0 };
+static std::atomic<uint64_t> bellRings{ 0 };
+
+// all kept out of line: with a malloc or free inlined next to the other operator, GCC takes
+// the pair for mismatched (-Wmismatched-new-delete)
+#if defined(__GNUC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+BENCH_NOINLINE void* operator new(size_t n) {
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    allocBytes.fetch_add(n, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void* operator new[](size_t n) { return operator new(n); }
+
+BENCH_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete(void* p, size_t) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete[](void* p) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+namespace bench {
+
+enum Mix { AUDIO, MOUSE, BULK, CHURN, BCAST, MIX_COUNT };
+
+const char* const mixNames[MIX_COUNT] = { "audio", "mouse", "bulk", "churn", "bcast" };
+const uint8_t mixTypes[MIX_COUNT] = { 0x88, 0x10, 0x82, 0x80, 0x10 };   // CLIENT_AUDIO, MOUSE_MOVE, TCP_BINARY, TCP, MOUSE_MOVE
+constexpr uint32_t ROOM = 0x6C696E6B;       // the room every peer joins for bcast and --failover
+
+constexpr uint32_t HEADER = 17;
+constexpr uint32_t STAMP = 16;      // at the front of every payload: created at (8), mix, sender, pad (2), seq (4)
+
+struct Config {
+    int peers = 4;
+    double seconds = 10;
+    double warmup = 1;
+    bool sim = false;
+    bool localLink = true;
+    bool wireV2 = false;
+    bool bellEach = false;          // --doorbell each: a notification per message
+    bool mix[MIX_COUNT] = { true, true, true, true, false };
+    uint32_t audioBytes = 640;      // 20 ms of 16 kHz mono PCM
+    uint32_t mouseBytes = 24;
+    int mouseHz = 125;
+    uint32_t bulkBytes = 64 * 1024;
+    int bulkWindow = 8;
+    int churnPerSec = 20;
+    uint32_t channelSize = 4 * 1024 * 1024;
+    uint16_t basePort = 41000;
+    uint16_t multicastPort = 42500;
+    uint32_t shards = 1;
+    int storm = 0;                  // connects in the storm, 0: run the mixes
+    int stormClients = 8;
+    int failover = 0;               // masters to crash, 0: none
+    uint32_t leaseMs = 150;
+    int floodPerSec = 0;
+    uint32_t admitMsgs = 0;         // per source, 0: unlimited
+    uint32_t admitBytes = 0;
+    bool admitSource = false;       // the limit is on all of a source's types, not MOUSE_MOVE
+    std::string json;
+};
+
+uint64_t cpuNow() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+    auto ns = [](const FILETIME& f) { return ((uint64_t(f.dwHighDateTime) << 32) | f.dwLowDateTime) * 100; };
+    return ns(kernel) + ns(user);
+#else
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Metrics.h buckets, recorded from any thread
+struct Histogram {
+    std::atomic<uint64_t> buckets[metrics::BUCKETS]{};
+    std::atomic<uint64_t> sum{ 0 };
+
+    void record(uint64_t v) {
+        buckets[metrics::bucketOf(v)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    metrics::HistogramSnapshot snapshot() const {
+        metrics::HistogramSnapshot s;
+        for (int b = 0; b < metrics::BUCKETS; ++b) {
+            s.buckets[b] = buckets[b].load(std::memory_order_relaxed);
+            s.count += s.buckets[b];
+        }
+        s.sum = sum.load(std::memory_order_relaxed);
+        return s;
+    }
+};
+
+struct Tally {
+    std::atomic<uint64_t> sent{ 0 };
+    std::atomic<uint64_t> received{ 0 };
+    std::atomic<uint64_t> bytes{ 0 };
+    Histogram endToEnd;
+    Histogram ringIn;
+};
+
+// the "dataReady" a page gets: the consumer sleeps on it once its ring says asleep
+struct Bell {
+    std::mutex m;
+    std::condition_variable cv;
+    uint32_t rung = 0;
+
+    void ring() {
+        bellRings.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(m);
+            rung++;
+        }
+        cv.notify_one();
+    }
+
+    // every ring since the last wait counts as one
+    void wait() {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait_for(lock, std::chrono::milliseconds(5), [this]() { return rung > 0; });
+        rung = 0;
+    }
+
+    // one ring, for --doorbell each
+    void waitOne() {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait_for(lock, std::chrono::milliseconds(5), [this]() { return rung > 0; });
+        if (rung) rung--;
+    }
+};
+
+// a UDP socket bound to one loopback address. Every peer on loopback sockets sends from
+// 127.0.0.1, so the flooder takes another one for admission to see a source of its own.
+class LoopbackSocket {
+public:
+    explicit LoopbackSocket(uint32_t ip) {
+        s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        sockaddr_in addr = address(ip, 0);
+        if (s != NONE && bind(s, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            closeSocket();
+            s = NONE;
+        }
+    }
+
+    ~LoopbackSocket() {
+        if (s != NONE) closeSocket();
+    }
+
+    bool ok() const { return s != NONE; }
+
+    bool sendTo(const transport::Buffer& b, uint32_t ip, uint16_t port) {
+        sockaddr_in addr = address(ip, port);
+        return sendto(s, (const char*)b.data, (int)b.len, 0, (sockaddr*)&addr, sizeof(addr)) > 0;
+    }
+
+private:
+    static sockaddr_in address(uint32_t ip, uint16_t port) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(ip);
+        addr.sin_port = htons(port);
+        return addr;
+    }
+
+#ifdef _WIN32
+    void closeSocket() { closesocket(s); }
+    static constexpr SOCKET NONE = INVALID_SOCKET;
+    SOCKET s;
+#else
+    void closeSocket() { ::close(s); }
+    static constexpr int NONE = -1;
+    int s;
+#endif
+};
+
+class Bench;
+
+class Peer {
+public:
+    Peer(Bench& bench, int index, uint32_t ip, std::shared_ptr<transport::Transport> net);
+    ~Peer();
+
+    void start();
+    void stop();
+    void generate();
+    void joinRoom(uint32_t roomHash, uint32_t leaseMs);
+
+    int index;
+    uint32_t ip;
+    uint16_t tcpPort, udpPort;
+    std::atomic<int> bulkInFlight{ 0 };
+    std::atomic<uint64_t> bulkProgress{ 0 };    // when a bulk chunk of ours last arrived
+    std::atomic<bool> alive{ true };            // false once its host was crashed
+    std::atomic<uint64_t> master{ 0 };          // the room master it follows, RoomElection::Peer::key
+    std::atomic<uint64_t> masterTerm{ 0 };
+
+private:
+    const Peer* nextAlive() const;
+    bool readFromPage();
+    bool readFromNative();
+    void fromNetwork(const uint8_t* data, uint32_t size);
+    void write(Mix mix, const Peer& to, uint32_t size, uint32_t seq);
+
+    Bench& bench;
+    std::vector<BYTE> shared;
+    std::unique_ptr<MessageChannel> native;     // the app's side of the ring
+    std::unique_ptr<MessageChannel> page;       // the page's side
+    Bell nativeBell, pageBell;
+    std::unique_ptr<ThreadPool> pool;
+    std::unique_ptr<NetworkManager> net;
+    std::thread nativeReader, pageReader, generator;
+    std::atomic<bool> running{ false };
+    MessageBlock* pendingBlock = nullptr;
+    std::vector<BYTE> pageBuffer;
+    std::vector<BYTE> scratch;
+};
+
+class Bench {
+public:
+    explicit Bench(const Config& cfg) : cfg(cfg) {}
+
+    int run();
+    int storm();
+    int failover();
+
+    // a message reached the page of peer `to`
+    void delivered(int to, const BYTE* data, uint32_t size) {
+        if (size < HEADER + STAMP) return;
+        uint64_t t0;
+        std::memcpy(&t0, data + HEADER, 8);
+        uint8_t mix = data[HEADER + 8], sender = data[HEADER + 9];
+        uint32_t seq;
+        std::memcpy(&seq, data + HEADER + 12, 4);
+        if (mix >= MIX_COUNT) return;
+        if (mix == BULK && sender < peers.size()) {
+            peers[sender]->bulkInFlight--;
+            peers[sender]->bulkProgress = metrics::now();
+        }
+        if (mix == CHURN) churnSeen = seq;
+        if (mix == BCAST) {
+            std::lock_guard<std::mutex> lock(bcastMutex);
+            if (!bcastSeen.insert((uint64_t(to) << 40) | (uint64_t(sender) << 32) | seq).second) bcastTwice++;
+        }
+        if (!measured(t0)) return;
+        Tally& t = tallies[mix];
+        t.received++;
+        t.bytes += size;
+        t.endToEnd.record(metrics::now() - t0);
+    }
+
+    bool measured(uint64_t t0) const {
+        return t0 >= windowStart.load(std::memory_order_relaxed) && t0 < windowEnd.load(std::memory_order_relaxed);
+    }
+
+    const Config cfg;
+    std::vector<std::unique_ptr<Peer>> peers;
+    Tally tallies[MIX_COUNT];
+    std::atomic<uint64_t> windowStart{ ~uint64_t(0) };
+    std::atomic<uint64_t> windowEnd{ ~uint64_t(0) };
+    std::atomic<uint32_t> churnSeen{ 0 };
+    std::atomic<bool> generating{ false };
+    std::atomic<uint64_t> flooded{ 0 };
+    std::atomic<uint64_t> netErrors{ 0 };
+    std::atomic<uint64_t> replayed{ 0 };
+    std::atomic<uint64_t> bcastTwice{ 0 };     // broadcasts a page got a second time
+
+private:
+    void startSim();
+    std::shared_ptr<transport::Transport> transportFor(uint32_t ip);
+    bool agreed(uint64_t afterTerm, uint64_t& master, uint64_t& term);
+    void churn(NetworkManager& client, uint32_t clientIP);
+    void flood(const std::function<bool(const transport::Buffer& b, uint32_t ip, uint16_t port)>& sendTo);
+    void replay(transport::Transport& net, uint32_t iface);
+    std::string report(double seconds, uint64_t cpu, uint64_t allocs, uint64_t allocated, uint64_t rings,
+        const metrics::Snapshot& before, const metrics::Snapshot& after);
+    int writeJson(const std::string& json);
+
+    std::unique_ptr<sim::Network> lan;
+    std::mutex bcastMutex;
+    std::set<uint64_t> bcastSeen;               // receiver, sender, seq
+};
+
+// ---------------- Peer ----------------
+
+Peer::Peer(Bench& bench, int index, uint32_t ip, std::shared_ptr<transport::Transport> transport)
+    : index(index), ip(ip), tcpPort(uint16_t(bench.cfg.basePort + index)),
+    udpPort(tcpPort), bench(bench), shared(bench.cfg.channelSize) {
+    native = std::make_unique<MessageChannel>(shared.data(), shared.size(), true);
+    page = std::make_unique<MessageChannel>(shared.data(), shared.size(), false);
+    pool = std::make_unique<ThreadPool>(4);
+    net = std::make_unique<NetworkManager>(
+        [this](const uint8_t* data, uint32_t size) { fromNetwork(data, size); },
+        [this](const char* text) {
+            unsigned mip = 0, mport = 0;
+            unsigned long long term = 0;
+            if (std::sscanf(text, "roomMaster-%u:%u-%llu", &mip, &mport, &term) == 3) {
+                master = RoomElection::Peer{ mip, uint16_t(mport) }.key();
+                masterTerm = term;
+            }
+            else if (std::strstr(text, "failed") || std::strstr(text, "error")) {
+                if (this->bench.cfg.failover) this->bench.netErrors++;     // expected from and towards crashed masters
+                else std::cerr << "peer " << this->index << ": " << text << std::endl;
+            }
+        },
+        std::move(transport));
+    net->setLocalLink(bench.cfg.localLink);
+    net->setWireV2(bench.cfg.wireV2);
+    net->setShards(bench.cfg.shards);
+    if (bench.cfg.admitMsgs || bench.cfg.admitBytes) {
+        admission::Limits limits;
+        admission::Rate& msgs = bench.cfg.admitSource ? limits.msgs : limits.typeMsgs[mixTypes[MOUSE]];
+        admission::Rate& bytes = bench.cfg.admitSource ? limits.bytes : limits.typeBytes[mixTypes[MOUSE]];
+        msgs.perSec = bench.cfg.admitMsgs;
+        bytes.perSec = bench.cfg.admitBytes;
+        net->setAdmission(limits);
+    }
+}
+
+Peer::~Peer() {
+    stop();
+}
+
+void Peer::start() {
+    if (!net->startTCPServer(tcpPort))
+        std::cerr << "peer " << index << ": no TCP server on " << tcpPort << std::endl;
+    running = true;
+    // same loop as the app's receiver: poll while there is data, then sleep until rung
+    nativeReader = std::thread([this]() {
+        while (running) {
+            if (bench.cfg.bellEach) {
+                nativeBell.waitOne();
+                readFromPage();
+                continue;
+            }
+            native->setPolling();
+            while (readFromPage()) {}
+            if (native->trySleep()) nativeBell.wait();
+        }
+        });
+    pageReader = std::thread([this]() {
+        while (running) {
+            if (bench.cfg.bellEach) {
+                pageBell.waitOne();
+                readFromNative();
+                continue;
+            }
+            page->setPolling();
+            while (readFromNative()) {}
+            if (page->trySleep()) pageBell.wait();
+        }
+        });
+    generator = std::thread([this]() { generate(); });
+}
+
+void Peer::stop() {
+    if (!running.exchange(false)) return;
+    if (generator.joinable()) generator.join();
+    nativeBell.ring();
+    if (nativeReader.joinable()) nativeReader.join();
+    pool.reset();               // runs the sends still queued
+    net.reset();
+    pageBell.ring();
+    if (pageReader.joinable()) pageReader.join();
+    delete pendingBlock;
+    pendingBlock = nullptr;
+}
+
+// page -> native, as BrowserWithMessaging::receiveBlock
+bool Peer::readFromPage() {
+    int n = native->readStream([this](uint32_t total) -> BYTE* {
+        if (total < HEADER) return nullptr;
+        pendingBlock = new MessageBlock(total);
+        return pendingBlock->getRawWritePtr();
+        });
+    if (n == 0) return false;
+
+    MessageBlock* msg = pendingBlock;
+    pendingBlock = nullptr;
+    if (n < 0 || !msg) {
+        delete msg;
+        return true;
+    }
+    metrics::add(metrics::CHANNEL_MSGS_IN);
+    metrics::add(metrics::CHANNEL_BYTES_IN, (uint64_t)n);
+    msg->setTotalSize((uint32_t)n);
+    msg->finalizeNetMsg();
+    if (msg->getPayloadSize() >= STAMP && msg->getPayload()[8] < MIX_COUNT) {
+        uint64_t t0;
+        std::memcpy(&t0, msg->getPayload(), 8);
+        if (bench.measured(t0)) bench.tallies[msg->getPayload()[8]].ringIn.record(metrics::now() - t0);
+    }
+    pool->enqueue([this, msg]() { net->sendMessage(msg); });
+    return true;
+}
+
+// native -> page, the page reading what onNetworkMessage wrote
+bool Peer::readFromNative() {
+    int n = page->readStream([this](uint32_t total) -> BYTE* {
+        if (pageBuffer.size() < total) pageBuffer.resize(total);
+        return pageBuffer.data();
+        });
+    if (n == 0) return false;
+    if (n > 0) bench.delivered(index, pageBuffer.data(), (uint32_t)n);
+    return true;
+}
+
+// the network callback, as BrowserWithMessaging::sendMessage
+void Peer::fromNetwork(const uint8_t* data, uint32_t size) {
+    uint64_t start = metrics::now();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    int written = native->writeStream(data, size, [this, deadline]() {
+        pageBell.ring();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return std::chrono::steady_clock::now() < deadline;
+        });
+    if (bench.cfg.bellEach || native->needsDoorbell()) pageBell.ring();
+
+    metrics::recordSince(metrics::CHANNEL_WRITE_NS, start);
+    if (written) {
+        metrics::add(metrics::CHANNEL_MSGS_OUT);
+        metrics::add(metrics::CHANNEL_BYTES_OUT, size);
+    }
+    else metrics::add(metrics::CHANNEL_WRITE_FAILURES);
+}
+
+// one message from this peer's page, the way the page frames it; bcast ignores `to`
+void Peer::write(Mix mix, const Peer& to, uint32_t size, uint32_t seq) {
+    bool tcp = mixTypes[mix] & 0x80, room = mix == BCAST;
+    uint32_t total = HEADER + std::max(size, STAMP);
+    if (scratch.size() < total) scratch.resize(total);
+    BYTE* b = scratch.data();
+    auto put32 = [](BYTE* p, uint32_t v) { p[0] = BYTE(v >> 24); p[1] = BYTE(v >> 16); p[2] = BYTE(v >> 8); p[3] = BYTE(v); };
+    auto put16 = [](BYTE* p, uint16_t v) { p[0] = BYTE(v >> 8); p[1] = BYTE(v); };
+    put32(b, ip);
+    put16(b + 4, tcp ? 0 : udpPort);
+    put32(b + 6, room ? mcast::ROOM_BROADCAST : to.ip);
+    put16(b + 10, room ? 0 : tcp ? to.tcpPort : to.udpPort);
+    put32(b + 12, total);
+    b[16] = mixTypes[mix];
+
+    uint64_t t0 = metrics::now();
+    std::memcpy(b + HEADER, &t0, 8);
+    b[HEADER + 8] = BYTE(mix);
+    b[HEADER + 9] = BYTE(index);
+    std::memcpy(b + HEADER + 12, &seq, 4);
+
+    if (bench.measured(t0)) bench.tallies[mix].sent++;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    page->writeStream(b, total, [this, deadline]() {
+        nativeBell.ring();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return std::chrono::steady_clock::now() < deadline;
+        });
+    if (bench.cfg.bellEach || page->needsDoorbell()) nativeBell.ring();
+}
+
+// the peer after this one that is still up, this one if none is
+const Peer* Peer::nextAlive() const {
+    const auto& peers = bench.peers;
+    for (size_t i = 1; i < peers.size(); ++i) {
+        const Peer* p = peers[(index + i) % peers.size()].get();
+        if (p->alive) return p;
+    }
+    return this;
+}
+
+void Peer::joinRoom(uint32_t roomHash, uint32_t leaseMs) {
+    std::vector<RoomElection::Peer> members;
+    for (auto& p : bench.peers)
+        if (p.get() != this) members.push_back({ p->ip, p->tcpPort });
+    net->setRoom(roomHash, ip, tcpPort, leaseMs);
+    net->setRoomMembers(members);
+    net->electRoomMaster();
+    if (bench.cfg.mix[BCAST]) net->setMulticast(bench.cfg.multicastPort);
+}
+
+void Peer::generate() {
+    const Config& cfg = bench.cfg;
+    const auto& peers = bench.peers;
+    const Peer* bulkTo = nullptr;
+    uint64_t audioEvery = 20000000, mouseEvery = 1000000000ull / std::max(cfg.mouseHz, 1);
+    uint64_t nextAudio = metrics::now(), nextMouse = nextAudio, nextBroadcast = nextAudio;
+    uint32_t seq = 0;
+
+    while (running && !bench.generating) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    while (running && bench.generating && alive) {
+        uint64_t now = metrics::now();
+        const Peer& next = *nextAlive();
+        if (cfg.mix[AUDIO]) {
+            for (; nextAudio <= now; nextAudio += audioEvery)
+                for (auto& p : peers)
+                    if (p.get() != this && p->alive) write(AUDIO, *p, cfg.audioBytes, ++seq);
+        }
+        if (cfg.mix[MOUSE]) {
+            for (; nextMouse <= now; nextMouse += mouseEvery) write(MOUSE, next, cfg.mouseBytes, ++seq);
+        }
+        if (cfg.mix[BCAST]) {
+            for (; nextBroadcast <= now; nextBroadcast += mouseEvery) write(BCAST, *this, cfg.mouseBytes, ++seq);
+        }
+        if (cfg.mix[BULK] && &next != this) {
+            // what went to a crashed peer never comes back, nor does what admission dropped
+            if (bulkTo != &next || (bulkInFlight >= cfg.bulkWindow && bulkProgress + 500000000 < now)) {
+                bulkInFlight = 0;
+                bulkProgress = now;
+            }
+            bulkTo = &next;
+            while (bulkInFlight < cfg.bulkWindow) {
+                bulkInFlight++;
+                write(BULK, next, cfg.bulkBytes, ++seq);
+            }
+        }
+
+        uint64_t wake = UINT64_MAX;
+        if (cfg.mix[AUDIO]) wake = std::min(wake, nextAudio);
+        if (cfg.mix[MOUSE]) wake = std::min(wake, nextMouse);
+        if (cfg.mix[BCAST]) wake = std::min(wake, nextBroadcast);
+        if (cfg.mix[BULK]) wake = std::min(wake, now + 200000);
+        now = metrics::now();
+        std::this_thread::sleep_for(std::chrono::nanoseconds(wake > now ? std::min<uint64_t>(wake - now, 10000000) : 0));
+    }
+}
+
+// ---------------- Bench ----------------
+
+// connect, one message, wait until a page got it, disconnect; over and over
+void Bench::churn(NetworkManager& client, uint32_t clientIP) {
+    uint64_t every = 1000000000ull / std::max(cfg.churnPerSec, 1);
+    uint64_t next = metrics::now();
+    std::vector<BYTE> b(HEADER + STAMP);
+    uint32_t seq = 0;
+    while (generating) {
+        const Peer& to = *peers[seq % peers.size()];
+        ++seq;
+        if (!to.alive) continue;
+        uint64_t t0 = metrics::now();
+        uint32_t total = HEADER + STAMP;
+        BYTE* p = b.data();
+        p[0] = BYTE(clientIP >> 24); p[1] = BYTE(clientIP >> 16); p[2] = BYTE(clientIP >> 8); p[3] = BYTE(clientIP);
+        p[4] = p[5] = 0;
+        p[6] = BYTE(to.ip >> 24); p[7] = BYTE(to.ip >> 16); p[8] = BYTE(to.ip >> 8); p[9] = BYTE(to.ip);
+        p[10] = BYTE(to.tcpPort >> 8); p[11] = BYTE(to.tcpPort);
+        p[12] = 0; p[13] = 0; p[14] = BYTE(total >> 8); p[15] = BYTE(total);
+        p[16] = mixTypes[CHURN];
+        std::memcpy(p + HEADER, &t0, 8);
+        p[HEADER + 8] = CHURN;
+        p[HEADER + 9] = 0xFF;
+        std::memcpy(p + HEADER + 12, &seq, 4);
+        if (measured(t0)) tallies[CHURN].sent++;
+
+        client.sendMessage(p, total);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (churnSeen.load() != seq && std::chrono::steady_clock::now() < deadline && generating)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        client.removeConnection(mixTypes[CHURN], clientIP, 0, to.ip, to.tcpPort);
+
+        next += every;
+        uint64_t now = metrics::now();
+        if (next > now) std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+        else next = now;
+    }
+}
+
+// v1 datagrams too short to carry a stamp, so the pages that get them count nothing
+void Bench::flood(const std::function<bool(const transport::Buffer& b, uint32_t ip, uint16_t port)>& sendTo) {
+    std::vector<uint8_t> datagram(5 + cfg.mouseBytes);
+    uint32_t total = uint32_t(datagram.size()) + 12;
+    datagram[0] = BYTE(total >> 24); datagram[1] = BYTE(total >> 16); datagram[2] = BYTE(total >> 8); datagram[3] = BYTE(total);
+    datagram[4] = mixTypes[MOUSE];
+    transport::Buffer b{ datagram.data(), uint32_t(datagram.size()) };
+    uint64_t every = 1000000000ull / std::max(cfg.floodPerSec, 1);
+    uint64_t next = metrics::now();
+    uint64_t n = 0;
+    while (generating) {
+        const Peer& to = *peers[n % peers.size()];
+        if (sendTo(b, to.ip, to.udpPort)) flooded++;
+        ++n;
+        next += every;
+        uint64_t now = metrics::now();
+        if (next > now + 1000000) std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+        else if (next + 100000000 < now) next = now;        // fell far behind: no catching up
+    }
+}
+
+// a member of the room's group that sends every envelope it hears once more, 50 ms later and
+// from its own address: the copies carry the original sender and sequence number. It hears
+// its own copies as well, those it leaves. A datagram of one byte from itself ends it.
+void Bench::replay(transport::Transport& net, uint32_t iface) {
+    uint32_t group = mcast::groupFor(ROOM);
+    transport::Handle h = net.joinGroup(group, cfg.multicastPort, iface);
+    if (h == transport::NONE) {
+        std::cerr << "replayer: cannot join the group" << std::endl;
+        return;
+    }
+    std::thread stopper([&]() {
+        while (generating) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        uint8_t stop = 0;
+        transport::Buffer b{ &stop, 1 };
+        net.sendTo(h, &b, 1, group, cfg.multicastPort);
+        });
+    std::deque<std::pair<uint64_t, std::vector<uint8_t>>> heard;
+    std::set<std::tuple<uint32_t, uint16_t, uint32_t, uint64_t>> copied;
+    std::vector<uint8_t> buffer(64 * 1024);
+    for (;;) {
+        uint32_t ip = 0;
+        uint16_t port = 0;
+        int r = net.recvFrom(h, buffer.data(), (int)buffer.size(), ip, port);
+        if (r == 1 || r < 0) break;
+        uint64_t now = metrics::now();
+        // v1: total size (4), type; v2: marker, type, a trace id if flagged
+        int at = buffer[0] == 0 ? 5 : (buffer[0] & wire::WIRE_UDP_TRACED) ? 2 + (int)wire::TRACE_ID_SIZE : 2;
+        mcast::Header e;
+        if (r <= at || !mcast::decodeHeader(buffer.data() + at, uint32_t(r - at), e) ||
+            !copied.insert({ e.ip, e.port, e.epoch, e.seq }).second) continue;
+        heard.emplace_back(now + 50000000, std::vector<uint8_t>(buffer.begin(), buffer.begin() + r));
+        while (!heard.empty() && heard.front().first <= now) {
+            transport::Buffer b{ heard.front().second.data(), uint32_t(heard.front().second.size()) };
+            if (net.sendTo(h, &b, 1, group, cfg.multicastPort) > 0) replayed++;
+            heard.pop_front();
+        }
+    }
+    stopper.join();
+    net.close(h);
+}
+
+// a zero latency sim::Network following real time
+void Bench::startSim() {
+    lan = std::make_unique<sim::Network>(1);
+    sim::LinkModel instant;
+    instant.latencyUs = 0;
+    lan->setDefaultLink(instant);
+    lan->runRealtime(1.0);
+}
+
+// a host on the sim network, the platform's sockets (null) without one
+std::shared_ptr<transport::Transport> Bench::transportFor(uint32_t ip) {
+    if (lan) return lan->addHost(ip);
+    return nullptr;
+}
+
+int Bench::run() {
+    uint32_t loopback = 0x7F000001;
+    if (cfg.sim) startSim();
+
+    for (int i = 0; i < cfg.peers; ++i) {
+        uint32_t ip = cfg.sim ? 0x0A000001 + i : loopback;
+        peers.push_back(std::make_unique<Peer>(*this, i, ip, transportFor(ip)));
+    }
+    uint32_t clientIP = cfg.sim ? 0x0A000100 : loopback;
+    std::unique_ptr<NetworkManager> client;
+    if (cfg.mix[CHURN]) {
+        client = std::make_unique<NetworkManager>([](const uint8_t*, uint32_t) {}, [](const char*) {}, transportFor(clientIP));
+        client->setLocalLink(cfg.localLink);
+        client->setWireV2(cfg.wireV2);
+    }
+    for (auto& p : peers) p->start();
+    if (cfg.mix[BCAST])
+        for (auto& p : peers) p->joinRoom(ROOM, cfg.leaseMs);
+
+    generating = true;
+    std::thread churner;
+    if (client) churner = std::thread([&]() { churn(*client, clientIP); });
+    std::thread flooding;
+    if (cfg.floodPerSec) {
+        flooding = std::thread([this]() {
+            if (!cfg.sim) {
+                LoopbackSocket s(0x7F000002);
+                if (!s.ok()) std::cerr << "flooder: cannot bind 127.0.0.2, no flood" << std::endl;
+                else flood([&s](const transport::Buffer& b, uint32_t ip, uint16_t port) { return s.sendTo(b, ip, port); });
+                return;
+            }
+            auto net = transportFor(0x0A000200);
+            transport::Handle h = net->bindUDP(0);
+            if (h == transport::NONE) return;
+            flood([&](const transport::Buffer& b, uint32_t ip, uint16_t port) { return net->sendTo(h, &b, 1, ip, port) > 0; });
+            net->close(h);
+            });
+    }
+    std::shared_ptr<transport::Transport> replayer;
+    std::thread replaying;
+    if (cfg.mix[BCAST]) {
+        replayer = cfg.sim ? transportFor(0x0A000300) : transport::platformDefault();
+        replaying = std::thread([&]() { replay(*replayer, cfg.sim ? 0x0A000300 : loopback); });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(cfg.warmup));
+    auto before = metrics::snapshot();
+    uint64_t cpu0 = cpuNow(), allocs0 = allocCount, bytes0 = allocBytes, rings0 = bellRings;
+    uint64_t start = metrics::now();
+    windowStart = start;
+    windowEnd = UINT64_MAX;
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(cfg.seconds));
+
+    uint64_t end = metrics::now();
+    windowEnd = end;
+    uint64_t cpu = cpuNow() - cpu0, allocs = allocCount - allocs0, allocated = allocBytes - bytes0, rings = bellRings - rings0;
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));     // let what was sent in the window arrive
+    auto after = metrics::snapshot();
+
+    generating = false;
+    if (churner.joinable()) churner.join();
+    if (flooding.joinable()) flooding.join();
+    if (replaying.joinable()) replaying.join();
+    for (auto& p : peers) p->stop();
+    client.reset();
+    peers.clear();
+    if (lan) lan->runRealtime(0);
+
+    return writeJson(report((end - start) / 1e9, cpu, allocs, allocated, rings, *before, *after));
+}
+
+int Bench::storm() {
+    uint32_t ip = cfg.sim ? 0x0A000001 : 0x7F000001;
+    uint16_t udpPort = uint16_t(cfg.basePort + 1000);
+    std::shared_ptr<transport::Transport> serverNet, clientNet;
+    if (cfg.sim) {
+        startSim();
+        serverNet = transportFor(ip);
+        clientNet = transportFor(0x0A000100);
+    }
+    else clientNet = transport::platformDefault();
+
+    std::atomic<uint32_t> published{ 0 };
+    auto server = std::make_unique<NetworkManager>([](const uint8_t*, uint32_t) {},
+        [&published](const char* text) {
+            if (std::strncmp(text, "connected-", 10) == 0) published++;
+            else if (std::strstr(text, "failed") || std::strstr(text, "error")) std::cerr << "server: " << text << std::endl;
+        },
+        serverNet);
+    server->setShards(cfg.shards);
+    server->setLocalLink(false);
+    if (!server->startTCPServer(cfg.basePort) || !server->createConnection(mixTypes[MOUSE], 0, udpPort, 0, 0)) {
+        std::cerr << "no server on " << cfg.basePort << " / " << udpPort << std::endl;
+        return 1;
+    }
+
+    // connect phase: every client thread connects its share as fast as it can and keeps them
+    int clients = std::max(cfg.stormClients, 1);
+    std::vector<std::vector<transport::Handle>> held(clients);
+    std::atomic<uint32_t> connected{ 0 }, failed{ 0 };
+    std::vector<std::thread> threads;
+    uint64_t start = metrics::now();
+    for (int c = 0; c < clients; ++c)
+        threads.emplace_back([&, c]() {
+            for (int k = c; k < cfg.storm; k += clients) {
+                transport::Handle h = clientNet->connect(ip, cfg.basePort);
+                if (h != transport::NONE && clientNet->waitConnected(h)) {
+                    held[c].push_back(h);
+                    connected++;
+                    continue;
+                }
+                if (h != transport::NONE) clientNet->close(h);
+                failed++;
+            }
+            });
+    for (auto& t : threads) t.join();
+    threads.clear();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (published < connected && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    double setupSeconds = (metrics::now() - start) / 1e9;
+
+    // flood phase: v1 datagrams of mouseBytes, as fast as the client threads can send them
+    std::vector<uint8_t> datagram(5 + cfg.mouseBytes);
+    uint32_t total = uint32_t(datagram.size()) + 12;
+    datagram[0] = BYTE(total >> 24); datagram[1] = BYTE(total >> 16); datagram[2] = BYTE(total >> 8); datagram[3] = BYTE(total);
+    datagram[4] = mixTypes[MOUSE];
+    std::atomic<bool> flooding{ true };
+    std::atomic<uint64_t> udpSent{ 0 };
+    auto before = metrics::snapshot();
+    start = metrics::now();
+    for (int c = 0; c < clients; ++c)
+        threads.emplace_back([&]() {
+            transport::Handle h = clientNet->bindUDP(0);
+            if (h == transport::NONE) return;
+            transport::Buffer b{ datagram.data(), uint32_t(datagram.size()) };
+            uint64_t n = 0;
+            while (flooding)
+                if (clientNet->sendTo(h, &b, 1, ip, udpPort) > 0) ++n;
+            udpSent += n;
+            clientNet->close(h);
+            });
+    std::this_thread::sleep_for(std::chrono::duration<double>(cfg.seconds));
+    flooding = false;
+    for (auto& t : threads) t.join();
+    double floodSeconds = (metrics::now() - start) / 1e9;
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));     // what is still in the socket buffers
+    auto after = metrics::snapshot();
+    uint64_t udpReceived = after->counters[metrics::UDP_MSGS_RECEIVED] - before->counters[metrics::UDP_MSGS_RECEIVED];
+
+    for (auto& h : held)
+        for (transport::Handle s : h) clientNet->abort(s);
+    server.reset();
+    if (lan) lan->runRealtime(0);
+
+    char line[512];
+    std::snprintf(line, sizeof(line), "storm: %d connects from %d clients, shards %u, %s\n\n", cfg.storm, clients, cfg.shards,
+        cfg.sim ? "sim network" : "loopback sockets");
+    std::cout << line;
+    std::snprintf(line, sizeof(line), "connect %8u ok %6u failed %6u published in %9.1f ms %10.0f connects/s\n",
+        connected.load(), failed.load(), published.load(), setupSeconds * 1000, published / setupSeconds);
+    std::cout << line;
+    std::snprintf(line, sizeof(line), "udp     %8llu sent %12llu received in %6.1f s %10.0f datagrams/s\n",
+        (unsigned long long)udpSent.load(), (unsigned long long)udpReceived, floodSeconds, udpReceived / floodSeconds);
+    std::cout << line;
+
+    std::snprintf(line, sizeof(line), "{\n  \"config\": {\"storm\": %d, \"clients\": %d, \"shards\": %u, \"net\": \"%s\", \"seconds\": %.3f},\n"
+        "  \"connect\": {\"ok\": %u, \"failed\": %u, \"published\": %u, \"ms\": %.3f, \"per_sec\": %.1f},\n"
+        "  \"udp\": {\"sent\": %llu, \"received\": %llu, \"per_sec\": %.1f}\n}\n",
+        cfg.storm, clients, cfg.shards, cfg.sim ? "sim" : "sockets", floodSeconds,
+        connected.load(), failed.load(), published.load(), setupSeconds * 1000, published / setupSeconds,
+        (unsigned long long)udpSent.load(), (unsigned long long)udpReceived, udpReceived / floodSeconds);
+    return writeJson(line);
+}
+
+// every surviving peer follows the same surviving master, with a term above afterTerm
+bool Bench::agreed(uint64_t afterTerm, uint64_t& master, uint64_t& term) {
+    master = 0;
+    term = 0;
+    for (auto& p : peers) {
+        if (!p->alive) continue;
+        if (!master) {
+            master = p->master;
+            term = p->masterTerm;
+        }
+        if (p->master != master || p->masterTerm != term) return false;
+    }
+    if (term <= afterTerm) return false;
+    for (auto& p : peers)
+        if (p->alive && RoomElection::Peer{ p->ip, p->tcpPort }.key() == master) return true;
+    return false;
+}
+
+int Bench::failover() {
+    startSim();
+    for (int i = 0; i < cfg.peers; ++i) {
+        uint32_t ip = 0x0A000001 + i;
+        peers.push_back(std::make_unique<Peer>(*this, i, ip, transportFor(ip)));
+    }
+    for (auto& p : peers) p->start();
+    for (auto& p : peers) p->joinRoom(ROOM, cfg.leaseMs);
+    generating = true;
+
+    uint64_t master = 0, term = 0;
+    auto settle = [&](uint64_t afterTerm) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (!agreed(afterTerm, master, term)) {
+            if (std::chrono::steady_clock::now() >= deadline) return false;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        return true;
+    };
+    bool ok = settle(0);
+    std::this_thread::sleep_for(std::chrono::duration<double>(cfg.warmup));
+
+    std::vector<double> ms;
+    for (int k = 0; ok && k < cfg.failover; ++k) {
+        Peer* victim = nullptr;
+        for (auto& p : peers)
+            if (p->alive && RoomElection::Peer{ p->ip, p->tcpPort }.key() == master) victim = p.get();
+        if (!victim) break;
+        uint64_t start = metrics::now();
+        lan->crash(victim->ip);
+        victim->alive = false;
+        ok = settle(term);
+        if (ok) ms.push_back((metrics::now() - start) / 1e6);
+        std::this_thread::sleep_for(std::chrono::milliseconds(cfg.leaseMs));
+    }
+
+    generating = false;
+    for (auto& p : peers) p->stop();
+    peers.clear();
+    lan->runRealtime(0);
+
+    char line[256];
+    std::snprintf(line, sizeof(line), "failover: %d peers, lease %u ms, sim network, %zu of %d masters replaced\n\n",
+        cfg.peers, cfg.leaseMs, ms.size(), cfg.failover);
+    std::string text = line, rows;
+    for (size_t k = 0; k < ms.size(); ++k) {
+        std::snprintf(line, sizeof(line), "crash %2zu  new master agreed in %9.1f ms\n", k + 1, ms[k]);
+        text += line;
+        std::snprintf(line, sizeof(line), "%s%.3f", k ? ", " : "", ms[k]);
+        rows += line;
+    }
+    std::vector<double> sorted = ms;
+    std::sort(sorted.begin(), sorted.end());
+    double lo = sorted.empty() ? 0 : sorted.front(), mid = sorted.empty() ? 0 : sorted[sorted.size() / 2],
+        hi = sorted.empty() ? 0 : sorted.back();
+    std::snprintf(line, sizeof(line), "\nmin %.1f ms  median %.1f ms  max %.1f ms  (%llu connection errors around the crashed peers)\n",
+        lo, mid, hi, (unsigned long long)netErrors.load());
+    text += line;
+    std::cout << text;
+    if (!ok) std::cerr << "no agreed master within 10 s" << std::endl;
+
+    std::snprintf(line, sizeof(line), "{\n  \"config\": {\"failover\": %d, \"peers\": %d, \"lease_ms\": %u, \"net\": \"sim\"},\n",
+        cfg.failover, cfg.peers, cfg.leaseMs);
+    std::string json = line;
+    json += "  \"agreed_ms\": [" + rows + "],\n";
+    std::snprintf(line, sizeof(line), "  \"min_ms\": %.3f, \"median_ms\": %.3f, \"max_ms\": %.3f, \"net_errors\": %llu\n}\n",
+        lo, mid, hi, (unsigned long long)netErrors.load());
+    json += line;
+    int rc = writeJson(json);
+    return ok ? rc : 1;
+}
+
+int Bench::writeJson(const std::string& json) {
+    if (cfg.json.empty()) return 0;
+    FILE* f = cfg.json == "-" ? stdout : std::fopen(cfg.json.c_str(), "w");
+    if (!f) {
+        std::cerr << "cannot write " << cfg.json << std::endl;
+        return 1;
+    }
+    std::fputs(json.c_str(), f);
+    if (f != stdout) std::fclose(f);
+    return 0;
+}
+
+static std::string percentiles(const metrics::HistogramSnapshot& h) {
+    char s[256];
+    std::snprintf(s, sizeof(s), "{\"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+        (unsigned long long)h.count, (unsigned long long)(h.count ? h.sum / h.count : 0),
+        (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(99),
+        (unsigned long long)h.percentile(99.9), (unsigned long long)h.percentile(100));
+    return s;
+}
+
+static std::string us(uint64_t ns) {
+    char s[32];
+    std::snprintf(s, sizeof(s), "%.1f", ns / 1000.0);
+    return s;
+}
+
+std::string Bench::report(double seconds, uint64_t cpu, uint64_t allocs, uint64_t allocated, uint64_t rings,
+    const metrics::Snapshot& before, const metrics::Snapshot& after) {
+    char line[512];
+    uint64_t delivered = 0;
+    for (auto& t : tallies) delivered += t.received;
+    uint64_t per = std::max<uint64_t>(delivered, 1);
+
+    std::snprintf(line, sizeof(line), "%d peers, %s, doorbell %s, %.1f s measured, %llu messages delivered, latency in us\n\n",
+        cfg.peers, cfg.sim ? "sim network" : "loopback sockets", cfg.bellEach ? "each" : "sleep", seconds, (unsigned long long)delivered);
+    std::cout << line;
+    if (cfg.floodPerSec) {
+        uint64_t dropped = after.counters[metrics::ADMIT_MSG_DROPS] - before.counters[metrics::ADMIT_MSG_DROPS];
+        std::snprintf(line, sizeof(line), "flood: %llu datagrams sent in total, %llu dropped by admission in the window\n\n",
+            (unsigned long long)flooded.load(), (unsigned long long)dropped);
+        std::cout << line;
+    }
+    if (cfg.mix[BCAST]) {
+        const Tally& t = tallies[BCAST];
+        auto counted = [&](metrics::Counter c) { return (unsigned long long)(after.counters[c] - before.counters[c]); };
+        std::snprintf(line, sizeof(line), "bcast: %llu of %llu deliveries, %llu delivered twice; in the window %llu group datagrams, "
+            "%llu TCP copies, %llu copies dropped as seen (%llu replayed in total)\n\n",
+            (unsigned long long)t.received.load(), (unsigned long long)t.sent.load() * (cfg.peers - 1), (unsigned long long)bcastTwice.load(),
+            counted(metrics::MCAST_SENT), counted(metrics::MCAST_FALLBACKS), counted(metrics::MCAST_DUPLICATES),
+            (unsigned long long)replayed.load());
+        std::cout << line;
+    }
+    std::snprintf(line, sizeof(line), "%-6s %10s %10s %10s %9s %10s %10s %10s %10s %10s\n", "mix", "sent", "received",
+        "msgs/s", "MB/s", "e2e p50", "p99", "p99.9", "ring p50", "p99");
+    std::cout << line;
+
+    std::string json = "{\n  \"config\": {";
+    std::snprintf(line, sizeof(line), "\"peers\": %d, \"seconds\": %.3f, \"net\": \"%s\", \"locallink\": %s, \"wire_v2\": %s, \"doorbell\": \"%s\", "
+        "\"audio_bytes\": %u, \"mouse_bytes\": %u, \"mouse_hz\": %d, \"bulk_bytes\": %u, \"bulk_window\": %d, \"churn_per_sec\": %d, "
+        "\"flood_per_sec\": %d, \"admit_msgs\": %u, \"admit_bytes\": %u, \"admit\": \"%s\"},\n",
+        cfg.peers, seconds, cfg.sim ? "sim" : "sockets", cfg.localLink ? "true" : "false", cfg.wireV2 ? "true" : "false",
+        cfg.bellEach ? "each" : "sleep", cfg.audioBytes, cfg.mouseBytes, cfg.mouseHz, cfg.bulkBytes, cfg.bulkWindow, cfg.churnPerSec,
+        cfg.floodPerSec, cfg.admitMsgs, cfg.admitBytes, cfg.admitSource ? "source" : "mouse_move");
+    json += line;
+
+    json += "  \"mixes\": {";
+    bool first = true;
+    for (int m = 0; m < MIX_COUNT; ++m) {
+        if (!cfg.mix[m]) continue;
+        Tally& t = tallies[m];
+        metrics::HistogramSnapshot e2e = t.endToEnd.snapshot(), ring = t.ringIn.snapshot();
+        double rate = t.received / seconds, mb = t.bytes / seconds / 1e6;
+        std::snprintf(line, sizeof(line), "%-6s %10llu %10llu %10.0f %9.2f %10s %10s %10s %10s %10s\n", mixNames[m],
+            (unsigned long long)t.sent.load(), (unsigned long long)t.received.load(), rate, mb,
+            us(e2e.percentile(50)).c_str(), us(e2e.percentile(99)).c_str(), us(e2e.percentile(99.9)).c_str(),
+            us(ring.percentile(50)).c_str(), us(ring.percentile(99)).c_str());
+        std::cout << line;
+
+        std::snprintf(line, sizeof(line), "%s\n    \"%s\": {\"sent\": %llu, \"received\": %llu, \"msgs_per_sec\": %.1f, \"mb_per_sec\": %.3f, ",
+            first ? "" : ",", mixNames[m], (unsigned long long)t.sent.load(), (unsigned long long)t.received.load(), rate, mb);
+        json += line;
+        json += "\"end_to_end_ns\": " + percentiles(e2e) + ", \"ring_in_ns\": " + percentiles(ring) + "}";
+        first = false;
+    }
+    json += "\n  },\n";
+    if (cfg.mix[BCAST]) {
+        std::snprintf(line, sizeof(line), "  \"bcast\": {\"expected\": %llu, \"delivered_twice\": %llu, \"replayed\": %llu, \"multicast_port\": %u},\n",
+            (unsigned long long)tallies[BCAST].sent.load() * (cfg.peers - 1), (unsigned long long)bcastTwice.load(),
+            (unsigned long long)replayed.load(), cfg.multicastPort);
+        json += line;
+    }
+
+    std::snprintf(line, sizeof(line), "\nper delivered message: %.0f ns CPU, %.2f allocations, %.0f bytes allocated, %.3f doorbells\n\n",
+        double(cpu) / per, double(allocs) / per, double(allocated) / per, double(rings) / per);
+    std::cout << line << "stages (Metrics.h), *_ns in ns:\n";
+    std::snprintf(line, sizeof(line), "  \"per_message\": {\"cpu_ns\": %.1f, \"allocations\": %.3f, \"allocated_bytes\": %.1f, \"doorbells\": %.3f},\n",
+        double(cpu) / per, double(allocs) / per, double(allocated) / per, double(rings) / per);
+    json += line;
+
+    json += "  \"stages\": {";
+    for (int h = 0; h < metrics::HISTOGRAM_COUNT; ++h) {
+        metrics::HistogramSnapshot d = after.histograms[h];
+        for (int b = 0; b < metrics::BUCKETS; ++b) d.buckets[b] -= before.histograms[h].buckets[b];
+        d.count -= before.histograms[h].count;
+        d.sum -= before.histograms[h].sum;
+        std::snprintf(line, sizeof(line), "  %-20s %10llu  p50 %10llu  p99 %10llu  p99.9 %10llu  max %10llu\n",
+            metrics::histogramNames[h], (unsigned long long)d.count, (unsigned long long)d.percentile(50),
+            (unsigned long long)d.percentile(99), (unsigned long long)d.percentile(99.9), (unsigned long long)d.percentile(100));
+        std::cout << line;
+        json += std::string(h ? "," : "") + "\n    \"" + metrics::histogramNames[h] + "\": " + percentiles(d);
+    }
+    json += "\n  },\n  \"counters\": {";
+    for (int c = 0; c < metrics::COUNTER_COUNT; ++c) {
+        std::snprintf(line, sizeof(line), "%s\n    \"%s\": %llu", c ? "," : "", metrics::counterNames[c],
+            (unsigned long long)(after.counters[c] - before.counters[c]));
+        json += line;
+    }
+    json += "\n  }\n}\n";
+    return json;
+}
+
+} // namespace bench
+
+static int usage() {
+    std::cerr <<
+        "linkSphereBench [options]\n"
+        "  --peers N            peers in the room (4)\n"
+        "  --seconds S          measured time (10), after --warmup S (1)\n"
+        "  --mix LIST           any of audio,mouse,bulk,churn,bcast (all but bcast)\n"
+        "  --net sockets|sim    loopback sockets, or the in-process simulator (sockets)\n"
+        "  --no-locallink       no shared-memory links between peers on this host\n"
+        "  --wire-v2            v2 framing on the wire\n"
+        "  --doorbell each|sleep  notify ring readers after every message, or only asleep ones (sleep)\n"
+        "  --audio-bytes N      audio frame payload (640)\n"
+        "  --mouse-bytes N      mouse event payload (24), --mouse-hz N (125)\n"
+        "  --bulk-bytes N       bulk chunk payload (65536), --bulk-window N chunks in flight (8)\n"
+        "  --churn N            connections per second for churn (20)\n"
+        "  --channel-bytes N    page channel size per peer (4194304)\n"
+        "  --port N             first peer's TCP and UDP port, one more per peer (41000)\n"
+        "  --multicast N        the room's group port for bcast (42500)\n"
+        "  --shards N           sockets per listening / bound port, 0: one per core (1)\n"
+        "  --flood N            a misbehaving sender, N datagrams/s over the peers (0)\n"
+        "  --admit M,B          peers limit every source's MOUSE_MOVE to M msgs/s and B bytes/s,\n"
+        "                       0 = unlimited; --admit-source M,B: all its types together\n"
+        "  --storm N            instead of the mixes: N connects at once to one server, then a\n"
+        "                       UDP flood for --seconds; --storm-clients N threads doing it (8)\n"
+        "  --failover N         instead of the mixes' report: crash the room master N times on\n"
+        "                       --net sim and time the new master; --lease MS room lease (150)\n"
+        "  --json FILE          results as JSON, - for stdout\n";
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    bench::Config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::invalid_argument(a);
+            return argv[++i];
+        };
+        try {
+            if (a == "--peers") cfg.peers = std::stoi(value());
+            else if (a == "--seconds") cfg.seconds = std::stod(value());
+            else if (a == "--warmup") cfg.warmup = std::stod(value());
+            else if (a == "--net") cfg.sim = value() == "sim";
+            else if (a == "--no-locallink") cfg.localLink = false;
+            else if (a == "--wire-v2") cfg.wireV2 = true;
+            else if (a == "--doorbell") cfg.bellEach = value() == "each";
+            else if (a == "--audio-bytes") cfg.audioBytes = (uint32_t)std::stoul(value());
+            else if (a == "--mouse-bytes") cfg.mouseBytes = (uint32_t)std::stoul(value());
+            else if (a == "--mouse-hz") cfg.mouseHz = std::stoi(value());
+            else if (a == "--bulk-bytes") cfg.bulkBytes = (uint32_t)std::stoul(value());
+            else if (a == "--bulk-window") cfg.bulkWindow = std::stoi(value());
+            else if (a == "--churn") cfg.churnPerSec = std::stoi(value());
+            else if (a == "--channel-bytes") cfg.channelSize = (uint32_t)std::stoul(value());
+            else if (a == "--port") cfg.basePort = (uint16_t)std::stoi(value());
+            else if (a == "--multicast") cfg.multicastPort = (uint16_t)std::stoi(value());
+            else if (a == "--shards") cfg.shards = (uint32_t)std::stoul(value());
+            else if (a == "--storm") cfg.storm = std::stoi(value());
+            else if (a == "--storm-clients") cfg.stormClients = std::stoi(value());
+            else if (a == "--failover") cfg.failover = std::stoi(value());
+            else if (a == "--lease") cfg.leaseMs = (uint32_t)std::stoul(value());
+            else if (a == "--flood") cfg.floodPerSec = std::stoi(value());
+            else if (a == "--admit" || a == "--admit-source") {
+                cfg.admitSource = a == "--admit-source";
+                std::string v = value();
+                size_t comma = v.find(',');
+                cfg.admitMsgs = (uint32_t)std::stoul(v.substr(0, comma));
+                cfg.admitBytes = comma == std::string::npos ? 0 : (uint32_t)std::stoul(v.substr(comma + 1));
+            }
+            else if (a == "--json") cfg.json = value();
+            else if (a == "--mix") {
+                std::string list = value();
+                for (int m = 0; m < bench::MIX_COUNT; ++m)
+                    cfg.mix[m] = list.find(bench::mixNames[m]) != std::string::npos;
+            }
+            else return usage();
+        }
+        catch (const std::exception&) {
+            return usage();
+        }
+    }
+    if (cfg.peers < 1 || cfg.peers > 250 || cfg.seconds <= 0 || cfg.storm < 0) return usage();
+    if (cfg.failover < 0 || (cfg.failover && cfg.peers < cfg.failover + 2)) return usage();
+
+    try {
+        bench::Bench b(cfg);
+        if (cfg.failover) return b.failover();
+        return cfg.storm ? b.storm() : b.run();
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,378 @@
+// Replays a traffic capture (Capture.h) through the native core, or exports it to pcapng.
+//
+//   linkSphereReplay <capture dir> [--speed <x>] [--pcapng <file>]
+//
+// Replay runs on a sim::Network with instant links, so it comes out the same every time: one
+// NetworkManager stands in for the captured app at the address it had, and one sink
+// NetworkManager for every peer it sent to. Received messages are injected into the app
+// (NetworkBase::inject: the native handlers, then the dispatcher), sent ones go through
+// sendMessage to the sinks, at the captured pace times --speed (default 1, 0 = as fast as
+// possible). Control messages bound to a connection (PING / PONG, shared memory switches,
+// multicast envelopes) are skipped both ways. What the app sent on connections its peers
+// had opened goes out on a connection of its own to the peer's address.
+//
+// Reports how many records went each way and arrived, captured vs replayed duration and the
+// histograms of Metrics.h (dispatch wait, send queue, ...).
+//
+// --pcapng writes the capture as a pcapng file instead, for Wireshark: every message becomes
+// one IPv4 packet from and to the record's endpoints (TCP or UDP header made up, the message
+// from its size field on as payload; larger TCP messages span several packets), stamped
+// with the captured wall clock and marked inbound / outbound.
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include "NetworkManager.h"
+#include "SimTransport.h"
+#include "Capture.h"
+#include "Metrics.h"
+
+namespace replay {
+
+// ---------------- pcapng ----------------
+
+constexpr uint16_t LINKTYPE_RAW = 101;          // packets start at the IPv4 header
+constexpr uint32_t MAX_TCP_PAYLOAD = 65535 - 40;
+
+class PcapWriter {
+public:
+    explicit PcapWriter(FILE* f) : f(f) {
+        std::vector<uint8_t> shb;
+        put32(shb, 0x1A2B3C4D);                 // byte order magic
+        put16(shb, 1);                          // version 1.0
+        put16(shb, 0);
+        put32(shb, 0xFFFFFFFF);                 // section length unknown
+        put32(shb, 0xFFFFFFFF);
+        block(0x0A0D0D0A, shb);
+
+        std::vector<uint8_t> idb;
+        put16(idb, LINKTYPE_RAW);
+        put16(idb, 0);
+        put32(idb, 0);                          // no snap length
+        put16(idb, 9);                          // if_tsresol: 10^-9 s
+        put16(idb, 1);
+        put32(idb, 9);
+        put32(idb, 0);                          // end of options
+        block(1, idb);
+    }
+
+    // one capture record as one or more packets
+    void write(const capture::Record& r) {
+        const capture::RecordHeader& h = r.header;
+        bool in = h.direction == capture::IN;
+        uint32_t srcIP = in ? h.remoteIP : h.localIP, dstIP = in ? h.localIP : h.remoteIP;
+        uint16_t srcPort = in ? h.remotePort : h.localPort, dstPort = in ? h.localPort : h.remotePort;
+        const uint8_t* msg = r.block + 12;      // the message as it is framed: size, type, payload
+        uint32_t len = h.blockSize - 12;
+
+        if (!h.tcp) {
+            packet(h, 17, srcIP, srcPort, dstIP, dstPort, 0, msg, std::min(len, 65535u - 28));
+            return;
+        }
+        uint32_t& seq = tcpSeq[flowKey(srcIP, srcPort, dstIP, dstPort)];
+        for (uint32_t at = 0; at < len; at += MAX_TCP_PAYLOAD) {
+            uint32_t n = std::min(MAX_TCP_PAYLOAD, len - at);
+            packet(h, 6, srcIP, srcPort, dstIP, dstPort, seq, msg + at, n);
+            seq += n;
+        }
+    }
+
+    uint64_t packets = 0;
+
+private:
+    FILE* f;
+    std::map<std::pair<uint64_t, uint64_t>, uint32_t> tcpSeq;
+    uint16_t ipId = 0;
+
+    static std::pair<uint64_t, uint64_t> flowKey(uint32_t srcIP, uint16_t srcPort, uint32_t dstIP, uint16_t dstPort) {
+        return { (uint64_t(srcIP) << 16) | srcPort, (uint64_t(dstIP) << 16) | dstPort };
+    }
+
+    static void put16(std::vector<uint8_t>& b, uint16_t v) { b.insert(b.end(), (uint8_t*)&v, (uint8_t*)&v + 2); }
+    static void put32(std::vector<uint8_t>& b, uint32_t v) { b.insert(b.end(), (uint8_t*)&v, (uint8_t*)&v + 4); }
+    static void be16(uint8_t* p, uint16_t v) { p[0] = uint8_t(v >> 8); p[1] = uint8_t(v); }
+    static void be32(uint8_t* p, uint32_t v) { be16(p, uint16_t(v >> 16)); be16(p + 2, uint16_t(v)); }
+
+    void block(uint32_t type, std::vector<uint8_t>& body) {
+        body.resize((body.size() + 3) & ~size_t(3));
+        uint32_t total = uint32_t(body.size() + 12);
+        std::fwrite(&type, 4, 1, f);
+        std::fwrite(&total, 4, 1, f);
+        std::fwrite(body.data(), 1, body.size(), f);
+        std::fwrite(&total, 4, 1, f);
+    }
+
+    void packet(const capture::RecordHeader& h, uint8_t proto, uint32_t srcIP, uint16_t srcPort, uint32_t dstIP, uint16_t dstPort,
+        uint32_t seq, const uint8_t* data, uint32_t len) {
+        uint32_t l4 = proto == 6 ? 20 : 8;
+        uint32_t total = 20 + l4 + len;
+        std::vector<uint8_t> ip(20 + l4);
+        ip[0] = 0x45;
+        be16(&ip[2], uint16_t(total));
+        be16(&ip[4], ipId++);
+        be16(&ip[6], 0x4000);                   // don't fragment
+        ip[8] = 64;
+        ip[9] = proto;
+        be32(&ip[12], srcIP);
+        be32(&ip[16], dstIP);
+        uint32_t sum = 0;
+        for (int i = 0; i < 20; i += 2) sum += (ip[i] << 8) | ip[i + 1];
+        while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+        be16(&ip[10], uint16_t(~sum));
+
+        uint8_t* p = &ip[20];
+        be16(p, srcPort);
+        be16(p + 2, dstPort);
+        if (proto == 6) {
+            be32(p + 4, seq);
+            p[12] = 5 << 4;
+            p[13] = 0x18;                       // PSH, ACK
+            be16(p + 14, 0xFFFF);
+        }
+        else be16(p + 4, uint16_t(8 + len));    // checksums stay 0: none for UDP, not checked for TCP
+
+        std::vector<uint8_t> epb;
+        put32(epb, 0);                          // interface
+        put32(epb, uint32_t(h.wallNs >> 32));
+        put32(epb, uint32_t(h.wallNs));
+        put32(epb, total);
+        put32(epb, total);
+        epb.insert(epb.end(), ip.begin(), ip.end());
+        epb.insert(epb.end(), data, data + len);
+        epb.resize((epb.size() + 3) & ~size_t(3));
+        put16(epb, 2);                          // epb_flags: inbound 1, outbound 2
+        put16(epb, 4);
+        put32(epb, h.direction == capture::IN ? 1 : 2);
+        put32(epb, 0);
+        block(6, epb);
+        ++packets;
+    }
+};
+
+int exportPcapng(capture::Reader& reader, const std::string& path) {
+    FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) {
+        std::cerr << "cannot write " << path << std::endl;
+        return 1;
+    }
+    PcapWriter out(f);
+    capture::Record r;
+    uint64_t records = 0;
+    while (reader.read(r)) {
+        out.write(r);
+        ++records;
+    }
+    bool ok = !std::ferror(f);
+    std::fclose(f);
+    if (!ok) {
+        std::cerr << "cannot write " << path << std::endl;
+        return 1;
+    }
+    std::cout << records << " records, " << out.packets << " packets written to " << path << std::endl;
+    return 0;
+}
+
+// ---------------- replay ----------------
+
+// the types consumeNative handles with the connection they came on, which inject has not;
+// the core sends its own on the replay's connections
+bool connectionBound(uint8_t type) {
+    return type == clockmsg::PING || type == clockmsg::PONG || type == locallink::SHM_OFFER ||
+        type == locallink::SHM_SWITCH || type == mcast::MCAST_DATA || type == mcast::MCAST_UNICAST;
+}
+
+bool replayable(const capture::Record& r) {
+    uint8_t type = r.block[16];
+    if (connectionBound(type)) return false;
+    return r.header.direction == capture::IN || bool(type & 0x80) == bool(r.header.tcp);   // else sendMessage would pick the other protocol
+}
+
+// a peer the app sent to: a TCP server or a bound UDP port counting what reaches it
+struct Sink {
+    std::unique_ptr<NetworkManager> net;
+    std::atomic<uint64_t> received{ 0 };
+};
+
+int run(capture::Reader& reader, double speed) {
+    // first pass: the app's address, the peers it sent to and the time span
+    capture::Record r;
+    std::map<uint32_t, uint64_t> localIPs;
+    std::set<std::pair<uint64_t, bool>> peers;             // (peerKey, tcp)
+    uint64_t records = 0, firstNs = 0, lastNs = 0;
+    while (reader.read(r)) {
+        if (!records++) firstNs = r.header.monoNs;
+        lastNs = std::max(lastNs, r.header.monoNs);
+        if (r.header.localIP) localIPs[r.header.localIP]++;
+        if (r.header.direction == capture::OUT && replayable(r) && r.header.remoteIP && r.header.remotePort)
+            peers.insert({ NetworkBase::peerKey(r.header.remoteIP, r.header.remotePort), r.header.tcp != 0 });
+    }
+    if (!records) {
+        std::cerr << "the capture holds no records" << std::endl;
+        return 1;
+    }
+    uint32_t appIP = 0x0A000001;
+    uint64_t most = 0;
+    for (auto& [ip, n] : localIPs)
+        if (n > most) { most = n; appIP = ip; }
+
+    sim::Network lan(1);
+    sim::LinkModel instant;
+    instant.latencyUs = 0;
+    lan.setDefaultLink(instant);
+    lan.runRealtime(1.0);
+
+    std::map<uint32_t, std::shared_ptr<sim::Host>> hosts;
+    auto hostFor = [&](uint32_t ip) {
+        auto& h = hosts[ip];
+        if (!h) h = lan.addHost(ip);
+        return h;
+    };
+    auto quiet = [](NetworkManager& net) {
+        net.setLiveness(0, 0, 0, 5000);         // no PINGs of our own in the replay
+        net.setLocalLink(false);
+    };
+
+    std::atomic<uint64_t> dispatched{ 0 };
+    auto app = std::make_unique<NetworkManager>(
+        [&dispatched](const uint8_t*, uint32_t) { dispatched++; },
+        [](const char* text) {
+            if (std::strstr(text, "failed") || std::strstr(text, "error")) std::cerr << "app: " << text << std::endl;
+        },
+        hostFor(appIP));
+    quiet(*app);
+
+    std::map<std::pair<uint64_t, bool>, std::unique_ptr<Sink>> sinks;
+    for (auto& key : peers) {
+        uint32_t ip = uint32_t(key.first >> 16);
+        uint16_t port = uint16_t(key.first);
+        auto sink = std::make_unique<Sink>();
+        Sink* s = sink.get();
+        sink->net = std::make_unique<NetworkManager>(
+            [s](const uint8_t*, uint32_t) { s->received++; }, [](const char*) {}, hostFor(ip), 1);
+        quiet(*sink->net);
+        bool ok = key.second ? sink->net->startTCPServer(port) : sink->net->createConnection(0x10, 0, port, 0, 0, false) != nullptr;
+        if (!ok) {
+            std::cerr << "no sink at " << ip << ":" << port << std::endl;
+            continue;
+        }
+        sinks[key] = std::move(sink);
+    }
+
+    std::string error;
+    if (!reader.rewind(error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    auto before = metrics::snapshot();
+    uint64_t injected = 0, skipped = 0, sent = 0;
+    auto start = std::chrono::steady_clock::now();
+    while (reader.read(r)) {
+        const capture::RecordHeader& h = r.header;
+        if (speed > 0 && h.monoNs > firstNs)
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(uint64_t((h.monoNs - firstNs) / speed)));
+
+        if (!replayable(r)) {
+            ++skipped;
+            continue;
+        }
+        MessageBlock* mb = new MessageBlock(h.blockSize);
+        std::memcpy(mb->getRawWritePtr(), r.block, h.blockSize);
+        mb->finalizeNetMsg();
+        if (h.direction == capture::IN) {
+            app->inject(mb);
+            ++injected;
+            continue;
+        }
+        mb->setSrcIP(appIP);
+        mb->setSrcPort(h.tcp ? 0 : h.localPort);
+        mb->setDstIP(h.remoteIP);
+        mb->setDstPort(h.remotePort);
+        app->sendMessage(mb);
+        ++sent;
+    }
+    double replayed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // what is still queued: until nothing has arrived for 100 ms, at most 2 s
+    auto arrived = [&]() {
+        uint64_t n = dispatched;
+        for (auto& [key, s] : sinks) n += s->received;
+        return n;
+    };
+    uint64_t lastSeen = UINT64_MAX;
+    for (int i = 0; i < 20 && arrived() != lastSeen; ++i) {
+        lastSeen = arrived();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    uint64_t delivered = lastSeen - dispatched;
+    size_t sinkCount = sinks.size();
+    auto after = metrics::snapshot();
+
+    app.reset();
+    sinks.clear();
+    lan.runRealtime(0);
+
+    double captured = (lastNs - firstNs) / 1e9;
+    char line[256];
+    snprintf(line, sizeof(line), "%llu records in %zu segments, captured over %.3f s, replayed in %.3f s (%.2fx)\n",
+        (unsigned long long)records, reader.segments(), captured, replayed, replayed > 0 ? captured / replayed : 0.0);
+    std::cout << line;
+    snprintf(line, sizeof(line), "in:  %llu injected, %llu dispatched, %llu taken by native handlers\n",
+        (unsigned long long)injected, (unsigned long long)dispatched.load(),
+        (unsigned long long)(injected - std::min<uint64_t>(injected, dispatched)));
+    std::cout << line;
+    snprintf(line, sizeof(line), "out: %llu sent, %llu delivered to %zu peers\n",
+        (unsigned long long)sent, (unsigned long long)delivered, sinkCount);
+    std::cout << line;
+    snprintf(line, sizeof(line), "skipped: %llu connection-bound control messages\n", (unsigned long long)skipped);
+    std::cout << line;
+
+    metrics::Snapshot window = *after;
+    for (int h = 0; h < metrics::HISTOGRAM_COUNT; ++h) {
+        for (int b = 0; b < metrics::BUCKETS; ++b) window.histograms[h].buckets[b] -= before->histograms[h].buckets[b];
+        window.histograms[h].count -= before->histograms[h].count;
+        window.histograms[h].sum -= before->histograms[h].sum;
+    }
+    for (int c = 0; c < metrics::COUNTER_COUNT; ++c) window.counters[c] -= before->counters[c];
+    for (int d = 0; d < 2; ++d)
+        for (int t = 0; t < 256; ++t) {
+            window.typeMsgs[d][t] -= before->typeMsgs[d][t];
+            window.typeBytes[d][t] -= before->typeBytes[d][t];
+        }
+    std::cout << metrics::dumpText(window);
+    return 0;
+}
+
+} // namespace replay
+
+int main(int argc, char** argv) {
+    std::string dir, pcapng;
+    double speed = 1;
+    bool usage = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a == "--speed" && i + 1 < argc) speed = std::atof(argv[++i]);
+        else if (a == "--pcapng" && i + 1 < argc) pcapng = argv[++i];
+        else if (dir.empty() && a[0] != '-') dir = a;
+        else usage = true;
+    }
+    if (usage || dir.empty() || speed < 0) {
+        std::cerr << "usage: linkSphereReplay <capture dir> [--speed <x>, 0 = as fast as possible] [--pcapng <file>]\n";
+        return 2;
+    }
+
+    capture::Reader reader;
+    std::string error;
+    if (!reader.open(dir, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    return pcapng.empty() ? replay::run(reader, speed) : replay::exportPcapng(reader, pcapng);
+}
@@ -8,6 +8,7 @@
 #include <functional>
 #include <vector>
 #include <sstream>
+#include <filesystem>
 
 #include "NetworkManager.h"
 #include "BrowserWithMessaging.h"
@@ -16,6 +17,7 @@
 #include "getLocalIPs.h"
 #include "buildOfflinePage.h"
 #include "EnsureWebView2Runtime.h"
+#include "Log.h"
 //#include "ThreadPool.h"
 
 //ThreadPool g_pool(4); // or std::thread::hardware_concurrency(
@@ -30,7 +32,7 @@ static void setEventHandler(const std::wstring& e, std::function<void(const std:
 
 void onNotification(const std::wstring& m) {
     size_t p = m.find(L'-');
-    std::wcout << L"[NOTIFY] " << m << std::endl;
+    LS_LOG(logging::Level::Debug, "[NOTIFY] {}", m);
     //std::this_thread::sleep_for(std::chrono::seconds(5));
     //std::cout << "this function completed" << endl;
 
@@ -46,10 +48,13 @@ void onNotification(const std::wstring& m) {
     
 }
 
-void onBrowserMessage(const BYTE* d, uint32_t s) {
-    if (!g_net) return;
+void onBrowserMessage(MessageBlock* msg) {
+    if (!g_net) {
+        delete msg;
+        return;
+    }
 
-    bool success = g_net->sendMessage(d, s);
+    bool success = g_net->sendMessage(msg);
     //std::cout << "message received from browser\n";
 }
 
@@ -69,7 +74,15 @@ void notifyNetworkEvent(const char* t) {
     if (!w.empty() && w.back() == L'\0') w.pop_back();
 
     g_browser->notify( w.c_str());
-    std::cout << "to browser " << t << std::endl;
+    if (std::strncmp(t, "error-", 6) == 0 || std::strstr(t, "failed")) LS_LOG(logging::Level::Warn, "to browser {}", t);
+    else LS_LOG(logging::Level::Debug, "to browser {}", t);
+}
+
+static std::string toUtf8(const std::wstring& w) {
+    int sz = WideCharToMultiByte(CP_UTF8, 0, w.c_str(), (int)w.size(), nullptr, 0, nullptr, nullptr);
+    std::string s(sz, 0);
+    WideCharToMultiByte(CP_UTF8, 0, w.c_str(), (int)w.size(), &s[0], sz, nullptr, nullptr);
+    return s;
 }
 
 //void onClientConnect(const wstring & t) {
@@ -95,6 +108,12 @@ int main() {
     browser.setOnReceiveCallback(onBrowserMessage);
     browser.setOnNotificationCallback(onNotification);
 
+    // the server, room and connections of the last run, back before the page asks for them
+    std::error_code tempError;
+    std::filesystem::path tempDir = std::filesystem::temp_directory_path(tempError);
+    if (!tempError && net.openConnectionTable((tempDir / "linkSphere-connections.lstab").string()))
+        net.restoreConnections();
+
     setEventHandler(L"startTCP", [](const std::wstring& p) {
         bool ok = g_net && g_browser &&g_net->startTCPServer((uint16_t)std::stoi(p));
         g_browser->notify(((ok ? L"serverStarted-" : L"serverFailed-") + p).c_str());
@@ -133,6 +152,171 @@ int main() {
         ConnectionContext* ctx = g_net->createConnection(t, sip, sp, dip, dp);
         });
 
+    setEventHandler(L"channelSize", [](const std::wstring& p) {    // takes effect on the next page load
+        if (g_browser) g_browser->setChannelSize((uint32_t)std::stoul(p));
+        });
+
+    setEventHandler(L"compression", [](const std::wstring& p) {   // type-method, see Compression.h
+        if (!g_net) return;
+        uint8_t t = 0, m = 0;
+        swscanf_s(p.c_str(), L"%hhu-%hhu", &t, &m);
+        g_net->setCompression(t, m);
+        });
+
+    setEventHandler(L"getMetrics", [](const std::wstring&) {       // answered with "metrics-<text dump>"
+        if (!g_net || !g_browser) return;
+        std::string text = g_net->dumpMetrics();
+        g_browser->notify((L"metrics-" + std::wstring(text.begin(), text.end())).c_str());
+        });
+
+    setEventHandler(L"traceSample", [](const std::wstring& p) {    // trace one message in every p, 0 = off
+        tracing::setSampleEvery((uint32_t)std::stoul(p));
+        });
+
+    setEventHandler(L"getTrace", [](const std::wstring&) {         // answered with "trace-<Chrome trace JSON>"
+        if (!g_browser) return;
+        std::string json = tracing::dumpChromeJson();
+        g_browser->notify((L"trace-" + std::wstring(json.begin(), json.end())).c_str());
+        });
+
+    setEventHandler(L"ping", [](const std::wstring& p) {           // type-srcPort-dstIP-dstPort, answered with "peerClock-..."
+        if (!g_net) return;
+        uint8_t t = 0; uint16_t sp = 0, dp = 0; uint32_t dip = 0;
+        swscanf_s(p.c_str(), L"%hhu-%hu-%u-%hu", &t, &sp, &dip, &dp);
+        g_net->ping(t, sp, dip, dp);
+        });
+
+    setEventHandler(L"pingInterval", [](const std::wstring& p) {   // ms between native PINGs on TCP connections, 0 = off
+        if (g_net) g_net->setPingInterval((uint32_t)std::stoul(p));
+        });
+
+    setEventHandler(L"liveness", [](const std::wstring& p) {       // heartbeat-deadAfter-idle-connect in ms, see NetworkBase::setLiveness
+        if (!g_net) return;
+        uint32_t hb = 0, dead = 0, idle = 0, conn = 0;
+        swscanf_s(p.c_str(), L"%u-%u-%u-%u", &hb, &dead, &idle, &conn);
+        g_net->setLiveness(hb, dead, idle, conn);
+        });
+
+    setEventHandler(L"room", [](const std::wstring& p) {           // roomHash-selfIP-selfPort-leaseMs, see RoomElection.h
+        if (!g_net) return;
+        uint32_t room = 0, ip = 0, lease = 0; uint16_t port = 0;
+        swscanf_s(p.c_str(), L"%u-%u-%hu-%u", &room, &ip, &port, &lease);
+        g_net->setRoom(room, ip, port, lease);
+        });
+
+    setEventHandler(L"roomMembers", [](const std::wstring& p) {    // ip:port,ip:port,...
+        if (!g_net) return;
+        std::vector<RoomElection::Peer> members;
+        std::wstringstream ss(p);
+        std::wstring item;
+        while (std::getline(ss, item, L',')) {
+            RoomElection::Peer peer;
+            if (swscanf_s(item.c_str(), L"%u:%hu", &peer.ip, &peer.port) == 2) members.push_back(peer);
+        }
+        g_net->setRoomMembers(members);
+        });
+
+    setEventHandler(L"roomElect", [](const std::wstring&) {        // answered with "roomMaster-<ip>:<port>-<term>"
+        if (g_net) g_net->electRoomMaster();
+        });
+
+    setEventHandler(L"relayCapacity", [](const std::wstring& p) {  // children this member can mix for, answered with "relayPlan-..."
+        if (g_net) g_net->setRelayCapacity((uint16_t)std::stoul(p));
+        });
+
+    setEventHandler(L"multicast", [](const std::wstring& p) {      // UDP port for room broadcasts, 0 = unicast only
+        if (g_net) g_net->setMulticast((uint16_t)std::stoul(p));
+        });
+
+    setEventHandler(L"localLink", [](const std::wstring& p) {      // 1/0: shared memory with peers on this machine, see LocalLink.h
+        if (g_net) g_net->setLocalLink(p != L"0");
+        });
+
+    setEventHandler(L"admission", [](const std::wstring& p) {      // maxConnsPerIP-msgsPerSec-bytesPerSec per peer address, 0 = unlimited; see Admission.h
+        unsigned conns = 0, msgs = 0, bytes = 0;
+        if (!g_net || swscanf_s(p.c_str(), L"%u-%u-%u", &conns, &msgs, &bytes) != 3) return;
+        admission::Limits limits = g_net->admissionLimits();
+        limits.maxConnsPerIP = conns;
+        limits.msgs.perSec = msgs;
+        limits.bytes.perSec = bytes;
+        g_net->setAdmission(limits);
+        });
+
+    setEventHandler(L"admissionType", [](const std::wstring& p) {  // type-msgsPerSec-bytesPerSec per peer address and message type
+        unsigned type = 0, msgs = 0, bytes = 0;
+        if (!g_net || swscanf_s(p.c_str(), L"%u-%u-%u", &type, &msgs, &bytes) != 3 || type > 255) return;
+        admission::Limits limits = g_net->admissionLimits();
+        limits.typeMsgs[type].perSec = msgs;
+        limits.typeBytes[type].perSec = bytes;
+        g_net->setAdmission(limits);
+        });
+
+    setEventHandler(L"getAdmission", [](const std::wstring&) {     // answered with "admission-ip:conns:droppedMsgs:droppedBytes,..."
+        if (!g_net || !g_browser) return;
+        std::wstring text;
+        for (const admission::SourceStats& s : g_net->admissionSources())
+            text += (text.empty() ? L"" : L",") + std::to_wstring(s.ip) + L":" + std::to_wstring(s.conns) + L":" +
+                std::to_wstring(s.droppedMsgs) + L":" + std::to_wstring(s.droppedBytes);
+        g_browser->notify((L"admission-" + text).c_str());
+        });
+
+    setEventHandler(L"presenceStart", [](const std::wstring& p) {  // ip-tcpPort-discoveryPort-info, see Presence.h; answered with "presence-..."
+        if (!g_net) return;
+        uint32_t ip = 0; uint16_t tcp = 0, discovery = 0; int used = 0;
+        if (swscanf_s(p.c_str(), L"%u-%hu-%hu-%n", &ip, &tcp, &discovery, &used) < 3 || !used) return;
+        g_net->startPresence(ip, tcp, discovery, toUtf8(p.substr(used)));
+        });
+
+    setEventHandler(L"presenceInfo", [](const std::wstring& p) {   // the page's user info, JSON
+        if (g_net) g_net->setPresenceInfo(toUtf8(p));
+        });
+
+    setEventHandler(L"presenceSeed", [](const std::wstring& p) {   // ip:discoveryPort,ip:discoveryPort,...
+        if (!g_net) return;
+        std::vector<std::pair<uint32_t, uint16_t>> peers;
+        std::wstringstream ss(p);
+        std::wstring item;
+        while (std::getline(ss, item, L',')) {
+            uint32_t ip = 0; uint16_t port = 0;
+            if (swscanf_s(item.c_str(), L"%u:%hu", &ip, &port) == 2) peers.push_back({ ip, port });
+        }
+        g_net->seedPresence(peers);
+        });
+
+    setEventHandler(L"presenceStop", [](const std::wstring&) {
+        if (g_net) g_net->stopPresence();
+        });
+
+    setEventHandler(L"presenceSnapshot", [](const std::wstring&) { // answered with "presence-..." listing everyone
+        if (g_net) g_net->presenceSnapshot();
+        });
+
+    setEventHandler(L"captureStart", [](const std::wstring& p) {   // segmentMB-dir, see Capture.h; answered with "capture-started-<dir>"
+        if (!g_net) return;
+        uint32_t segmentMB = 0; int used = 0;
+        if (swscanf_s(p.c_str(), L"%u-%n", &segmentMB, &used) < 1 || !used) return;
+        g_net->startCapture(toUtf8(p.substr(used)), segmentMB);
+        });
+
+    setEventHandler(L"captureStop", [](const std::wstring&) {      // answered with "capture-stopped-<records>-<dropped>"
+        if (g_net) g_net->stopCapture();
+        });
+
+    setEventHandler(L"restore", [](const std::wstring& p) {        // connects at once; answered with "restore-done-<up>-<failed>-<ms>"
+        if (g_net) g_net->restoreConnections((uint32_t)std::stoul(p));
+        });
+
+    setEventHandler(L"logLevel", [](const std::wstring& p) {       // 0 debug .. 3 error, see Log.h
+        unsigned long level = std::stoul(p);
+        logging::setLevel((logging::Level)(level > 3 ? 3 : level));
+        });
+
+    setEventHandler(L"logSampling", [](const std::wstring& p) {    // level-n: keep one record in every n of that level
+        unsigned level = 0, every = 1;
+        if (swscanf_s(p.c_str(), L"%u-%u", &level, &every) == 2 && level < 4)
+            logging::setSampling((logging::Level)level, every);
+        });
+
     setEventHandler(L"close", [](const std::wstring&) { if (g_browser) g_browser->close(); });
 
     browser.setOfflinePageCallback([url](int ec) { return buildOfflinePage(url, ec); });
@@ -140,5 +324,6 @@ int main() {
     while (g_browser->isOpen())
         std::this_thread::sleep_for(std::chrono::seconds(1));
 
+    logging::flush();
     return 0;
 }
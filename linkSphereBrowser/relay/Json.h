@@ -0,0 +1,129 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Just enough JSON for the page's room messages (CONNECT_REQUEST, PEER_CONNECTED, ...): flat
+// lookups of top-level fields. Values come back as their raw text, so strings such as a
+// member's name or photo are passed on as the page wrote them, escapes and all.
+namespace relayd::json {
+
+inline size_t skipSpace(const std::string& s, size_t i) {
+    while (i < s.size() && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r')) ++i;
+    return i;
+}
+
+// end of the value starting at i, npos if it is malformed
+inline size_t skipValue(const std::string& s, size_t i) {
+    i = skipSpace(s, i);
+    if (i >= s.size()) return std::string::npos;
+    if (s[i] == '"') {
+        for (++i; i < s.size(); ++i) {
+            if (s[i] == '\\') ++i;
+            else if (s[i] == '"') return i + 1;
+        }
+        return std::string::npos;
+    }
+    if (s[i] == '{' || s[i] == '[') {
+        char close = s[i] == '{' ? '}' : ']';
+        i = skipSpace(s, i + 1);
+        if (i < s.size() && s[i] == close) return i + 1;
+        for (;;) {
+            if (close == '}') {
+                i = skipValue(s, i);                // key
+                i = i == std::string::npos ? i : skipSpace(s, i);
+                if (i >= s.size() || s[i] != ':') return std::string::npos;
+                ++i;
+            }
+            i = skipValue(s, i);
+            i = i == std::string::npos ? i : skipSpace(s, i);
+            if (i >= s.size()) return std::string::npos;
+            if (s[i] == close) return i + 1;
+            if (s[i] != ',') return std::string::npos;
+            ++i;
+        }
+    }
+    size_t start = i;
+    while (i < s.size() && s[i] != ',' && s[i] != '}' && s[i] != ']' && s[i] != ' ' && s[i] != '\n') ++i;
+    return i > start ? i : std::string::npos;
+}
+
+// raw text of obj[key], false if obj is no object or lacks the key
+inline bool field(const std::string& obj, const std::string& key, std::string& raw) {
+    std::string quoted = "\"" + key + "\"";
+    size_t i = skipSpace(obj, 0);
+    if (i >= obj.size() || obj[i] != '{') return false;
+    i = skipSpace(obj, i + 1);
+    while (i < obj.size() && obj[i] == '"') {
+        size_t keyEnd = skipValue(obj, i);
+        if (keyEnd == std::string::npos) return false;
+        bool match = obj.compare(i, keyEnd - i, quoted) == 0;
+        i = skipSpace(obj, keyEnd);
+        if (i >= obj.size() || obj[i] != ':') return false;
+        size_t valueStart = skipSpace(obj, i + 1);
+        size_t valueEnd = skipValue(obj, valueStart);
+        if (valueEnd == std::string::npos) return false;
+        if (match) {
+            raw = obj.substr(valueStart, valueEnd - valueStart);
+            return true;
+        }
+        i = skipSpace(obj, valueEnd);
+        if (i < obj.size() && obj[i] == ',') i = skipSpace(obj, i + 1);
+    }
+    return false;
+}
+
+// obj[key] as a number, fallback if it is missing or not one
+inline double number(const std::string& obj, const std::string& key, double fallback = 0) {
+    std::string raw;
+    if (!field(obj, key, raw) || raw.empty() || raw[0] == '"' || raw == "null") return fallback;
+    char* end = nullptr;
+    double v = strtod(raw.c_str(), &end);
+    return end && *end == 0 ? v : fallback;
+}
+
+// obj[key] if it is a string, raw (quotes included), else ""
+inline std::string string(const std::string& obj, const std::string& key) {
+    std::string raw;
+    return field(obj, key, raw) && !raw.empty() && raw[0] == '"' ? raw : "\"\"";
+}
+
+// raw text of each element of an array
+inline std::vector<std::string> elements(const std::string& array) {
+    std::vector<std::string> out;
+    size_t i = skipSpace(array, 0);
+    if (i >= array.size() || array[i] != '[') return out;
+    i = skipSpace(array, i + 1);
+    while (i < array.size() && array[i] != ']') {
+        size_t end = skipValue(array, i);
+        if (end == std::string::npos) return out;
+        out.push_back(array.substr(i, end - i));
+        i = skipSpace(array, end);
+        if (i < array.size() && array[i] == ',') i = skipSpace(array, i + 1);
+    }
+    return out;
+}
+
+// text as a JSON string, escaped like JSON.stringify
+inline std::string quote(const std::string& text) {
+    std::string out = "\"";
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') { out += '\\'; out += (char)c; }
+        else if (c == '\n') out += "\\n";
+        else if (c == '\r') out += "\\r";
+        else if (c == '\t') out += "\\t";
+        else if (c == '\b') out += "\\b";
+        else if (c == '\f') out += "\\f";
+        else if (c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        }
+        else out += (char)c;
+    }
+    return out + "\"";
+}
+
+} // namespace relayd::json
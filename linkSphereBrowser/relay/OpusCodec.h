@@ -0,0 +1,87 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#ifdef LINKSPHERE_OPUS
+#include <opus/opus.h>
+#endif
+
+// Room audio as the page's audio.js frames it: a 13-byte header (u8 0 key / 1 delta, u64 BE
+// timestamp, u32 BE duration, both in us) and one Opus packet of 48 kHz mono, 20 ms frames.
+//
+// Built without LINKSPHERE_OPUS (no libopus) the node still relays and takes part in the
+// room, but decodes and encodes nothing and so reports no mixing capacity.
+namespace relayd {
+
+constexpr int SAMPLE_RATE = 48000;
+constexpr int FRAME = 960;                          // samples in 20 ms
+constexpr uint32_t PACKET_HEADER = 13;
+constexpr uint32_t MAX_PACKET = PACKET_HEADER + 4000;
+
+#ifdef LINKSPHERE_OPUS
+constexpr bool HAVE_OPUS = true;
+
+class Decoder {
+public:
+    Decoder() {
+        int err = 0;
+        dec = opus_decoder_create(SAMPLE_RATE, 1, &err);
+    }
+    ~Decoder() { if (dec) opus_decoder_destroy(dec); }
+    Decoder(const Decoder&) = delete;
+    Decoder& operator=(const Decoder&) = delete;
+
+    // samples written to pcm (at most max), 0 for a packet that does not decode
+    int decode(const uint8_t* packet, uint32_t len, float* pcm, int max) {
+        if (!dec || len <= PACKET_HEADER) return 0;
+        int n = opus_decode_float(dec, packet + PACKET_HEADER, (opus_int32)(len - PACKET_HEADER), pcm, max, 0);
+        return n < 0 ? 0 : n;
+    }
+
+private:
+    OpusDecoder* dec = nullptr;
+};
+
+class Encoder {
+public:
+    Encoder() {
+        int err = 0;
+        enc = opus_encoder_create(SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP, &err);
+        if (!enc) return;
+        opus_encoder_ctl(enc, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));     // as audio.js configures WebCodecs
+        opus_encoder_ctl(enc, OPUS_SET_COMPLEXITY(5));
+        opus_encoder_ctl(enc, OPUS_SET_VBR(1));
+    }
+    ~Encoder() { if (enc) opus_encoder_destroy(enc); }
+    Encoder(const Encoder&) = delete;
+    Encoder& operator=(const Encoder&) = delete;
+
+    // one FRAME of pcm into out (MAX_PACKET bytes), header included; its length or 0
+    uint32_t encode(const float* pcm, uint8_t* out, uint64_t timestampUs) {
+        if (!enc) return 0;
+        int n = opus_encode_float(enc, pcm, FRAME, out + PACKET_HEADER, (opus_int32)(MAX_PACKET - PACKET_HEADER));
+        if (n <= 0) return 0;
+        out[0] = 0;                                 // every Opus packet decodes on its own
+        for (int i = 0; i < 8; ++i) out[1 + i] = (uint8_t)(timestampUs >> (56 - 8 * i));
+        uint32_t duration = 1000000 * FRAME / SAMPLE_RATE;
+        for (int i = 0; i < 4; ++i) out[9 + i] = (uint8_t)(duration >> (24 - 8 * i));
+        return PACKET_HEADER + (uint32_t)n;
+    }
+
+private:
+    OpusEncoder* enc = nullptr;
+};
+#else
+constexpr bool HAVE_OPUS = false;
+
+class Decoder {
+public:
+    int decode(const uint8_t*, uint32_t, float*, int) { return 0; }
+};
+
+class Encoder {
+public:
+    uint32_t encode(const float*, uint8_t*, uint64_t) { return 0; }
+};
+#endif
+
+} // namespace relayd
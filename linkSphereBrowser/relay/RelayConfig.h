@@ -0,0 +1,197 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Transport.h"
+#include "Admission.h"
+
+// linkSphereRelay's config file: "key = value" lines, # starts a comment, and one
+// "[room <roomId>]" section per room the node serves. Keys before the first section are
+// the node's, see linkSphereRelay.conf for all of them.
+namespace relayd {
+
+struct RoomConfig {
+    std::string id;                         // the page's roomId, as Room.init gets it
+    uint16_t port = 0;                      // our TCP server port in this room
+    std::vector<std::pair<uint32_t, uint16_t>> members;    // ip, TCP port: who to contact first
+    uint32_t leaseMs = 0;                   // 0: the node's
+    uint16_t multicast = 0;                 // UDP port for room broadcasts, 0 = unicast only
+    int capacity = -1;                      // children offered on the relay tree, -1: measured
+};
+
+struct Config {
+    uint32_t ip = 0;                        // announced to the rooms, 0: first non-loopback address
+    std::string name = "relay";             // shown to the members like a user's name
+    uint32_t threads = 1;                   // per room, running its network callbacks
+    uint32_t shards = 1;                    // sockets per room port, 0: one per core (NetworkBase::setShards)
+    uint32_t leaseMs = 150;
+    uint32_t heartbeatMs = 2000;            // see NetworkBase::setLiveness
+    uint32_t deadAfterMs = 6000;
+    uint32_t idleMs = 0;
+    uint32_t connectMs = 5000;
+    bool localLink = true;
+    uint32_t maxMembers = 64;               // per room; further members are turned away
+    std::string capture;                    // directory capturing each room's traffic, "" = off
+    admission::Limits admission;            // per member address, applied without restarting rooms
+    std::vector<RoomConfig> rooms;
+};
+
+// "ip:port" with a dotted quad or a host order number, as the page writes them
+inline bool parseEndpoint(const std::string& text, uint32_t& ip, uint16_t& port) {
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos) return false;
+    std::string host = text.substr(0, colon);
+    unsigned p = 0;
+    char tail = 0;
+    if (sscanf(text.c_str() + colon + 1, "%u%c", &p, &tail) != 1 || !p || p > 65535) return false;
+    port = (uint16_t)p;
+    if (transport::parseIPv4(host, ip)) return true;
+    unsigned long n = 0;
+    if (sscanf(host.c_str(), "%lu%c", &n, &tail) != 1 || n > 0xFFFFFFFFul) return false;
+    ip = (uint32_t)n;
+    return true;
+}
+
+inline bool parseNumber(const std::string& text, uint32_t& value, uint32_t max = 0xFFFFFFFFu) {
+    unsigned long n = 0;
+    char tail = 0;
+    if (sscanf(text.c_str(), "%lu%c", &n, &tail) != 1 || n > max) return false;
+    value = (uint32_t)n;
+    return true;
+}
+
+inline std::string trim(const std::string& s) {
+    size_t a = s.find_first_not_of(" \t\r");
+    size_t b = s.find_last_not_of(" \t\r");
+    return a == std::string::npos ? "" : s.substr(a, b - a + 1);
+}
+
+// false with error set to "<path>:<line>: <why>" if the file is unusable
+inline bool loadConfig(const std::string& path, Config& cfg, std::string& error) {
+    std::ifstream in(path);
+    if (!in) {
+        error = path + ": cannot be read";
+        return false;
+    }
+    Config out;
+    RoomConfig* room = nullptr;
+    std::string line;
+    int lineNo = 0;
+    auto fail = [&](const std::string& why) {
+        error = path + ":" + std::to_string(lineNo) + ": " + why;
+        return false;
+    };
+
+    while (std::getline(in, line)) {
+        ++lineNo;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+
+        if (line.front() == '[') {
+            if (line.back() != ']' || line.compare(0, 6, "[room ") != 0) return fail("expected [room <roomId>]");
+            out.rooms.push_back({});
+            room = &out.rooms.back();
+            room->id = trim(line.substr(6, line.size() - 7));
+            if (room->id.empty()) return fail("room without an id");
+            continue;
+        }
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) return fail("expected key = value");
+        std::string key = trim(line.substr(0, eq));
+        std::string value = trim(line.substr(eq + 1));
+        uint32_t n = 0;
+
+        if (room) {
+            if (key == "port") {
+                if (!parseNumber(value, n, 65535) || !n) return fail("bad port");
+                room->port = (uint16_t)n;
+            }
+            else if (key == "members") {
+                std::stringstream ss(value);
+                std::string item;
+                while (std::getline(ss, item, ',')) {
+                    uint32_t ip = 0;
+                    uint16_t port = 0;
+                    if (!parseEndpoint(trim(item), ip, port)) return fail("bad member " + trim(item));
+                    room->members.push_back({ ip, port });
+                }
+            }
+            else if (key == "lease") {
+                if (!parseNumber(value, room->leaseMs)) return fail("bad lease");
+            }
+            else if (key == "multicast") {
+                if (!parseNumber(value, n, 65535)) return fail("bad multicast port");
+                room->multicast = (uint16_t)n;
+            }
+            else if (key == "capacity") {
+                if (value == "auto") room->capacity = -1;
+                else if (parseNumber(value, n, 64)) room->capacity = (int)n;
+                else return fail("bad capacity");
+            }
+            else return fail("unknown room key " + key);
+            continue;
+        }
+
+        if (key == "ip") {
+            if (!transport::parseIPv4(value, out.ip)) return fail("bad ip");
+        }
+        else if (key == "name") out.name = value;
+        else if (key == "threads") {
+            if (!parseNumber(value, out.threads, 64) || !out.threads) return fail("bad threads");
+        }
+        else if (key == "shards") {
+            if (!parseNumber(value, out.shards, 256)) return fail("bad shards");
+        }
+        else if (key == "lease") {
+            if (!parseNumber(value, out.leaseMs) || !out.leaseMs) return fail("bad lease");
+        }
+        else if (key == "liveness") {
+            if (sscanf(value.c_str(), "%u %u %u %u", &out.heartbeatMs, &out.deadAfterMs, &out.idleMs, &out.connectMs) != 4)
+                return fail("liveness takes heartbeat deadAfter idle connect");
+        }
+        else if (key == "locallink") out.localLink = value != "0" && value != "off";
+        else if (key == "max_members") {
+            if (!parseNumber(value, out.maxMembers) || !out.maxMembers) return fail("bad max_members");
+        }
+        else if (key == "capture") out.capture = value;
+        else if (key == "max_conns_per_ip") {
+            if (!parseNumber(value, out.admission.maxConnsPerIP)) return fail("bad max_conns_per_ip");
+        }
+        else if (key == "rate") {
+            admission::Limits& a = out.admission;
+            if (sscanf(value.c_str(), "%u %u", &a.msgs.perSec, &a.bytes.perSec) != 2)
+                return fail("rate takes msgs/s bytes/s");
+        }
+        else if (key == "type_rate") {
+            int type = 0;
+            unsigned msgs = 0, bytes = 0;
+            if (sscanf(value.c_str(), "%i %u %u", &type, &msgs, &bytes) != 3 || type < 0 || type > 255)
+                return fail("type_rate takes type msgs/s bytes/s");
+            out.admission.typeMsgs[type].perSec = msgs;
+            out.admission.typeBytes[type].perSec = bytes;
+        }
+        else return fail("unknown key " + key);
+    }
+
+    std::set<uint16_t> ports;
+    std::set<std::string> ids;
+    for (const RoomConfig& r : out.rooms) {
+        if (!r.port) {
+            error = path + ": room " + r.id + " has no port";
+            return false;
+        }
+        if (!ports.insert(r.port).second || !ids.insert(r.id).second) {
+            error = path + ": room " + r.id + " repeats a room id or port";
+            return false;
+        }
+    }
+    cfg = std::move(out);
+    return true;
+}
+
+} // namespace relayd
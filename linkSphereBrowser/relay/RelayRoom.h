@@ -0,0 +1,476 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "NetworkManager.h"
+#include "MessageBlockView.h"
+#include "ThreadPool.h"
+#include "RelayConfig.h"
+#include "RoomMixer.h"
+#include "Json.h"
+
+// One room served by the relay node: Room.js for a member without microphone or speakers.
+// The node joins like a page does (CONNECT_REQUEST / REPLY), takes part in the election and
+// the relay tree, and while it is master, or a relay with children, mixes for them
+// (RoomMixer.h). The notifications the page would get (roomMaster-, relayPlan-, connection
+// events) are handled here instead; onEvent sees each of them afterwards.
+//
+// What the room decides runs in order on its one worker thread, as it would on the page's
+// event loop, so none of the room's state below needs a lock; audio goes straight to the
+// mixer.
+namespace relayd {
+
+constexpr uint8_t TCP = 0x80;               // MsgType, see Web/utils/MessageTypes.js
+constexpr uint8_t CONNECT_REQUEST = 0x8A;
+constexpr uint8_t CONNECT_REPLY = 0x8B;
+constexpr uint8_t ALL_PEERS = 0x8C;
+constexpr uint8_t PEER_CONNECTED = 0x8D;
+constexpr uint8_t PEER_REMOVED = 0x8E;
+constexpr uint8_t GET_ALL_PEERS = 0x8F;
+constexpr uint64_t REPORT_MS = 2000;        // capacity reports, as Room._reportCapacity
+constexpr uint32_t MAX_PENDING_MIXES = 5;   // ticks of mixes waiting for the worker before one is dropped
+
+// FNV-1a of the roomId, as MessageHandler.setRoom
+inline uint32_t roomHash(const std::string& id) {
+    uint32_t hash = 0x811c9dc5;
+    for (unsigned char c : id) hash = (hash ^ c) * 0x01000193;
+    return hash;
+}
+
+inline std::string dotted(uint32_t ip) {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
+    return text;
+}
+
+class RelayRoom {
+public:
+    // every notification of the room's NetworkManager, after the room acted on it
+    std::function<void(const std::string& roomId, const std::string& event)> onEvent;
+
+    // net: the network to run on (e.g. a sim::Host), the platform's sockets if null
+    RelayRoom(const Config& node, RoomConfig room, uint32_t selfIP, std::shared_ptr<transport::Transport> net = nullptr)
+        : node(node), room(std::move(room)), selfIP(selfIP),
+        network(net ? std::move(net) : transport::platformDefault()) {
+        if (!this->room.leaseMs) this->room.leaseMs = node.leaseMs;
+    }
+
+    ~RelayRoom() { stop(); }
+
+    const RoomConfig& config() const { return room; }
+
+    bool start(std::string& error) {
+        if (net) return true;
+        {
+            std::lock_guard<std::mutex> lock(workerMutex);
+            worker = std::make_unique<ThreadPool>(1);
+        }
+        net = std::make_unique<NetworkManager>(
+            [this](const uint8_t* data, uint32_t size) { onMessage(data, size); },
+            [this](const char* text) { onNotify(text); },
+            network, node.threads);
+        net->setLiveness(node.heartbeatMs, node.deadAfterMs, node.idleMs, node.connectMs);
+        net->setLocalLink(node.localLink);
+        net->setShards(node.shards);
+        net->setAdmission(node.admission);
+        if (!node.capture.empty()) net->startCapture(node.capture + "/" + room.id, 0);
+        if (!net->startTCPServer(room.port)) {
+            {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                error = "room " + room.id + ": " + startError;
+            }
+            stop();
+            return false;
+        }
+        net->setMulticast(room.multicast);
+        net->setRoom(roomHash(room.id), selfIP, room.port, room.leaseMs);
+        if (room.capacity >= 0 || !HAVE_OPUS) {
+            reported = room.capacity >= 0 ? room.capacity : 0;
+            net->setRelayCapacity((uint16_t)reported);
+        }
+        nextElect = nowMs() + 3 * room.leaseMs;     // time for the members' leases to arrive
+        contact(room.members);
+        return true;
+    }
+
+    // leaves the room (lease 0) and closes every connection
+    void stop() {
+        if (!net) return;
+        post([this]() { net->setRoom(roomHash(room.id), selfIP, room.port, 0); });
+        std::unique_ptr<ThreadPool> draining;
+        {
+            std::lock_guard<std::mutex> lock(workerMutex);
+            draining.swap(worker);
+        }
+        draining.reset();                       // runs what is queued, net is still there
+        net.reset();
+        mixer.stop();
+        peers.clear();
+        masterIP = 0;
+        masterPort = 0;
+    }
+
+    // members to say hello to, e.g. the room's list after a config reload
+    void contact(const std::vector<std::pair<uint32_t, uint16_t>>& members) {
+        post([this, members]() {
+            for (auto& [ip, port] : members)
+                if (!peers.count(ip)) connect(ip, port, "\"\"", "\"\"");
+            });
+    }
+
+    // from the daemon's loop every TICK_MS
+    void tick(uint64_t now) {
+        if (!net) return;
+        std::vector<RoomMixer::Packet> out;
+        std::vector<uint32_t> gone;
+        mixer.tick(now, out, gone);
+        if (!out.empty() || !gone.empty()) {
+            if (pendingMixes >= MAX_PENDING_MIXES && gone.empty()) metrics::add(metrics::SEND_DROPS, out.size());
+            else {
+                ++pendingMixes;
+                post([this, out = std::move(out), gone = std::move(gone)]() {
+                    --pendingMixes;
+                    for (const RoomMixer::Packet& p : out) send(p.ip, p.port, p.type, p.data.data(), (uint32_t)p.data.size());
+                    for (uint32_t ip : gone)        // RoomServer's client timeout
+                        if (isMaster()) broadcast(PEER_REMOVED, removedJson(ip));
+                    });
+            }
+        }
+        if (now >= nextReport) {
+            nextReport = now + REPORT_MS;
+            post([this]() { reportCapacity(); });
+        }
+        if (now >= nextElect) {
+            // no master yet: as the page's RoomClient does when it hears none, pick one
+            nextElect = now + REPORT_MS;
+            post([this]() { if (!masterIP) net->electRoomMaster(); });
+        }
+    }
+
+    // one line about the room, handed to done on the worker
+    // takes effect at once, on the connections already up too
+    void setAdmission(const admission::Limits& limits) {
+        node.admission = limits;
+        if (net) net->setAdmission(limits);
+    }
+
+    void status(std::function<void(const std::string&)> done) {
+        post([this, done]() {
+            size_t connected = 0;
+            for (auto& [ip, p] : peers) connected += p.connected;
+            std::string line = "room " + room.id + " port " + std::to_string(room.port) +
+                " master " + (masterIP ? dotted(masterIP) + ":" + std::to_string(masterPort) : std::string("none")) +
+                " term " + std::to_string(term) +
+                " members " + std::to_string(connected) + "/" + std::to_string(peers.size()) +
+                " streams " + std::to_string(mixer.size()) +
+                " capacity " + std::to_string(reported);
+            int listed = 0;
+            for (const admission::SourceStats& s : net->admissionSources()) {
+                if (!s.droppedMsgs || listed++ == 3) break;
+                line += " dropped " + dotted(s.ip) + ":" + std::to_string(s.droppedMsgs);
+            }
+            done(line);
+            });
+    }
+
+private:
+    struct Peer {
+        uint16_t port = 0;                      // its TCP server port
+        uint16_t randomPort = 0;                // its end of the connection it made to us
+        bool connected = false;                 // CONNECT_* received, else still connecting
+        std::string name = "\"\"";              // raw JSON strings, passed on as received
+        std::string photo = "\"\"";
+    };
+
+    Config node;
+    RoomConfig room;
+    uint32_t selfIP;
+    std::shared_ptr<transport::Transport> network;
+    RoomMixer mixer;
+    std::unique_ptr<NetworkManager> net;
+
+    std::unique_ptr<ThreadPool> worker;
+    std::mutex workerMutex;
+    std::atomic<uint32_t> pendingMixes{ 0 };
+    std::mutex errorMutex;
+    std::string startError{ "TCP server did not start" };
+
+    // on the worker
+    std::map<uint32_t, Peer> peers;
+    uint32_t masterIP = 0;
+    uint16_t masterPort = 0;
+    uint64_t term = 0;
+    int reported = -1;                          // capacity last sent to the master
+
+    // on the daemon's loop
+    uint64_t nextReport = 0;
+    uint64_t nextElect = 0;
+
+    uint64_t nowMs() { return network->now() / 1000000; }
+
+    bool isMaster() const { return masterIP == selfIP && masterPort == room.port; }
+
+    void post(std::function<void()> task) {
+        std::lock_guard<std::mutex> lock(workerMutex);
+        if (worker) worker->enqueue(std::move(task));
+    }
+
+    // NetworkManager's pool
+    void onMessage(const uint8_t* data, uint32_t size) {
+        ConstMessageBlockView view(data, size);
+        if (!view.valid()) return;
+        uint32_t ip = view.getSrcIP();
+        switch (view.getType()) {
+        case CLIENT_AUDIO:
+            mixer.onClientAudio(ip, view.getPayload(), view.getPayloadSize(), nowMs());
+            return;
+        case AUDIO_MIX:                         // only the parent's matters, we have no speakers
+            mixer.onUpstreamAudio(ip, view.getPayload(), view.getPayloadSize());
+            return;
+        case CONNECT_REQUEST:
+        case CONNECT_REPLY:
+        case ALL_PEERS:
+        case PEER_CONNECTED:
+        case PEER_REMOVED:
+        case GET_ALL_PEERS:
+            break;
+        default:
+            return;
+        }
+        uint8_t type = view.getType();
+        uint16_t srcPort = view.getSrcPort();
+        std::string text((const char*)view.getPayload(), view.getPayloadSize());
+        post([this, type, ip, srcPort, text = std::move(text)]() {
+            switch (type) {
+            case CONNECT_REQUEST:
+            case CONNECT_REPLY: onConnect(type, ip, srcPort, text); break;
+            case ALL_PEERS: onAllPeers(ip, text); break;
+            case PEER_CONNECTED:
+            case PEER_REMOVED: onPeerUpdate(type, ip, text); break;
+            case GET_ALL_PEERS: onAllPeersRequest(ip); break;
+            }
+            });
+    }
+
+    // any of NetworkManager's threads, possibly under its locks: only queues
+    void onNotify(const char* text) {
+        std::string event = text;
+        if (event.compare(0, 6, "error-") == 0) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            startError = event.substr(6);
+        }
+        post([this, event = std::move(event)]() {
+            handleEvent(event);
+            if (onEvent) onEvent(room.id, event);
+            });
+    }
+
+    void handleEvent(const std::string& event) {
+        unsigned ip = 0, port = 0, third = 0;
+        unsigned long long t = 0;
+        int used = 0;
+        if (sscanf(event.c_str(), "roomMaster-%u:%u-%llu", &ip, &port, &t) == 3)
+            onMasterElected(ip, (uint16_t)port, t);
+        else if (sscanf(event.c_str(), "relayPlan-%u:%u-%n", &ip, &port, &used) == 2 && used)
+            onRelayPlan({ ip, (uint16_t)port }, event.substr(used));
+        else if (sscanf(event.c_str(), "tcp::%u::%u:%u-%n", &third, &ip, &port, &used) == 3 && used) {
+            // what Room.js attaches to each peer's connections: failed or closed means gone
+            std::string what = event.substr(used);
+            if (what.compare(0, 10, "removeConn") == 0) return;
+            if (what.find("failed") == std::string::npos && what.find("close") == std::string::npos) return;
+            auto it = peers.find(ip);
+            if (it == peers.end()) return;
+            if ((third == 0 && port == it->second.port) || (third == room.port && port == it->second.randomPort))
+                remove(ip);
+        }
+    }
+
+    std::string selfJson() {
+        std::string master = masterIP
+            ? "{\"ip\":" + std::to_string(masterIP) + ",\"port\":" + std::to_string(masterPort) + "}"
+            : "{\"ip\":null,\"port\":null}";
+        return "{\"ip\":" + std::to_string(selfIP) + ",\"port\":" + std::to_string(room.port) +
+            ",\"name\":" + json::quote(node.name) + ",\"photo\":\"\",\"roomId\":" + json::quote(room.id) +
+            ",\"master\":" + master + "}";
+    }
+
+    std::string peerJson(uint32_t ip, const Peer& p) {
+        return "{\"ip\":" + std::to_string(ip) + ",\"port\":" + std::to_string(p.port) +
+            ",\"name\":" + p.name + ",\"photo\":" + p.photo + ",\"status\":\"connected\"}";
+    }
+
+    // RoomServer sends { peerIP }, Room.onPeerUpdate reads ip: both, so either side works
+    std::string removedJson(uint32_t ip) {
+        return "{\"ip\":" + std::to_string(ip) + ",\"peerIP\":" + std::to_string(ip) + "}";
+    }
+
+    void send(uint32_t ip, uint16_t port, uint8_t type, const uint8_t* data, uint32_t len) {
+        net->sendMessage(MessageBlockBuilder(len).type(type).dst(ip, port).append(data, len).finish());
+    }
+
+    void send(uint32_t ip, uint16_t port, uint8_t type, const std::string& text) {
+        send(ip, port, type, (const uint8_t*)text.data(), (uint32_t)text.size());
+    }
+
+    // Room.broadcastPeerUpdate: the master tells everyone connected
+    void broadcast(uint8_t type, const std::string& text) {
+        if (!isMaster()) return;
+        if (room.multicast) return send(mcast::ROOM_BROADCAST, 0, type, text);
+        for (auto& [ip, p] : peers)
+            if (p.connected) send(ip, p.port, type, text);
+    }
+
+    void syncMembers() {
+        std::vector<RoomElection::Peer> members;
+        for (auto& [ip, p] : peers) members.push_back({ ip, p.port });
+        net->setRoomMembers(members);
+    }
+
+    void connect(uint32_t ip, uint16_t port, const std::string& name, const std::string& photo) {
+        if (!ip || !port || ip == selfIP) return;
+        auto it = peers.find(ip);
+        if (it != peers.end() && !it->second.connected) return;
+        if (it == peers.end() && peers.size() >= node.maxMembers) return;
+        Peer& p = peers[ip];
+        p.port = port;
+        p.connected = false;
+        if (name != "\"\"") p.name = name;
+        if (photo != "\"\"") p.photo = photo;
+        syncMembers();
+        send(ip, port, CONNECT_REQUEST, selfJson());
+    }
+
+    void onConnect(uint8_t type, uint32_t ip, uint16_t srcPort, const std::string& text) {
+        if (json::string(text, "roomId") != json::quote(room.id)) return remove(ip);
+        auto it = peers.find(ip);
+        if (it == peers.end() && peers.size() >= node.maxMembers) return;      // full: no reply, it gives up
+
+        Peer& p = peers[ip];
+        p.port = (uint16_t)json::number(text, "port", p.port);
+        p.randomPort = srcPort;
+        p.connected = true;
+        p.name = json::string(text, "name");
+        p.photo = json::string(text, "photo");
+        syncMembers();
+
+        std::string master;
+        json::field(text, "master", master);
+        uint32_t mip = (uint32_t)json::number(master, "ip");
+        uint16_t mport = (uint16_t)json::number(master, "port");
+        if (mip && mip != masterIP) {
+            if (isMaster()) mixer.stop();
+            if (ip == mip) {
+                masterIP = ip;
+                masterPort = p.port;
+            }
+            else {
+                masterIP = 0;
+                masterPort = 0;
+                connect(mip, mport, "\"\"", "\"\"");
+            }
+        }
+
+        if (type == CONNECT_REQUEST) send(ip, p.port, CONNECT_REPLY, selfJson());
+        if (isMaster() && mixer.addClient(ip, p.port, nowMs()))
+            broadcast(PEER_CONNECTED, peerJson(ip, p));
+    }
+
+    void onPeerUpdate(uint8_t type, uint32_t from, const std::string& text) {
+        if (from != masterIP) return;
+        uint32_t ip = (uint32_t)json::number(text, "ip", json::number(text, "peerIP"));
+        if (type == PEER_REMOVED) return remove(ip);
+        auto it = peers.find(ip);
+        if (it == peers.end() || !it->second.connected)
+            connect(ip, (uint16_t)json::number(text, "port"), json::string(text, "name"), json::string(text, "photo"));
+    }
+
+    void onAllPeers(uint32_t from, const std::string& text) {
+        if (from != masterIP) return;
+        for (const std::string& peer : json::elements(text)) {
+            uint32_t ip = (uint32_t)json::number(peer, "ip");
+            uint16_t port = (uint16_t)json::number(peer, "port");
+            auto it = peers.find(ip);
+            if (it == peers.end()) {
+                connect(ip, port, json::string(peer, "name"), json::string(peer, "photo"));
+                continue;
+            }
+            it->second.port = port;
+            it->second.name = json::string(peer, "name");
+            it->second.photo = json::string(peer, "photo");
+        }
+    }
+
+    void onAllPeersRequest(uint32_t from) {
+        if (!isMaster()) return;
+        auto it = peers.find(from);
+        if (it == peers.end()) return;
+        std::string list = "[" + selfJson();
+        for (auto& [ip, p] : peers)
+            if (p.connected) list += "," + peerJson(ip, p);
+        send(from, it->second.port, ALL_PEERS, list + "]");
+    }
+
+    void remove(uint32_t ip) {
+        auto it = peers.find(ip);
+        if (it == peers.end()) return;
+        Peer p = it->second;
+        net->removeConnection(TCP, selfIP, 0, ip, p.port);
+        net->removeConnection(TCP, selfIP, room.port, ip, p.randomPort);
+        peers.erase(it);
+        syncMembers();
+        if (mixer.remove(ip)) broadcast(PEER_REMOVED, removedJson(ip));
+        if (ip == masterIP) startElection();    // the page's RoomClient would hear its mix stop
+    }
+
+    void startElection() {
+        if (isMaster()) mixer.stop();
+        masterIP = 0;
+        masterPort = 0;
+        net->electRoomMaster();
+    }
+
+    void onMasterElected(uint32_t ip, uint16_t port, uint64_t t) {
+        term = t;
+        if (ip == masterIP && port == masterPort) return;
+        if (isMaster()) mixer.stop();
+        mixer.setRelay(nullptr, {}, nowMs());   // the new master sends everyone a fresh relay plan
+        masterIP = ip;
+        masterPort = port;
+        if (!isMaster()) return;
+        mixer.start();
+        for (auto& [peerIP, p] : std::map<uint32_t, Peer>(peers))      // their CONNECT_REPLY adds them to the mixer
+            connect(peerIP, p.port, p.name, p.photo);
+    }
+
+    // Room._onRelayPlan: the root, or a node with children, mixes for them and sends its
+    // parent the subtree's mix; a leaf has nothing to mix, we are nobody's listener
+    void onRelayPlan(relay::Node parent, const std::string& list) {
+        std::map<uint32_t, uint16_t> clients;
+        size_t i = 0;
+        while (i < list.size()) {
+            size_t end = list.find(',', i);
+            if (end == std::string::npos) end = list.size();
+            unsigned ip = 0, port = 0;
+            if (sscanf(list.c_str() + i, "%u:%u", &ip, &port) == 2 && ip != selfIP) clients[ip] = (uint16_t)port;
+            i = end + 1;
+        }
+        if (parent.ip && clients.empty()) parent = {};
+        mixer.setRelay(&clients, parent, nowMs());
+    }
+
+    void reportCapacity() {
+        int capacity = room.capacity >= 0 ? room.capacity : mixer.capacity();
+        if (capacity < 0 || capacity == reported) return;
+        reported = capacity;
+        net->setRelayCapacity((uint16_t)capacity);
+    }
+};
+
+} // namespace relayd
@@ -0,0 +1,212 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "RelayTree.h"
+#include "OpusCodec.h"
+
+// Mix-minus for one room, RoomServer.js without the WebView. Every client's CLIENT_AUDIO is
+// decoded into its ring; each tick (20 ms) sums all rings and sends every client the sum
+// minus its own signal as AUDIO_MIX. On the relay tree (RelayTree.h) the parent is one more
+// stream: it gets the mix of our subtree as CLIENT_AUDIO, and its AUDIO_MIX, the rest of
+// the room, is mixed in like a client's audio.
+//
+// Audio arrives on the network's threads, ticks come from the daemon's loop and the rest
+// from the room, so all of it is under one mutex; what is to be sent is handed back instead.
+namespace relayd {
+
+constexpr uint8_t CLIENT_AUDIO = 0x88;      // MsgType.CLIENT_AUDIO
+constexpr uint8_t AUDIO_MIX = 0x89;         // MsgType.AUDIO_MIX
+constexpr uint32_t TICK_MS = 20;
+constexpr double MIX_BUDGET_MS = 5;         // share of each tick the mixer may use, for capacity()
+constexpr uint64_t FIRST_AUDIO_MS = 500;    // a new client is dropped if it sends nothing by then
+constexpr uint64_t AUDIO_GAP_MS = 200;      // or if it goes quiet for this long later
+
+class RoomMixer {
+public:
+    struct Packet {
+        uint32_t ip;
+        uint16_t port;
+        uint8_t type;
+        std::vector<uint8_t> data;
+    };
+
+    // a client that connected (CONNECT_REQUEST / REPLY); false if it is mixed already
+    bool addClient(uint32_t ip, uint16_t port, uint64_t nowMs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (streams.count(ip)) return false;
+        if (!relayed || relayClients.count(ip)) create(ip, port, false, nowMs);
+        return true;
+    }
+
+    // clients: ip -> port of the children, upstream: ip 0 at the root; null goes back to
+    // mixing everyone. Streams of members that moved elsewhere are dropped quietly.
+    void setRelay(const std::map<uint32_t, uint16_t>* clients, relay::Node parent, uint64_t nowMs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = streams.begin(); it != streams.end();) {
+            bool keep = it->second->upstream ? parent.ip == it->first : clients && clients->count(it->first);
+            it = keep ? std::next(it) : streams.erase(it);
+        }
+        relayed = clients != nullptr;
+        relayClients = clients ? *clients : std::map<uint32_t, uint16_t>{};
+        upstream = parent;
+
+        if (relayClients.empty()) {
+            mixing = false;
+            return;
+        }
+        for (auto& [ip, port] : relayClients)
+            if (!streams.count(ip)) create(ip, port, false, nowMs);
+        if (upstream.ip && !streams.count(upstream.ip)) create(upstream.ip, upstream.port, true, nowMs);
+        mixing = true;
+    }
+
+    bool isUpstream(uint32_t ip) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return upstream.ip && upstream.ip == ip;
+    }
+
+    void onClientAudio(uint32_t ip, const uint8_t* packet, uint32_t len, uint64_t nowMs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = streams.find(ip);
+        if (it == streams.end() && relayed && relayClients.count(ip))     // a child that timed out and came back
+            it = create(ip, relayClients[ip], false, nowMs);
+        if (it == streams.end() || it->second->upstream) return;
+        it->second->decode(packet, len);
+        it->second->deadline = nowMs + AUDIO_GAP_MS;
+    }
+
+    // AUDIO_MIX from the parent: everything outside our subtree
+    void onUpstreamAudio(uint32_t ip, const uint8_t* packet, uint32_t len) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = streams.find(ip);
+        if (it != streams.end() && it->second->upstream) it->second->decode(packet, len);
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        mixing = true;
+    }
+
+    // stops mixing and drops every stream, as when another member becomes master
+    void stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        mixing = false;
+        streams.clear();
+    }
+
+    // true if ip was a client, whom the room then reports gone (PEER_REMOVED)
+    bool remove(uint32_t ip) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = streams.find(ip);
+        if (it == streams.end()) return false;
+        bool client = !it->second->upstream;
+        streams.erase(it);
+        return client;
+    }
+
+    // children this node could mix for within MIX_BUDGET_MS, -1 until it has mixed
+    int capacity() {
+        if (!HAVE_OPUS) return 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (mixCostMs <= 0) return -1;
+        return std::max(1, std::min(64, (int)(MIX_BUDGET_MS / mixCostMs) - 2));
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return streams.size();
+    }
+
+    // every TICK_MS: clients that went quiet land in gone, the mixes in out
+    void tick(uint64_t nowMs, std::vector<Packet>& out, std::vector<uint32_t>& gone) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = streams.begin(); it != streams.end();) {
+            if (it->second->deadline && nowMs >= it->second->deadline) {
+                gone.push_back(it->first);
+                it = streams.erase(it);
+            }
+            else ++it;
+        }
+        if (!mixing || streams.empty()) return;
+
+        auto start = std::chrono::steady_clock::now();
+        std::fill(mix, mix + FRAME, 0.0f);
+        for (auto& [ip, s] : streams) {
+            std::fill(s->out, s->out + FRAME, 0.0f);
+            s->read(s->out, FRAME);
+            for (int i = 0; i < FRAME; ++i) mix[i] += s->out[i];
+        }
+
+        uint8_t packet[MAX_PACKET];
+        for (auto& [ip, s] : streams) {
+            for (int i = 0; i < FRAME; ++i) s->out[i] = mix[i] - s->out[i];
+            uint32_t n = s->encoder.encode(s->out, packet, nowMs * 1000);
+            if (n) out.push_back({ ip, s->port, s->upstream ? CLIENT_AUDIO : AUDIO_MIX, std::vector<uint8_t>(packet, packet + n) });
+        }
+
+        double cost = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / streams.size();
+        mixCostMs = mixCostMs > 0 ? 0.9 * mixCostMs + 0.1 * cost : cost;
+    }
+
+private:
+    // one member's audio: decoded into a ring the tick reads a frame from, like RingBuffer.js
+    // (a full ring drops its oldest samples)
+    struct Stream {
+        static constexpr uint32_t RING = FRAME * 10;
+
+        uint16_t port = 0;
+        bool upstream = false;
+        uint64_t deadline = 0;                  // ms, 0 for the upstream
+        Decoder decoder;
+        Encoder encoder;
+        float ring[RING];
+        uint32_t readIndex = 0;
+        uint32_t writeIndex = 0;
+        float out[FRAME];
+
+        void decode(const uint8_t* packet, uint32_t len) {
+            float pcm[FRAME * 6];               // the longest Opus packet, 120 ms
+            int n = decoder.decode(packet, len, pcm, FRAME * 6);
+            for (int i = 0; i < n; ++i) {
+                uint32_t next = (writeIndex + 1) % RING;
+                if (next == readIndex) readIndex = (readIndex + 1) % RING;
+                ring[writeIndex] = pcm[i];
+                writeIndex = next;
+            }
+        }
+
+        int read(float* to, int n) {
+            int available = (int)((writeIndex + RING - readIndex) % RING);
+            n = std::min(n, available);
+            for (int i = 0; i < n; ++i) {
+                to[i] = ring[readIndex];
+                readIndex = (readIndex + 1) % RING;
+            }
+            return n;
+        }
+    };
+
+    std::mutex mutex;
+    std::map<uint32_t, std::unique_ptr<Stream>> streams;
+    bool mixing = false;
+    bool relayed = false;                       // relayClients is the plan, else everyone is mixed
+    std::map<uint32_t, uint16_t> relayClients;
+    relay::Node upstream;
+    double mixCostMs = 0;                       // smoothed mixer time per stream
+    float mix[FRAME];
+
+    std::map<uint32_t, std::unique_ptr<Stream>>::iterator create(uint32_t ip, uint16_t port, bool up, uint64_t nowMs) {
+        auto s = std::make_unique<Stream>();
+        s->port = port;
+        s->upstream = up;
+        s->deadline = up ? 0 : nowMs + FIRST_AUDIO_MS;
+        return streams.insert_or_assign(ip, std::move(s)).first;
+    }
+};
+
+} // namespace relayd
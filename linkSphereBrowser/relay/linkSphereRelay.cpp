@@ -0,0 +1,190 @@
+// Headless relay node: the native core without the browser, for a Linux server hosting rooms.
+//
+//   linkSphereRelay <config> [--check]
+//
+// Every [room] of the config (RelayConfig.h) gets a NetworkManager listening on the room's
+// port and a RelayRoom doing the page's part, so the node is one more member to the pages:
+// it can be elected master, take children on the relay tree and mix for them. One loop
+// ticks all mixers every 20 ms; there is no GUI thread.
+//
+// Signals: SIGHUP rereads the config (rooms that appeared start, rooms that went away leave,
+// changed rooms restart, new members are contacted), SIGUSR1 prints one line per room and
+// the metrics, SIGINT / SIGTERM leave every room and exit. Events go through the async log
+// (Log.h) to stdout, one line each: "<time> INFO [tid] <roomId> <notification>"; errors to
+// stderr. --check only validates the config.
+#include <iostream>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "RelayRoom.h"
+#include "../Log.h"
+
+namespace {
+
+volatile std::sig_atomic_t quitSignal = 0;
+volatile std::sig_atomic_t reloadSignal = 0;
+volatile std::sig_atomic_t statusSignal = 0;
+
+std::mutex outMutex;
+
+void logLine(std::ostream& out, const std::string& line) {
+    std::lock_guard<std::mutex> lock(outMutex);
+    out << line << std::endl;
+}
+
+// connection successes are the bulk of the notifications and say nothing an operator needs
+bool worthLogging(const std::string& event) {
+    return event.size() < 8 || event.compare(event.size() - 8, 8, "-success") != 0;
+}
+
+bool sameNode(const relayd::Config& a, const relayd::Config& b) {
+    return a.ip == b.ip && a.name == b.name && a.threads == b.threads && a.shards == b.shards && a.leaseMs == b.leaseMs &&
+        a.heartbeatMs == b.heartbeatMs && a.deadAfterMs == b.deadAfterMs && a.idleMs == b.idleMs &&
+        a.connectMs == b.connectMs && a.localLink == b.localLink && a.maxMembers == b.maxMembers &&
+        a.capture == b.capture;
+}
+
+bool sameRoom(const relayd::RoomConfig& a, const relayd::RoomConfig& b) {
+    return a.port == b.port && a.leaseMs == b.leaseMs && a.multicast == b.multicast && a.capacity == b.capacity;
+}
+
+class Node {
+public:
+    ~Node() { rooms.clear(); }
+
+    // brings the running rooms in line with cfg
+    void apply(const relayd::Config& next) {
+        bool restartAll = !sameNode(loaded, next);
+        uint32_t lease = next.leaseMs;
+        loaded = next;
+        cfg = next;
+        if (!cfg.ip) cfg.ip = defaultIP();
+
+        std::map<std::string, const relayd::RoomConfig*> wanted;
+        for (const relayd::RoomConfig& r : cfg.rooms) wanted[r.id] = &r;
+
+        for (auto it = rooms.begin(); it != rooms.end();) {
+            auto w = wanted.find(it->first);
+            relayd::RoomConfig effective = w == wanted.end() ? relayd::RoomConfig{} : *w->second;
+            if (!effective.leaseMs) effective.leaseMs = lease;
+            if (w == wanted.end() || restartAll || !sameRoom(it->second->config(), effective)) {
+                LS_LOG(logging::Level::Info, "{} leaving", it->first);
+                it = rooms.erase(it);
+            }
+            else {
+                it->second->setAdmission(cfg.admission);
+                it->second->contact(w->second->members);
+                wanted.erase(w);
+                ++it;
+            }
+        }
+
+        for (auto& [id, r] : wanted) {
+            auto room = std::make_unique<relayd::RelayRoom>(cfg, *r, cfg.ip);
+            room->onEvent = [](const std::string& roomId, const std::string& event) {
+                if (worthLogging(event)) LS_LOG(logging::Level::Info, "{} {}", roomId, event);
+                };
+            std::string error;
+            if (!room->start(error)) {
+                LS_LOG(logging::Level::Error, "{}", error);
+                continue;
+            }
+            LS_LOG(logging::Level::Info, "{} joined on {}:{}", id, relayd::dotted(cfg.ip), r->port);
+            rooms[id] = std::move(room);
+        }
+    }
+
+    void tick(uint64_t nowMs) {
+        for (auto& [id, room] : rooms) room->tick(nowMs);
+    }
+
+    void status() {
+        logging::flush();                       // the room lines after the events before them
+        for (auto& [id, room] : rooms)
+            room->status([](const std::string& line) { logLine(std::cout, line); });
+        logLine(std::cout, metrics::dumpText());
+    }
+
+private:
+    relayd::Config loaded;                      // as read, cfg with the address filled in
+    relayd::Config cfg;
+    std::map<std::string, std::unique_ptr<relayd::RelayRoom>> rooms;
+
+    static uint32_t defaultIP() {
+        for (uint32_t ip : transport::platformDefault()->localIPs())
+            if ((ip & 0xFF000000) != 0x7F000000) return ip;
+        return 0x7F000001;
+    }
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3 || (argc == 3 && std::strcmp(argv[2], "--check") != 0)) {
+        std::cerr << "usage: " << argv[0] << " <config> [--check]\n";
+        return 2;
+    }
+    std::string path = argv[1];
+
+    relayd::Config cfg;
+    std::string error;
+    if (!relayd::loadConfig(path, cfg, error)) {
+        std::cerr << error << "\n";
+        return 1;
+    }
+    if (argc == 3) {
+        std::cout << path << ": " << cfg.rooms.size() << " rooms\n";
+        return 0;
+    }
+    if (!relayd::HAVE_OPUS)
+        std::cerr << "built without libopus: the node relays and takes part in elections but mixes nothing\n";
+
+#ifdef __GLIBC__
+    mallopt(M_ARENA_MAX, 2);        // glibc would give each of the many network threads an arena
+#endif
+    struct sigaction sa{};
+    sa.sa_handler = [](int sig) {
+        if (sig == SIGHUP) reloadSignal = 1;
+        else if (sig == SIGUSR1) statusSignal = 1;
+        else quitSignal = 1;
+    };
+    sigemptyset(&sa.sa_mask);
+    for (int sig : { SIGHUP, SIGUSR1, SIGINT, SIGTERM }) sigaction(sig, &sa, nullptr);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    Node node;
+    node.apply(cfg);
+
+    auto next = std::chrono::steady_clock::now();
+    while (!quitSignal) {
+        next += std::chrono::milliseconds(relayd::TICK_MS);
+        auto now = std::chrono::steady_clock::now();
+        if (next < now) next = now;             // fell behind (suspend, overload): no burst of ticks
+        std::this_thread::sleep_until(next);
+
+        node.tick(metrics::now() / 1000000);
+
+        if (reloadSignal) {
+            reloadSignal = 0;
+            relayd::Config fresh;
+            if (relayd::loadConfig(path, fresh, error)) node.apply(fresh);
+            else LS_LOG(logging::Level::Error, "{} (kept the running config)", error);
+        }
+        if (statusSignal) {
+            statusSignal = 0;
+            node.status();
+        }
+    }
+    node.apply(relayd::Config{});               // leave every room while the log still runs
+    logging::flush();
+    return 0;
+}